@@ -0,0 +1,66 @@
+/*
+	EPRO shared control page
+
+	Layout of the page that the actuator drivers (eprofan, microwave) expose through mmap() of
+	their character device, so the controller can command them without a write() per change.
+	This header is included both by the drivers and by the userspace programs, the
+	in-kernel actuator interface at the bottom is for modules only.
+
+	Protocol:
+	- the controller owns the command half: it makes cmd_seq odd, updates the fields, then
+	  makes cmd_seq even again (with memory barriers in between)
+	- the driver timer checks cmd_seq every EPRO_CTRL_POLL milliseconds and applies a new
+	  even value; a value that is odd or changes while reading is retried at the next tick
+	- EPRO_IOC_DOORBELL makes the driver check the page immediately
+	- the driver owns the status half, with the same odd/even rule on status_seq;
+	  cmd_applied tells the controller which cmd_seq the status refers to, cmd_error
+	  whether the driver could carry it out
+	- each driver only looks at its own fields, the other ones stay zero
+
+	Usage from userspace:
+		fd   = open("/dev/eprofan", O_RDWR);
+		page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+*/
+
+#ifndef EPRO_CTRL_H
+#define EPRO_CTRL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define EPRO_CTRL_POLL		10		// [milliseconds] driver polling interval of the page
+
+struct epro_ctrl_page {
+
+	// command, written by the controller
+	__u32 cmd_seq;			// odd while the controller is writing
+	__u32 fan_percentage;		// eprofan: open-loop speed [0-100]
+	__u32 fan_target_rpm;		// eprofan: closed-loop speed, 0 = open-loop
+	__u32 lamp_mask;		// microwave: bit 0 = halogen 1, bit 1 = halogen 2, bit 2 = halogen 3
+
+	// status, written by the driver
+	__u32 status_seq;		// odd while the driver is writing
+	__u32 cmd_applied;		// last cmd_seq applied
+	__u32 fan_duty;			// eprofan: current duty percentage (ramping)
+	__u32 fan_rpm;			// eprofan: measured speed
+	__u32 fan_stalled;		// eprofan: 1 = driven but not spinning
+	__u32 lamp_state;		// microwave: lamps currently on, same bits as lamp_mask
+	__s32 cmd_error;		// 0, or the -errno the command cmd_applied was refused with
+};
+
+#define EPRO_IOC_MAGIC		'e'
+#define EPRO_IOC_DOORBELL	_IO(EPRO_IOC_MAGIC, 1)	// apply the command half now
+
+#ifdef __KERNEL__
+
+/*
+	In-kernel actuator interface, exported by eprofan and microwave for other modules
+	(see ../thermostat/eprothermo.c). Safe to call from timer and hrtimer callbacks.
+*/
+int eprofan_set_percentage(int percentage);	// open-loop fan speed [0-100], ramped
+int eprofan_get_rpm(void);			// measured fan speed, 0 without tachometer
+int microwave_set_lamps(int mask);		// halogen lights, same bits as lamp_mask
+
+#endif
+
+#endif
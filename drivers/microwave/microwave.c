@@ -14,6 +14,15 @@
 	 - when inserted, the driver configures the GPIOs;
 	 - user can change the heating by writing in /dev/microwave how many halogen lights are to be turned on;
 	 - when removed, the driver turns off the halogen lights and releases the GPIOs.
+
+	Shared control page (see ../epro_ctrl.h):
+	 - mmap /dev/microwave to get a page where the controller writes lamp_mask (bit 0 = halogen 1 ...);
+	 - while the page is mapped a timer applies new masks every EPRO_CTRL_POLL and publishes lamp_state back;
+	 - ioctl EPRO_IOC_DOORBELL applies the mask immediately.
+
+	Sysfs statistics (/sys/class/epro/microwave/), read only:
+	 - writes and rejected: write() calls, and the ones that failed;
+	 - lamp_on_ms: how long each halogen has been on since the driver was loaded, "<1> <2> <3>".
 */
 
 
@@ -27,6 +36,15 @@
 #include <linux/cdev.h>         					// VFS registration: cdev_init() and cdev_add()
 #include <linux/uaccess.h>      					// copy_to_user() and read_from_user()
 #include <linux/gpio.h>         					// gpio kernel library
+#include <linux/timer.h>        					// control page polling timer
+#include <linux/spinlock.h>     					// control page polled by the timer and the doorbell
+#include <linux/mm.h>           					// mmap of the control page
+#include <linux/ioctl.h>        					// doorbell ioctl
+#include <linux/bitops.h>       					// hweight8(): lamps in a mask
+#include <linux/ktime.h>        					// lamp on-time
+#include <linux/math64.h>       					// 64 bit divisions for the on-time
+
+#include "../epro_ctrl.h"       					// shared control page layout
 
 #define MSG_SIZE 3							// my buffer size
 
@@ -34,10 +52,56 @@ static dev_t devnum;            					// my dynamically allocated device number <
 static char msg[MSG_SIZE];						// my buffer to store a string
 static struct cdev mydev;       					// character device structure
 static struct class *cl;        					// device class
+static struct device *sysdev;   					// its sysfs directory
 static int hal1_gpio = 44;      					// first halogen gpio number (P9_12 --> gpio1[28])
 static int hal2_gpio = 26;      					// second halogen gpio number (P9_14 --> gpio1[18])
 static int hal3_gpio = 46;      					// third halogen gpio number (P9_16 --> gpio1[19])
 static int hal_status = 0;      					// halogen status memory (0 = OFF, 1 = one ON, 2 = two ON, 3 = all three ON)
+static int hal_mask = 0;        					// halogen lights currently on (bit 0 = first halogen ...)
+
+static unsigned long hal_writes = 0;					// write() calls
+static unsigned long hal_rejected = 0;					// write() calls that failed
+static u64 hal_on_ns[3];						// on-time of each halogen, the current one excluded
+static ktime_t hal_on_since[3];						// when each halogen that is on was turned on
+static DEFINE_SPINLOCK(hal_lock);					// lamps switched by write(), the page timer and other modules
+
+static struct epro_ctrl_page *ctrl;					// shared control page
+static struct timer_list ctrl_timer;					// control page polling
+static u32 ctrl_seq = 0;						// last command applied from the page
+static int ctrl_users = 0;						// active mappings of the page
+static DEFINE_SPINLOCK(ctrl_lock);					// page polled by the timer and by the doorbell ioctl
+
+	// LIGHTS // switch on the halogen lights in the mask, shared by write() and the control page
+
+static void hal_apply(int mask)
+{
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	int i;
+
+	spin_lock_irqsave(&hal_lock, flags);
+	for (i = 0; i < 3; i++){					// on-time accounting, on the switches only
+		if ((mask >> i) & 1 & ~(hal_mask >> i)){
+			hal_on_since[i] = now;}
+		else if ((hal_mask >> i) & 1 & ~(mask >> i)){
+			hal_on_ns[i] += ktime_to_ns(ktime_sub(now, hal_on_since[i]));}}
+	hal_mask = mask & 0x7;
+	hal_status = hweight8(hal_mask);
+	gpio_set_value(hal1_gpio, (hal_mask >> 0) & 1);
+	gpio_set_value(hal2_gpio, (hal_mask >> 1) & 1);
+	gpio_set_value(hal3_gpio, (hal_mask >> 2) & 1);
+	spin_unlock_irqrestore(&hal_lock, flags);
+}
+
+	// IN-KERNEL INTERFACE // see ../epro_ctrl.h
+
+int microwave_set_lamps(int mask)
+{
+	if (mask & ~0x7) {return -EINVAL;}
+	hal_apply(mask);
+	return 0;
+}
+EXPORT_SYMBOL(microwave_set_lamps);
 
 	// READ // report the current halogen lights status to the user
 
@@ -47,7 +111,7 @@ static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off
 
 	if (*off >= MSG_SIZE) {return 0;}				// no more (or nothing) to read in my buffer
 	if (*off + len > MSG_SIZE) {len = MSG_SIZE - *off;}		// prevent overflow reading my buffer
-	if (copy_to_user(buf, &msg + *off, len) != 0){return -EFAULT;}	// read LEN bytes from my buffer
+	if (copy_to_user(buf, msg + *off, len) != 0){return -EFAULT;}	// read LEN bytes from my buffer
 
 	*off += len;							// increment offset
 	return len;
@@ -57,93 +121,229 @@ static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off
 
 static ssize_t my_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
 {
-	if (*off >= MSG_SIZE) return -ENOSPC;				// no more space left to write in my buffer
-	if (*off + len >= MSG_SIZE) {return -EINVAL;}			// get hal_status from user, return an error for numbers bigger than 1 digit (+'/0')
-	if (copy_from_user(&msg + *off, buf, len)!= 0){return -EFAULT;}	// extract a chunk of data (of LEN bytes) from the user buffer and store it in my buffer at 										position OFFSET
+	hal_writes++;
+	if (*off >= MSG_SIZE) {hal_rejected++; return -ENOSPC;}	// no more space left to write in my buffer
+	if (*off + len >= MSG_SIZE) {hal_rejected++; return -EINVAL;}	// get hal_status from user, return an error for numbers bigger than 1 digit (+'/0')
+	if (copy_from_user(msg + *off, buf, len)!= 0){hal_rejected++; return -EFAULT;}	// extract a chunk of data (of LEN bytes) from the user buffer and store it in my buffer at 										position OFFSET
 
+	msg[*off + len] = 0;						// terminate the string, leftovers of longer inputs must not be parsed
 	sscanf(msg,"%i",&hal_status);					// homemade string to integer conversion
 
-	if     (hal_status == 1){					// turn on the appropriate light according to the set value hal_status (one)
-		gpio_set_value(hal1_gpio, 1);
-		gpio_set_value(hal2_gpio, 0);
-		gpio_set_value(hal3_gpio, 0);}
-	else if(hal_status == 2){					// two lights, if number two is written
-		gpio_set_value(hal1_gpio, 1);
-		gpio_set_value(hal2_gpio, 1);
-		gpio_set_value(hal3_gpio, 0);}
-	else if(hal_status == 3){					// turn on all the lights, when digit "3" is recieved
-		gpio_set_value(hal1_gpio, 1);
-		gpio_set_value(hal2_gpio, 1);
-		gpio_set_value(hal3_gpio, 1);}
-	else   {gpio_set_value(hal1_gpio, 0);				// when other [!= {1,2,3}] inputs are detected, turn off all the lights
-		gpio_set_value(hal2_gpio, 0);
-		gpio_set_value(hal3_gpio, 0);
-		if (hal_status != 0){					// if input is none of the four predefined values [!= {0,1,2,3}], return an error as well 
-			hal_status = 0;
-			return -EINVAL;}}
+	if (hal_status >= 1 && hal_status <= 3){			// turn on the first hal_status lights (one, two or all three)
+		hal_apply((1 << hal_status) - 1);}
+	else if (hal_status != 0){					// if input is none of the four predefined values [!= {0,1,2,3}], turn off all the lights
+		hal_apply(0);						// and return an error as well
+		hal_rejected++;
+		return -EINVAL;}
+	else   {hal_apply(0);}						// "0" turns off all the lights
 
 	*off += len;							// increment offset, the placeholder inside my buffer
 
 	return len;							// return the number of bytes I was able to write in my driver buffer a new iteration of 										this function is expected if there is still user data pending to be store in the driver
 };
 
+	// CONTROL PAGE // apply a new mask and publish the lamp state, ctrl_lock held
+
+static void ctrl_poll(void)
+{
+	u32 seq = ACCESS_ONCE(ctrl->cmd_seq);
+	u32 mask;
+
+	if (seq != ctrl_seq && !(seq & 1)){				// a new, complete command: read it and check it did not change meanwhile
+		smp_rmb();
+		mask = ACCESS_ONCE(ctrl->lamp_mask);
+		smp_rmb();
+		if (ACCESS_ONCE(ctrl->cmd_seq) == seq){
+			ctrl_seq = seq;
+			hal_apply(mask);}}
+
+	ctrl->status_seq++;						// publish the status
+	smp_wmb();
+	ctrl->cmd_applied = ctrl_seq;
+	ctrl->lamp_state = hal_mask;
+	smp_wmb();
+	ctrl->status_seq++;
+}
+
+static void ctrl_check(unsigned long data)
+{
+	spin_lock(&ctrl_lock);
+	ctrl_poll();
+	if (ctrl_users > 0){						// keep polling while the page is mapped
+		mod_timer(&ctrl_timer, jiffies + msecs_to_jiffies(EPRO_CTRL_POLL));}
+	spin_unlock(&ctrl_lock);
+}
+
+	// IOCTL // doorbell, apply the control page now
+
+static long my_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	if (cmd != EPRO_IOC_DOORBELL) {return -ENOTTY;}
+
+	spin_lock_bh(&ctrl_lock);
+	ctrl_poll();
+	spin_unlock_bh(&ctrl_lock);
+	return 0;
+}
+
+	// MMAP // map the control page, the polling timer runs while there is at least one mapping
+
+static void ctrl_vma_open(struct vm_area_struct *vma)
+{
+	spin_lock_bh(&ctrl_lock);
+	if (ctrl_users++ == 0){
+		mod_timer(&ctrl_timer, jiffies + msecs_to_jiffies(EPRO_CTRL_POLL));}
+	spin_unlock_bh(&ctrl_lock);
+}
+
+static void ctrl_vma_close(struct vm_area_struct *vma)
+{
+	spin_lock_bh(&ctrl_lock);
+	ctrl_users--;
+	spin_unlock_bh(&ctrl_lock);
+}
+
+static struct vm_operations_struct ctrl_vm_ops =
+{
+	.open  = ctrl_vma_open,
+	.close = ctrl_vma_close
+};
+
+static int my_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE) {return -EINVAL;}
+
+	if (remap_pfn_range(vma, vma->vm_start, virt_to_phys(ctrl) >> PAGE_SHIFT,
+			vma->vm_end - vma->vm_start, vma->vm_page_prot)) {return -EAGAIN;}
+
+	vma->vm_ops = &ctrl_vm_ops;
+	ctrl_vma_open(vma);
+	return 0;
+}
+
+	// SYSFS // statistics
+
+static ssize_t writes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", hal_writes);
+}
+
+static ssize_t rejected_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", hal_rejected);
+}
+
+static ssize_t lamp_on_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	u64 ns[3];
+	int i;
+
+	spin_lock_irqsave(&hal_lock, flags);
+	for (i = 0; i < 3; i++){					// the lamps that are on count up to now
+		ns[i] = hal_on_ns[i];
+		if ((hal_mask >> i) & 1) {ns[i] += ktime_to_ns(ktime_sub(now, hal_on_since[i]));}}
+	spin_unlock_irqrestore(&hal_lock, flags);
+	return sprintf(buf, "%llu %llu %llu\n", div_u64(ns[0], NSEC_PER_MSEC), div_u64(ns[1], NSEC_PER_MSEC), div_u64(ns[2], NSEC_PER_MSEC));
+}
+
+static DEVICE_ATTR(writes,     S_IRUGO, writes_show,     NULL);
+static DEVICE_ATTR(rejected,   S_IRUGO, rejected_show,   NULL);
+static DEVICE_ATTR(lamp_on_ms, S_IRUGO, lamp_on_ms_show, NULL);
+
+static struct device_attribute *hal_attrs[] = { &dev_attr_writes, &dev_attr_rejected, &dev_attr_lamp_on_ms };
+
 	// FILE OPERATIONS & FUNCTION CALLBACKS //
 
 static struct file_operations fops =
 {
 	.owner = THIS_MODULE,
 	.read  = my_read,
-	.write = my_write
+	.write = my_write,
+	.mmap  = my_mmap,
+	.unlocked_ioctl = my_ioctl
 };
 
 	// CONSTRUCTOR //
 
 static int __init my_init(void)
 {
+	int i, rc = -1;
+
+	if ((ctrl = (struct epro_ctrl_page *)get_zeroed_page(GFP_KERNEL)) == NULL){
+		return -ENOMEM;						// the control page must exist before anybody can mmap it
+	}
+	SetPageReserved(virt_to_page(ctrl));
+	setup_timer(&ctrl_timer, ctrl_check, 0);
+
 	if (alloc_chrdev_region(&devnum, 0, 1, "microwave") < 0){
-		return -1;
+		goto fail_page;
 	}
 	if ((cl = class_create(THIS_MODULE, "epro")) == NULL){
-		unregister_chrdev_region(devnum, 1);
-		return -1;
+		goto fail_region;
 	}
-	if (device_create(cl, NULL, devnum, NULL, "microwave") == NULL){
-		class_destroy(cl);
-		unregister_chrdev_region(devnum, 1);
-		return -1;
+	if ((sysdev = device_create(cl, NULL, devnum, NULL, "microwave")) == NULL){
+		goto fail_class;
 	}
 	cdev_init(&mydev, &fops);
 	if (cdev_add(&mydev, devnum, 1) == -1){
-		device_destroy(cl, devnum);
-		class_destroy(cl);
-		unregister_chrdev_region(devnum, 1);
-		return -1;
+		goto fail_device;
 	}
 	printk(KERN_INFO "HALOGEN module registered, <Major, Minor>: <%d, %d>, HZ:%d \n", MAJOR(devnum), MINOR(devnum), HZ);
+
+	for (i = 0; i < ARRAY_SIZE(hal_attrs); i++){			// statistics, the driver works without them
+		if (device_create_file(sysdev, hal_attrs[i])){
+			printk(KERN_WARNING "Microwave: unable to create sysfs attribute %s \n", hal_attrs[i]->attr.name);}}
 	
+	rc = -EINVAL;
 	if (!gpio_is_valid(hal1_gpio) || !gpio_is_valid(hal2_gpio) || !gpio_is_valid(hal3_gpio)){
 		printk(KERN_ALERT "Microwave: One or more of the requested GPIOs for halogen lights is not valid \n");
-		return -EINVAL;						// check if gpio numbers are valid on this bo
+		goto fail_cdev;						// check if gpio numbers are valid on this bo
 	}
 	if(gpio_request_one(hal1_gpio, GPIOF_OUT_INIT_LOW,"Halogen 1")){// request gpio pins and configure directions
 		printk(KERN_ALERT "Microwave: Unable to request gpio %d \n", hal1_gpio);
-		return -EINVAL;
+		goto fail_cdev;
 	}
 	if(gpio_request_one(hal2_gpio, GPIOF_OUT_INIT_LOW, "Halogen 2")){
 		printk(KERN_ALERT "Microwave: Unable to request gpio %d \n", hal2_gpio);
-		return -EINVAL;
+		goto fail_hal1;
 	}
 	if(gpio_request_one(hal3_gpio, GPIOF_OUT_INIT_LOW, "Halogen 3")){
 		printk(KERN_ALERT "Microwave: Unable to request gpio %d \n", hal3_gpio);
-		return -EINVAL;
+		goto fail_hal2;
 	}
 	return 0;
+
+fail_hal2:								// undo in reverse order
+	gpio_free(hal2_gpio);
+fail_hal1:
+	gpio_free(hal1_gpio);
+fail_cdev:
+	for (i = 0; i < ARRAY_SIZE(hal_attrs); i++){
+		device_remove_file(sysdev, hal_attrs[i]);}
+	cdev_del(&mydev);
+	del_timer_sync(&ctrl_timer);					// the device was open, mmap() may have started polling
+fail_device:
+	device_destroy(cl, devnum);
+fail_class:
+	class_destroy(cl);
+fail_region:
+	unregister_chrdev_region(devnum, 1);
+fail_page:
+	ClearPageReserved(virt_to_page(ctrl));
+	free_page((unsigned long)ctrl);
+	return rc;
 };
 
 	// DESTRUCTOR //
 
 static void __exit my_exit(void)
 {
+	int i;
+
+	del_timer_sync(&ctrl_timer);					// stop polling the control page
+
 	gpio_set_value(hal1_gpio, 0);					// switch off the lights
 	gpio_set_value(hal2_gpio, 0);
 	gpio_set_value(hal3_gpio, 0);
@@ -152,10 +352,15 @@ static void __exit my_exit(void)
 	gpio_free(hal2_gpio);
 	gpio_free(hal3_gpio);
 
+	for (i = 0; i < ARRAY_SIZE(hal_attrs); i++){			// remove the statistics
+		device_remove_file(sysdev, hal_attrs[i]);}
 	cdev_del(&mydev);						// unregister character device
 	device_destroy(cl, devnum);
 	class_destroy(cl);
 	unregister_chrdev_region(devnum, 1);
+
+	ClearPageReserved(virt_to_page(ctrl));				// release the control page
+	free_page((unsigned long)ctrl);
 	printk(KERN_INFO "HALOGEN module unregistered \n");
 };
 
@@ -4,12 +4,41 @@
 
 	Configuration:
 	- We have a led/fan connected to pin 13 of connector P8 (ehrpwm2B)
+	- The fan tachometer output is connected to pin 15 of connector P8 (gpio1[15]),
+	  with a pull-up: the fan pulls it low TACH_PPR times per revolution
 
 	Usage:
 	- write in /dev/eprofan the desired fan speed in percentage [0-100]
 	- the driver will gently ramp up(down) the fan speed to the desired percentage
+	- write in /dev/eprofan "r" followed by a speed in RPM (e.g. "r1800") to enable the
+	  closed-loop mode: the driver adjusts the duty cycle by itself to hold that speed,
+	  writing a percentage again goes back to open-loop
+	- read /dev/eprofan to get "<duty percentage> <measured rpm> <target rpm> <stalled>",
+	  target rpm is 0 in open-loop, stalled is 1 when the fan is driven but no pulse arrives
 	- have fun
 
+	Tachometer:
+	- every falling edge is timestamped with the hrtimer clock (ktime_get()) in the irq handler,
+	  the pulse period is filtered with a 1/8 exponential average
+	- an hrtimer runs every TACH_PERIOD, converts the period into RPM, detects stalls and,
+	  in closed-loop mode, integrates the RPM error into the duty cycle
+	- load the module with tach_gpio=-1 if there is no tachometer wired
+	- the timers only compute the duty cycle, a work item applies it: pwm_config() may sleep
+
+	Shared control page (see ../epro_ctrl.h):
+	- mmap /dev/eprofan to get a page where the controller writes fan_percentage or
+	  fan_target_rpm, a timer applies new commands every EPRO_CTRL_POLL while the page is mapped
+	- the driver publishes duty, rpm and stall status back on the same page
+	- ioctl EPRO_IOC_DOORBELL applies the command immediately
+
+	Sysfs (/sys/class/fans/eprofan/):
+	- statistics, read only: writes and rejected (write() calls and the ones that failed),
+	  ramp_steps and ramp_ms (duty increments and milliseconds spent ramping to a new speed)
+	- tunables, read and write at runtime: period_ns (PWM period, FAN_PERIOD at load),
+	  duty_resolution (duty increments from 0 to 100%, FAN_PERIOD / DUTY_INCREMENT at load)
+	  and ramp_step_ms (interval between increments, FAN_STEP at load)
+	- writes are logged with pr_debug(), enable them with dynamic debug when needed
+
 */
 
 
@@ -25,6 +54,18 @@
 #include <linux/uaccess.h>		// copy_to_user() and read_from_user()
 
 #include <linux/timer.h>		// timer functions
+#include <linux/hrtimer.h>		// high resolution timer for the tachometer
+#include <linux/ktime.h>		// pulse timestamps
+#include <linux/math64.h>		// 64 bit divisions for the rpm
+#include <linux/gpio.h>			// tachometer input
+#include <linux/interrupt.h>		// tachometer interrupt
+#include <linux/spinlock.h>		// duty cycle shared by the ramp timer and the hrtimer
+#include <linux/mutex.h>		// serialize the pwm updates
+#include <linux/workqueue.h>		// pwm updates out of the timers, pwm_config() may sleep
+#include <linux/mm.h>			// mmap of the control page
+#include <linux/ioctl.h>		// doorbell ioctl
+
+#include "../epro_ctrl.h"		// shared control page layout
 
 #include <linux/platform_device.h>
 #include <linux/slab.h>
@@ -33,20 +74,61 @@
 #include <linux/io.h>
 #include <linux/pwm.h>
 
-#define FAN_PERIOD	50000		// [nanoseconds] 20kHz frequency
-#define DUTY_INCREMENT	  500		// [nanoseconds] 1% of the period
-#define FAN_STEP	   50		// [milliseconds] interval in beetewen duty increments
+#define FAN_PERIOD	50000		// [nanoseconds] 20kHz frequency, default of period_ns
+#define DUTY_INCREMENT	  500		// [nanoseconds] 1% of the period, default of duty_resolution
+#define FAN_STEP	   50		// [milliseconds] interval in beetewen duty increments, default of ramp_step_ms
+
+#define TACH_PPR	    2		// tachometer pulses per revolution
+#define TACH_PERIOD	  100		// [milliseconds] rpm evaluation and closed-loop interval
+#define TACH_STALL	  500		// [milliseconds] no pulses for this long means stalled
+#define TACH_MIN_PULSE	 1000		// [microseconds] shorter pulse periods are glitches (>30000 rpm)
+#define RPM_PER_STEP	   50		// [rpm] closed-loop error worth one duty increment per TACH_PERIOD
+#define MAX_STEPS	    5		// closed-loop slew limit, duty increments per TACH_PERIOD
 
 static dev_t devnum; 			// my dynamically allocated device number <Major,Minor>
 static struct cdev mydev;		// character device structure
 static struct class *cl;		// device class
+static struct device *sysdev;		// its sysfs directory
 
 static struct timer_list fan_timer;
 static int fan_percentage = 0;		// fan speed percentage
 static int fan_duty 	  = 0;		// fan duty cycle
+static DEFINE_SPINLOCK(fan_lock);	// protects fan_duty and the tunables
+static DEFINE_MUTEX(pwm_lock);		// one pwm_config() at a time, with the latest duty
+static struct work_struct pwm_work;	// pwm_config() on behalf of the timers
+
+static int fan_period     = FAN_PERIOD;		// [nanoseconds] PWM period
+static int duty_increment = DUTY_INCREMENT;	// [nanoseconds] one ramp step, fan_period / duty_resolution
+static int fan_step       = FAN_STEP;		// [milliseconds] interval between ramp steps
+
+static unsigned long fan_writes = 0;	// write() calls
+static unsigned long fan_rejected = 0;	// write() calls that failed
+static unsigned long ramp_steps = 0;	// duty increments of the ramp
+static u64 ramp_ns = 0;			// time spent ramping, the current ramp excluded
+static ktime_t ramp_start;		// start of the current ramp
+static int ramping = 0;
 
 struct pwm_device *pwm_a;		// PWM device
 
+static int tach_gpio = 47;		// tachometer gpio number (P8_15 -> gpio1[15]), -1 = no tachometer
+module_param(tach_gpio, int, 0444);
+MODULE_PARM_DESC(tach_gpio, "tachometer gpio (default 47, P8_15), -1 to disable");
+
+static int tach_irq = -1;		// tachometer IRQ identifier
+static struct hrtimer tach_timer;	// rpm evaluation and closed-loop timer
+static ktime_t tach_last;		// timestamp of the last pulse
+static u64 tach_period_ns = 0;		// filtered pulse period, 0 = no measurement yet
+static int fan_rpm = 0;			// measured speed
+static int fan_target_rpm = 0;		// closed-loop target speed, 0 = open-loop
+static int fan_stalled = 0;		// driven but not spinning
+
+static struct epro_ctrl_page *ctrl;	// shared control page
+static struct timer_list ctrl_timer;	// control page polling
+static u32 ctrl_seq = 0;		// last command applied from the page
+static int ctrl_error = 0;		// what applying it returned
+static int ctrl_users = 0;		// active mappings of the page
+static DEFINE_SPINLOCK(ctrl_lock);	// page polling runs in the timer and in the doorbell ioctl
+
 
 
 /*
@@ -67,13 +149,85 @@ static int my_close(struct inode *i, struct file *f)
 	return 0;
 }
 
+/*
+ *	SPEED SETTERS, shared by write() and the control page
+ */
+static int fan_set_percentage(int percentage)
+{
+	unsigned long flags;
+
+	if (percentage > 100 || percentage < 0) { return -EINVAL; }
+
+	// back to open-loop
+	spin_lock_irqsave(&fan_lock, flags);
+	fan_percentage = percentage;
+	fan_target_rpm = 0;
+	spin_unlock_irqrestore(&fan_lock, flags);
+
+	// lux fiat
+	mod_timer( &fan_timer, jiffies + msecs_to_jiffies(fan_step) );
+	return 0;
+}
+
+// the ramp reached its target or was taken over, fan_lock held
+static void ramp_end(void)
+{
+	if (!ramping) { return; }
+	ramp_ns += ktime_to_ns(ktime_sub(ktime_get(), ramp_start));
+	ramping = 0;
+}
+
+static int fan_set_rpm(int rpm)
+{
+	unsigned long flags;
+
+	if (tach_irq < 0) { return -ENODEV; }
+	if (rpm <= 0) { return -EINVAL; }
+
+	// the ramp timer hands over to the tachometer timer: called from the control page
+	// timer and under ctrl_lock, so no del_timer_sync(), a ramp step already running
+	// sees the target under fan_lock and stops there
+	spin_lock_irqsave(&fan_lock, flags);
+	fan_target_rpm = rpm;
+	ramp_end();
+	spin_unlock_irqrestore(&fan_lock, flags);
+	del_timer(&fan_timer);
+	return 0;
+}
+
+/*
+ *	IN-KERNEL INTERFACE, see ../epro_ctrl.h
+ */
+int eprofan_set_percentage(int percentage)
+{
+	return fan_set_percentage(percentage);
+}
+EXPORT_SYMBOL(eprofan_set_percentage);
+
+int eprofan_get_rpm(void)
+{
+	return fan_rpm;
+}
+EXPORT_SYMBOL(eprofan_get_rpm);
+
 /*
  *	READ:
+ *	Report "<duty percentage> <measured rpm> <target rpm> <stalled>"
  */
 static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off)
 {
-	// do nothing
-	return 0;
+	char msg[32];
+	int size;
+
+	size = snprintf(msg, sizeof(msg), "%d %d %d %d\n",
+			fan_duty * 100 / fan_period, fan_rpm, fan_target_rpm, fan_stalled);
+
+	if (*off >= size) { return 0; }
+	if (*off + len > size) { len = size - *off; }
+	if (copy_to_user(buf, msg + *off, len) != 0) { return -EFAULT; }
+
+	*off += len;
+	return len;
 }
 
 
@@ -82,47 +236,364 @@ static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off
  */
 static ssize_t my_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
 {	
-	char tmp[4];
+	char tmp[8];
+	int rc;
 
-	if ( copy_from_user(&tmp, buf, len) != 0 ) { return -EFAULT; }
-	//if ( kstrtoint(tmp,10,&fan_percentage) )   { return -EINVAL; }
-	fan_percentage=simple_strtol(tmp,NULL,0);
-	
-	printk(KERN_INFO "PWM_A, FAN PERCENTAGE: rc=[%d] \n", fan_percentage);
-	if(fan_percentage > 100) { fan_percentage=100; return -EINVAL;}
-	if(fan_percentage < 0)   { fan_percentage=0;   return -EINVAL;}
+	fan_writes++;
+	if (len >= sizeof(tmp)) { fan_rejected++; return -EINVAL; }
+	if ( copy_from_user(&tmp, buf, len) != 0 ) { fan_rejected++; return -EFAULT; }
+	tmp[len] = 0;
 
-	// lux fiat
-	mod_timer( &fan_timer, jiffies + msecs_to_jiffies(FAN_STEP) );
+	// "r<rpm>": closed-loop speed
+	if (tmp[0] == 'r') {
+		pr_debug("PWM_A, FAN TARGET RPM: rc=[%s] \n", tmp+1);
+		rc = fan_set_rpm(simple_strtol(tmp+1, NULL, 0));
+	}
+	else {
+		//if ( kstrtoint(tmp,10,&fan_percentage) )   { return -EINVAL; }
+		pr_debug("PWM_A, FAN PERCENTAGE: rc=[%s] \n", tmp);
+		rc = fan_set_percentage(simple_strtol(tmp,NULL,0));
+	}
 
+	if (rc) { fan_rejected++; return rc; }
 	return len;
 }
 
 
+/*
+ *	PWM UPDATE: the timers only compute the duty under fan_lock, pwm_config() may sleep
+ *	(runtime PM and clocks of the ehrpwm) so it runs here, in process context
+ */
+static void pwm_apply(void)
+{
+	unsigned long flags;
+	int duty, period;
+
+	mutex_lock(&pwm_lock);
+	spin_lock_irqsave(&fan_lock, flags);
+	duty = fan_duty;
+	period = fan_period;
+	spin_unlock_irqrestore(&fan_lock, flags);
+	pwm_config(pwm_a, duty, period);
+	mutex_unlock(&pwm_lock);
+}
+
+static void pwm_apply_work(struct work_struct *work)
+{
+	pwm_apply();
+}
+
+
 /*
  *	CALLBACK FUNCTION FOR THE TIMER
  */
 static void adjust_speed(unsigned long data)
 {
+	unsigned long flags;
+	int target_duty;
 
-	int target_duty = fan_percentage * DUTY_INCREMENT;		
+	spin_lock_irqsave(&fan_lock, flags);
+	target_duty = fan_percentage * fan_period / 100;
 
-	// once you get to ther desired duty cycle, exit the loop	
-	if (fan_duty==target_duty) return;
+	// closed-loop took over meanwhile
+	if (fan_target_rpm > 0) { ramp_end(); spin_unlock_irqrestore(&fan_lock, flags); return; }
 
-	// increment or decremente the duty cycle by 1%
-	if(fan_duty<target_duty) { fan_duty+=DUTY_INCREMENT; }
-	else { fan_duty-=DUTY_INCREMENT; }
+	// once you get to ther desired duty cycle, exit the loop	
+	if (fan_duty==target_duty) { ramp_end(); spin_unlock_irqrestore(&fan_lock, flags); return; }
+	if (!ramping) { ramp_start = ktime_get(); ramping = 1; }
+
+	// increment or decremente the duty cycle by one step, the last one may be shorter
+	if(fan_duty<target_duty) { fan_duty = min(fan_duty + duty_increment, target_duty); }
+	else { fan_duty = max(fan_duty - duty_increment, target_duty); }
+	ramp_steps++;
+	spin_unlock_irqrestore(&fan_lock, flags);
 	
 	// apply new configuration to PWM device
-	pwm_config(pwm_a, fan_duty, FAN_PERIOD);
-	
+	schedule_work(&pwm_work);
+
 	// reschedule next speed adjustment
-	mod_timer( &fan_timer, jiffies + msecs_to_jiffies(FAN_STEP) );
+	mod_timer( &fan_timer, jiffies + msecs_to_jiffies(fan_step) );
+}
+
+
+/*
+ *	CALLBACK FUNCTION to timestamp the tachometer pulses
+ */
+static irqreturn_t tach_handler(int irq, void* dev_id)
+{
+	ktime_t now = ktime_get();
+	u64 period = ktime_to_ns(ktime_sub(now, tach_last));
+
+	// ignore glitches, and the first pulse after a stall (its period is meaningless)
+	if (period < TACH_MIN_PULSE * NSEC_PER_USEC) { return IRQ_HANDLED; }
+	tach_last = now;
+	if (period > TACH_STALL * NSEC_PER_MSEC)     { return IRQ_HANDLED; }
+
+	// 1/8 exponential average of the period
+	if (tach_period_ns == 0) { tach_period_ns = period; }
+	else { tach_period_ns = tach_period_ns - (tach_period_ns >> 3) + (period >> 3); }
+
+	return IRQ_HANDLED;
+}
+
+
+/*
+ *	CALLBACK FUNCTION FOR THE TACHOMETER TIMER
+ */
+static enum hrtimer_restart tach_check(struct hrtimer *t)
+{
+	unsigned long flags;
+	u64 idle = ktime_to_ns(ktime_sub(ktime_get(), tach_last));
+	int steps;
+
+	// convert the period into rpm, no pulses for a while means the fan is not spinning
+	if (idle > TACH_STALL * NSEC_PER_MSEC || tach_period_ns == 0) {
+		tach_period_ns = 0;
+		fan_rpm = 0;
+	}
+	else {
+		fan_rpm = div_u64(60ULL * NSEC_PER_SEC, tach_period_ns * TACH_PPR);
+	}
+
+	// complain once when the fan is driven but does not turn
+	if (fan_rpm == 0 && fan_duty > 0) {
+		if (!fan_stalled) { printk(KERN_WARNING "PWM_A, fan stalled at duty [%d] \n", fan_duty); }
+		fan_stalled = 1;
+	}
+	else {
+		fan_stalled = 0;
+	}
+
+	// closed-loop: integrate the rpm error into the duty cycle, with a slew limit
+	if (fan_target_rpm > 0) {
+		steps = (fan_target_rpm - fan_rpm) / RPM_PER_STEP;
+		if (steps >  MAX_STEPS) { steps =  MAX_STEPS; }
+		if (steps < -MAX_STEPS) { steps = -MAX_STEPS; }
+
+		spin_lock_irqsave(&fan_lock, flags);
+		if (steps != 0) {
+			fan_duty += steps * duty_increment;
+			if (fan_duty > fan_period) { fan_duty = fan_period; }
+			if (fan_duty < 0)          { fan_duty = 0; }
+		}
+		fan_percentage = fan_duty * 100 / fan_period;
+		spin_unlock_irqrestore(&fan_lock, flags);
+		if (steps != 0) { schedule_work(&pwm_work); }
+	}
+
+	hrtimer_forward_now(t, ktime_set(0, TACH_PERIOD * NSEC_PER_MSEC));
+	return HRTIMER_RESTART;
 }
 
 
 
+/*
+ *	CONTROL PAGE: apply a new command and publish the status, ctrl_lock held
+ */
+static void ctrl_poll(void)
+{
+	u32 seq = ACCESS_ONCE(ctrl->cmd_seq);
+	u32 percentage, rpm;
+
+	// a new, complete command: read it and check it did not change meanwhile
+	if (seq != ctrl_seq && !(seq & 1)) {
+		smp_rmb();
+		percentage = ACCESS_ONCE(ctrl->fan_percentage);
+		rpm        = ACCESS_ONCE(ctrl->fan_target_rpm);
+		smp_rmb();
+		if (ACCESS_ONCE(ctrl->cmd_seq) == seq) {
+			ctrl_seq = seq;
+			if (rpm > 0) { ctrl_error = fan_set_rpm(rpm); }
+			else { ctrl_error = fan_set_percentage(percentage); }
+		}
+	}
+
+	// publish the status
+	ctrl->status_seq++;
+	smp_wmb();
+	ctrl->cmd_applied = ctrl_seq;
+	ctrl->cmd_error   = ctrl_error;
+	ctrl->fan_duty    = fan_duty * 100 / fan_period;
+	ctrl->fan_rpm     = fan_rpm;
+	ctrl->fan_stalled = fan_stalled;
+	smp_wmb();
+	ctrl->status_seq++;
+}
+
+/*
+ *	CALLBACK FUNCTION FOR THE CONTROL PAGE TIMER
+ */
+static void ctrl_check(unsigned long data)
+{
+	spin_lock(&ctrl_lock);
+	ctrl_poll();
+	if (ctrl_users > 0) {
+		mod_timer( &ctrl_timer, jiffies + msecs_to_jiffies(EPRO_CTRL_POLL) );
+	}
+	spin_unlock(&ctrl_lock);
+}
+
+/*
+ *	IOCTL:
+ *	Doorbell, apply the control page now
+ */
+static long my_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	if (cmd != EPRO_IOC_DOORBELL) { return -ENOTTY; }
+
+	spin_lock_bh(&ctrl_lock);
+	ctrl_poll();
+	spin_unlock_bh(&ctrl_lock);
+	return 0;
+}
+
+/*
+ *	MMAP:
+ *	Map the control page, the polling timer runs while there is at least one mapping
+ */
+static void ctrl_vma_open(struct vm_area_struct *vma)
+{
+	spin_lock_bh(&ctrl_lock);
+	if (ctrl_users++ == 0) {
+		mod_timer( &ctrl_timer, jiffies + msecs_to_jiffies(EPRO_CTRL_POLL) );
+	}
+	spin_unlock_bh(&ctrl_lock);
+}
+
+static void ctrl_vma_close(struct vm_area_struct *vma)
+{
+	spin_lock_bh(&ctrl_lock);
+	ctrl_users--;
+	spin_unlock_bh(&ctrl_lock);
+}
+
+static struct vm_operations_struct ctrl_vm_ops =
+{
+	.open  = ctrl_vma_open,
+	.close = ctrl_vma_close
+};
+
+static int my_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE) { return -EINVAL; }
+
+	if (remap_pfn_range(vma, vma->vm_start, virt_to_phys(ctrl) >> PAGE_SHIFT,
+			vma->vm_end - vma->vm_start, vma->vm_page_prot)) {
+		return -EAGAIN;
+	}
+
+	vma->vm_ops = &ctrl_vm_ops;
+	ctrl_vma_open(vma);
+	return 0;
+}
+
+
+
+/*
+ *	SYSFS: statistics
+ */
+static ssize_t writes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", fan_writes);
+}
+
+static ssize_t rejected_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", fan_rejected);
+}
+
+static ssize_t ramp_steps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ramp_steps);
+}
+
+static ssize_t ramp_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	unsigned long flags;
+	u64 ns;
+
+	// the current ramp included
+	spin_lock_irqsave(&fan_lock, flags);
+	ns = ramp_ns + (ramping ? ktime_to_ns(ktime_sub(ktime_get(), ramp_start)) : 0);
+	spin_unlock_irqrestore(&fan_lock, flags);
+	return sprintf(buf, "%llu\n", div_u64(ns, NSEC_PER_MSEC));
+}
+
+/*
+ *	SYSFS: tunables
+ */
+static ssize_t period_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", fan_period);
+}
+
+static ssize_t period_ns_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long flags;
+	int period, resolution;
+
+	// 1kHz to 1MHz
+	if (kstrtoint(buf, 0, &period) || period < 1000 || period > 1000000) { return -EINVAL; }
+
+	// same duty percentage and resolution on the new period
+	spin_lock_irqsave(&fan_lock, flags);
+	resolution = fan_period / duty_increment;
+	fan_duty = div_u64((u64)fan_duty * period, fan_period);
+	fan_period = period;
+	duty_increment = max(period / resolution, 1);
+	spin_unlock_irqrestore(&fan_lock, flags);
+	pwm_apply();
+	return count;
+}
+
+static ssize_t duty_resolution_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", fan_period / duty_increment);
+}
+
+static ssize_t duty_resolution_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long flags;
+	int resolution;
+
+	if (kstrtoint(buf, 0, &resolution) || resolution < 1 || resolution > 1000) { return -EINVAL; }
+
+	spin_lock_irqsave(&fan_lock, flags);
+	duty_increment = max(fan_period / resolution, 1);
+	spin_unlock_irqrestore(&fan_lock, flags);
+	return count;
+}
+
+static ssize_t ramp_step_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", fan_step);
+}
+
+static ssize_t ramp_step_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	int step;
+
+	// the next ramp step already uses it
+	if (kstrtoint(buf, 0, &step) || step < 1 || step > 10000) { return -EINVAL; }
+	fan_step = step;
+	return count;
+}
+
+static DEVICE_ATTR(writes,          S_IRUGO,           writes_show,          NULL);
+static DEVICE_ATTR(rejected,        S_IRUGO,           rejected_show,        NULL);
+static DEVICE_ATTR(ramp_steps,      S_IRUGO,           ramp_steps_show,      NULL);
+static DEVICE_ATTR(ramp_ms,         S_IRUGO,           ramp_ms_show,         NULL);
+static DEVICE_ATTR(period_ns,       S_IRUGO | S_IWUSR, period_ns_show,       period_ns_store);
+static DEVICE_ATTR(duty_resolution, S_IRUGO | S_IWUSR, duty_resolution_show, duty_resolution_store);
+static DEVICE_ATTR(ramp_step_ms,    S_IRUGO | S_IWUSR, ramp_step_ms_show,    ramp_step_ms_store);
+
+static struct device_attribute *fan_attrs[] = {
+	&dev_attr_writes, &dev_attr_rejected, &dev_attr_ramp_steps, &dev_attr_ramp_ms,
+	&dev_attr_period_ns, &dev_attr_duty_resolution, &dev_attr_ramp_step_ms
+};
+
+
+
 /*
  *	File operations and function callbacks
  */
@@ -132,29 +603,72 @@ static struct file_operations fops =
 	.open    = my_open,
 	.release = my_close,
 	.read    = my_read,
-	.write   = my_write
+	.write   = my_write,
+	.mmap    = my_mmap,
+	.unlocked_ioctl = my_ioctl
 };
 
 
 
+/*
+ *	TACHOMETER SETUP, failures leave the driver in open-loop only
+ */
+static void tach_init(void)
+{
+	if (tach_gpio < 0) { return; }
+
+	if (!gpio_is_valid(tach_gpio) || gpio_request_one(tach_gpio, GPIOF_IN, "EPRO_FAN_1_TACH")) {
+		printk(KERN_ALERT "PWM_A, unable to request tachometer gpio %d \n", tach_gpio);
+		return;
+	}
+
+	tach_irq = gpio_to_irq(tach_gpio);
+	if (request_irq(tach_irq, tach_handler, IRQF_TRIGGER_FALLING, "EPRO_FAN_1_TACH", NULL) < 0) {
+		printk(KERN_ALERT "PWM_A, unable to request tachometer irq \n");
+		gpio_free(tach_gpio);
+		tach_irq = -1;
+		return;
+	}
+
+	tach_last = ktime_get();
+	hrtimer_init(&tach_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tach_timer.function = tach_check;
+	hrtimer_start(&tach_timer, ktime_set(0, TACH_PERIOD * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+}
+
+
+
 /*
  *	CONSTRUCTOR
  */
 static int __init my_init(void)
 {
-	int rc;
+	int rc, i;
+
+	// the control page must exist before anybody can mmap it
+	if ((ctrl = (struct epro_ctrl_page *)get_zeroed_page(GFP_KERNEL)) == NULL) {
+		return -ENOMEM;
+	}
+	SetPageReserved(virt_to_page(ctrl));
+	setup_timer( &ctrl_timer, ctrl_check, 0 );
 
 	// register character device as usual
 	if (alloc_chrdev_region(&devnum, 0, 1, "eprofan") < 0) {
+		ClearPageReserved(virt_to_page(ctrl));
+		free_page((unsigned long)ctrl);
 		return -1;
 	}
 	if ((cl = class_create(THIS_MODULE, "fans")) == NULL) {
 		unregister_chrdev_region(devnum, 1);
+		ClearPageReserved(virt_to_page(ctrl));
+		free_page((unsigned long)ctrl);
 		return -1;
 	}
-	if (device_create(cl, NULL, devnum, NULL, "eprofan") == NULL){
+	if ((sysdev = device_create(cl, NULL, devnum, NULL, "eprofan")) == NULL){
 		class_destroy(cl);
 		unregister_chrdev_region(devnum, 1);
+		ClearPageReserved(virt_to_page(ctrl));
+		free_page((unsigned long)ctrl);
 		return -1;
 	}
 	cdev_init(&mydev, &fops);
@@ -163,10 +677,19 @@ static int __init my_init(void)
 		device_destroy(cl, devnum);
 		class_destroy(cl);
 		unregister_chrdev_region(devnum, 1);
+		ClearPageReserved(virt_to_page(ctrl));
+		free_page((unsigned long)ctrl);
 		return -1;
 	}
 	printk(KERN_INFO "PWM module registered, <Major, Minor>: <%d, %d>\n", MAJOR(devnum), MINOR(devnum));
 
+	// statistics and tunables, the driver works without them
+	for (i = 0; i < ARRAY_SIZE(fan_attrs); i++) {
+		if (device_create_file(sysdev, fan_attrs[i])) {
+			printk(KERN_WARNING "PWM_A, unable to create sysfs attribute %s \n", fan_attrs[i]->attr.name);
+		}
+	}
+
 
 
 	/*
@@ -189,16 +712,20 @@ static int __init my_init(void)
 
 	// Configure PWM device (initially OFF)
 	fan_duty=0;
-	rc = pwm_config(pwm_a, fan_duty, FAN_PERIOD);
+	rc = pwm_config(pwm_a, fan_duty, fan_period);
 	printk(KERN_INFO "PWM_A, pwm_config(): rc=[%d] \n", rc);
 
 	// Enable PWM device
 	rc = pwm_enable(pwm_a);
 	printk(KERN_INFO "PWM_A, pwm_enable(): rc=[%d] \n", rc);
 	
-	// setup the timer
+	// setup the timer, and the work applying its steps
+	INIT_WORK(&pwm_work, pwm_apply_work);
 	setup_timer( &fan_timer, adjust_speed, 0 );
 
+	// setup the tachometer (optional)
+	tach_init();
+
 
 	return 0;
 }
@@ -208,8 +735,19 @@ static int __init my_init(void)
  */
 static void __exit my_exit(void)
 {
-	// remove timer
-	del_timer(&fan_timer);
+	int i;
+
+	// remove tachometer
+	if (tach_irq >= 0) {
+		hrtimer_cancel(&tach_timer);
+		free_irq(tach_irq, NULL);
+		gpio_free(tach_gpio);
+	}
+
+	// remove timers, then the pwm update they may have queued
+	del_timer_sync(&ctrl_timer);
+	del_timer_sync(&fan_timer);
+	cancel_work_sync(&pwm_work);
 
 	pwm_disable(pwm_a);
 	printk(KERN_INFO "PWM_A, pwm_disable()\n");
@@ -218,10 +756,15 @@ static void __exit my_exit(void)
 	printk(KERN_INFO "PWM_A, pwm_free()\n");
 
 	// unregister character device
+	for (i = 0; i < ARRAY_SIZE(fan_attrs); i++) { device_remove_file(sysdev, fan_attrs[i]); }
 	cdev_del(&mydev);
 	device_destroy(cl, devnum);
 	class_destroy(cl);
 	unregister_chrdev_region(devnum, 1);
+
+	// release the control page
+	ClearPageReserved(virt_to_page(ctrl));
+	free_page((unsigned long)ctrl);
 	printk(KERN_INFO "PWM module unregistered \n");
 }
 
@@ -0,0 +1,422 @@
+/*
+	In-kernel thermostat: reads the TMP102 and drives the lamps and the fan by itself
+
+
+	Configuration:
+	- TMP102 temperature sensor at address 0x48 of i2c bus 1 (P9_19 SCL, P9_20 SDA), read
+	  through the eprotemp driver when it is loaded (see ../tmp102), directly otherwise
+	- eprofan and microwave loaded first, their exported setters are looked up at load time
+	  (see ../epro_ctrl.h), a missing actuator is simply left alone
+
+	Usage:
+	- write in /dev/eprothermo the target temperature (e.g. "23.5"), or "key=value" pairs
+	  separated by spaces, newlines or ';':
+		setpoint=23.5		target temperature [degrees]
+		temp=21.0		current temperature [degrees], for boxes without a local sensor
+		lamp_step=3.0		degrees interval to fire each lamp
+		fan_step=0.5		degrees interval to increase the fan speed of fan_increment
+		fan_increment=10	[%]
+		fan_min=25		[%] fan speed while heating, and minimum while cooling
+		period=1000		[milliseconds] control period
+	- read /dev/eprothermo to get the controller LOG line "<target>;<current>;<lamps>;<fan>"
+	  followed by a second line with the gains and the sensor counters
+	- the control law is the same as the one of programs/controller.c, which only relays
+	  SET, TEMP and LOG here when this module is loaded
+
+	Timing:
+	- an hrtimer runs the control law every period on the last sample and calls the
+	  actuators directly, so the control latency is bounded by the kernel timer
+	- i2c transfers sleep, so the hrtimer also queues a work item that fetches the next
+	  sample: the law always runs on a sample at most one period old
+	- temperatures are fixed point, in millidegrees
+
+*/
+
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+
+#include <linux/types.h>		// dev_t data type
+#include <linux/kdev_t.h>		// dev_t: Major() and Minor() functions
+#include <linux/fs.h>			// chrdev regirstration: alloc_chardev_region()
+#include <linux/device.h>		// udev support: class_create() and device_create()
+#include <linux/cdev.h>			// VFS registration: cdev_init() and cdev_add()
+#include <linux/uaccess.h>		// copy_to_user() and read_from_user()
+
+#include <linux/hrtimer.h>		// control period
+#include <linux/ktime.h>
+#include <linux/workqueue.h>		// sensor sampling, i2c transfers sleep
+#include <linux/i2c.h>			// TMP102
+#include <linux/spinlock.h>		// gains and samples shared with the hrtimer
+
+#include "../epro_ctrl.h"		// actuator interface
+#include "../tmp102/eprotemp.h"		// sensor interface
+
+#define TMP102_BUS	    1		// i2c bus number
+#define TMP102_ADDR	 0x48		// i2c address (ADD0 to ground)
+#define TMP102_TEMP	 0x00		// temperature register, 12 bit left aligned, 0.0625 degrees/lsb
+
+#define THERMO_LAMPS	    3		// halogens
+#define MIN_PERIOD	   10		// [milliseconds]
+#define MAX_PERIOD	60000
+
+static dev_t devnum; 			// my dynamically allocated device number <Major,Minor>
+static struct cdev mydev;		// character device structure
+static struct class *cl;		// device class
+
+static int period = 1000;		// [milliseconds] control period
+module_param(period, int, 0444);
+MODULE_PARM_DESC(period, "control period in milliseconds (default 1000)");
+
+static int i2c_bus = TMP102_BUS;
+module_param(i2c_bus, int, 0444);
+MODULE_PARM_DESC(i2c_bus, "TMP102 i2c bus (default 1), -1 to only use written temperatures");
+
+// control law, temperatures in millidegrees
+static int target_temp   = 0;
+static int current_temp  = 0;
+static int lamp_step     = 3000;
+static int fan_step      = 500;
+static int fan_increment = 10;
+static int fan_min       = 25;
+static DEFINE_SPINLOCK(thermo_lock);	// the above, between write() and the hrtimer
+
+// actuators, current outputs and setters
+static int lamps = 0, fan = 0;
+static int (*set_fan)(int percentage);
+static int (*set_lamps)(int mask);
+
+static struct hrtimer thermo_timer;
+static struct work_struct sample_work;
+static struct i2c_adapter *adapter;
+static struct i2c_client *sensor;	// NULL without a TMP102 of our own
+static int (*get_temp)(int *milli);	// eprotemp, when it owns the TMP102
+static unsigned long samples = 0, sample_errors = 0;
+
+
+
+/*
+ *	OPEN
+ */
+static int my_open(struct inode *i, struct file *f)
+{
+	// do nothing
+	return 0;
+}
+
+/*
+ *	CLOSE
+ */
+static int my_close(struct inode *i, struct file *f)
+{
+	// do nothing
+	return 0;
+}
+
+/*
+ *	FIXED POINT HELPERS
+ */
+
+// "23.5" or "-4" into millidegrees
+static int parse_milli(const char *s, int *milli)
+{
+	int neg = 0, v = 0, scale = 1000, digits = 0;
+
+	if (*s == '-') { neg = 1; s++; }
+	else if (*s == '+') { s++; }
+
+	for (; *s >= '0' && *s <= '9'; s++, digits++) {
+		if (v >= 100000) { return -EINVAL; }
+		v = v * 10 + (*s - '0');
+	}
+	v *= 1000;
+	if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++, digits++) {
+			scale /= 10;
+			v += (*s - '0') * scale;
+		}
+	}
+	if (digits == 0 || *s != 0) { return -EINVAL; }
+
+	*milli = neg ? -v : v;
+	return 0;
+}
+
+// millidegrees into "23.5", like the "%.1f" of the controller
+static int format_tenths(char *buf, size_t len, int milli)
+{
+	int t = (milli >= 0 ? milli + 50 : milli - 50) / 100;
+
+	return snprintf(buf, len, "%s%d.%d", t < 0 ? "-" : "", abs(t) / 10, abs(t) % 10);
+}
+
+// rounding towards minus infinity, the floor() of the controller
+static int floor_div(int a, int b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+ *	READ:
+ *	"<target>;<current>;<lamps>;<fan>" like the controller LOG, then the gains
+ */
+static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off)
+{
+	char msg[192], t[3][16];
+	int size;
+
+	format_tenths(t[0], sizeof(t[0]), target_temp);
+	format_tenths(t[1], sizeof(t[1]), current_temp);
+	size = snprintf(msg, sizeof(msg), "%s;%s;%d;%d\n", t[0], t[1], lamps, fan);
+
+	format_tenths(t[0], sizeof(t[0]), lamp_step);
+	format_tenths(t[1], sizeof(t[1]), fan_step);
+	format_tenths(t[2], sizeof(t[2]), target_temp);
+	size += snprintf(msg + size, sizeof(msg) - size,
+			"setpoint=%s lamp_step=%s fan_step=%s fan_increment=%d fan_min=%d period=%d samples=%lu errors=%lu\n",
+			t[2], t[0], t[1], fan_increment, fan_min, period, samples, sample_errors);
+
+	if (*off >= size) { return 0; }
+	if (*off + len > size) { len = size - *off; }
+	if (copy_to_user(buf, msg + *off, len) != 0) { return -EFAULT; }
+
+	*off += len;
+	return len;
+}
+
+
+/*
+ *	WRITE:
+ *	A bare number is the setpoint, otherwise "key=value" pairs
+ */
+static int thermo_set(char *key, char *val)
+{
+	unsigned long flags;
+	int v, rc;
+
+	if (val == NULL) { val = key; key = "setpoint"; }
+	if ((rc = parse_milli(val, &v)) != 0) { return rc; }
+
+	spin_lock_irqsave(&thermo_lock, flags);
+	if      (strcmp(key, "setpoint") == 0) { target_temp = v; }
+	else if (strcmp(key, "temp") == 0)     { current_temp = v; }
+	else if (strcmp(key, "lamp_step") == 0     && v > 0)                 { lamp_step = v; }
+	else if (strcmp(key, "fan_step") == 0      && v > 0)                 { fan_step = v; }
+	else if (strcmp(key, "fan_increment") == 0 && v >= 1000 && v <= 100000)  { fan_increment = v / 1000; }
+	else if (strcmp(key, "fan_min") == 0       && v >= 0 && v <= 100000) { fan_min = v / 1000; }
+	else if (strcmp(key, "period") == 0        && v >= MIN_PERIOD * 1000 && v <= MAX_PERIOD * 1000) { period = v / 1000; }
+	else { rc = -EINVAL; }
+	spin_unlock_irqrestore(&thermo_lock, flags);
+
+	return rc;
+}
+
+static ssize_t my_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
+{
+	char tmp[128], *s, *tok, *eq;
+	int rc, before = target_temp;
+
+	if (len >= sizeof(tmp)) { return -EINVAL; }
+	if ( copy_from_user(tmp, buf, len) != 0 ) { return -EFAULT; }
+	tmp[len] = 0;
+
+	s = tmp;
+	while ((tok = strsep(&s, " \t\n;")) != NULL) {
+		if (*tok == 0) { continue; }
+		if ((eq = strchr(tok, '=')) != NULL) { *eq++ = 0; }
+		if ((rc = thermo_set(tok, eq)) != 0) { return rc; }
+	}
+
+	// the controller writes on every reading, only a new setpoint is worth a line
+	if (target_temp != before) { printk(KERN_INFO "EPROTHERMO, setpoint [%d] mC \n", target_temp); }
+	return len;
+}
+
+
+
+/*
+ *	SAMPLING: one i2c transfer, in process context
+ */
+static void sample_fetch(struct work_struct *work)
+{
+	int raw = i2c_smbus_read_word_data(sensor, TMP102_TEMP);
+
+	if (raw < 0) { sample_errors++; return; }
+
+	// smbus words are little endian, the TMP102 sends the msb first
+	raw = (s16)swab16(raw) >> 4;
+	current_temp = raw * 625 / 10;
+	samples++;
+}
+
+
+/*
+ *	CALLBACK FUNCTION FOR THE CONTROL TIMER
+ */
+static enum hrtimer_restart thermo_check(struct hrtimer *t)
+{
+	int diff, n, new_lamps = lamps, new_fan = fan, temp;
+
+	spin_lock(&thermo_lock);
+
+	// eprotemp keeps its own sampling rate, take its last sample
+	if (get_temp != NULL && get_temp(&temp) == 0) { current_temp = temp; }
+	diff = target_temp - current_temp;
+
+	// we need to RAISE the temperature: slow fan, lamps proportional to the difference
+	if (diff > 0) {
+		new_fan = fan_min;
+		n = floor_div(diff, lamp_step) + 1;
+		new_lamps = (n > THERMO_LAMPS) ? THERMO_LAMPS : n;
+	}
+
+	// we need to LOWER the temperature: lamps off, fan proportional to the difference
+	if (diff < 0) {
+		new_lamps = 0;
+		n = -(floor_div(diff, fan_step) + 1) * fan_increment;
+		if (n > 100)     { n = 100; }
+		if (n < fan_min) { n = fan_min; }
+		new_fan = n;
+	}
+	spin_unlock(&thermo_lock);
+
+	// actuate on changes only, the fan driver ramps by itself
+	if (new_fan != fan && set_fan != NULL)         { set_fan(new_fan); }
+	if (new_lamps != lamps && set_lamps != NULL)   { set_lamps((1 << new_lamps) - 1); }
+	fan = new_fan;
+	lamps = new_lamps;
+
+	// the next period runs on a fresh sample
+	if (sensor != NULL) { schedule_work(&sample_work); }
+
+	hrtimer_forward_now(t, ktime_set(period / 1000, (period % 1000) * NSEC_PER_MSEC));
+	return HRTIMER_RESTART;
+}
+
+
+
+/*
+ *	File operations and function callbacks
+ */
+static struct file_operations fops =
+{
+	.owner   = THIS_MODULE,
+	.open    = my_open,
+	.release = my_close,
+	.read    = my_read,
+	.write   = my_write
+};
+
+
+
+/*
+ *	SENSOR SETUP, without a TMP102 the temperature comes from write()
+ */
+static void sensor_init(void)
+{
+	if (i2c_bus < 0) { return; }
+
+	if ((get_temp = symbol_get(eprotemp_get_temp)) != NULL) {
+		printk(KERN_INFO "EPROTHERMO, temperature from eprotemp \n");
+		return;
+	}
+
+	if ((adapter = i2c_get_adapter(i2c_bus)) == NULL) {
+		printk(KERN_ALERT "EPROTHERMO, no i2c bus %d \n", i2c_bus);
+		return;
+	}
+	if ((sensor = i2c_new_dummy(adapter, TMP102_ADDR)) == NULL) {
+		printk(KERN_ALERT "EPROTHERMO, unable to attach the TMP102 \n");
+		i2c_put_adapter(adapter);
+		adapter = NULL;
+		return;
+	}
+
+	// the first period already runs on a real sample
+	sample_fetch(NULL);
+}
+
+
+
+/*
+ *	CONSTRUCTOR
+ */
+static int __init my_init(void)
+{
+	if (period < MIN_PERIOD || period > MAX_PERIOD) { return -EINVAL; }
+
+	// register character device as usual
+	if (alloc_chrdev_region(&devnum, 0, 1, "eprothermo") < 0) {
+		return -1;
+	}
+	if ((cl = class_create(THIS_MODULE, "thermostats")) == NULL) {
+		unregister_chrdev_region(devnum, 1);
+		return -1;
+	}
+	if (device_create(cl, NULL, devnum, NULL, "eprothermo") == NULL){
+		class_destroy(cl);
+		unregister_chrdev_region(devnum, 1);
+		return -1;
+	}
+	cdev_init(&mydev, &fops);
+	if (cdev_add(&mydev, devnum, 1) == -1)
+	{
+		device_destroy(cl, devnum);
+		class_destroy(cl);
+		unregister_chrdev_region(devnum, 1);
+		return -1;
+	}
+	printk(KERN_INFO "EPROTHERMO module registered, <Major, Minor>: <%d, %d>\n", MAJOR(devnum), MINOR(devnum));
+
+	// actuators, they stay pinned while we are loaded
+	set_fan   = symbol_get(eprofan_set_percentage);
+	set_lamps = symbol_get(microwave_set_lamps);
+	if (set_fan == NULL)   { printk(KERN_WARNING "EPROTHERMO, eprofan not loaded, no fan \n"); }
+	if (set_lamps == NULL) { printk(KERN_WARNING "EPROTHERMO, microwave not loaded, no lamps \n"); }
+
+	INIT_WORK(&sample_work, sample_fetch);
+	sensor_init();
+
+	hrtimer_init(&thermo_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	thermo_timer.function = thermo_check;
+	hrtimer_start(&thermo_timer, ktime_set(period / 1000, (period % 1000) * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+
+
+/*
+ *	DECONSTRUCTOR
+ */
+static void __exit my_exit(void)
+{
+	// stop the control law first, then whatever it may have queued
+	hrtimer_cancel(&thermo_timer);
+	cancel_work_sync(&sample_work);
+
+	if (sensor != NULL) {
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+	}
+	if (get_temp != NULL) { symbol_put(eprotemp_get_temp); }
+
+	// leave the box safe: lamps off, fan to the minimum
+	if (set_lamps != NULL) { set_lamps(0); symbol_put(microwave_set_lamps); }
+	if (set_fan != NULL)   { set_fan(fan_min); symbol_put(eprofan_set_percentage); }
+
+	cdev_del(&mydev);
+	device_destroy(cl, devnum);
+	class_destroy(cl);
+	unregister_chrdev_region(devnum, 1);
+	printk(KERN_INFO "EPROTHERMO module unregistered\n");
+}
+
+
+
+module_init(my_init);
+module_exit(my_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("EPRO2 in-kernel thermostat");
@@ -0,0 +1,441 @@
+/*
+	TMP102 temperature sensor driver a.k.a. "eprotemp"
+
+
+	Configuration:
+	- TMP102 at address 0x48 of i2c bus 1 (P9_19 SCL, P9_20 SDA), ADD0 to ground
+
+	Usage:
+	- an hrtimer triggers a sample every [period] milliseconds, the sample is timestamped
+	  at the trigger and pushed in a fifo (see eprotemp.h for the record layout)
+	- reading /dev/eprotemp returns as many whole records as fit in the user buffer (at
+	  least one), blocking until a sample arrives unless the file was opened with O_NONBLOCK
+	- poll()/select() report the device as readable while the fifo is not empty
+	- EPROTEMP_IOC_SET_CONFIG sets the trigger period, the conversion rate of the sensor and
+	  the extended (13 bit) mode, EPROTEMP_IOC_STATS returns the counters
+	- a full fifo drops the newest samples, the seq field of the records shows the gaps
+	- other modules get the last sample with eprotemp_get_temp() (see ../thermostat)
+
+	Timing:
+	- i2c transfers sleep, so the hrtimer only takes the timestamp and queues the transfer
+	  on a high priority workqueue: the timestamps keep the period of the hrtimer, the
+	  transfer latency does not add jitter to them
+	- the work item is the only producer and reads are serialized by a mutex, so the fifo
+	  needs no lock (like in templates/module_gpio_interrupt)
+
+*/
+
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+
+#include <linux/types.h>		// dev_t data type
+#include <linux/kdev_t.h>		// dev_t: Major() and Minor() functions
+#include <linux/fs.h>			// chrdev regirstration: alloc_chardev_region()
+#include <linux/device.h>		// udev support: class_create() and device_create()
+#include <linux/cdev.h>			// VFS registration: cdev_init() and cdev_add()
+#include <linux/uaccess.h>		// copy_to_user() and read_from_user()
+
+#include <linux/hrtimer.h>		// sampling trigger
+#include <linux/ktime.h>		// sample timestamps
+#include <linux/workqueue.h>		// i2c transfers sleep
+#include <linux/i2c.h>			// TMP102
+#include <linux/kfifo.h>		// lock-free fifo between the work item and read()
+#include <linux/wait.h>			// wait queues for blocking readers
+#include <linux/poll.h>			// poll() and select() support
+#include <linux/mutex.h>		// serialize concurrent readers
+#include <linux/spinlock.h>		// last sample and counters
+#include <linux/ioctl.h>		// configuration and statistics
+
+#include "eprotemp.h"
+
+#define TMP102_BUS	    1		// i2c bus number
+#define TMP102_ADDR	 0x48		// i2c address (ADD0 to ground)
+#define TMP102_TEMP	 0x00		// temperature register
+#define TMP102_CONF	 0x01		// configuration register
+#define TMP102_CONF_CR	 0x00c0		// conversion rate bits
+#define TMP102_CONF_EM	 0x0010		// extended mode bit
+#define TMP102_TEMP_EM	 0x0001		// set in the temperature register in extended mode
+
+#define FIFO_SIZE	 1024		// [records] must be a power of 2, 16kB of samples
+#define MIN_PERIOD	   10		// [milliseconds]
+#define MAX_PERIOD	60000
+
+static dev_t devnum; 			// my dynamically allocated device number <Major,Minor>
+static struct cdev mydev;		// character device structure
+static struct class *cl;		// device class
+
+static int i2c_bus = TMP102_BUS;
+module_param(i2c_bus, int, 0444);
+MODULE_PARM_DESC(i2c_bus, "TMP102 i2c bus (default 1)");
+
+static int period = 250;		// [milliseconds] sampling trigger interval
+module_param(period, int, 0444);
+MODULE_PARM_DESC(period, "sampling period in milliseconds (default 250)");
+
+static int rate = EPROTEMP_RATE_4HZ;	// sensor conversion rate
+module_param(rate, int, 0444);
+MODULE_PARM_DESC(rate, "TMP102 conversion rate: 0=0.25Hz 1=1Hz 2=4Hz (default) 3=8Hz");
+
+static int extended = 0;		// 13 bit extended mode
+module_param(extended, int, 0444);
+MODULE_PARM_DESC(extended, "TMP102 extended mode, up to 150 degrees (default 0)");
+
+static struct i2c_adapter *adapter;
+static struct i2c_client *sensor;
+
+static struct hrtimer trigger_timer;
+static struct workqueue_struct *sample_wq;
+static struct work_struct sample_work;
+static s64 trigger_ts;			// timestamp of the pending trigger
+static u32 trigger_seq = 0;		// triggers so far
+
+static DECLARE_KFIFO(samples, struct eprotemp_sample, FIFO_SIZE);
+static DECLARE_WAIT_QUEUE_HEAD(readers);	// readers sleeping on an empty fifo
+static DEFINE_MUTEX(read_lock);			// kfifo allows only one reader at a time
+static DEFINE_MUTEX(config_lock);		// configuration changes
+static DEFINE_SPINLOCK(stats_lock);		// the two below, read from any context
+static struct eprotemp_stats stats;
+static struct eprotemp_sample latest;
+
+
+
+/*
+ *	OPEN
+ */
+static int my_open(struct inode *i, struct file *f)
+{
+	// do nothing
+	return 0;
+}
+
+/*
+ *	CLOSE
+ */
+static int my_close(struct inode *i, struct file *f)
+{
+	// do nothing
+	return 0;
+}
+
+/*
+ *	READ:
+ *	Drain whole records from the fifo, as many as fit in the user buffer
+ */
+static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off)
+{
+	unsigned long flags;
+	unsigned int copied;
+	int rc;
+
+	// we deliver only whole records
+	if (len < sizeof(struct eprotemp_sample)) { return -EINVAL; }
+	len -= len % sizeof(struct eprotemp_sample);
+
+	if (mutex_lock_interruptible(&read_lock)) { return -ERESTARTSYS; }
+
+	// sleep until the work item pushes something
+	while (kfifo_is_empty(&samples)) {
+		mutex_unlock(&read_lock);
+		if (f->f_flags & O_NONBLOCK) { return -EAGAIN; }
+		if (wait_event_interruptible(readers, !kfifo_is_empty(&samples))) { return -ERESTARTSYS; }
+		if (mutex_lock_interruptible(&read_lock)) { return -ERESTARTSYS; }
+	}
+
+	// one copy for the whole batch
+	rc = kfifo_to_user(&samples, buf, len, &copied);
+	if (rc == 0) {
+		spin_lock_irqsave(&stats_lock, flags);
+		stats.read += copied / sizeof(struct eprotemp_sample);
+		spin_unlock_irqrestore(&stats_lock, flags);
+	}
+	mutex_unlock(&read_lock);
+
+	return rc ? rc : copied;
+}
+
+
+/*
+ *	POLL:
+ *	Readable while there are records in the fifo
+ */
+static unsigned int my_poll(struct file *f, poll_table *wait)
+{
+	poll_wait(f, &readers, wait);
+	if (!kfifo_is_empty(&samples)) { return POLLIN | POLLRDNORM; }
+	return 0;
+}
+
+
+/*
+ *	SENSOR CONFIGURATION: conversion rate and extended mode, config_lock held
+ */
+static int sensor_configure(int new_rate, int new_extended)
+{
+	int conf = i2c_smbus_read_word_data(sensor, TMP102_CONF);
+
+	if (conf < 0) { return conf; }
+
+	// smbus words are little endian, the TMP102 sends the msb first
+	conf = swab16(conf) & ~(TMP102_CONF_CR | TMP102_CONF_EM);
+	conf |= new_rate << 6;
+	if (new_extended) { conf |= TMP102_CONF_EM; }
+
+	return i2c_smbus_write_word_data(sensor, TMP102_CONF, swab16(conf));
+}
+
+
+/*
+ *	IOCTL:
+ *	Configuration and counters
+ */
+static long my_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct eprotemp_config conf;
+	struct eprotemp_stats snapshot;
+	unsigned long flags;
+	int rc;
+
+	switch (cmd) {
+
+	case EPROTEMP_IOC_GET_CONFIG:
+		conf.period = period;
+		conf.rate = rate;
+		conf.extended = extended;
+		if (copy_to_user((void __user *)arg, &conf, sizeof(conf)) != 0) { return -EFAULT; }
+		return 0;
+
+	case EPROTEMP_IOC_SET_CONFIG:
+		if (copy_from_user(&conf, (void __user *)arg, sizeof(conf)) != 0) { return -EFAULT; }
+		if (conf.period < MIN_PERIOD || conf.period > MAX_PERIOD) { return -EINVAL; }
+		if (conf.rate > EPROTEMP_RATE_8HZ || conf.extended > 1) { return -EINVAL; }
+
+		mutex_lock(&config_lock);
+		if ((rc = sensor_configure(conf.rate, conf.extended)) == 0) {
+			rate = conf.rate;
+			extended = conf.extended;
+
+			// the new period starts now
+			if (conf.period != period) {
+				period = conf.period;
+				hrtimer_cancel(&trigger_timer);
+				hrtimer_start(&trigger_timer, ktime_set(period / 1000, (period % 1000) * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+			}
+		}
+		mutex_unlock(&config_lock);
+		return rc;
+
+	case EPROTEMP_IOC_STATS:
+		spin_lock_irqsave(&stats_lock, flags);
+		snapshot = stats;
+		spin_unlock_irqrestore(&stats_lock, flags);
+		if (copy_to_user((void __user *)arg, &snapshot, sizeof(snapshot)) != 0) { return -EFAULT; }
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+
+/*
+ *	IN-KERNEL INTERFACE, see eprotemp.h
+ */
+int eprotemp_get_temp(int *milli)
+{
+	unsigned long flags;
+	int rc = -ENODATA;
+
+	spin_lock_irqsave(&stats_lock, flags);
+	if (stats.captured + stats.dropped > 0) {
+		*milli = latest.temp;
+		rc = 0;
+	}
+	spin_unlock_irqrestore(&stats_lock, flags);
+	return rc;
+}
+EXPORT_SYMBOL(eprotemp_get_temp);
+
+
+/*
+ *	SAMPLING: one i2c transfer, in process context
+ */
+static void sample_fetch(struct work_struct *work)
+{
+	struct eprotemp_sample s;
+	unsigned long flags;
+	int raw;
+
+	s.timestamp = trigger_ts;
+	s.seq = trigger_seq;
+
+	raw = i2c_smbus_read_word_data(sensor, TMP102_TEMP);
+	if (raw < 0) {
+		spin_lock_irqsave(&stats_lock, flags);
+		stats.errors++;
+		spin_unlock_irqrestore(&stats_lock, flags);
+		return;
+	}
+
+	// 12 bit left aligned, or 13 bit with the extended mode flag, 0.0625 degrees per lsb
+	raw = swab16(raw);
+	if (raw & TMP102_TEMP_EM) { s.temp = ((s16)raw >> 3) * 625 / 10; }
+	else { s.temp = ((s16)raw >> 4) * 625 / 10; }
+
+	// push the sample, never wait: a full fifo drops the newest one
+	spin_lock_irqsave(&stats_lock, flags);
+	if (kfifo_put(&samples, &s)) { stats.captured++; }
+	else { stats.dropped++; }
+	latest = s;
+	spin_unlock_irqrestore(&stats_lock, flags);
+
+	wake_up_interruptible(&readers);
+}
+
+
+/*
+ *	CALLBACK FUNCTION FOR THE TRIGGER TIMER
+ */
+static enum hrtimer_restart trigger(struct hrtimer *t)
+{
+	unsigned long flags;
+
+	// timestamp first, everything else is jitter
+	s64 now = ktime_to_ns(ktime_get());
+
+	// the previous transfer is still queued: skip this trigger
+	if (work_pending(&sample_work)) {
+		spin_lock_irqsave(&stats_lock, flags);
+		stats.overruns++;
+		spin_unlock_irqrestore(&stats_lock, flags);
+	}
+	else {
+		trigger_ts = now;
+		trigger_seq++;
+		queue_work(sample_wq, &sample_work);
+	}
+
+	hrtimer_forward_now(t, ktime_set(period / 1000, (period % 1000) * NSEC_PER_MSEC));
+	return HRTIMER_RESTART;
+}
+
+
+
+/*
+ *	File operations and function callbacks
+ */
+static struct file_operations fops =
+{
+	.owner   	= THIS_MODULE,
+	.open    	= my_open,
+	.release 	= my_close,
+	.read    	= my_read,
+	.poll    	= my_poll,
+	.unlocked_ioctl	= my_ioctl
+};
+
+
+
+/*
+ *	CONSTRUCTOR
+ */
+static int __init my_init(void)
+{
+	if (period < MIN_PERIOD || period > MAX_PERIOD) { return -EINVAL; }
+	if (rate < 0 || rate > EPROTEMP_RATE_8HZ) { return -EINVAL; }
+
+	INIT_KFIFO(samples);
+
+	// attach to the sensor first, there is nothing to offer without it
+	if ((adapter = i2c_get_adapter(i2c_bus)) == NULL) {
+		printk(KERN_ALERT "EPROTEMP, no i2c bus %d \n", i2c_bus);
+		return -ENODEV;
+	}
+	if ((sensor = i2c_new_dummy(adapter, TMP102_ADDR)) == NULL) {
+		printk(KERN_ALERT "EPROTEMP, unable to attach the TMP102 \n");
+		i2c_put_adapter(adapter);
+		return -EBUSY;
+	}
+	if (sensor_configure(rate, extended) < 0) {
+		printk(KERN_ALERT "EPROTEMP, no answer from the TMP102 \n");
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+		return -ENODEV;
+	}
+	if ((sample_wq = alloc_workqueue("eprotemp", WQ_HIGHPRI, 1)) == NULL) {
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+		return -ENOMEM;
+	}
+	INIT_WORK(&sample_work, sample_fetch);
+
+	// register character device as usual
+	if (alloc_chrdev_region(&devnum, 0, 1, "eprotemp") < 0) {
+		destroy_workqueue(sample_wq);
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+		return -1;
+	}
+	if ((cl = class_create(THIS_MODULE, "sensors")) == NULL) {
+		unregister_chrdev_region(devnum, 1);
+		destroy_workqueue(sample_wq);
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+		return -1;
+	}
+	if (device_create(cl, NULL, devnum, NULL, "eprotemp") == NULL){
+		class_destroy(cl);
+		unregister_chrdev_region(devnum, 1);
+		destroy_workqueue(sample_wq);
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+		return -1;
+	}
+	cdev_init(&mydev, &fops);
+	if (cdev_add(&mydev, devnum, 1) == -1)
+	{
+		device_destroy(cl, devnum);
+		class_destroy(cl);
+		unregister_chrdev_region(devnum, 1);
+		destroy_workqueue(sample_wq);
+		i2c_unregister_device(sensor);
+		i2c_put_adapter(adapter);
+		return -1;
+	}
+	printk(KERN_INFO "EPROTEMP module registered, <Major, Minor>: <%d, %d>\n", MAJOR(devnum), MINOR(devnum));
+
+	// start sampling
+	hrtimer_init(&trigger_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	trigger_timer.function = trigger;
+	hrtimer_start(&trigger_timer, ktime_set(period / 1000, (period % 1000) * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+/*
+ *	DECONSTRUCTOR
+ */
+static void __exit my_exit(void)
+{
+	// stop the trigger first, then whatever it may have queued
+	hrtimer_cancel(&trigger_timer);
+	cancel_work_sync(&sample_work);
+	destroy_workqueue(sample_wq);
+
+	i2c_unregister_device(sensor);
+	i2c_put_adapter(adapter);
+
+	// unregister character device
+	cdev_del(&mydev);
+	device_destroy(cl, devnum);
+	class_destroy(cl);
+	unregister_chrdev_region(devnum, 1);
+	printk(KERN_INFO "EPROTEMP module unregistered: %llu samples captured, %llu dropped, %llu errors\n",
+		stats.captured, stats.dropped, stats.errors);
+}
+
+module_init(my_init);
+module_exit(my_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("EPRO2 TMP102 temperature sensor, triggered and buffered");
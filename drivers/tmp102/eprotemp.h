@@ -0,0 +1,59 @@
+/*
+	EPROTEMP, TMP102 temperature sensor driver interface
+
+	Records read from /dev/eprotemp, the configuration and statistics ioctls. This header
+	is included both by the driver and by the userspace programs, the in-kernel interface
+	at the bottom is for modules only.
+
+	Usage from userspace:
+		struct eprotemp_sample s[64];
+		fd = open("/dev/eprotemp", O_RDONLY);
+		n  = read(fd, s, sizeof(s)) / sizeof(s[0]);
+*/
+
+#ifndef EPROTEMP_H
+#define EPROTEMP_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// one sample, 16 bytes, native endianness
+struct eprotemp_sample {
+	__s64 timestamp;		// [nanoseconds] monotonic clock, when the sample was triggered
+	__s32 temp;			// [millidegrees]
+	__u32 seq;			// trigger number, a gap means samples were lost
+};
+
+// TMP102 conversion rates, CR1:CR0 of the configuration register
+#define EPROTEMP_RATE_0_25HZ	0
+#define EPROTEMP_RATE_1HZ	1
+#define EPROTEMP_RATE_4HZ	2		// power-on default
+#define EPROTEMP_RATE_8HZ	3
+
+struct eprotemp_config {
+	__u32 period;			// [milliseconds] sampling trigger interval
+	__u32 rate;			// sensor conversion rate, EPROTEMP_RATE_*
+	__u32 extended;			// 1 = 13 bit extended mode, up to 150 degrees
+};
+
+struct eprotemp_stats {
+	__u64 captured;			// samples pushed in the fifo
+	__u64 dropped;			// samples lost because the fifo was full
+	__u64 errors;			// failed i2c transfers
+	__u64 overruns;			// triggers while the previous transfer was still running
+	__u64 read;			// samples delivered to userspace
+};
+
+#define EPROTEMP_IOC_MAGIC	't'
+#define EPROTEMP_IOC_GET_CONFIG	_IOR(EPROTEMP_IOC_MAGIC, 1, struct eprotemp_config)
+#define EPROTEMP_IOC_SET_CONFIG	_IOW(EPROTEMP_IOC_MAGIC, 2, struct eprotemp_config)
+#define EPROTEMP_IOC_STATS	_IOR(EPROTEMP_IOC_MAGIC, 3, struct eprotemp_stats)
+
+#ifdef __KERNEL__
+
+// last sample [millidegrees], -ENODATA before the first one; safe from any context
+int eprotemp_get_temp(int *milli);
+
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+/*
+	CHECKS
+
+	CHECK(), CHECK_EQ() and BENCH(), shared by the driver tests (through harness.h) and by
+	the tests of the userspace programs, which do not use the kernel shim.
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <time.h>
+
+static const char *harness_name;
+static int harness_checks __attribute__((unused)) = 0, harness_failures __attribute__((unused)) = 0;
+
+#define CHECK(cond) do {								\
+	harness_checks++;								\
+	if (!(cond)) {									\
+		harness_failures++;							\
+		fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);\
+	}										\
+} while (0)
+
+#define CHECK_EQ(a, b) do {								\
+	long __a = (long)(a), __b = (long)(b);						\
+	harness_checks++;								\
+	if (__a != __b) {								\
+		harness_failures++;							\
+		fprintf(stderr, "%s:%d: CHECK failed: %s == %s (%ld != %ld)\n",		\
+			__FILE__, __LINE__, #a, #b, __a, __b);				\
+	}										\
+} while (0)
+
+// host time, for the benchmarks
+static inline long long harness_host_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// run [body] [iters] times and print "driver,benchmark,iterations,ns_per_op"
+#define BENCH(label, iters, body) do {							\
+	long __i, __n = (iters);							\
+	long long __t0 = harness_host_ns();						\
+	for (__i = 0; __i < __n; __i++) { body; }					\
+	printf("%s,%s,%ld,%.1f\n", harness_name, label, __n,				\
+		(double)(harness_host_ns() - __t0) / __n);				\
+} while (0)
+
+#endif
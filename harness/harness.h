@@ -0,0 +1,87 @@
+/*
+	DRIVER HARNESS
+
+	Each test_<driver>.c includes this file and then the driver source itself, so the static
+	functions and variables of the driver are reachable from the tests. HARNESS_MAIN() gives
+	every test program the same command line:
+
+		./test_eprofan			run the unit tests, exit status = number of failures
+		./test_eprofan -b		run the microbenchmarks, CSV on stdout
+		./test_eprofan -w out.vcd	run the unit tests and dump the gpio/pwm waveforms
+		./test_eprofan -v		echo the driver printk on stderr
+*/
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "shim/kernel_shim.h"
+
+#include "check.h"
+
+// write a string to a device file, opening and closing it like fprintf() in the controller does
+static inline ssize_t harness_echo(const char *dev, const char *text)
+{
+	struct file *f = shim_open(dev, O_WRONLY);
+	ssize_t rc;
+
+	if (f == NULL) return -ENODEV;
+	rc = shim_write(f, text, strlen(text));
+	shim_close(f);
+	return rc;
+}
+
+// read a device file from the start into a NUL-terminated buffer
+static inline ssize_t harness_cat(const char *dev, char *buf, size_t len)
+{
+	struct file *f = shim_open(dev, O_RDONLY);
+	ssize_t rc;
+
+	if (f == NULL) return -ENODEV;
+	rc = shim_read(f, buf, len - 1);
+	buf[rc > 0 ? rc : 0] = 0;
+	shim_close(f);
+	return rc;
+}
+
+// a numeric sysfs attribute of a device, like cat /sys/class/<class>/<device>/<attr>
+static inline long harness_attr(const char *dev, const char *attr)
+{
+	char buf[PAGE_SIZE];
+	ssize_t rc = shim_attr_show(dev, attr, buf);
+
+	return rc < 0 ? rc : strtol(buf, NULL, 0);
+}
+
+// the TMP102 of the board, bus 1 address 0x48 as the eprotemp and eprothermo drivers expect:
+// set its temperature register to [milli] millidegrees, 0.0625 degrees per lsb, left aligned
+// on 12 bits, or on 13 bits with bit 0 set in [extended] mode
+static inline void harness_tmp102(int milli, int extended)
+{
+	u16 reg = (u16)((unsigned int)(milli * 10 / 625) << (extended ? 3 : 4));
+
+	shim_i2c_set(1, 0x48, 0x00, extended ? reg | 0x0001 : reg);
+}
+
+#define HARNESS_MAIN(name, tests, benches)						\
+int main(int argc, char **argv)								\
+{											\
+	const char *vcd = NULL;								\
+	int bench = 0, i;								\
+											\
+	harness_name = name;								\
+	for (i = 1; i < argc; i++) {							\
+		if (strcmp(argv[i], "-b") == 0) bench = 1;				\
+		else if (strcmp(argv[i], "-v") == 0) shim_verbose = 1;			\
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) vcd = argv[++i];	\
+		else { fprintf(stderr, "usage: %s [-b] [-v] [-w waves.vcd]\n", argv[0]); return 1; } \
+	}										\
+											\
+	if (bench) { shim_tracing = 0; benches(); return 0; }				\
+											\
+	tests();									\
+	if (vcd != NULL && shim_trace_vcd(vcd) != 0) { perror(vcd); }			\
+	printf("%s: %d checks, %d failed\n", name, harness_checks, harness_failures);	\
+	return harness_failures;							\
+}
+
+#endif
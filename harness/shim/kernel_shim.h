@@ -0,0 +1,560 @@
+/*
+	KERNEL SHIM
+
+	Just enough of the kernel API used by our drivers to compile them as plain userspace C.
+	Every header in linux/ includes this file, shim.c implements it.
+
+	- time is virtual: jiffies, ktime_get() and the timers only move when the harness runs
+	  the event loop (shim_run()), so tests are deterministic and as fast as the host
+	- gpio and pwm outputs are recorded with their virtual timestamp (see shim_trace_vcd())
+	- there is only one thread: locks are no-ops and a sleeping wait runs the event loop
+	  until its condition holds or nothing is left to happen
+*/
+
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+/*
+ *	TYPES & HELPERS
+ */
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef long long s64;
+
+typedef uint8_t  __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef unsigned long long __u64;
+typedef int32_t  __s32;
+typedef long long __s64;
+
+#define __user
+#define __iomem
+#define __init
+#define __exit
+#define __must_check
+
+#define ACCESS_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define barrier()		__asm__ __volatile__("" ::: "memory")
+#define smp_mb()		__sync_synchronize()
+#define smp_rmb()		__sync_synchronize()
+#define smp_wmb()		__sync_synchronize()
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)		((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+
+#define hweight8(w)		__builtin_popcount((u8)(w))
+#define hweight32(w)		__builtin_popcount((u32)(w))
+
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+static inline s64 div_s64(s64 dividend, s32 divisor) { return dividend / divisor; }
+
+#define swab16(x)		((u16)((((u16)(x) & 0x00ff) << 8) | (((u16)(x) & 0xff00) >> 8)))
+
+static inline long simple_strtol(const char *cp, char **endp, unsigned int base) { return strtol(cp, endp, base); }
+static inline unsigned long simple_strtoul(const char *cp, char **endp, unsigned int base) { return strtoul(cp, endp, base); }
+
+// the whole string is the number, a trailing newline allowed
+static inline int kstrtoint(const char *s, unsigned int base, int *res)
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(s, &end, base);
+	if (end == s || (*end != 0 && strcmp(end, "\n") != 0)) return -EINVAL;
+	if (errno == ERANGE || v != (int)v) return -ERANGE;
+	*res = v;
+	return 0;
+}
+
+#define ERESTARTSYS		512
+
+
+/*
+ *	PRINTK
+ */
+#define KERN_EMERG		"<0>"
+#define KERN_ALERT		"<1>"
+#define KERN_CRIT		"<2>"
+#define KERN_ERR		"<3>"
+#define KERN_WARNING		"<4>"
+#define KERN_NOTICE		"<5>"
+#define KERN_INFO		"<6>"
+#define KERN_DEBUG		"<7>"
+
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define pr_info(fmt, ...)	printk(KERN_INFO fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	printk(KERN_WARNING fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...)	do { } while (0)
+
+extern unsigned long shim_printk_count;	// messages printed since start
+extern int shim_verbose;		// echo printk on stderr
+
+
+/*
+ *	MODULE
+ */
+struct module;
+#define THIS_MODULE		((struct module *)0)
+
+#define MODULE_LICENSE(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_param_array(name, type, nump, perm)
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+// symbols of other modules are linked from the test program, which provides them
+#define symbol_get(x)		(&(x))
+#define symbol_put(x)		do { } while (0)
+
+// the driver under test gets its entry points renamed, the harness calls them
+#define module_init(fn)		int shim_module_init(void) { return fn(); }
+#define module_exit(fn)		void shim_module_exit(void) { fn(); }
+int  shim_module_init(void);
+void shim_module_exit(void);
+
+
+/*
+ *	CHARACTER DEVICES
+ */
+#define MINORBITS		20
+#define MINORMASK		((1U << MINORBITS) - 1)
+#define MAJOR(dev)		((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev)		((unsigned int)((dev) & MINORMASK))
+#define MKDEV(ma, mi)		(((ma) << MINORBITS) | (mi))
+
+struct inode { dev_t i_rdev; };
+
+struct file {
+	unsigned int f_flags;
+	loff_t f_pos;
+	void *private_data;
+	const struct file_operations *f_op;
+};
+
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+struct vm_area_struct;
+
+struct file_operations {
+	struct module *owner;
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	unsigned int (*poll)(struct file *, poll_table *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+};
+
+struct cdev {
+	const struct file_operations *ops;
+	dev_t dev;
+	unsigned int count;
+};
+
+struct class  { const char *name; };
+struct device { dev_t devt; const char *name; void *driver_data; };
+
+int  alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name);
+void unregister_chrdev_region(dev_t from, unsigned int count);
+void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+int  cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev *cdev);
+struct class  *class_create(struct module *owner, const char *name);
+void class_destroy(struct class *cls);
+struct device *device_create(struct class *cls, struct device *parent, dev_t devt, void *drvdata, const char *fmt, ...);
+void device_destroy(struct class *cls, dev_t devt);
+
+// sysfs attributes of a device, the harness reaches them with shim_attr_show()/shim_attr_store()
+typedef unsigned short umode_t;
+#define S_IRUGO			(S_IRUSR | S_IRGRP | S_IROTH)
+
+struct attribute { const char *name; umode_t mode; };
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+};
+#define DEVICE_ATTR(_name, _mode, _show, _store) \
+	struct device_attribute dev_attr_##_name = { { #_name, _mode }, _show, _store }
+
+int  device_create_file(struct device *dev, const struct device_attribute *attr);
+void device_remove_file(struct device *dev, const struct device_attribute *attr);
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) { memcpy(to, from, n); return 0; }
+
+#define _IOC_NRBITS		8
+#define _IOC_TYPEBITS		8
+#define _IOC_SIZEBITS		14
+#define _IOC_NRSHIFT		0
+#define _IOC_TYPESHIFT		(_IOC_NRSHIFT + _IOC_NRBITS)
+#define _IOC_SIZESHIFT		(_IOC_TYPESHIFT + _IOC_TYPEBITS)
+#define _IOC_DIRSHIFT		(_IOC_SIZESHIFT + _IOC_SIZEBITS)
+#define _IOC_NONE		0U
+#define _IOC_WRITE		1U
+#define _IOC_READ		2U
+#define _IOC(dir, type, nr, size) \
+	(((dir) << _IOC_DIRSHIFT) | ((type) << _IOC_TYPESHIFT) | ((nr) << _IOC_NRSHIFT) | ((size) << _IOC_SIZESHIFT))
+#define _IO(type, nr)		_IOC(_IOC_NONE, (type), (nr), 0)
+#define _IOR(type, nr, t)	_IOC(_IOC_READ, (type), (nr), sizeof(t))
+#define _IOW(type, nr, t)	_IOC(_IOC_WRITE, (type), (nr), sizeof(t))
+#define _IOWR(type, nr, t)	_IOC(_IOC_READ | _IOC_WRITE, (type), (nr), sizeof(t))
+
+
+/*
+ *	MEMORY
+ */
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define PAGE_ALIGN(x)		(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		1
+#define VM_READ			0x00000001
+#define VM_WRITE		0x00000002
+#define VM_MAYREAD		0x00000010
+#define VM_MAYWRITE		0x00000020
+#define VM_DONTEXPAND		0x00040000
+
+struct page;
+typedef unsigned long pgprot_t;
+
+struct vm_operations_struct {
+	void (*open)(struct vm_area_struct *);
+	void (*close)(struct vm_area_struct *);
+};
+
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+	pgprot_t vm_page_prot;
+	const struct vm_operations_struct *vm_ops;
+	void *vm_private_data;
+};
+
+unsigned long get_zeroed_page(int gfp);
+void free_page(unsigned long addr);
+unsigned long __get_free_pages(int gfp, unsigned int order);
+void free_pages(unsigned long addr, unsigned int order);
+#define get_order(size)		shim_get_order(size)
+int  shim_get_order(unsigned long size);
+#define virt_to_page(addr)	((struct page *)(addr))
+#define virt_to_phys(addr)	((unsigned long)(addr))
+#define SetPageReserved(page)	do { } while (0)
+#define ClearPageReserved(page)	do { } while (0)
+int  remap_pfn_range(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn, unsigned long size, pgprot_t prot);
+
+static inline void *kmalloc(size_t size, int gfp) { return malloc(size); }
+static inline void *kzalloc(size_t size, int gfp) { return calloc(1, size); }
+static inline void  kfree(const void *p) { free((void *)p); }
+static inline void *vmalloc(unsigned long size) { return malloc(size); }
+static inline void  vfree(const void *p) { free((void *)p); }
+
+#define IS_ERR(ptr)		((unsigned long)(ptr) >= (unsigned long)-4095)
+#define PTR_ERR(ptr)		((long)(ptr))
+
+
+/*
+ *	TIME
+ */
+#define HZ			100
+#define NSEC_PER_USEC		1000L
+#define NSEC_PER_MSEC		1000000L
+#define NSEC_PER_SEC		1000000000L
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC		1
+#endif
+
+extern unsigned long jiffies;
+static inline unsigned long msecs_to_jiffies(unsigned int m) { return (m * HZ + 999) / 1000; }
+static inline unsigned int  jiffies_to_msecs(unsigned long j) { return j * 1000 / HZ; }
+
+typedef s64 ktime_t;
+ktime_t ktime_get(void);
+#define ktime_set(sec, nsec)	((ktime_t)(sec) * NSEC_PER_SEC + (nsec))
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_add(a, b)		((a) + (b))
+#define ktime_add_ns(a, ns)	((a) + (ns))
+#define ktime_to_ns(kt)		((s64)(kt))
+#define ktime_to_us(kt)		((s64)(kt) / NSEC_PER_USEC)
+#define ns_to_ktime(ns)		((ktime_t)(ns))
+
+struct timer_list {
+	void (*function)(unsigned long);
+	unsigned long data;
+	unsigned long expires;
+	int pending;
+};
+
+void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data);
+void init_timer(struct timer_list *timer);
+int  mod_timer(struct timer_list *timer, unsigned long expires);
+int  del_timer(struct timer_list *timer);
+#define del_timer_sync(t)	del_timer(t)
+#define timer_pending(t)	((t)->pending)
+
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode    { HRTIMER_MODE_ABS, HRTIMER_MODE_REL };
+
+struct hrtimer {
+	enum hrtimer_restart (*function)(struct hrtimer *);
+	ktime_t expires;
+	int pending;
+};
+
+void hrtimer_init(struct hrtimer *timer, int clock_id, enum hrtimer_mode mode);
+int  hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode);
+int  hrtimer_cancel(struct hrtimer *timer);
+u64  hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+#define hrtimer_active(t)	((t)->pending)
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *);
+struct work_struct {
+	work_func_t func;
+	int pending;
+};
+
+// the work runs from the event loop, at the virtual time it was queued
+#define INIT_WORK(w, f)		((w)->func = (f), (w)->pending = 0)
+int  schedule_work(struct work_struct *work);
+int  cancel_work_sync(struct work_struct *work);
+int  flush_work(struct work_struct *work);
+#define work_pending(w)		((w)->pending)
+
+struct workqueue_struct { const char *name; };
+#define WQ_UNBOUND		(1 << 1)
+#define WQ_HIGHPRI		(1 << 4)
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+#define queue_work(wq, w)	schedule_work(w)
+
+
+/*
+ *	LOCKS, there is only one thread in the harness
+ */
+typedef struct { int locked; } spinlock_t;
+#define DEFINE_SPINLOCK(name)			spinlock_t name = { 0 }
+#define spin_lock_init(l)			((l)->locked = 0)
+#define spin_lock(l)				((l)->locked++)
+#define spin_unlock(l)				((l)->locked--)
+#define spin_lock_bh(l)				((l)->locked++)
+#define spin_unlock_bh(l)			((l)->locked--)
+#define spin_lock_irq(l)			((l)->locked++)
+#define spin_unlock_irq(l)			((l)->locked--)
+#define spin_lock_irqsave(l, flags)		((flags) = 0, (l)->locked++)
+#define spin_unlock_irqrestore(l, flags)	((void)(flags), (l)->locked--)
+
+struct mutex { int locked; };
+#define DEFINE_MUTEX(name)			struct mutex name = { 0 }
+#define mutex_init(m)				((m)->locked = 0)
+#define mutex_lock(m)				((m)->locked++)
+#define mutex_lock_interruptible(m)		((m)->locked++, 0)
+#define mutex_unlock(m)				((m)->locked--)
+
+
+/*
+ *	WAIT QUEUES & POLL
+ */
+typedef struct { unsigned long wakeups; } wait_queue_head_t;
+#define DECLARE_WAIT_QUEUE_HEAD(name)		wait_queue_head_t name = { 0 }
+#define init_waitqueue_head(q)			((q)->wakeups = 0)
+#define wake_up_interruptible(q)		((q)->wakeups++)
+#define wake_up(q)				((q)->wakeups++)
+
+// nothing else can make the condition true but pending timers and stimuli: run them
+#define wait_event_interruptible(q, cond) ({				\
+	int __ret = 0;							\
+	while (!(cond)) {						\
+		if (!shim_run_next()) { __ret = -ERESTARTSYS; break; }	\
+	}								\
+	__ret;								\
+})
+
+#define POLLIN			0x0001
+#define POLLPRI			0x0002
+#define POLLOUT			0x0004
+#define POLLERR			0x0008
+#define POLLHUP			0x0010
+#define POLLRDNORM		0x0040
+#define POLLWRNORM		0x0100
+
+static inline void poll_wait(struct file *filp, wait_queue_head_t *q, poll_table *p) { }
+
+
+/*
+ *	KFIFO, the 3.8 flavour: kfifo_put()/kfifo_get() take a pointer
+ */
+#define DECLARE_KFIFO(fifo, type, size) \
+	struct { unsigned int in, out, mask; type buf[size]; } fifo
+#define INIT_KFIFO(fifo) \
+	((fifo).in = (fifo).out = 0, (fifo).mask = ARRAY_SIZE((fifo).buf) - 1)
+#define kfifo_len(fifo)		((fifo)->in - (fifo)->out)
+#define kfifo_size(fifo)	((fifo)->mask + 1)
+#define kfifo_is_empty(fifo)	((fifo)->in == (fifo)->out)
+#define kfifo_is_full(fifo)	(kfifo_len(fifo) > (fifo)->mask)
+#define kfifo_reset(fifo)	((fifo)->in = (fifo)->out = 0)
+
+#define kfifo_put(fifo, val) ({						\
+	typeof(fifo) __f = (fifo);					\
+	int __ok = !kfifo_is_full(__f);					\
+	if (__ok) { __f->buf[__f->in & __f->mask] = *(val); smp_wmb(); __f->in++; } \
+	__ok;								\
+})
+
+#define kfifo_get(fifo, val) ({						\
+	typeof(fifo) __f = (fifo);					\
+	int __ok = !kfifo_is_empty(__f);				\
+	if (__ok) { *(val) = __f->buf[__f->out & __f->mask]; smp_mb(); __f->out++; } \
+	__ok;								\
+})
+
+#define kfifo_to_user(fifo, to, len, copied) ({				\
+	typeof(fifo) __f = (fifo);					\
+	char *__to = (char *)(to);					\
+	unsigned int __n = (len) / sizeof(__f->buf[0]);			\
+	if (__n > kfifo_len(__f)) __n = kfifo_len(__f);			\
+	*(copied) = __n * sizeof(__f->buf[0]);				\
+	while (__n--) {							\
+		memcpy(__to, &__f->buf[__f->out & __f->mask], sizeof(__f->buf[0])); \
+		__to += sizeof(__f->buf[0]); __f->out++;		\
+	}								\
+	0;								\
+})
+
+
+/*
+ *	GPIO & INTERRUPTS
+ */
+#define GPIOF_DIR_OUT		(0 << 0)
+#define GPIOF_DIR_IN		(1 << 0)
+#define GPIOF_INIT_LOW		(0 << 1)
+#define GPIOF_INIT_HIGH		(1 << 1)
+#define GPIOF_IN		(GPIOF_DIR_IN)
+#define GPIOF_OUT_INIT_LOW	(GPIOF_DIR_OUT | GPIOF_INIT_LOW)
+#define GPIOF_OUT_INIT_HIGH	(GPIOF_DIR_OUT | GPIOF_INIT_HIGH)
+
+#define SHIM_NGPIO		128
+
+int  gpio_is_valid(int gpio);
+int  gpio_request(unsigned int gpio, const char *label);
+int  gpio_request_one(unsigned int gpio, unsigned long flags, const char *label);
+void gpio_free(unsigned int gpio);
+int  gpio_direction_output(unsigned int gpio, int value);
+int  gpio_direction_input(unsigned int gpio);
+int  gpio_get_value(unsigned int gpio);
+void gpio_set_value(unsigned int gpio, int value);
+int  gpio_to_irq(unsigned int gpio);
+
+typedef enum { IRQ_NONE, IRQ_HANDLED } irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int, void *);
+
+#define IRQF_TRIGGER_RISING	0x00000001
+#define IRQF_TRIGGER_FALLING	0x00000002
+#define IRQF_TRIGGER_HIGH	0x00000004
+#define IRQF_TRIGGER_LOW	0x00000008
+#define IRQF_SHARED		0x00000080
+
+int  request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags, const char *name, void *dev);
+void free_irq(unsigned int irq, void *dev_id);
+void disable_irq(unsigned int irq);
+void enable_irq(unsigned int irq);
+
+
+/*
+ *	I2C, smbus transfers to simulated devices (see shim_i2c_attach())
+ */
+struct i2c_adapter { int nr; };
+struct i2c_client {
+	unsigned short addr;
+	struct i2c_adapter *adapter;
+};
+
+struct i2c_adapter *i2c_get_adapter(int nr);
+void i2c_put_adapter(struct i2c_adapter *adap);
+struct i2c_client *i2c_new_dummy(struct i2c_adapter *adap, u16 address);
+void i2c_unregister_device(struct i2c_client *client);
+s32  i2c_smbus_read_byte_data(const struct i2c_client *client, u8 command);
+s32  i2c_smbus_write_byte_data(const struct i2c_client *client, u8 command, u8 value);
+s32  i2c_smbus_read_word_data(const struct i2c_client *client, u8 command);
+s32  i2c_smbus_write_word_data(const struct i2c_client *client, u8 command, u16 value);
+
+
+/*
+ *	PWM
+ */
+struct pwm_device;
+struct pwm_device *pwm_request(int pwm_id, const char *label);
+void pwm_free(struct pwm_device *pwm);
+int  pwm_config(struct pwm_device *pwm, int duty_ns, int period_ns);
+int  pwm_enable(struct pwm_device *pwm);
+void pwm_disable(struct pwm_device *pwm);
+
+
+/*
+ *	HARNESS SIDE: event loop, stimuli, device files and waveforms
+ */
+s64  shim_now(void);					// [nanoseconds] virtual time
+void shim_run(s64 ns);					// run timers and stimuli for ns of virtual time
+int  shim_run_next(void);				// run the next pending event, 0 if there is none
+void shim_at(s64 when, void (*fn)(void *), void *arg);	// one-shot callback at virtual time [when]
+
+void shim_gpio_drive(unsigned int gpio, int value);	// drive an input pin, fires its irq on a matching edge
+int  shim_pwm_duty(int pwm_id);				// last configured duty [nanoseconds]
+int  shim_pwm_period(int pwm_id);
+int  shim_pwm_enabled(int pwm_id);
+unsigned long shim_irq_count(unsigned int irq);		// interrupts delivered
+
+// simulated i2c devices: 16 bit registers, kept in bus order (msb first, like the datasheets)
+void shim_i2c_attach(int bus, int addr);		// a device answers at bus/addr
+void shim_i2c_detach(int bus, int addr);		// transfers to it fail with -EREMOTEIO
+void shim_i2c_set(int bus, int addr, u8 reg, u16 value);
+u16  shim_i2c_get(int bus, int addr, u8 reg);
+unsigned long shim_i2c_xfers(int bus, int addr);	// transfers to the device
+
+struct file *shim_open(const char *name, unsigned int flags);	// by device_create() name
+int     shim_close(struct file *f);
+ssize_t shim_read(struct file *f, void *buf, size_t len);
+ssize_t shim_write(struct file *f, const void *buf, size_t len);
+long    shim_ioctl(struct file *f, unsigned int cmd, unsigned long arg);
+unsigned int shim_poll(struct file *f);
+ssize_t shim_attr_show(const char *dev, const char *attr, char *buf);	// buf of PAGE_SIZE bytes
+ssize_t shim_attr_store(const char *dev, const char *attr, const char *buf);
+void   *shim_mmap(struct file *f, size_t len, unsigned long pgoff);	// NULL on error, writable if [f] is
+void   *shim_mmap_ro(struct file *f, size_t len, unsigned long pgoff);	// read-only, whatever [f] is
+int     shim_mprotect(void *addr, int writable);			// -EACCES past VM_MAYWRITE
+void    shim_munmap(void *addr);
+
+extern int shim_tracing;				// record gpio/pwm waveforms (default on)
+int  shim_trace_vcd(const char *path);			// dump recorded gpio/pwm waveforms
+void shim_trace_csv(FILE *out);
+void shim_reset(void);					// forget devices, timers and traces
+
+#endif
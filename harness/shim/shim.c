@@ -0,0 +1,965 @@
+/*
+	KERNEL SHIM, implementation (see kernel_shim.h)
+*/
+
+#include "kernel_shim.h"
+
+#define MAX_TIMERS	64
+#define MAX_DEVICES	16
+#define MAX_MAPPINGS	16
+#define MAX_ATTRS	16		// sysfs attributes per device
+#define MAX_PWM		16
+#define MAX_I2C		8		// simulated devices, and bus numbers
+#define IRQ_BASE	160		// gpio N raises irq IRQ_BASE+N
+
+unsigned long jiffies = 0;
+unsigned long shim_printk_count = 0;
+int shim_verbose = 0;
+int shim_tracing = 1;
+
+static s64 now_ns = 0;
+
+
+
+/*
+ *	PRINTK
+ */
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+	int n = 0;
+
+	shim_printk_count++;
+	if (shim_verbose) {
+		va_start(ap, fmt);
+		n = vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+	return n;
+}
+
+
+
+/*
+ *	WAVEFORM TRACE
+ */
+struct trace_event {
+	s64 time;
+	char signal[16];
+	int bits;		// 1 = wire, 32 = integer
+	long value;
+};
+
+static struct trace_event *trace = NULL;
+static size_t trace_len = 0, trace_cap = 0;
+
+static void trace_record(const char *signal, int bits, long value)
+{
+	if (!shim_tracing) return;
+	if (trace_len == trace_cap) {
+		trace_cap = trace_cap ? trace_cap * 2 : 1024;
+		trace = realloc(trace, trace_cap * sizeof(*trace));
+	}
+	trace[trace_len].time = now_ns;
+	snprintf(trace[trace_len].signal, sizeof(trace[trace_len].signal), "%s", signal);
+	trace[trace_len].bits = bits;
+	trace[trace_len].value = value;
+	trace_len++;
+}
+
+void shim_trace_csv(FILE *out)
+{
+	size_t i;
+
+	fprintf(out, "time_ns,signal,value\n");
+	for (i = 0; i < trace_len; i++) {
+		fprintf(out, "%lld,%s,%ld\n", (long long)trace[i].time, trace[i].signal, trace[i].value);
+	}
+}
+
+int shim_trace_vcd(const char *path)
+{
+	const char *names[64];
+	int bits[64];
+	int nsig = 0, i, b;
+	size_t e;
+	s64 last = -1;
+	FILE *out = fopen(path, "w");
+
+	if (out == NULL) return -1;
+
+	// one identifier per signal, in order of appearance
+	for (e = 0; e < trace_len; e++) {
+		for (i = 0; i < nsig; i++) { if (strcmp(names[i], trace[e].signal) == 0) break; }
+		if (i == nsig && nsig < 64) { names[nsig] = trace[e].signal; bits[nsig] = trace[e].bits; nsig++; }
+	}
+
+	fprintf(out, "$timescale 1ns $end\n$scope module shim $end\n");
+	for (i = 0; i < nsig; i++) {
+		fprintf(out, "$var %s %d %c %s $end\n", bits[i] == 1 ? "wire" : "integer", bits[i], '!' + i, names[i]);
+	}
+	fprintf(out, "$upscope $end\n$enddefinitions $end\n");
+
+	for (e = 0; e < trace_len; e++) {
+		for (i = 0; i < nsig; i++) { if (strcmp(names[i], trace[e].signal) == 0) break; }
+		if (i == nsig) continue;
+		if (trace[e].time != last) { fprintf(out, "#%lld\n", (long long)trace[e].time); last = trace[e].time; }
+		if (bits[i] == 1) {
+			fprintf(out, "%ld%c\n", trace[e].value ? 1L : 0L, '!' + i);
+		}
+		else {
+			fprintf(out, "b");
+			for (b = bits[i] - 1; b >= 0; b--) { fputc((trace[e].value >> b) & 1 ? '1' : '0', out); }
+			fprintf(out, " %c\n", '!' + i);
+		}
+	}
+	fclose(out);
+	return 0;
+}
+
+
+
+/*
+ *	EVENT LOOP: timer_list, hrtimer and one-shot callbacks on a virtual clock
+ */
+static struct timer_list *timers[MAX_TIMERS];
+static int ntimers = 0;
+static struct hrtimer *hrtimers[MAX_TIMERS];
+static int nhrtimers = 0;
+
+struct callback {
+	s64 when;
+	void (*fn)(void *);
+	void *arg;
+};
+static struct callback *callbacks = NULL;
+static size_t ncallbacks = 0, callbacks_cap = 0;
+
+#define JIFFY_NS	(NSEC_PER_SEC / HZ)
+
+s64 shim_now(void) { return now_ns; }
+ktime_t ktime_get(void) { return now_ns; }
+
+static void set_time(s64 t)
+{
+	if (t > now_ns) now_ns = t;
+	jiffies = now_ns / JIFFY_NS;
+}
+
+void shim_at(s64 when, void (*fn)(void *), void *arg)
+{
+	if (ncallbacks == callbacks_cap) {
+		callbacks_cap = callbacks_cap ? callbacks_cap * 2 : 64;
+		callbacks = realloc(callbacks, callbacks_cap * sizeof(*callbacks));
+	}
+	callbacks[ncallbacks].when = when;
+	callbacks[ncallbacks].fn = fn;
+	callbacks[ncallbacks].arg = arg;
+	ncallbacks++;
+}
+
+// find the earliest pending event, returns its time or -1
+static s64 next_event(int *kind, int *index)
+{
+	s64 best = -1, t;
+	int i;
+	size_t c;
+
+	for (i = 0; i < ntimers; i++) {
+		if (!timers[i]->pending) continue;
+		t = (s64)timers[i]->expires * JIFFY_NS;
+		if (best < 0 || t < best) { best = t; *kind = 0; *index = i; }
+	}
+	for (i = 0; i < nhrtimers; i++) {
+		if (!hrtimers[i]->pending) continue;
+		t = hrtimers[i]->expires;
+		if (best < 0 || t < best) { best = t; *kind = 1; *index = i; }
+	}
+	for (c = 0; c < ncallbacks; c++) {
+		t = callbacks[c].when;
+		if (best < 0 || t < best) { best = t; *kind = 2; *index = c; }
+	}
+	return best;
+}
+
+static void fire(s64 when, int kind, int index)
+{
+	struct callback cb;
+	struct hrtimer *hr;
+
+	set_time(when);
+	if (kind == 0) {
+		timers[index]->pending = 0;
+		timers[index]->function(timers[index]->data);
+	}
+	else if (kind == 1) {
+		hr = hrtimers[index];
+		hr->pending = 0;
+		if (hr->function(hr) == HRTIMER_RESTART) hr->pending = 1;
+	}
+	else {
+		cb = callbacks[index];
+		callbacks[index] = callbacks[--ncallbacks];
+		cb.fn(cb.arg);
+	}
+}
+
+int shim_run_next(void)
+{
+	int kind = 0, index = 0;
+	s64 when = next_event(&kind, &index);
+
+	if (when < 0) return 0;
+	fire(when, kind, index);
+	return 1;
+}
+
+void shim_run(s64 ns)
+{
+	int kind = 0, index = 0;
+	s64 target = now_ns + ns, when;
+
+	while ((when = next_event(&kind, &index)) >= 0 && when <= target) {
+		fire(when, kind, index);
+	}
+	set_time(target);
+}
+
+static void register_timer(struct timer_list *timer)
+{
+	int i;
+	for (i = 0; i < ntimers; i++) { if (timers[i] == timer) return; }
+	if (ntimers < MAX_TIMERS) timers[ntimers++] = timer;
+}
+
+void init_timer(struct timer_list *timer)
+{
+	timer->pending = 0;
+	register_timer(timer);
+}
+
+void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data)
+{
+	timer->function = function;
+	timer->data = data;
+	init_timer(timer);
+}
+
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	int was = timer->pending;
+
+	register_timer(timer);
+	timer->expires = expires;
+	timer->pending = 1;
+	return was;
+}
+
+int del_timer(struct timer_list *timer)
+{
+	int was = timer->pending;
+	timer->pending = 0;
+	return was;
+}
+
+void hrtimer_init(struct hrtimer *timer, int clock_id, enum hrtimer_mode mode)
+{
+	int i;
+
+	timer->pending = 0;
+	for (i = 0; i < nhrtimers; i++) { if (hrtimers[i] == timer) return; }
+	if (nhrtimers < MAX_TIMERS) hrtimers[nhrtimers++] = timer;
+}
+
+int hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode)
+{
+	int was = timer->pending;
+
+	timer->expires = (mode == HRTIMER_MODE_REL) ? now_ns + tim : tim;
+	timer->pending = 1;
+	return was;
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+	int was = timer->pending;
+	timer->pending = 0;
+	return was;
+}
+
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval)
+{
+	u64 overruns;
+
+	if (timer->expires > now_ns) return 0;
+	overruns = (now_ns - timer->expires) / interval + 1;
+	timer->expires += overruns * interval;
+	return overruns;
+}
+
+
+static void run_work(void *arg)
+{
+	struct work_struct *work = arg;
+
+	if (!work->pending) return;		// cancelled meanwhile
+	work->pending = 0;
+	work->func(work);
+}
+
+int schedule_work(struct work_struct *work)
+{
+	if (work->pending) return 0;
+	work->pending = 1;
+	shim_at(now_ns, run_work, work);
+	return 1;
+}
+
+int cancel_work_sync(struct work_struct *work)
+{
+	int was = work->pending;
+	work->pending = 0;
+	return was;
+}
+
+int flush_work(struct work_struct *work)
+{
+	int was = work->pending;
+	run_work(work);
+	return was;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...)
+{
+	struct workqueue_struct *wq = calloc(1, sizeof(*wq));
+	wq->name = fmt;
+	return wq;
+}
+
+void destroy_workqueue(struct workqueue_struct *wq) { free(wq); }
+
+
+/*
+ *	GPIO & INTERRUPTS
+ */
+static struct {
+	int requested;
+	int output;
+	int value;
+} gpios[SHIM_NGPIO];
+
+static struct {
+	irq_handler_t handler;
+	unsigned long flags;
+	void *dev;
+	int disabled;
+	unsigned long count;
+} irqs[SHIM_NGPIO];
+
+static void gpio_trace(unsigned int gpio)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "gpio%u", gpio);
+	trace_record(name, 1, gpios[gpio].value);
+}
+
+int gpio_is_valid(int gpio) { return gpio >= 0 && gpio < SHIM_NGPIO; }
+
+int gpio_request(unsigned int gpio, const char *label)
+{
+	if (gpio >= SHIM_NGPIO || gpios[gpio].requested) return -EBUSY;
+	gpios[gpio].requested = 1;
+	return 0;
+}
+
+int gpio_request_one(unsigned int gpio, unsigned long flags, const char *label)
+{
+	if (gpio_request(gpio, label)) return -EBUSY;
+	if (flags & GPIOF_DIR_IN) return gpio_direction_input(gpio);
+	return gpio_direction_output(gpio, (flags & GPIOF_INIT_HIGH) ? 1 : 0);
+}
+
+void gpio_free(unsigned int gpio)
+{
+	if (gpio < SHIM_NGPIO) gpios[gpio].requested = 0;
+}
+
+int gpio_direction_output(unsigned int gpio, int value)
+{
+	if (gpio >= SHIM_NGPIO) return -EINVAL;
+	gpios[gpio].output = 1;
+	gpios[gpio].value = value ? 1 : 0;
+	gpio_trace(gpio);
+	return 0;
+}
+
+int gpio_direction_input(unsigned int gpio)
+{
+	if (gpio >= SHIM_NGPIO) return -EINVAL;
+	gpios[gpio].output = 0;
+	return 0;
+}
+
+int gpio_get_value(unsigned int gpio)
+{
+	return gpio < SHIM_NGPIO ? gpios[gpio].value : 0;
+}
+
+void gpio_set_value(unsigned int gpio, int value)
+{
+	if (gpio >= SHIM_NGPIO) return;
+	value = value ? 1 : 0;
+	if (gpios[gpio].value == value) return;
+	gpios[gpio].value = value;
+	gpio_trace(gpio);
+}
+
+int gpio_to_irq(unsigned int gpio) { return IRQ_BASE + gpio; }
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags, const char *name, void *dev)
+{
+	unsigned int gpio = irq - IRQ_BASE;
+
+	if (gpio >= SHIM_NGPIO || irqs[gpio].handler != NULL) return -EBUSY;
+	irqs[gpio].handler = handler;
+	irqs[gpio].flags = flags;
+	irqs[gpio].dev = dev;
+	irqs[gpio].disabled = 0;
+	return 0;
+}
+
+void free_irq(unsigned int irq, void *dev_id)
+{
+	unsigned int gpio = irq - IRQ_BASE;
+	if (gpio < SHIM_NGPIO) irqs[gpio].handler = NULL;
+}
+
+void disable_irq(unsigned int irq)
+{
+	unsigned int gpio = irq - IRQ_BASE;
+	if (gpio < SHIM_NGPIO) irqs[gpio].disabled++;
+}
+
+void enable_irq(unsigned int irq)
+{
+	unsigned int gpio = irq - IRQ_BASE;
+	if (gpio < SHIM_NGPIO && irqs[gpio].disabled > 0) irqs[gpio].disabled--;
+}
+
+unsigned long shim_irq_count(unsigned int irq)
+{
+	unsigned int gpio = irq - IRQ_BASE;
+	return gpio < SHIM_NGPIO ? irqs[gpio].count : 0;
+}
+
+void shim_gpio_drive(unsigned int gpio, int value)
+{
+	int old;
+
+	if (gpio >= SHIM_NGPIO) return;
+	old = gpios[gpio].value;
+	value = value ? 1 : 0;
+	if (old == value) return;
+	gpios[gpio].value = value;
+	gpio_trace(gpio);
+
+	if (irqs[gpio].handler == NULL || irqs[gpio].disabled) return;
+	if (( value && (irqs[gpio].flags & IRQF_TRIGGER_RISING)) ||
+	    (!value && (irqs[gpio].flags & IRQF_TRIGGER_FALLING))) {
+		irqs[gpio].count++;
+		irqs[gpio].handler(IRQ_BASE + gpio, irqs[gpio].dev);
+	}
+}
+
+
+
+/*
+ *	PWM
+ */
+struct pwm_device {
+	int id;
+	int requested;
+	int duty_ns, period_ns;
+	int enabled;
+};
+
+static struct pwm_device pwms[MAX_PWM];
+
+struct pwm_device *pwm_request(int pwm_id, const char *label)
+{
+	if (pwm_id < 0 || pwm_id >= MAX_PWM || pwms[pwm_id].requested) return (struct pwm_device *)(long)-EBUSY;
+	pwms[pwm_id].id = pwm_id;
+	pwms[pwm_id].requested = 1;
+	return &pwms[pwm_id];
+}
+
+void pwm_free(struct pwm_device *pwm) { pwm->requested = 0; }
+
+int pwm_config(struct pwm_device *pwm, int duty_ns, int period_ns)
+{
+	char name[16];
+
+	if (duty_ns < 0 || duty_ns > period_ns) return -EINVAL;
+	if (pwm->duty_ns != duty_ns || pwm->period_ns != period_ns) {
+		snprintf(name, sizeof(name), "pwm%d", pwm->id);
+		trace_record(name, 32, duty_ns);
+	}
+	pwm->duty_ns = duty_ns;
+	pwm->period_ns = period_ns;
+	return 0;
+}
+
+int  pwm_enable(struct pwm_device *pwm)  { pwm->enabled = 1; return 0; }
+void pwm_disable(struct pwm_device *pwm) { pwm->enabled = 0; }
+
+int shim_pwm_duty(int pwm_id)    { return pwms[pwm_id].duty_ns; }
+int shim_pwm_period(int pwm_id)  { return pwms[pwm_id].period_ns; }
+int shim_pwm_enabled(int pwm_id) { return pwms[pwm_id].enabled; }
+
+
+
+/*
+ *	I2C
+ */
+static struct i2c_adapter adapters[MAX_I2C];
+
+static struct {
+	int bus, addr;
+	int attached;
+	u16 regs[256];
+	unsigned long xfers;
+} i2cs[MAX_I2C];
+static int ni2cs = 0;
+
+static int i2c_find(int bus, int addr)
+{
+	int i;
+	for (i = 0; i < ni2cs; i++) { if (i2cs[i].bus == bus && i2cs[i].addr == addr) return i; }
+	if (ni2cs == MAX_I2C) return -1;
+	memset(&i2cs[ni2cs], 0, sizeof(i2cs[0]));
+	i2cs[ni2cs].bus = bus;
+	i2cs[ni2cs].addr = addr;
+	return ni2cs++;
+}
+
+// the device a transfer goes to, -1 when nobody acknowledges
+static int i2c_xfer(const struct i2c_client *client)
+{
+	int i = i2c_find(client->adapter->nr, client->addr);
+
+	if (i < 0 || !i2cs[i].attached) return -1;
+	i2cs[i].xfers++;
+	return i;
+}
+
+struct i2c_adapter *i2c_get_adapter(int nr)
+{
+	if (nr < 0 || nr >= MAX_I2C) return NULL;
+	adapters[nr].nr = nr;
+	return &adapters[nr];
+}
+
+void i2c_put_adapter(struct i2c_adapter *adap) { }
+
+struct i2c_client *i2c_new_dummy(struct i2c_adapter *adap, u16 address)
+{
+	struct i2c_client *client = calloc(1, sizeof(*client));
+
+	client->adapter = adap;
+	client->addr = address;
+	return client;
+}
+
+void i2c_unregister_device(struct i2c_client *client) { free(client); }
+
+s32 i2c_smbus_read_byte_data(const struct i2c_client *client, u8 command)
+{
+	int i = i2c_xfer(client);
+	return (i < 0) ? -EREMOTEIO : i2cs[i].regs[command] >> 8;
+}
+
+s32 i2c_smbus_write_byte_data(const struct i2c_client *client, u8 command, u8 value)
+{
+	int i = i2c_xfer(client);
+	if (i < 0) return -EREMOTEIO;
+	i2cs[i].regs[command] = (value << 8) | (i2cs[i].regs[command] & 0xff);
+	return 0;
+}
+
+// smbus words travel least significant byte first
+s32 i2c_smbus_read_word_data(const struct i2c_client *client, u8 command)
+{
+	int i = i2c_xfer(client);
+	return (i < 0) ? -EREMOTEIO : swab16(i2cs[i].regs[command]);
+}
+
+s32 i2c_smbus_write_word_data(const struct i2c_client *client, u8 command, u16 value)
+{
+	int i = i2c_xfer(client);
+	if (i < 0) return -EREMOTEIO;
+	i2cs[i].regs[command] = swab16(value);
+	return 0;
+}
+
+void shim_i2c_attach(int bus, int addr)
+{
+	int i = i2c_find(bus, addr);
+	if (i >= 0) i2cs[i].attached = 1;
+}
+
+void shim_i2c_detach(int bus, int addr)
+{
+	int i = i2c_find(bus, addr);
+	if (i >= 0) i2cs[i].attached = 0;
+}
+
+void shim_i2c_set(int bus, int addr, u8 reg, u16 value)
+{
+	int i = i2c_find(bus, addr);
+	if (i >= 0) i2cs[i].regs[reg] = value;
+}
+
+u16 shim_i2c_get(int bus, int addr, u8 reg)
+{
+	int i = i2c_find(bus, addr);
+	return (i < 0) ? 0 : i2cs[i].regs[reg];
+}
+
+unsigned long shim_i2c_xfers(int bus, int addr)
+{
+	int i = i2c_find(bus, addr);
+	return (i < 0) ? 0 : i2cs[i].xfers;
+}
+
+
+/*
+ *	CHARACTER DEVICES
+ */
+static unsigned int next_major = 240;
+
+static struct {
+	dev_t devt;
+	char name[32];
+	struct device dev;
+	const struct device_attribute *attrs[MAX_ATTRS];
+	int nattrs;
+} devices[MAX_DEVICES];
+static int ndevices = 0;
+
+static struct cdev *cdevs[MAX_DEVICES];
+static int ncdevs = 0;
+
+static struct class classes[MAX_DEVICES];
+static int nclasses = 0;
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name)
+{
+	*dev = MKDEV(next_major, baseminor);
+	next_major++;
+	return 0;
+}
+
+void unregister_chrdev_region(dev_t from, unsigned int count) { }
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	memset(cdev, 0, sizeof(*cdev));
+	cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+	if (ncdevs == MAX_DEVICES) return -ENOMEM;
+	cdev->dev = dev;
+	cdev->count = count;
+	cdevs[ncdevs++] = cdev;
+	return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+	int i;
+	for (i = 0; i < ncdevs; i++) {
+		if (cdevs[i] == cdev) { cdevs[i] = cdevs[--ncdevs]; return; }
+	}
+}
+
+struct class *class_create(struct module *owner, const char *name)
+{
+	if (nclasses == MAX_DEVICES) return NULL;
+	classes[nclasses].name = name;
+	return &classes[nclasses++];
+}
+
+void class_destroy(struct class *cls) { }
+
+struct device *device_create(struct class *cls, struct device *parent, dev_t devt, void *drvdata, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ndevices == MAX_DEVICES) return NULL;
+	va_start(ap, fmt);
+	vsnprintf(devices[ndevices].name, sizeof(devices[ndevices].name), fmt, ap);
+	va_end(ap);
+	devices[ndevices].devt = devt;
+	devices[ndevices].dev.devt = devt;
+	devices[ndevices].dev.name = devices[ndevices].name;
+	devices[ndevices].dev.driver_data = drvdata;
+	devices[ndevices].nattrs = 0;
+	return &devices[ndevices++].dev;
+}
+
+void device_destroy(struct class *cls, dev_t devt)
+{
+	int i;
+	for (i = 0; i < ndevices; i++) {
+		if (devices[i].devt == devt) {
+			devices[i] = devices[--ndevices];
+			devices[i].dev.name = devices[i].name;
+			return;
+		}
+	}
+}
+
+static int device_find(const char *name)
+{
+	int i;
+
+	if (strncmp(name, "/dev/", 5) == 0) name += 5;
+	for (i = 0; i < ndevices; i++) { if (strcmp(devices[i].name, name) == 0) return i; }
+	return -1;
+}
+
+int device_create_file(struct device *dev, const struct device_attribute *attr)
+{
+	int i;
+
+	for (i = 0; i < ndevices; i++) {
+		if (&devices[i].dev != dev) continue;
+		if (devices[i].nattrs == MAX_ATTRS) return -ENOMEM;
+		devices[i].attrs[devices[i].nattrs++] = attr;
+		return 0;
+	}
+	return -ENODEV;
+}
+
+void device_remove_file(struct device *dev, const struct device_attribute *attr)
+{
+	int i, a;
+
+	for (i = 0; i < ndevices; i++) {
+		if (&devices[i].dev != dev) continue;
+		for (a = 0; a < devices[i].nattrs; a++) {
+			if (devices[i].attrs[a] == attr) { devices[i].attrs[a] = devices[i].attrs[--devices[i].nattrs]; return; }
+		}
+	}
+}
+
+static const struct device_attribute *attr_find(int i, const char *attr)
+{
+	int a;
+
+	for (a = 0; a < devices[i].nattrs; a++) {
+		if (strcmp(devices[i].attrs[a]->attr.name, attr) == 0) return devices[i].attrs[a];
+	}
+	return NULL;
+}
+
+ssize_t shim_attr_show(const char *dev, const char *attr, char *buf)
+{
+	const struct device_attribute *a;
+	int i = device_find(dev);
+
+	if (i < 0 || (a = attr_find(i, attr)) == NULL) return -ENOENT;
+	if (!(a->attr.mode & S_IRUSR) || a->show == NULL) return -EACCES;
+	memset(buf, 0, PAGE_SIZE);
+	return a->show(&devices[i].dev, (struct device_attribute *)a, buf);
+}
+
+ssize_t shim_attr_store(const char *dev, const char *attr, const char *buf)
+{
+	const struct device_attribute *a;
+	int i = device_find(dev);
+
+	if (i < 0 || (a = attr_find(i, attr)) == NULL) return -ENOENT;
+	if (!(a->attr.mode & S_IWUSR) || a->store == NULL) return -EACCES;
+	return a->store(&devices[i].dev, (struct device_attribute *)a, buf, strlen(buf));
+}
+
+struct file *shim_open(const char *name, unsigned int flags)
+{
+	struct inode inode;
+	struct file *f;
+	int i = device_find(name), c;
+
+	if (i < 0) return NULL;
+
+	for (c = 0; c < ncdevs; c++) {
+		if (devices[i].devt >= cdevs[c]->dev && devices[i].devt < cdevs[c]->dev + cdevs[c]->count) break;
+	}
+	if (c == ncdevs) return NULL;
+
+	f = calloc(1, sizeof(*f));
+	f->f_flags = flags;
+	f->f_op = cdevs[c]->ops;
+	inode.i_rdev = devices[i].devt;
+	if (f->f_op->open && f->f_op->open(&inode, f) != 0) { free(f); return NULL; }
+	return f;
+}
+
+int shim_close(struct file *f)
+{
+	struct inode inode = { 0 };
+	int rc = 0;
+
+	if (f->f_op->release) rc = f->f_op->release(&inode, f);
+	free(f);
+	return rc;
+}
+
+ssize_t shim_read(struct file *f, void *buf, size_t len)
+{
+	if (f->f_op->read == NULL) return -EINVAL;
+	return f->f_op->read(f, buf, len, &f->f_pos);
+}
+
+ssize_t shim_write(struct file *f, const void *buf, size_t len)
+{
+	if (f->f_op->write == NULL) return -EINVAL;
+	return f->f_op->write(f, buf, len, &f->f_pos);
+}
+
+long shim_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	if (f->f_op->unlocked_ioctl == NULL) return -ENOTTY;
+	return f->f_op->unlocked_ioctl(f, cmd, arg);
+}
+
+unsigned int shim_poll(struct file *f)
+{
+	if (f->f_op->poll == NULL) return POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM;
+	return f->f_op->poll(f, NULL);
+}
+
+
+
+/*
+ *	MEMORY & MMAP
+ */
+static struct {
+	struct vm_area_struct *vma;
+	char *base;		// kernel address backing vm_start
+} mappings[MAX_MAPPINGS];
+static int nmappings = 0;
+
+int shim_get_order(unsigned long size)
+{
+	int order = 0;
+	while ((PAGE_SIZE << order) < size) order++;
+	return order;
+}
+
+unsigned long __get_free_pages(int gfp, unsigned int order)
+{
+	void *p = aligned_alloc(PAGE_SIZE, PAGE_SIZE << order);
+	if (p) memset(p, 0, PAGE_SIZE << order);
+	return (unsigned long)p;
+}
+
+void free_pages(unsigned long addr, unsigned int order) { free((void *)addr); }
+unsigned long get_zeroed_page(int gfp) { return __get_free_pages(gfp, 0); }
+void free_page(unsigned long addr) { free((void *)addr); }
+
+int remap_pfn_range(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn, unsigned long size, pgprot_t prot)
+{
+	int i;
+
+	if (addr < vma->vm_start || addr + size > vma->vm_end) return -EINVAL;
+
+	// kernel and "user" memory are the same here: the first remap of a vma gives its base
+	for (i = 0; i < nmappings; i++) { if (mappings[i].vma == vma) return 0; }
+	if (nmappings == MAX_MAPPINGS) return -ENOMEM;
+	mappings[nmappings].vma = vma;
+	mappings[nmappings].base = (char *)(pfn << PAGE_SHIFT) - (addr - vma->vm_start);
+	nmappings++;
+	return 0;
+}
+
+// like mmap(MAP_SHARED): a mapping may become writable later only if its file is open for writing
+static void *mmap_flags(struct file *f, size_t len, unsigned long pgoff, int writable)
+{
+	struct vm_area_struct *vma;
+	int i;
+
+	if (f->f_op->mmap == NULL) return NULL;
+
+	vma = calloc(1, sizeof(*vma));
+	vma->vm_start = 0x40000000UL;
+	vma->vm_end = vma->vm_start + PAGE_ALIGN(len);
+	vma->vm_pgoff = pgoff;
+	vma->vm_flags = VM_READ | VM_MAYREAD;
+	if ((f->f_flags & O_ACCMODE) != O_RDONLY) vma->vm_flags |= VM_MAYWRITE | (writable ? VM_WRITE : 0);
+	if (f->f_op->mmap(f, vma) != 0) { free(vma); return NULL; }
+
+	for (i = 0; i < nmappings; i++) { if (mappings[i].vma == vma) return mappings[i].base; }
+	free(vma);
+	return NULL;
+}
+
+void *shim_mmap(struct file *f, size_t len, unsigned long pgoff)
+{
+	return mmap_flags(f, len, pgoff, 1);
+}
+
+void *shim_mmap_ro(struct file *f, size_t len, unsigned long pgoff)
+{
+	return mmap_flags(f, len, pgoff, 0);
+}
+
+int shim_mprotect(void *addr, int writable)
+{
+	int i;
+
+	for (i = 0; i < nmappings; i++) {
+		if (mappings[i].base != addr) continue;
+		if (writable && !(mappings[i].vma->vm_flags & VM_MAYWRITE)) return -EACCES;
+		if (writable) mappings[i].vma->vm_flags |= VM_WRITE;
+		else mappings[i].vma->vm_flags &= ~VM_WRITE;
+		return 0;
+	}
+	return -ENOMEM;
+}
+
+void shim_munmap(void *addr)
+{
+	int i;
+
+	for (i = 0; i < nmappings; i++) {
+		if (mappings[i].base != addr) continue;
+		if (mappings[i].vma->vm_ops && mappings[i].vma->vm_ops->close) mappings[i].vma->vm_ops->close(mappings[i].vma);
+		free(mappings[i].vma);
+		mappings[i] = mappings[--nmappings];
+		return;
+	}
+}
+
+
+
+/*
+ *	RESET between test cases
+ */
+void shim_reset(void)
+{
+	ntimers = 0;
+	nhrtimers = 0;
+	ncallbacks = 0;
+	ndevices = 0;
+	ncdevs = 0;
+	nclasses = 0;
+	nmappings = 0;
+	ni2cs = 0;
+	trace_len = 0;
+	memset(gpios, 0, sizeof(gpios));
+	memset(irqs, 0, sizeof(irqs));
+	memset(pwms, 0, sizeof(pwms));
+}
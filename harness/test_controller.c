@@ -0,0 +1,1063 @@
+/*
+	CONTROLLER harness: in-place parser, formatter, the allocation-free request path, schedules,
+	telemetry, control period statistics, the shared memory transport, the state file
+
+	Userspace, no kernel shim: the controller source is included with its main() renamed,
+	the network and the worker halves of a request run one after the other in this thread.
+*/
+
+#define _GNU_SOURCE	// as the controller, before any system header
+#include <stdlib.h>
+#include "check.h"
+
+// count the heap allocations, glibc lets the program replace malloc and friends
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static long allocations = 0;
+
+void *malloc(size_t size) { allocations++; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { allocations++; return __libc_calloc(n, size); }
+void *realloc(void *ptr, size_t size) { allocations++; return __libc_realloc(ptr, size); }
+void free(void *ptr) { __libc_free(ptr); }
+
+#define main controller_main
+#include "../programs/controller.c"
+#undef main
+
+
+// one request through requestHandler(), the owner and requestDone(), the reply as a client reads it
+static const char *request(const char *msg)
+{
+	static char reply[256];
+	connection_t *conn = pool_get();
+	int sv[2], w, n;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	conn->sock = sv[0];
+	n = write(sv[1], msg, strlen(msg));
+	w = requestHandler(conn);
+	if (w >= 0) {
+		spsc_push(&worker[w].requests, conn);
+		conn = (connection_t *)spsc_pop(&worker[w].requests);
+		zone_request(conn);
+		spsc_push(&worker[w].replies, conn);
+		requestDone((connection_t *)spsc_pop(&worker[w].replies));
+	}
+	n = read(sv[1], reply, sizeof(reply) - 1);
+	reply[n > 0 ? n : 0] = 0;
+	close(sv[1]);
+	return reply;
+}
+
+// a request handed to the owner of its zone, which answers it in its next batch; the client end
+static int queue(const char *msg)
+{
+	connection_t *conn = pool_get();
+	int sv[2], w;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	conn->sock = sv[0];
+	if (write(sv[1], msg, strlen(msg)) < 0) return -1;
+	w = requestHandler(conn);
+	if (w >= 0) {
+		spsc_push(&worker[w].requests, conn);
+		worker[w].pending++;
+	}
+	return sv[1];
+}
+
+// the replies of a batch back to their clients, as the network thread does
+static void answer(worker_t *w)
+{
+	connection_t *conn;
+
+	while ((conn = (connection_t *)spsc_pop(&w->replies)) != NULL) {
+		w->pending--;
+		requestDone(conn);
+	}
+}
+
+// the reply a client of queue() gets
+static const char *reply_of(int fd)
+{
+	static char reply[256];
+	int n = read(fd, reply, sizeof(reply) - 1);
+
+	reply[n > 0 ? n : 0] = 0;
+	close(fd);
+	return reply;
+}
+
+static void setup(void)
+{
+	int z;
+
+	zones = 2;
+	workers = 1;
+	for (z = 0; z < zones; z++) {
+		zone_init(&zone[z]);
+		win_init(&windows[z]);
+		hist_init(&history[z]);
+		worker[0].own[worker[0].nown++] = z;
+	}
+	spsc_init(&worker[0].requests, RING_SIZE);
+	spsc_init(&worker[0].replies, RING_SIZE);
+	pool_init();
+}
+
+
+static void test_parser(void)
+{
+	char buf[64], *field[5];
+	float f;
+	long l;
+
+	strcpy(buf, "TEMP;21.5;3;1");
+	CHECK_EQ(proto_split(buf, ';', field, 5), 4);
+	CHECK(strcmp(field[0], "TEMP") == 0);
+	CHECK(strcmp(field[3], "1") == 0);
+	CHECK(field[1] == buf + 5);		// in place
+
+	// the last field keeps the rest
+	strcpy(buf, "LOAD;1/0:2:3,;0");
+	CHECK_EQ(proto_split(buf, ';', field, 2), 2);
+	CHECK(strcmp(field[1], "1/0:2:3,;0") == 0);
+
+	CHECK_EQ(proto_float("-3.25", &f), 1);
+	CHECK(f == -3.25f);
+	CHECK_EQ(proto_float("21\n", &f), 1);
+	CHECK(f == 21.0f);
+	CHECK_EQ(proto_float(".5", &f), 1);
+	CHECK(f == 0.5f);
+	CHECK_EQ(proto_float("1e3", &f), 0);
+	CHECK_EQ(proto_float("", &f), 0);
+	CHECK_EQ(proto_float("-", &f), 0);
+	CHECK_EQ(proto_float("hot", &f), 0);
+	CHECK_EQ(proto_float("12345678901", &f), 0);
+
+	CHECK_EQ(proto_long("-42", &l), 1);
+	CHECK_EQ(l, -42);
+	CHECK_EQ(proto_long("4.2", &l), 0);
+	CHECK_EQ(proto_long("", &l), 0);
+}
+
+static void test_formatter(void)
+{
+	char buf[64], small[8];
+	proto_out_t out;
+
+	proto_begin(&out, buf, sizeof(buf));
+	proto_float_out(&out, 21.04f, 1);	proto_char(&out, ';');
+	proto_float_out(&out, -3.25f, 1);	proto_char(&out, ';');
+	proto_float_out(&out, -0.04f, 1);	proto_char(&out, ';');
+	proto_float_out(&out, 7.0f, 3);		proto_char(&out, ';');
+	proto_long_out(&out, -1234);		proto_char(&out, ';');
+	proto_long_out(&out, 0);
+	CHECK(strcmp(buf, "21.0;-3.3;0.0;7.000;-1234;0") == 0);
+
+	// past what a 32-bit long holds once scaled, as proto_float() takes it
+	proto_begin(&out, buf, sizeof(buf));
+	proto_float_out(&out, 123456789.0f, 3);	proto_char(&out, ';');
+	proto_float_out(&out, -5000.5f, 6);	proto_char(&out, ';');
+	proto_llong_out(&out, -9000000000LL);
+	CHECK(strcmp(buf, "123456792.000;-5000.500000;-9000000000") == 0);
+
+	// never past the end
+	proto_begin(&out, small, sizeof(small));
+	proto_str(&out, "Temperature");
+	CHECK(strcmp(small, "Tempera") == 0);
+	proto_long_out(&out, 99);
+	CHECK_EQ(out.len, 7);
+}
+
+static void test_requests(void)
+{
+	char dump[256], load[300];
+	int i;
+
+	CHECK(strcmp(request("SET;25;1"), "Temperature is set! I have to INCREASE the box temp of 25.0 degrees") == 0);
+	CHECK(strcmp(request("TEMP;20;0;1"), "Temperature value received!") == 0);
+	CHECK(strcmp(request("TEMP;21;1;1"), "Temperature value received!") == 0);
+	CHECK(strcmp(request("TEMP;35;2;1"), "Temperature value received, but it is an outlier!") == 0);
+	CHECK(strcmp(request("LOG;1;1"), "25.0;20.5;0;50;3") == 0);
+	zone_control(&zone[1], 0);
+	CHECK(strcmp(request("LOG;1;1"), "25.0;20.5;2;25;3") == 0);
+	CHECK(strcmp(request("SET;18.5;1"), "Temperature is set! I have to DECREASE the box temp of 2.0 degrees") == 0);
+
+	// hand off zone 1 to zone 0
+	strcpy(dump, request("DUMP;0;1"));
+	CHECK(strncmp(dump, "18.500/0:20.000:", 16) == 0);
+	snprintf(load, sizeof(load), "LOAD;%s;0", dump);
+	CHECK(strcmp(request(load), "Zone state loaded!") == 0);
+	CHECK(strcmp(request("LOG;0;0"), "18.5;20.5;0;50;3") == 0);
+
+	// the schedule and the model go along, a part at a time, and the target stays
+	request("SCHED;22:00=18,06:30=20,;1");
+	zone[1].model.samples = 1234;
+	zone[1].model.theta[0] = 0.0123456789; zone[1].model.theta[1] = -2.5e-5; zone[1].model.theta[2] = 1e-3;
+	for (i = 0; i < 9; i++) zone[1].model.P[i / 3][i % 3] = zone[1].model.P[i % 3][i / 3] = (i + 1) * 1.25e3;
+	strcpy(dump, request("DUMP;sched;1"));
+	CHECK(strcmp(dump, "S/6:30=20.00,22:0=18.00,") == 0);
+	snprintf(load, sizeof(load), "LOAD;%s;0", dump);
+	CHECK(strcmp(request(load), "Zone state loaded!") == 0);
+	CHECK_EQ(zone[0].nsched, 2);
+	CHECK(zone[0].sched[0].tod == 6 * 3600 + 30 * 60 && zone[0].sched[0].target == 20);
+	CHECK(zone[0].sched[1].tod == 22 * 3600 && zone[0].sched[1].target == 18);
+	CHECK(zone[0].next_at == zone[1].next_at && zone[0].target == 18.5f);
+	strcpy(dump, request("DUMP;model;1"));
+	CHECK(strncmp(dump, "M/1234:", 7) == 0);
+	snprintf(load, sizeof(load), "LOAD;%s;0", dump);
+	CHECK(strcmp(request(load), "Zone state loaded!") == 0);
+	CHECK_EQ(zone[0].model.samples, 1234);
+	for (i = 0; i < 3; i++) CHECK(fabs(zone[0].model.theta[i] - zone[1].model.theta[i]) <= 1e-7 * fabs(zone[1].model.theta[i]));
+	for (i = 0; i < 9; i++) CHECK(fabs(zone[0].model.P[i / 3][i % 3] - zone[1].model.P[i / 3][i % 3]) <= 1e-7 * zone[1].model.P[i / 3][i % 3]);
+	CHECK(strcmp(request("LOAD;M/1:2:3;0"), "cannot compute, bad zone state!") == 0);
+	CHECK(strcmp(request("LOAD;M/1:0:0:0:1:0:0:1:0:x;0"), "cannot compute, bad zone state!") == 0);
+	CHECK(strcmp(request("LOAD;S/25:00=20,;0"), "cannot compute, bad zone state!") == 0);
+	CHECK_EQ(zone[0].model.samples, 1234);
+	request("SCHED;;1");
+	request("SCHED;;0");
+	model_init(&zone[0].model);
+	model_init(&zone[1].model);
+	request("SET;18.5;1");
+
+	// errors
+	CHECK(strcmp(request("SET;hot;1"), "cannot compute, not a temperature!") == 0);
+	CHECK(strcmp(request("TEMP;1;9;1"), "cannot compute, unknown sensor!") == 0);
+	CHECK(strcmp(request("LOG;0;7"), "cannot compute, unknown zone!") == 0);
+	CHECK(strcmp(request("LOG;0;x"), "cannot compute, unknown zone!") == 0);
+	CHECK(strcmp(request("FOO"), "cannot compute, unknown command!") == 0);
+	CHECK(strcmp(request("LOAD;garbage;0"), "cannot compute, bad zone state!") == 0);
+	CHECK(strcmp(request("LOAD;1/0:x:5,;0"), "cannot compute, bad zone state!") == 0);
+	CHECK(strcmp(request("SCHED;25:00=20;1"), "cannot compute, bad schedule!") == 0);
+	CHECK(strcmp(request("SCHED;07:00;1"), "cannot compute, bad schedule!") == 0);
+}
+
+static void test_log_cache(void)
+{
+	char first[256];
+	unsigned int version;
+	unsigned long renders;
+	int i, changed = 0;
+
+	strcpy(first, request("LOG;1;1"));
+	version = zone[1].view.version;
+	renders = log_cache[1].renders;
+
+	// nothing changed: the same bytes, not rendered again, not even after a publish
+	for (i = 0; i < 10; i++) changed += strcmp(request("LOG;1;1"), first) != 0;
+	zone_publish(&zone[1]);
+	changed += strcmp(request("LOG;1;1"), first) != 0;
+	CHECK_EQ(changed, 0);
+	CHECK_EQ(zone[1].view.version, version);
+	CHECK_EQ(log_cache[1].renders, renders);
+
+	// a change shows at once
+	zone[1].target += 1;
+	zone_publish(&zone[1]);
+	CHECK_EQ(zone[1].view.version, version + 1);
+	CHECK(strcmp(request("LOG;1;1"), "19.5;20.5;2;25;3") == 0);
+	CHECK_EQ(log_cache[1].renders, renders + 1);
+	zone[1].target -= 1;
+	zone_publish(&zone[1]);
+	CHECK(strcmp(request("LOG;1;1"), first) == 0);
+}
+
+// a box: a lamp heats 0.6 degrees a minute, the fan at full speed cools 1.2, it drifts up 0.24
+static float box(float t, int lamps, int fan)
+{
+	return t + 0.01f * lamps - 0.02f * fan / 100 + 0.004f;
+}
+
+// one second of the box and of the controller, the sensor reads tenths of a degree
+static void tick(zone_t *zn, float *t, time_t now)
+{
+	char msg[32];
+
+	snprintf(msg, sizeof(msg), "TEMP;%.1f;0;%ld", *t, (long)(zn - zone));
+	request(msg);
+	zone_control(zn, now);
+	*t = box(*t, zn->lamps, zn->fan);
+}
+
+static void test_schedule(void)
+{
+	zone_t *zn = &zone[1];
+	struct tm tm;
+	time_t now, due, switched = 0;
+	float t = 20, at_due = 0;
+	char list[64];
+	int i;
+
+	// 08:00 today, one sensor, nothing learned
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	tm.tm_hour = 8; tm.tm_min = 0; tm.tm_sec = 0;
+	now = mktime(&tm);
+	request("LOAD;20/;1");
+	model_init(&zn->model);
+	zn->win_secs = -1;
+
+	// an hour of heating, cooling and holding to learn from
+	request("SET;25;1");
+	for (i = 0; i < 3600; i++, now++) {
+		if (i == 1200) request("SET;15;1");
+		if (i == 2400) request("SET;20;1");
+		tick(zn, &t, now);
+	}
+	CHECK(model_ready(&zn->model));
+	CHECK(fabs(zn->model.theta[0] - 0.01) < 0.002);
+	CHECK(fabs(zn->model.theta[1] + 0.02) < 0.004);
+	CHECK(strncmp(request("MODEL;0;1"), "0.59", 4) == 0 || strncmp(request("MODEL;0;1"), "0.60", 4) == 0);
+
+	// 26 degrees at 09:30: the setpoint moves early enough, not much more. The request
+	// takes the wall clock, set it again at the simulated 09:00.
+	CHECK(strcmp(request("SCHED;22:00=18,06:00=20,09:30=26,;1"), "Schedule is set! 3 setpoints a day") == 0);
+	strcpy(list, "22:00=18,06:00=20,09:30=26,");
+	CHECK_EQ(zone_sched_set(zn, list, now), 0);
+	CHECK(zn->target == 20.0f);
+	CHECK_EQ(zn->sched[0].tod, 6 * 3600);
+	due = now + 1800;
+	for (; now < due + 60; now++) {
+		tick(zn, &t, now);
+		if (switched == 0 && zn->target == 26.0f) switched = now;
+		if (now == due) at_due = t;
+	}
+	CHECK(switched < due);
+	CHECK(switched > due - 6 * 60 / 1.45 - 60);	// 6 degrees at 1.45 a minute, some margin
+	CHECK(at_due >= 25.8f);
+	CHECK_EQ(zn->boost, 0);
+	CHECK_EQ(zn->next_at, due + 12 * 3600 + 30 * 60);	// 22:00
+
+	// a SET wins until the next setpoint
+	request("SET;21;1");
+	tick(zn, &t, now++);
+	CHECK(zn->target == 21.0f);
+	CHECK(strcmp(request("SCHED;;1"), "Schedule is set! 0 setpoints a day") == 0);
+}
+
+static void test_no_allocations(void)
+{
+	void * volatile p;
+	int i;
+
+	// the counter works, the compiler may not drop a malloc() whose pointer it has to keep
+	allocations = 0;
+	p = malloc(16);
+	free(p);
+	CHECK_EQ(allocations, 1);
+
+	// steady state: nothing from the heap, whatever the command
+	allocations = 0;
+	for (i = 0; i < 1000; i++) {
+		request("SET;22.5;1");
+		request("TEMP;21.3;0;1");
+		request("TEMP;40;2;1");
+		request("LOG;1;1");
+		request("DUMP;0;1");
+		request("LOAD;20.000/0:21.000:4000,1:22.000:3000,;0");
+		request("LOG;0;7");
+		request("FOO");
+	}
+	CHECK_EQ(allocations, 0);
+
+	// every connection went back to the pool
+	for (i = 0; pool_get() != NULL; i++) { }
+	CHECK_EQ(i, POOL_SIZE);
+	pool_init();
+}
+
+
+// all the records in [buf], the applied ones into [out] (zone -1 when skipped); their number
+static int decode_all(const unsigned char *buf, int len, tele_state_t *state, telemetry_t *out, int *zones_out)
+{
+	int n, used, k = 0, z;
+
+	for (used = 0; used < len && (n = tele_decode(buf + used, len - used, state, MAX_ZONES, &z)) > 0; used += n, k++) {
+		zones_out[k] = z;
+		if (z >= 0) out[k] = state[z].last;
+	}
+	return used == len ? k : -1;
+}
+
+static int same(const telemetry_t *a, const telemetry_t *b)
+{
+	return a->time == b->time && a->target == b->target && a->current == b->current &&
+	       a->lamps == b->lamps && a->fan == b->fan && a->fresh == b->fresh;
+}
+
+static void test_telemetry(void)
+{
+	static unsigned char buf[64 * 3600 * 4];
+	static tele_state_t state[MAX_ZONES];
+	static telemetry_t rec[100], out[100], prev[64], cur;
+	int off[101], zs[100], i, len, z, bad, sv[2];
+	connection_t *conn;
+
+	// round trip: negative values, jumps, a gap in time
+	for (i = 0; i < 100; i++) {
+		rec[i].time = 1700000000LL + i + (i >= 50) * 7;
+		rec[i].target = i < 40 ? 250 : -150;
+		rec[i].current = 200 + i % 7 - 3 * (i / 10);
+		rec[i].lamps = (i / 20) % 4;
+		rec[i].fan = 100 - i;
+		rec[i].fresh = 3;
+	}
+	for (len = 0, bad = 0, i = 0; i < 100; i++) {
+		off[i] = len;
+		len += tele_encode(buf + len, 5, i % TELE_KEYFRAME ? &rec[i - 1] : NULL, &rec[i]);
+		bad += len - off[i] > TELE_MAX;
+	}
+	off[100] = len;
+	CHECK_EQ(bad, 0);
+	memset(state, 0, sizeof(state));
+	CHECK_EQ(decode_all(buf, len, state, out, zs), 100);
+	for (bad = 0, i = 0; i < 100; i++) bad += zs[i] != 5 || !same(&out[i], &rec[i]);
+	CHECK_EQ(bad, 0);
+	CHECK_EQ(off[2] - off[1], 2 + 1 + 1);		// zone, mask, fan - 1
+
+	// joining in the middle: nothing until the next keyframe, then all of it
+	memset(state, 0, sizeof(state));
+	CHECK_EQ(decode_all(buf + off[5], len - off[5], state, out, zs), 95);
+	for (bad = 0, i = 5; i < 100; i++) bad += i < TELE_KEYFRAME ? zs[i - 5] != -1 : !same(&out[i - 5], &rec[i]);
+	CHECK_EQ(bad, 0);
+
+	// a record cut short waits for the rest, garbage is refused
+	CHECK_EQ(tele_decode(buf, off[1] - 1, state, MAX_ZONES, &z), 0);
+	buf[1] = 0x40;
+	CHECK_EQ(tele_decode(buf, len, state, MAX_ZONES, &z), -1);
+
+	// an hour of 64 zones drifting a tenth every 20 seconds: under 3 bytes a zone a second,
+	// a LOG poll costs 255 bytes of reply alone
+	for (len = 0, i = 0; i < 3600; i++) {
+		for (z = 0; z < 64; z++) {
+			cur.time = 1700000000LL + i;
+			cur.target = 220;
+			cur.current = 200 + (i + z * 3) / 20 % 20;
+			cur.lamps = cur.current < 210 ? 2 : 1;
+			cur.fan = cur.current < 210 ? 25 : 50;
+			cur.fresh = 3;
+			len += tele_encode(buf + len, z, i % TELE_KEYFRAME ? &prev[z] : NULL, &cur);
+			prev[z] = cur;
+		}
+	}
+	CHECK(len < 64 * 3600 * 3);
+
+	// through the controller: a subscriber to all the zones joins after the first second
+	request("LOAD;20/;1");
+	request("SET;22;1");
+	request("TEMP;20.5;0;1");
+	telemetry_tick(1000);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	conn = pool_get();
+	conn->sock = sv[0];
+	write(sv[1], "SUB;0;*", 7);
+	CHECK_EQ(requestHandler(conn), -1);
+	CHECK(subscribers == conn);
+	request("TEMP;21.5;0;1");
+	telemetry_tick(1001);
+	telemetry_tick(1002);
+	len = read(sv[1], buf, sizeof(buf));
+	memset(state, 0, sizeof(state));
+	CHECK_EQ(decode_all(buf, len, state, out, zs), 3 * zones);
+	CHECK_EQ(state[1].last.time, 1002);
+	CHECK_EQ(state[1].last.target, 220);
+	CHECK_EQ(state[1].last.current, 215);
+	CHECK(len < 3 * zones * 3 + 2 * 16);		// two seconds of deltas after the keyframes
+
+	// the history of zone 1, the last two seconds
+	close(sv[1]);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	conn = pool_get();
+	conn->sock = sv[0];
+	write(sv[1], "HIST;2;1", 8);
+	CHECK_EQ(requestHandler(conn), -1);
+	len = read(sv[1], buf, sizeof(buf));
+	memset(state, 0, sizeof(state));
+	CHECK_EQ(decode_all(buf, len, state, out, zs), 2);
+	CHECK_EQ(out[0].time, 1001);
+	CHECK(same(&out[1], &tele_last[1]));
+	close(sv[1]);
+
+	// the subscriber hung up: dropped at the next second
+	telemetry_tick(1003);
+	CHECK(subscribers == NULL);
+}
+
+
+static void test_stats(void)
+{
+	worker_t *w = &worker[0];
+
+	// on time, 1.5 us late, 3 ms late, then two periods skipped and the third one late
+	w->next = 1000 * PERIOD_NS;
+	worker_period(w, 1, 1000 * PERIOD_NS);
+	worker_period(w, 1, 1001 * PERIOD_NS + 1500);
+	worker_period(w, 1, 1002 * PERIOD_NS + 3000000);
+	worker_period(w, 3, 1005 * PERIOD_NS + 40000);
+	CHECK_EQ(w->periods, 6);
+	CHECK_EQ(w->misses, 2);
+	CHECK_EQ(w->max_latency, 3000);
+	CHECK_EQ(w->next, 1006 * PERIOD_NS);
+	CHECK(strcmp(request("STATS;0;1"), "6;2;3000;1,1,0,0,0,0,1,0,0,0,0,0,1,0,0,0,0,0,0,0;0;0;0;0") == 0);
+
+	// beyond the last bucket
+	worker_period(w, 1, 1006 * PERIOD_NS + PERIOD_NS / 2);
+	CHECK_EQ(w->latency[LATENCY_BUCKETS - 1], 1);
+}
+
+
+static void test_shm(void)
+{
+	shm_region_t *client;
+	shm_ring_t *ring, *rings[SHM_RINGS];
+	shm_zone_t view;
+	int i, fd, port = 40000 + getpid() % 20000;
+	struct stat st;
+	char name[32];
+
+	shm = shm_create(port, zones);
+	CHECK(shm != NULL);
+	if (shm == NULL) return;
+	CHECK(shm_attach("192.0.2.1", port) == NULL);		// not this machine
+	CHECK(shm_attach("127.0.0.1", port + 1) == NULL);	// no controller
+	client = shm_attach("127.0.0.1", port);
+	CHECK(client != NULL);
+	if (client == NULL) return;
+	shm_name(name, sizeof(name), port);
+	fd = shm_open(name, O_RDONLY, 0);
+	CHECK(fstat(fd, &st) == 0 && (st.st_mode & 0777) == 0660);
+	close(fd);
+
+	// readings of zone 1, fused when its owner wakes up
+	request("LOAD;20/;1");
+	ring = shm_claim(client, 1);
+	CHECK(ring != NULL);
+	CHECK_EQ(shm_send(ring, 0, 21.0f), 1);
+	CHECK_EQ(shm_send(ring, 1, 22.0f), 1);
+	shm_drain(&worker[0], 0);
+	CHECK(strncmp(request("LOG;1;1"), "20.0;21.5;", 10) == 0);
+	shm_read_zone(client, 1, &view);
+	CHECK(view.current == 21.5f && view.fresh == 2);
+
+	// full: dropped, nothing blocks
+	for (i = 0; i < SHM_SLOTS; i++) shm_send(ring, 0, 21.0f);
+	CHECK_EQ(shm_send(ring, 0, 21.0f), 0);
+	shm_drain(&worker[0], 0);
+	CHECK_EQ(shm_send(ring, 0, 21.0f), 1);
+
+	// forged by a client: the controller keeps its own head, a tail too far ahead drops the ring
+	ring->head += 12345;
+	ring->tail += 100000;
+	shm_drain(&worker[0], 0);
+	CHECK_EQ(ring->head, ring->tail);
+	CHECK_EQ(shm_send(ring, 0, 23.0f), 1);
+	shm_drain(&worker[0], 0);
+	CHECK(strncmp(request("LOG;1;1"), "20.0;22.5;", 10) == 0);
+
+	// the ring comes back once the sensor left and its readings are in
+	shm_release(ring);
+	shm_drain(&worker[0], 1);
+	CHECK_EQ(ring->pid, 0);
+	CHECK_EQ(ring->active, 0);
+	for (i = 0; i < SHM_RINGS; i++) rings[i] = shm_claim(client, 0);
+	CHECK(rings[SHM_RINGS - 1] != NULL);
+	CHECK(shm_claim(client, 0) == NULL);
+
+	shm_detach(client);
+	shm_name(name, sizeof(name), port);
+	shm_unlink(name);
+	munmap(shm, sizeof(*shm));
+	shm = NULL;
+}
+
+
+static void test_state(void)
+{
+	char path[] = "/tmp/test_controllerXXXXXX";
+	zone_t *zn = &zone[1];
+	unsigned int seq;
+	int fd, warm;
+
+	fd = mkstemp(path);
+	close(fd);
+	saved = state_open(path, &warm);
+	CHECK(saved != NULL);
+	CHECK_EQ(warm, 0);			// empty file: cold start
+	if (saved == NULL) return;
+
+	// a zone with a schedule, a SET over it and two fresh readings
+	request("LOAD;20/;1");
+	request("SCHED;07:00=20,22:00=17,;1");
+	request("SET;19;1");
+	request("TEMP;21;0;1");
+	CHECK(saved->zone[1].target == 19.0f);		// a SET is saved at once
+	seq = saved->zone[1].seq;
+	request("TEMP;21.4;1;1");
+	CHECK_EQ(saved->zone[1].seq, seq);		// a reading waits for the control period
+	zn->model.samples = 42;
+	zn->lamps = 2;
+	zone_save(zn);
+	CHECK_EQ(saved->zone[1].seq, seq + 2);
+
+	// restart, in the order of main(): fresh zones, then the file
+	munmap(saved, sizeof(*saved));
+	saved = NULL;
+	zone_init(zn);
+	saved = state_open(path, &warm);
+	CHECK_EQ(warm, 1);
+	CHECK_EQ(zone_restore(zn, &saved->zone[1]), 0);
+	CHECK(zn->target == 19.0f);
+	CHECK(zn->current == 21.2f);
+	CHECK_EQ(zn->fresh, 2);
+	CHECK_EQ(zn->lamps, 2);
+	CHECK_EQ(zn->nsched, 2);
+	CHECK_EQ(zn->sched[1].tod, 22 * 3600);
+	CHECK(zn->next_at > time(NULL));
+	CHECK_EQ(zn->model.samples, 42);
+
+	// the readings are only as fresh as they were
+	saved->zone[1].saved -= deadline;
+	CHECK_EQ(zone_restore(zn, &saved->zone[1]), 0);
+	CHECK_EQ(zn->fresh, 0);
+
+	// a crash in the middle of writing a zone, a zone never written
+	saved->zone[1].seq++;
+	CHECK_EQ(zone_restore(zn, &saved->zone[1]), -1);
+	CHECK_EQ(zone_restore(zn, &saved->zone[MAX_ZONES - 1]), -1);
+
+	// another layout: cold start
+	saved->size--;
+	munmap(saved, sizeof(*saved));
+	saved = state_open(path, &warm);
+	CHECK_EQ(warm, 0);
+	CHECK_EQ(saved->zone[1].seq, 0);
+
+	munmap(saved, sizeof(*saved));
+	saved = NULL;
+	unlink(path);
+}
+
+
+static void test_heartbeat(void)
+{
+	sensor_t *s = &zone[1].sensors[6];
+	int64_t now;
+
+	CHECK(strcmp(request("HB;30;6;1"), "cannot compute, no fresh reading!") == 0);
+	CHECK(strcmp(request("HB;x;6;1"), "cannot compute, not a heartbeat!") == 0);
+
+	// a reading, then heartbeats keep it fresh for [deadline] past the next one
+	request("TEMP;21;6;1");
+	CHECK(strcmp(request("HB;30;6;1"), "Heartbeat received!") == 0);
+	now = now_ns();
+	CHECK_EQ(s->heartbeat, 30000);
+	CHECK(s->expires > now + (deadline + 29000) * 1000000LL && s->expires <= now + (deadline + 30000) * 1000000LL);
+	CHECK_EQ(s->value, 21);
+
+	// a reading that moved does not cut that short
+	request("TEMP;21.5;6;1");
+	CHECK(s->expires > now + (deadline + 29000) * 1000000LL);
+	CHECK_EQ(s->value, 21.5);
+
+	// a silent sensor still goes stale, then its heartbeats are refused
+	s->expires = now_ns() - 1;
+	zone_expire(&zone[1]);
+	CHECK_EQ(s->fresh, 0);
+	CHECK(strcmp(request("HB;30;6;1"), "cannot compute, no fresh reading!") == 0);
+}
+
+static void test_overload(void)
+{
+	worker_t *w = &worker[0];
+	unsigned long conflated = w->conflated, expired = w->expired, shed = w->shed, readings = zone[1].readings;
+	char stats[256];
+	int fd[4];
+
+	// three readings of a sensor and a SET behind them: the SET first, then the newest reading only
+	fd[0] = queue("TEMP;20;4;1");
+	fd[1] = queue("TEMP;20.5;4;1");
+	fd[2] = queue("TEMP;21;4;1");
+	fd[3] = queue("SET;22;1");
+	CHECK_EQ(worker_batch(w, now_ns()), 4);
+	answer(w);
+	CHECK(strcmp(reply_of(fd[0]), "Temperature value received, but a newer one replaced it!") == 0);
+	CHECK(strcmp(reply_of(fd[1]), "Temperature value received, but a newer one replaced it!") == 0);
+	CHECK(strcmp(reply_of(fd[2]), "Temperature value received!") == 0);
+	CHECK(strncmp(reply_of(fd[3]), "Temperature is set!", 19) == 0);
+	CHECK_EQ(zone[1].sensors[4].value, 21);
+	CHECK_EQ(zone[1].readings, readings + 1);
+	CHECK_EQ(w->conflated - conflated, 2);
+
+	// queued for too long: the reading is turned away, the SET still applies
+	fd[0] = queue("TEMP;25;4;1");
+	fd[1] = queue("SET;23;1");
+	worker_batch(w, now_ns() + (queue_ms + 1) * 1000000LL);
+	answer(w);
+	CHECK(strcmp(reply_of(fd[0]), "cannot compute, busy!") == 0);
+	CHECK(strncmp(reply_of(fd[1]), "Temperature is set!", 19) == 0);
+	CHECK_EQ(zone[1].sensors[4].value, 21);
+	CHECK_EQ(zone[1].target, 23);
+	CHECK_EQ(w->expired - expired, 1);
+
+	// a full queue turns the readings away at once, but keeps room for a SET
+	w->pending = RING_SIZE - RING_RESERVE;
+	CHECK(strcmp(reply_of(queue("TEMP;25;4;1")), "cannot compute, busy!") == 0);
+	fd[0] = queue("SET;22;1");
+	worker_batch(w, now_ns());
+	answer(w);
+	CHECK(strncmp(reply_of(fd[0]), "Temperature is set!", 19) == 0);
+	CHECK_EQ(w->pending, RING_SIZE - RING_RESERVE);
+	w->pending = 0;
+	CHECK_EQ(w->shed - shed, 1);
+
+	strcpy(stats, request("STATS;0;1"));
+	CHECK(strcmp(stats + strlen(stats) - 8, ";0;1;2;1") == 0);	// refused, shed, conflated, expired
+
+	zone[1].sensors[4].expires = now_ns() - 1;
+	zone_expire(&zone[1]);
+}
+
+static void test_batch(void)
+{
+	connection_t *conn = pool_get();
+	char reply[256];
+	int sv[2], n;
+
+	CHECK(strcmp(request("BATCH;1:20,2:x;1"), "cannot compute, bad batch!") == 0);
+	CHECK(strcmp(request("BATCH;8:20;1"), "cannot compute, bad batch!") == 0);
+	CHECK(strcmp(request("BATCH;1:20,2:21;9"), "cannot compute, unknown zone!") == 0);
+
+	// all the readings at once, the LOG line back, and the connection stays open
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	conn->sock = sv[0];
+	n = write(sv[1], "BATCH;1:20,2:21.5;1", 19);
+	CHECK_EQ(requestHandler(conn), 0);
+	zone_request(conn);
+	requestDone(conn);
+	n = read(sv[1], reply, sizeof(reply));
+	CHECK_EQ(n, 255);
+	CHECK(strcmp(reply, log_reply(1)) == 0);
+	CHECK_EQ(zone[1].sensors[1].value, 20);
+	CHECK_EQ(zone[1].sensors[2].value, 21.5);
+	CHECK_EQ(conn->keep, 1);
+
+	// the next request on it, then the hang up gives it back to the pool
+	n = write(sv[1], "LOG;0;1", 7);
+	CHECK_EQ(requestHandler(conn), -1);
+	n = read(sv[1], reply, sizeof(reply));
+	CHECK(n == 255 && strcmp(reply, log_reply(1)) == 0);
+	close(sv[1]);
+	CHECK_EQ(requestHandler(conn), -1);
+	CHECK(pool_free == conn);
+
+	zone[1].sensors[1].expires = zone[1].sensors[2].expires = now_ns() - 1;
+	zone_expire(&zone[1]);
+}
+
+// the samples of test_window(), second [i]
+static float signal_at(int i)
+{
+	return 20 + 2 * sinf(i / 100.0f);
+}
+
+// the statistics of seconds [from] to [to] the long way, in doubles
+static void naive(int from, int to, float target, win_stats_t *s)
+{
+	double sum = 0, sq = 0, x;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	s->min = INFINITY;
+	s->max = -INFINITY;
+	for (i = from; i < to; i++) {
+		if (i % 97 == 0) continue;
+		x = signal_at(i);
+		s->samples++;
+		sum += x;
+		if (x < s->min) s->min = x;
+		if (x > s->max) s->max = x;
+		if (x > target) s->above++;
+	}
+	s->mean = sum / s->samples;
+	for (i = from; i < to; i++) {
+		if (i % 97 == 0) continue;
+		x = signal_at(i) - s->mean;
+		sq += x * x;
+	}
+	s->stddev = sqrt(sq / s->samples);
+}
+
+static int same_stats(const win_stats_t *a, const win_stats_t *b)
+{
+	return a->samples == b->samples && a->above == b->above && a->min == b->min && a->max == b->max &&
+	       fabsf(a->mean - b->mean) < 1e-3 && fabsf(a->stddev - b->stddev) < 1e-3;
+}
+
+static void test_window(void)
+{
+	static window_t w;
+	win_stats_t s, t;
+	int i;
+
+	win_init(&w);
+	CHECK(!win_query(&w, 60, &s));
+
+	// two hours, with a gap every 97 seconds
+	for (i = 0; i < 7200; i++) win_sample(&w, signal_at(i), 21, i % 97 != 0);
+
+	// exact up to WIN_SECONDS, whole minutes beyond
+	CHECK(win_query(&w, 300, &s));
+	naive(7200 - 300, 7200, 21, &t);
+	CHECK(same_stats(&s, &t));
+	CHECK(win_query(&w, 3600, &s));
+	naive(7200 - 3600, 7200, 21, &t);
+	CHECK(same_stats(&s, &t));
+
+	// the minute being filled counts too
+	for (; i < 7230; i++) win_sample(&w, signal_at(i), 21, i % 97 != 0);
+	CHECK(win_query(&w, 3600, &s));
+	naive(7230 - 3630, 7230, 21, &t);
+	CHECK(same_stats(&s, &t));
+
+	// a day asked for, two hours there; the SIMD kernels agree with the scalar ones
+	CHECK(win_query(&w, 86400, &s));
+	naive(0, 7230, 21, &t);
+	CHECK(same_stats(&s, &t));
+	CHECK(win_reduce(&w, 86400, 0, &t));
+	CHECK(same_stats(&s, &t));
+	CHECK(win_reduce(&w, 77, 0, &t) && win_query(&w, 77, &s) && same_stats(&s, &t));
+
+	// through the protocol
+	CHECK(strcmp(request("WIN;0;1"), "cannot compute, not a window!") == 0);
+	CHECK(strcmp(request("WIN;86401;1"), "cannot compute, not a window!") == 0);
+	for (i = 0; i < 5; i++) win_sample(&windows[1], 20 + i * 0.5f, 21, 1);
+	CHECK(strcmp(request("WIN;5;1"), "5;20.0;22.0;21.00;0.71;2") == 0);
+}
+
+// second [i] of a typical day of a zone: drifting a tenth every 20 seconds around a target
+// that moves twice a day, the lamps and the fan following; [noise] tenths of noise on top
+static void day_at(long i, int noise, telemetry_t *t)
+{
+	t->time = 1700000000LL + i;
+	t->target = i % 86400 < 25200 || i % 86400 >= 79200 ? 180 : 220;
+	t->current = t->target - 10 + (i / 20) % 20 + (noise ? (int)((i * 7919) % (2 * noise + 1)) - noise : 0);
+	t->lamps = t->current < t->target - 5 ? 2 : t->current < t->target ? 1 : 0;
+	t->fan = t->current < t->target ? 50 : 20;
+	t->fresh = 3;
+}
+
+static int history_rounds;	// times the socket had room for more of the last HIST reply
+
+// a HIST request through a socket of [sndbuf] bytes (0 = the default), the records of its
+// reply into [out]; their number
+static int history_count(const char *msg, telemetry_t *out, int sndbuf)
+{
+	static unsigned char buf[HIST_SIZE * TELE_MAX];
+	static tele_state_t state[MAX_ZONES];
+	static int zs[HIST_SIZE];
+	connection_t *conn = pool_get();
+	int sv[2], n, w, len = 0;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	if (sndbuf > 0) setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	conn->sock = sv[0];
+	n = write(sv[1], msg, strlen(msg));
+	w = requestHandler(conn);
+	if (w >= 0) return -1;
+	for (history_rounds = 0; ; history_rounds++) {
+		while ((n = read(sv[1], buf + len, sizeof(buf) - len)) > 0) len += n;
+		if (w != -2) break;
+		// the socket takes more, as the network thread sees it
+		if (!history_send(conn)) {
+			close(conn->sock);
+			pool_put(conn);
+			w = -1;
+		}
+	}
+	close(sv[1]);
+	memset(state, 0, sizeof(state));
+	return decode_all(buf, len, state, out, zs);
+}
+
+static void test_history(void)
+{
+	static hist_t h;
+	static telemetry_t out[HIST_SIZE];
+	char msg[32];
+	telemetry_t t;
+	int i, n, bad;
+
+	// a typical day, all of it kept at 10 times less at least
+	hist_init(&h);
+	for (i = 0; i < 86400; i++) {
+		day_at(i, 0, &t);
+		hist_add(&h, &t);
+	}
+	CHECK_EQ(h.records, 86400);
+	CHECK(h.records * sizeof(telemetry_t) >= 10 * h.bytes);
+
+	// the last records and a range across blocks, exact
+	n = hist_last(&h, HIST_SIZE, out);
+	CHECK_EQ(n, HIST_SIZE);
+	for (bad = 0, i = 0; i < n; i++) {
+		day_at(86400 - HIST_SIZE + i, 0, &t);
+		bad += !same(&out[i], &t);
+	}
+	CHECK_EQ(bad, 0);
+	n = hist_range(&h, 1700000000LL + 25000, 1700000000LL + 25399, out, HIST_SIZE);
+	CHECK_EQ(n, 400);
+	for (bad = 0, i = 0; i < n; i++) {
+		day_at(25000 + i, 0, &t);
+		bad += !same(&out[i], &t);
+	}
+	CHECK_EQ(bad, 0);
+	CHECK_EQ(hist_range(&h, 1700000000LL + 86395, 1700000000LL + 90000, out, HIST_SIZE), 5);
+	CHECK_EQ(hist_range(&h, 1600000000LL, 1600000099LL, out, HIST_SIZE), 0);
+
+	// three noisy days: the oldest blocks make room, what is left is the most recent, in order
+	for (i = 86400; i < 4 * 86400; i++) {
+		day_at(i, 2, &t);
+		hist_add(&h, &t);
+	}
+	CHECK(h.bytes <= HIST_ARENA);
+	CHECK(h.records < 3 * 86400);
+	n = hist_last(&h, HIST_SIZE, out);
+	for (bad = 0, i = 0; i < n; i++) {
+		day_at(4 * 86400 - HIST_SIZE + i, 2, &t);
+		bad += !same(&out[i], &t);
+	}
+	CHECK_EQ(bad, 0);
+	n = hist_range(&h, 0, 1LL << 40, out, 1);
+	CHECK_EQ(out[0].time, 1700000000LL + 4 * 86400 - h.records);
+
+	// gaps and a clock set back, big steps
+	hist_init(&h);
+	for (i = 0; i < 300; i++) {
+		day_at(i, 0, &t);
+		t.time += (i >= 100) * 3600 - (i >= 200) * 90000;
+		t.current = i % 50 == 0 ? -400 : t.current;
+		t.fan = i % 3 ? 100 : 0;
+		hist_add(&h, &t);
+	}
+	n = hist_last(&h, 300, out);
+	CHECK_EQ(n, 300);
+	for (bad = 0, i = 0; i < n; i++) {
+		day_at(i, 0, &t);
+		t.time += (i >= 100) * 3600 - (i >= 200) * 90000;
+		t.current = i % 50 == 0 ? -400 : t.current;
+		t.fan = i % 3 ? 100 : 0;
+		bad += !same(&out[i], &t);
+	}
+	CHECK_EQ(bad, 0);
+
+	// through the protocol: the last seconds, then a range of seconds ago
+	for (i = 0; i < 10; i++) {
+		day_at(i, 0, &t);
+		t.time = time(NULL) - 9 + i;
+		hist_add(&history[0], &t);
+	}
+	CHECK_EQ(history_count("HIST;4;0", out, 0), 4);
+	CHECK_EQ(out[3].time, t.time);
+	CHECK_EQ(history_rounds, 0);
+	CHECK_EQ(history_count("HIST;8-6;0", out, 0), 3);
+	CHECK_EQ(out[2].time - out[0].time, 2);
+	CHECK_EQ(history_count("HIST;0;0", out, 0), 0);
+	CHECK(strcmp(request("HIST;6-8;0"), "cannot compute, not a number of records!") == 0);
+
+	// a whole reply through a small socket: a chunk at a time as it drains, none lost
+	hist_init(&history[1]);
+	for (i = 0; i < 2 * HIST_SIZE; i++) {
+		day_at(i, 2, &t);
+		hist_add(&history[1], &t);
+	}
+	CHECK_EQ(history_count("HIST;99999;1", out, 4096), HIST_SIZE);
+	CHECK(history_rounds > 1);
+	for (bad = 0, i = 0; i < HIST_SIZE; i++) {
+		day_at(HIST_SIZE + i, 2, &t);
+		bad += !same(&out[i], &t);
+	}
+	CHECK_EQ(bad, 0);
+	n = time(NULL) - (1700000000LL + 2 * HIST_SIZE - 1);
+	snprintf(msg, sizeof(msg), "HIST;%d-%d;1", n + 1000, n + 500);
+	CHECK_EQ(history_count(msg, out, 4096), 501);
+	CHECK(out[0].time - 1700000000LL - (2 * HIST_SIZE - 1 - 1000) <= 1);	// a second may have gone by
+	for (bad = 0, i = 0; i < 501; i++) {
+		day_at(out[0].time - 1700000000LL + i, 2, &t);
+		bad += !same(&out[i], &t);
+	}
+	CHECK_EQ(bad, 0);
+	hist_init(&history[1]);
+}
+
+static void tests(void)
+{
+	setup();
+	test_parser();
+	test_formatter();
+	test_requests();
+	test_log_cache();
+	test_no_allocations();
+	test_schedule();
+	test_telemetry();
+	test_stats();
+	test_shm();
+	test_state();
+	test_heartbeat();
+	test_overload();
+	test_batch();
+	test_window();
+	test_history();
+}
+
+static void benches(void)
+{
+	char buf[64], *field[5];
+	proto_out_t out;
+	float f;
+
+	setup();
+	BENCH("parse", 1000000, {
+		strcpy(buf, "TEMP;21.5;3;1");
+		proto_split(buf, ';', field, 5);
+		proto_float(field[1], &f);
+	});
+	BENCH("format_log", 1000000, {
+		proto_begin(&out, buf, sizeof(buf));
+		proto_float_out(&out, 21.5f, 1);	proto_char(&out, ';');
+		proto_float_out(&out, 23.0f, 1);	proto_char(&out, ';');
+		proto_long_out(&out, 2);		proto_char(&out, ';');
+		proto_long_out(&out, 25);		proto_char(&out, ';');
+		proto_long_out(&out, 3);
+	});
+	BENCH("request_temp", 100000, { request("TEMP;21.3;0;1"); });
+	BENCH("request_log", 100000, { request("LOG;1;1"); });
+
+	// the same reading through the shared memory
+	shm = shm_create(40000 + getpid() % 20000, zones);
+	if (shm != NULL) {
+		shm_ring_t *ring = shm_claim(shm, 1);
+		char name[32];
+
+		BENCH("shm_temp", 1000000, { shm_send(ring, 0, 21.3f); shm_drain(&worker[0], 0); });
+		shm_name(name, sizeof(name), 40000 + getpid() % 20000);
+		shm_unlink(name);
+		munmap(shm, sizeof(*shm));
+		shm = NULL;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	harness_name = "controller";
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) { benches(); return 0; }
+
+	// -w: no waveforms here, the unit tests only
+	tests();
+	printf("%s: %d checks, %d failed\n", harness_name, harness_checks, harness_failures);
+	return harness_failures;
+}
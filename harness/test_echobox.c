@@ -0,0 +1,151 @@
+/*
+	ECHOBOX template harness: a ring-buffer pipe, blocking or not, polled and mapped
+*/
+
+#include "harness.h"
+#include "../templates/module_echobox/echobox.c"
+
+
+static struct file *peer;	// the other end of a blocked read or write
+
+static void peer_write(void *arg)
+{
+	shim_write(peer, arg, strlen(arg));
+}
+
+static void peer_read(void *arg)
+{
+	char buf[100];
+
+	shim_read(peer, buf, sizeof(buf));
+}
+
+static void tests(void)
+{
+	static char out[8192], in[8192];
+	struct echobox_head *head;
+	struct file *f, *r;
+	char buf[16], *map, *map2;
+	int i;
+
+	CHECK_EQ(shim_module_init(), 0);
+	CHECK_EQ(rb->size, 4096);
+
+	// what goes in comes out, whole, like a pipe
+	CHECK_EQ(harness_echo("/dev/echobox", "hello world"), 11);
+	CHECK_EQ(harness_cat("/dev/echobox", buf, sizeof(buf)), 11);
+	CHECK(strcmp(buf, "hello world") == 0);
+
+	// empty: -EAGAIN without blocking, else a sleep nothing wakes up here
+	f = shim_open("/dev/echobox", O_RDWR | O_NONBLOCK);
+	CHECK_EQ(shim_read(f, buf, sizeof(buf)), -EAGAIN);
+	CHECK_EQ(shim_poll(f), POLLOUT | POLLWRNORM);
+	r = shim_open("/dev/echobox", O_RDONLY);
+	CHECK_EQ(shim_read(r, buf, sizeof(buf)), -ERESTARTSYS);
+
+	// full: the write takes what fits, then -EAGAIN
+	for (i = 0; i < (int)sizeof(out); i++) out[i] = i * 7;
+	CHECK_EQ(shim_write(f, out, 5000), 4096);
+	CHECK_EQ(shim_write(f, out, 1), -EAGAIN);
+	CHECK_EQ(shim_poll(f), POLLIN | POLLRDNORM);
+
+	// around the end of the ring, in order
+	CHECK_EQ(shim_read(f, in, 1000), 1000);
+	CHECK_EQ(shim_write(f, out + 4096, 1000), 1000);
+	CHECK_EQ(shim_read(f, in + 1000, sizeof(in)), 4096);
+	CHECK(memcmp(in, out, 5096) == 0);
+	CHECK_EQ(shim_poll(f), POLLOUT | POLLWRNORM);
+
+	// a blocked reader woken by a writer, a blocked writer by a reader
+	peer = f;
+	shim_at(shim_now() + NSEC_PER_MSEC, peer_write, "ping");
+	memset(buf, 0, sizeof(buf));
+	CHECK_EQ(shim_read(r, buf, sizeof(buf)), 4);
+	CHECK(strcmp(buf, "ping") == 0);
+	CHECK_EQ(shim_write(f, out, 4096), 4096);
+	shim_at(shim_now() + NSEC_PER_MSEC, peer_read, NULL);
+	shim_close(r);
+	r = shim_open("/dev/echobox", O_WRONLY);
+	CHECK_EQ(shim_write(r, out, 500), 100);
+	CHECK_EQ(shim_read(f, in, sizeof(in)), 4096);
+	CHECK(memcmp(in, out + 100, 3996) == 0 && memcmp(in + 3996, out, 100) == 0);
+	shim_close(r);
+
+	// zero copy: the bytes in the mapping, handed back with the ioctl
+	r = shim_open("/dev/echobox", O_RDONLY);
+	CHECK(shim_mmap(f, PAGE_SIZE, 0) == NULL);		// writable
+	head = shim_mmap(r, PAGE_SIZE, ECHOBOX_PAGE_HEAD);
+	map = shim_mmap(r, 4096, ECHOBOX_PAGE_RING);
+	CHECK(head != NULL && map != NULL);
+	CHECK(shim_mmap(r, 8192, ECHOBOX_PAGE_RING) == NULL);
+	CHECK(shim_mmap(r, PAGE_SIZE, 2) == NULL);
+
+	// read-only for good, and the driver does not trust what the page says anyway
+	CHECK_EQ(shim_mprotect(head, 1), -EACCES);
+	map2 = shim_mmap_ro(f, PAGE_SIZE, ECHOBOX_PAGE_HEAD);
+	CHECK(map2 != NULL);
+	CHECK_EQ(shim_mprotect(map2, 1), -EACCES);
+	shim_munmap(map2);
+	head->size = 1 << 30;
+	head->tail -= 100000;
+	CHECK_EQ(shim_write(f, out, 5000), 4096);
+	CHECK_EQ(shim_read(f, in, sizeof(in)), 4096);
+	CHECK(memcmp(in, out, 4096) == 0);
+	CHECK_EQ(head->size, 4096);
+	CHECK_EQ(head->head, head->tail);
+	CHECK_EQ(shim_write(f, "abc", 3), 3);
+	CHECK_EQ(head->head - head->tail, 3);
+	CHECK(strncmp(map + (head->tail & (head->size - 1)), "abc", 3) == 0);
+	CHECK_EQ(shim_ioctl(r, ECHOBOX_IOC_CONSUME, 4), -EINVAL);
+	CHECK_EQ(shim_ioctl(r, ECHOBOX_IOC_CONSUME, 3), 0);
+	CHECK_EQ(head->head, head->tail);
+	CHECK_EQ(shim_read(f, buf, sizeof(buf)), -EAGAIN);
+	CHECK_EQ(shim_ioctl(r, 0, 0), -ENOTTY);
+	shim_munmap(head);
+	shim_munmap(map);
+	shim_close(r);
+	shim_close(f);
+	shim_module_exit();
+
+	// the size at insmod, in whole pages
+	ring_size = 10000;
+	CHECK_EQ(shim_module_init(), 0);
+	CHECK_EQ(rb->size, 16384);
+	shim_module_exit();
+	ring_size = 0;
+	CHECK_EQ(shim_module_init(), -EINVAL);
+	ring_size = 4096;
+}
+
+static void benches(void)
+{
+	static char buf[4096];
+	struct echobox_head *head;
+	struct file *f, *r;
+	char *map;
+
+	shim_module_init();
+	f = shim_open("/dev/echobox", O_RDWR | O_NONBLOCK);
+
+	BENCH("write_read_64", 1000000, { shim_write(f, buf, 64); shim_read(f, buf, 64); });
+	BENCH("write_read_4k", 100000, { shim_write(f, buf, 4096); shim_read(f, buf, 4096); });
+	BENCH("poll", 1000000, { shim_poll(f); });
+
+	// the consumer side through the mapping instead of read()
+	r = shim_open("/dev/echobox", O_RDONLY);
+	head = shim_mmap(r, PAGE_SIZE, ECHOBOX_PAGE_HEAD);
+	map = shim_mmap(r, 4096, ECHOBOX_PAGE_RING);
+	BENCH("write_consume_4k", 100000, {
+		shim_write(f, buf, 4096);
+		buf[0] = map[head->tail & (head->size - 1)];
+		shim_ioctl(f, ECHOBOX_IOC_CONSUME, head->head - head->tail);
+	});
+
+	shim_munmap(head);
+	shim_munmap(map);
+	shim_close(r);
+	shim_close(f);
+	shim_module_exit();
+}
+
+HARNESS_MAIN("echobox", tests, benches)
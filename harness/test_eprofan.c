@@ -0,0 +1,288 @@
+/*
+	EPROFAN harness: ramp, tachometer, closed loop and control page
+*/
+
+#include "harness.h"
+#include "../drivers/pwm_fan/eprofan.c"
+
+#define PWM_ID		6		// ehrpwm2B, see pwm_request() in the driver
+#define FAN_MAX_RPM	3000		// simulated fan speed at 100% duty
+
+
+/*
+ *	FAN MODEL: speed proportional to the duty cycle, TACH_PPR falling edges per revolution
+ */
+static int fan_spinning = 1;
+
+static void fan_pulse(void *arg)
+{
+	int duty = shim_pwm_duty(PWM_ID);
+	s64 period;
+
+	if (!fan_spinning || duty == 0) {
+		shim_at(shim_now() + 10 * NSEC_PER_MSEC, fan_pulse, NULL);
+		return;
+	}
+
+	// one full tach period: low half, high half
+	period = 60LL * NSEC_PER_SEC / ((s64)FAN_MAX_RPM * duty / FAN_PERIOD * TACH_PPR + 1);
+	shim_gpio_drive(tach_gpio, 0);
+	shim_gpio_drive(tach_gpio, 1);
+	shim_at(shim_now() + period, fan_pulse, NULL);
+}
+
+static int fan_read(int *duty, int *rpm, int *target, int *stalled)
+{
+	char buf[64];
+
+	if (harness_cat("/dev/eprofan", buf, sizeof(buf)) <= 0) return -1;
+	return sscanf(buf, "%d %d %d %d", duty, rpm, target, stalled);
+}
+
+
+static void test_ramp(void)
+{
+	CHECK_EQ(harness_echo("/dev/eprofan", "50"), 2);
+
+	// one DUTY_INCREMENT every FAN_STEP
+	shim_run(10 * FAN_STEP * NSEC_PER_MSEC + 1);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 10 * DUTY_INCREMENT);
+
+	shim_run(3 * NSEC_PER_SEC);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 50 * DUTY_INCREMENT);
+
+	// out of range and too long inputs
+	CHECK_EQ(harness_echo("/dev/eprofan", "150"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprofan", "-3"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprofan", "123456789"), -EINVAL);
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 50 * DUTY_INCREMENT);
+
+	CHECK_EQ(harness_echo("/dev/eprofan", "20"), 2);
+	shim_run(3 * NSEC_PER_SEC);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 20 * DUTY_INCREMENT);
+}
+
+static void test_tachometer(void)
+{
+	int duty, rpm, target, stalled;
+
+	// 20% of 3000 rpm
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(fan_read(&duty, &rpm, &target, &stalled), 4);
+	CHECK_EQ(duty, 20);
+	CHECK(rpm > 570 && rpm < 630);
+	CHECK_EQ(target, 0);
+	CHECK_EQ(stalled, 0);
+
+	// blocked rotor
+	fan_spinning = 0;
+	shim_run(NSEC_PER_SEC);
+	fan_read(&duty, &rpm, &target, &stalled);
+	CHECK_EQ(rpm, 0);
+	CHECK_EQ(stalled, 1);
+
+	fan_spinning = 1;
+	shim_run(NSEC_PER_SEC);
+	fan_read(&duty, &rpm, &target, &stalled);
+	CHECK(rpm > 570 && rpm < 630);
+	CHECK_EQ(stalled, 0);
+}
+
+static void test_closed_loop(void)
+{
+	int duty, rpm, target, stalled;
+
+	CHECK_EQ(harness_echo("/dev/eprofan", "r1800"), 5);
+	CHECK_EQ(harness_echo("/dev/eprofan", "r0"), -EINVAL);
+	shim_run(10 * NSEC_PER_SEC);
+
+	fan_read(&duty, &rpm, &target, &stalled);
+	CHECK_EQ(target, 1800);
+	CHECK(rpm > 1700 && rpm < 1900);
+	CHECK(duty > 55 && duty < 65);
+
+	// a percentage goes back to open-loop
+	CHECK_EQ(harness_echo("/dev/eprofan", "30"), 2);
+	shim_run(5 * NSEC_PER_SEC);
+	fan_read(&duty, &rpm, &target, &stalled);
+	CHECK_EQ(target, 0);
+	CHECK_EQ(duty, 30);
+
+	// the in-kernel interface behaves like write()
+	CHECK_EQ(eprofan_set_percentage(101), -EINVAL);
+	CHECK_EQ(eprofan_set_percentage(40), 0);
+	shim_run(2 * NSEC_PER_SEC);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 40 * DUTY_INCREMENT);
+	CHECK(eprofan_get_rpm() > 1140 && eprofan_get_rpm() < 1260);
+}
+
+static void test_control_page(void)
+{
+	struct file *f = shim_open("/dev/eprofan", O_RDWR);
+	struct epro_ctrl_page *page;
+	int irq;
+
+	page = shim_mmap(f, PAGE_SIZE, 0);
+	CHECK(page != NULL);
+	if (page == NULL) { shim_close(f); return; }
+	CHECK(shim_mmap(f, 2 * PAGE_SIZE, 0) == NULL);
+
+	// picked up by the polling timer
+	page->cmd_seq++;
+	page->fan_percentage = 40;
+	page->cmd_seq++;
+	shim_run(2 * EPRO_CTRL_POLL * NSEC_PER_MSEC);
+	CHECK_EQ(fan_percentage, 40);
+	CHECK_EQ(page->cmd_applied, page->cmd_seq);
+	CHECK_EQ(page->status_seq % 2, 0);
+
+	// half written commands are ignored
+	page->cmd_seq++;
+	page->fan_percentage = 90;
+	shim_run(2 * EPRO_CTRL_POLL * NSEC_PER_MSEC);
+	CHECK_EQ(fan_percentage, 40);
+	page->cmd_seq++;
+
+	// the doorbell does not wait for the timer
+	CHECK_EQ(shim_ioctl(f, EPRO_IOC_DOORBELL, 0), 0);
+	CHECK_EQ(fan_percentage, 90);
+	CHECK_EQ(shim_ioctl(f, 0, 0), -ENOTTY);
+
+	// status comes back
+	shim_run(5 * NSEC_PER_SEC);
+	CHECK_EQ(page->fan_duty, 90);
+	CHECK(page->fan_rpm > 2600 && page->fan_rpm < 2800);
+
+	// a command the driver cannot carry out is reported, the previous one stays
+	page->cmd_seq++;
+	page->fan_percentage = 150;
+	page->cmd_seq++;
+	CHECK_EQ(shim_ioctl(f, EPRO_IOC_DOORBELL, 0), 0);
+	CHECK_EQ(page->cmd_applied, page->cmd_seq);
+	CHECK_EQ(page->cmd_error, -EINVAL);
+	CHECK_EQ(fan_percentage, 90);
+	irq = tach_irq;
+	tach_irq = -1;				// no tachometer
+	page->cmd_seq++;
+	page->fan_target_rpm = 1200;
+	page->cmd_seq++;
+	CHECK_EQ(shim_ioctl(f, EPRO_IOC_DOORBELL, 0), 0);
+	CHECK_EQ(page->cmd_error, -ENODEV);
+	CHECK_EQ(fan_target_rpm, 0);
+	tach_irq = irq;
+
+	// closed loop through the page
+	page->cmd_seq++;
+	page->fan_target_rpm = 1200;
+	page->cmd_seq++;
+	shim_run(10 * NSEC_PER_SEC);
+	CHECK_EQ(fan_target_rpm, 1200);
+	CHECK(page->fan_rpm > 1100 && page->fan_rpm < 1300);
+	CHECK_EQ(page->cmd_error, 0);
+
+	// no mapping, no polling
+	shim_munmap(page);
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(ctrl_users, 0);
+	CHECK(!timer_pending(&ctrl_timer));
+	shim_close(f);
+}
+
+static void test_sysfs(void)
+{
+	long writes = harness_attr("eprofan", "writes"), rejected = harness_attr("eprofan", "rejected");
+	unsigned long printed;
+	long steps, ms;
+
+	// a ramp from 0 to 20%: 20 increments, one every FAN_STEP
+	harness_echo("/dev/eprofan", "0");
+	shim_run(10 * NSEC_PER_SEC);
+	steps = harness_attr("eprofan", "ramp_steps");
+	ms = harness_attr("eprofan", "ramp_ms");
+	printed = shim_printk_count;
+	harness_echo("/dev/eprofan", "20");
+	CHECK_EQ(shim_printk_count, printed);	// no printk per write
+	shim_run(NSEC_PER_SEC / 2);
+	CHECK_EQ(harness_attr("eprofan", "ramp_steps") - steps, 10);
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(harness_attr("eprofan", "ramp_steps") - steps, 20);
+	CHECK_EQ(harness_attr("eprofan", "ramp_ms") - ms, 20 * FAN_STEP);
+	CHECK_EQ(harness_echo("/dev/eprofan", "150"), -EINVAL);
+	CHECK_EQ(harness_attr("eprofan", "writes") - writes, 3);
+	CHECK_EQ(harness_attr("eprofan", "rejected") - rejected, 1);
+
+	// the PWM period, at the same duty percentage
+	CHECK_EQ(harness_attr("eprofan", "period_ns"), FAN_PERIOD);
+	CHECK_EQ(shim_attr_store("eprofan", "period_ns", "40000\n"), 6);
+	CHECK_EQ(shim_pwm_period(PWM_ID), 40000);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 8000);
+
+	// coarser and faster ramps
+	CHECK_EQ(harness_attr("eprofan", "duty_resolution"), FAN_PERIOD / DUTY_INCREMENT);
+	CHECK_EQ(shim_attr_store("eprofan", "duty_resolution", "50"), 2);
+	CHECK_EQ(shim_attr_store("eprofan", "ramp_step_ms", "10"), 2);
+	steps = harness_attr("eprofan", "ramp_steps");
+	harness_echo("/dev/eprofan", "30");
+	shim_run(60 * NSEC_PER_MSEC + 1);
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 12000);
+	CHECK_EQ(harness_attr("eprofan", "ramp_steps") - steps, 5);
+
+	// out of range, not numbers, read only
+	CHECK_EQ(shim_attr_store("eprofan", "period_ns", "10"), -EINVAL);
+	CHECK_EQ(shim_attr_store("eprofan", "duty_resolution", "many"), -EINVAL);
+	CHECK_EQ(shim_attr_store("eprofan", "ramp_step_ms", "0"), -EINVAL);
+	CHECK_EQ(shim_attr_store("eprofan", "writes", "0"), -EACCES);
+
+	shim_attr_store("eprofan", "period_ns", "50000");
+	shim_attr_store("eprofan", "duty_resolution", "100");
+	shim_attr_store("eprofan", "ramp_step_ms", "50");
+	CHECK_EQ(shim_pwm_duty(PWM_ID), 30 * DUTY_INCREMENT);
+}
+
+static void tests(void)
+{
+	CHECK_EQ(shim_module_init(), 0);
+	CHECK(shim_pwm_enabled(PWM_ID));
+	CHECK_EQ(shim_pwm_period(PWM_ID), FAN_PERIOD);
+	shim_at(0, fan_pulse, NULL);
+
+	test_ramp();
+	test_tachometer();
+	test_closed_loop();
+	test_control_page();
+	test_sysfs();
+
+	shim_module_exit();
+	CHECK(!shim_pwm_enabled(PWM_ID));
+}
+
+static void benches(void)
+{
+	struct file *f;
+	struct epro_ctrl_page *page;
+	char buf[64];
+	int i = 0;
+
+	shim_module_init();
+	f = shim_open("/dev/eprofan", O_RDWR);
+
+	BENCH("write_percentage", 1000000, { f->f_pos = 0; shim_write(f, "55", 2); });
+	BENCH("read_status", 1000000, { f->f_pos = 0; shim_read(f, buf, sizeof(buf)); });
+	BENCH("ramp_step", 1000000, { fan_percentage = (i++ & 1) ? 100 : 0; adjust_speed(0); });
+	BENCH("tach_irq", 1000000, { shim_gpio_drive(tach_gpio, 1); shim_gpio_drive(tach_gpio, 0); });
+	BENCH("tach_timer", 1000000, { tach_check(&tach_timer); });
+
+	page = shim_mmap(f, PAGE_SIZE, 0);
+	BENCH("page_command_doorbell", 1000000, {
+		page->cmd_seq++; page->fan_percentage = (i++ & 1) ? 70 : 30; page->cmd_seq++;
+		shim_ioctl(f, EPRO_IOC_DOORBELL, 0);
+	});
+	BENCH("page_poll_idle", 1000000, { ctrl_check(0); });
+	shim_munmap(page);
+
+	shim_close(f);
+	shim_module_exit();
+}
+
+HARNESS_MAIN("eprofan", tests, benches)
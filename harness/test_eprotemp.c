@@ -0,0 +1,173 @@
+/*
+	EPROTEMP harness: triggered sampling, batched and blocking reads, sensor configuration
+*/
+
+#include "harness.h"
+#include "../drivers/tmp102/eprotemp.c"
+
+#define MS		NSEC_PER_MSEC
+
+
+static void test_sampling(void)
+{
+	struct file *f = shim_open("/dev/eprotemp", O_RDONLY | O_NONBLOCK);
+	struct eprotemp_sample s[8];
+	s64 t0 = shim_now();
+	int milli;
+
+	CHECK_EQ(shim_read(f, s, sizeof(s)), -EAGAIN);
+	CHECK_EQ(shim_poll(f), 0);
+	CHECK_EQ(eprotemp_get_temp(&milli), -ENODATA);
+
+	// one sample per period, timestamped at the trigger
+	harness_tmp102(21500, 0);
+	shim_run(4 * 250 * MS);
+	CHECK_EQ(shim_poll(f), POLLIN | POLLRDNORM);
+
+	// whole records only, all of them in one read
+	CHECK_EQ(shim_read(f, s, sizeof(s[0]) - 1), -EINVAL);
+	CHECK_EQ(shim_read(f, s, sizeof(s) + 3), 4 * sizeof(s[0]));
+	CHECK_EQ(s[0].timestamp, t0 + 250 * MS);
+	CHECK_EQ(s[3].timestamp, t0 + 1000 * MS);
+	CHECK_EQ(s[0].seq, 1);
+	CHECK_EQ(s[3].seq, 4);
+	CHECK_EQ(s[0].temp, 21500);
+
+	// negative temperatures
+	harness_tmp102(-12250, 0);
+	shim_run(250 * MS);
+	CHECK_EQ(shim_read(f, s, sizeof(s)), sizeof(s[0]));
+	CHECK_EQ(s[0].temp, -12250);
+	CHECK_EQ(eprotemp_get_temp(&milli), 0);
+	CHECK_EQ(milli, -12250);
+	shim_close(f);
+}
+
+static void test_blocking(void)
+{
+	struct file *f = shim_open("/dev/eprotemp", O_RDONLY);
+	struct eprotemp_sample s;
+
+	// the read sleeps until the next trigger
+	harness_tmp102(30000, 0);
+	CHECK_EQ(shim_read(f, &s, sizeof(s)), sizeof(s));
+	CHECK_EQ(s.timestamp, shim_now());
+	CHECK_EQ(s.temp, 30000);
+	shim_close(f);
+}
+
+static void test_config(void)
+{
+	struct file *f = shim_open("/dev/eprotemp", O_RDONLY | O_NONBLOCK);
+	struct eprotemp_config conf;
+	struct eprotemp_sample s[16];
+
+	// power-on defaults written at load time: 4Hz, normal mode
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_GET_CONFIG, (unsigned long)&conf), 0);
+	CHECK_EQ(conf.period, 250);
+	CHECK_EQ(conf.rate, EPROTEMP_RATE_4HZ);
+	CHECK_EQ(conf.extended, 0);
+	CHECK_EQ(shim_i2c_get(TMP102_BUS, TMP102_ADDR, TMP102_CONF), 0x60a0);
+
+	// 8Hz, extended mode, 125ms trigger
+	conf.period = 125;
+	conf.rate = EPROTEMP_RATE_8HZ;
+	conf.extended = 1;
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_SET_CONFIG, (unsigned long)&conf), 0);
+	CHECK_EQ(shim_i2c_get(TMP102_BUS, TMP102_ADDR, TMP102_CONF), 0x60f0);
+
+	while (shim_read(f, s, sizeof(s)) > 0) { }
+	harness_tmp102(140000, 1);
+	shim_run(1000 * MS);
+	CHECK_EQ(shim_read(f, s, sizeof(s)), 8 * sizeof(s[0]));
+	CHECK_EQ(s[1].timestamp - s[0].timestamp, 125 * MS);
+	CHECK_EQ(s[7].temp, 140000);
+
+	// out of range
+	conf.period = 5;
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_SET_CONFIG, (unsigned long)&conf), -EINVAL);
+	conf.period = 250;
+	conf.rate = 4;
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_SET_CONFIG, (unsigned long)&conf), -EINVAL);
+	CHECK_EQ(shim_ioctl(f, 0, 0), -ENOTTY);
+	shim_close(f);
+}
+
+static void test_errors(void)
+{
+	struct file *f = shim_open("/dev/eprotemp", O_RDONLY | O_NONBLOCK);
+	struct eprotemp_stats before, after;
+	struct eprotemp_sample s[64];
+	ssize_t n, total = 0;
+
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_STATS, (unsigned long)&before), 0);
+
+	// a sensor that does not answer leaves a gap
+	shim_i2c_detach(TMP102_BUS, TMP102_ADDR);
+	shim_run(1000 * MS);
+	shim_i2c_attach(TMP102_BUS, TMP102_ADDR);
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_STATS, (unsigned long)&after), 0);
+	CHECK_EQ(after.errors - before.errors, 8);
+	CHECK_EQ(after.captured - before.captured, 0);
+
+	// nobody reading: the fifo fills up and drops the newest samples
+	shim_run((FIFO_SIZE + 100) * 125 * MS);
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_STATS, (unsigned long)&after), 0);
+	CHECK_EQ(after.captured - before.captured, FIFO_SIZE);
+	CHECK_EQ(after.dropped - before.dropped, 100);
+
+	while ((n = shim_read(f, s, sizeof(s))) > 0) total += n;
+	CHECK_EQ(total, FIFO_SIZE * sizeof(s[0]));
+	CHECK_EQ(shim_ioctl(f, EPROTEMP_IOC_STATS, (unsigned long)&after), 0);
+	CHECK_EQ(after.read - before.read, FIFO_SIZE);
+	CHECK_EQ(after.overruns, 0);
+	shim_close(f);
+}
+
+
+static void tests(void)
+{
+	// no sensor, no driver
+	CHECK_EQ(shim_module_init(), -ENODEV);
+
+	shim_i2c_attach(TMP102_BUS, TMP102_ADDR);
+	shim_i2c_set(TMP102_BUS, TMP102_ADDR, TMP102_CONF, 0x60a0);
+	CHECK_EQ(shim_module_init(), 0);
+
+	test_sampling();
+	test_blocking();
+	test_config();
+	test_errors();
+
+	shim_module_exit();
+}
+
+static void benches(void)
+{
+	struct file *f;
+	struct eprotemp_sample s[256];
+	int i;
+
+	shim_i2c_attach(TMP102_BUS, TMP102_ADDR);
+	harness_tmp102(21000, 0);
+	shim_module_init();
+	f = shim_open("/dev/eprotemp", O_RDONLY | O_NONBLOCK);
+
+	BENCH("sample", 1000000, {
+		sample_fetch(&sample_work);
+		if (kfifo_is_full(&samples)) kfifo_reset(&samples);
+	});
+	BENCH("read_batch_256", 100000, {
+		for (i = 0; i < 256; i++) sample_fetch(&sample_work);
+		shim_read(f, s, sizeof(s));
+	});
+	BENCH("read_single", 1000000, {
+		sample_fetch(&sample_work);
+		shim_read(f, s, sizeof(s[0]));
+	});
+
+	shim_close(f);
+	shim_module_exit();
+}
+
+HARNESS_MAIN("eprotemp", tests, benches)
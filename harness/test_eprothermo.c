@@ -0,0 +1,164 @@
+/*
+	EPROTHERMO harness: TMP102 sampling, control law and configuration through write()
+*/
+
+#include "harness.h"
+
+// the actuators, normally exported by eprofan and microwave
+static int fan_set = -1, lamp_set = -1, actuations = 0;
+
+int eprofan_set_percentage(int percentage) { fan_set = percentage; actuations++; return 0; }
+int microwave_set_lamps(int mask) { lamp_set = mask; actuations++; return 0; }
+
+// eprotemp is not loaded, the module talks to the TMP102 by itself
+#pragma weak eprotemp_get_temp
+
+#include "../drivers/thermostat/eprothermo.c"
+
+#define PERIOD_NS	(1000 * NSEC_PER_MSEC)
+
+
+static void test_sampling(void)
+{
+	char buf[256];
+
+	// read at load time
+	CHECK_EQ(current_temp, 21000);
+	CHECK_EQ(samples, 1);
+
+	// then once per period, used by the next one
+	harness_tmp102(-1000, 0);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(samples, 2);
+	CHECK_EQ(current_temp, -1000);
+	CHECK_EQ(harness_cat("/dev/eprothermo", buf, sizeof(buf)) > 0, 1);
+	CHECK(strncmp(buf, "0.0;-1.0;", 9) == 0);
+
+	// a sensor that does not answer keeps the last sample
+	shim_i2c_detach(TMP102_BUS, TMP102_ADDR);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(sample_errors, 1);
+	CHECK_EQ(current_temp, -1000);
+	shim_i2c_attach(TMP102_BUS, TMP102_ADDR);
+}
+
+static void test_control(void)
+{
+	char buf[256];
+
+	harness_tmp102(21000, 0);
+	shim_run(PERIOD_NS);
+
+	// heating: lamps in proportion, slow fan
+	CHECK_EQ(harness_echo("/dev/eprothermo", "23.5"), 4);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(lamp_set, 0x1);
+	CHECK_EQ(fan_set, 25);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "setpoint=27.5\n"), 14);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(lamp_set, 0x7);
+
+	// cooling: lamps off, fan in proportion, from the next sample on
+	harness_tmp102(30000, 0);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(lamp_set, 0x7);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(lamp_set, 0);
+	CHECK_EQ(fan_set, 40);		// -2.5 degrees: -(floor(-5) + 1) * 10
+	CHECK_EQ(harness_cat("/dev/eprothermo", buf, sizeof(buf)) > 0, 1);
+	CHECK(strncmp(buf, "27.5;30.0;0;40\n", 15) == 0);
+
+	// steady state, no actuation
+	actuations = 0;
+	shim_run(5 * PERIOD_NS);
+	CHECK_EQ(actuations, 0);
+
+	// gains
+	CHECK_EQ(harness_echo("/dev/eprothermo", "fan_step=0.25;fan_increment=20"), 30);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(fan_set, 100);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "fan_min=30 setpoint=35"), 22);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(fan_set, 30);
+	CHECK_EQ(lamp_set, 0x3);
+
+	// faster period
+	CHECK_EQ(harness_echo("/dev/eprothermo", "period=100"), 10);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(period, 100);
+	CHECK(samples >= 10);
+}
+
+static void test_errors(void)
+{
+	CHECK_EQ(harness_echo("/dev/eprothermo", "hot"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "foo=1"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "period=5"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "lamp_step=0"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "12.3.4"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "9999999"), -EINVAL);
+	CHECK_EQ(target_temp, 35000);
+}
+
+static void test_no_sensor(void)
+{
+	unsigned long printed;
+
+	// the temperature comes from write() only, on a fresh load
+	sensor = NULL;
+	i2c_bus = -1;
+	period = 1000;
+	CHECK_EQ(shim_module_init(), 0);
+	CHECK(sensor == NULL);
+
+	CHECK_EQ(harness_echo("/dev/eprothermo", "setpoint=20;temp=19.5"), 21);
+	shim_run(PERIOD_NS);
+	CHECK_EQ(lamp_set, 0x1);
+	printed = shim_printk_count;
+	CHECK_EQ(harness_echo("/dev/eprothermo", "temp=-3"), 7);
+	CHECK_EQ(harness_echo("/dev/eprothermo", "setpoint=20;temp=-2"), 19);
+	CHECK_EQ(shim_printk_count, printed);		// readings and the same setpoint are not logged
+	CHECK_EQ(current_temp, -2000);
+	shim_module_exit();
+	i2c_bus = TMP102_BUS;
+}
+
+
+static void tests(void)
+{
+	shim_i2c_attach(TMP102_BUS, TMP102_ADDR);
+	harness_tmp102(21000, 0);
+	CHECK_EQ(shim_module_init(), 0);
+
+	test_sampling();
+	test_control();
+	test_errors();
+
+	// leaves the box safe
+	shim_module_exit();
+	CHECK_EQ(lamp_set, 0);
+	CHECK_EQ(fan_set, fan_min);
+
+	shim_reset();
+	test_no_sensor();
+}
+
+static void benches(void)
+{
+	int i = 0;
+
+	shim_i2c_attach(TMP102_BUS, TMP102_ADDR);
+	harness_tmp102(21000, 0);
+	shim_module_init();
+
+	BENCH("control_law", 1000000, {
+		target_temp = (i++ & 1) ? 15000 : 27000;
+		thermo_check(&thermo_timer);
+	});
+	BENCH("sample_fetch", 1000000, { sample_fetch(&sample_work); });
+	BENCH("write_setpoint", 1000000, { harness_echo("/dev/eprothermo", "23.5"); });
+
+	shim_module_exit();
+}
+
+HARNESS_MAIN("eprothermo", tests, benches)
@@ -0,0 +1,130 @@
+/*
+	GPIO_INTERRUPT template harness: edge capture, batched and blocking reads, overflow
+*/
+
+#include "harness.h"
+#include "../templates/module_gpio_interrupt/gpio_interrupt.h"
+#include "../templates/module_gpio_interrupt/gpio_interrupt.c"
+
+static void edge(void *arg)
+{
+	shim_gpio_drive(btn_gpio_num, (int)(long)arg);
+}
+
+
+static void test_capture(void)
+{
+	struct file *f = shim_open("/dev/gint", O_RDONLY | O_NONBLOCK);
+	struct gint_event ev[8];
+	s64 t0 = shim_now();
+
+	CHECK_EQ(shim_read(f, ev, sizeof(ev)), -EAGAIN);
+	CHECK_EQ(shim_poll(f), 0);
+
+	// three edges, 1ms apart
+	shim_at(t0 + 1 * NSEC_PER_MSEC, edge, (void *)1);
+	shim_at(t0 + 2 * NSEC_PER_MSEC, edge, (void *)0);
+	shim_at(t0 + 3 * NSEC_PER_MSEC, edge, (void *)1);
+	shim_run(5 * NSEC_PER_MSEC);
+	CHECK_EQ(shim_poll(f), POLLIN | POLLRDNORM);
+
+	// whole records only
+	CHECK_EQ(shim_read(f, ev, sizeof(ev[0]) - 1), -EINVAL);
+
+	// all of them in one read
+	CHECK_EQ(shim_read(f, ev, sizeof(ev) + 5), 3 * sizeof(ev[0]));
+	CHECK_EQ(ev[0].timestamp, t0 + 1 * NSEC_PER_MSEC);
+	CHECK_EQ(ev[1].timestamp, t0 + 2 * NSEC_PER_MSEC);
+	CHECK_EQ(ev[2].timestamp, t0 + 3 * NSEC_PER_MSEC);
+	CHECK_EQ(ev[0].gpio, btn_gpio_num);
+	CHECK_EQ(ev[0].edge, 1);
+	CHECK_EQ(ev[1].edge, 0);
+	CHECK_EQ(ev[2].edge, 1);
+
+	// the led follows every edge
+	CHECK_EQ(gpio_get_value(led_gpio_num), 1);
+	shim_close(f);
+}
+
+static void test_blocking(void)
+{
+	struct file *f = shim_open("/dev/gint", O_RDONLY);
+	struct gint_event ev;
+	s64 when = shim_now() + 40 * NSEC_PER_MSEC;
+
+	// the read sleeps until the edge arrives
+	shim_at(when, edge, (void *)0);
+	CHECK_EQ(shim_read(f, &ev, sizeof(ev)), sizeof(ev));
+	CHECK_EQ(ev.timestamp, when);
+	CHECK_EQ(ev.edge, 0);
+	shim_close(f);
+}
+
+static void test_overflow(void)
+{
+	struct file *f = shim_open("/dev/gint", O_RDONLY | O_NONBLOCK);
+	struct gint_event ev[64];
+	struct gint_stats before, after;
+	ssize_t n, total = 0;
+	int i;
+
+	CHECK_EQ(shim_ioctl(f, GINT_IOC_STATS, (unsigned long)&before), 0);
+
+	for (i = 0; i < GINT_FIFO_SIZE + 100; i++) {
+		shim_gpio_drive(btn_gpio_num, !gpio_get_value(btn_gpio_num));
+	}
+
+	CHECK_EQ(shim_ioctl(f, GINT_IOC_STATS, (unsigned long)&after), 0);
+	CHECK_EQ(after.captured - before.captured, GINT_FIFO_SIZE);
+	CHECK_EQ(after.dropped - before.dropped, 100);
+
+	while ((n = shim_read(f, ev, sizeof(ev))) > 0) total += n;
+	CHECK_EQ(n, -EAGAIN);
+	CHECK_EQ(total, GINT_FIFO_SIZE * sizeof(ev[0]));
+
+	CHECK_EQ(shim_ioctl(f, GINT_IOC_STATS, (unsigned long)&after), 0);
+	CHECK_EQ(after.read - before.read, GINT_FIFO_SIZE);
+	CHECK_EQ(shim_ioctl(f, 0, 0), -ENOTTY);
+	shim_close(f);
+}
+
+
+static void tests(void)
+{
+	CHECK_EQ(shim_module_init(), 0);
+
+	test_capture();
+	test_blocking();
+	test_overflow();
+
+	shim_module_exit();
+	CHECK_EQ(gpio_get_value(led_gpio_num), 0);
+}
+
+static void benches(void)
+{
+	struct file *f;
+	struct gint_event ev[256];
+	int i;
+
+	shim_module_init();
+	f = shim_open("/dev/gint", O_RDONLY | O_NONBLOCK);
+
+	BENCH("irq_edge", 1000000, {
+		shim_gpio_drive(btn_gpio_num, !gpio_get_value(btn_gpio_num));
+		if (kfifo_is_full(&events)) kfifo_reset(&events);
+	});
+	BENCH("read_batch_256", 100000, {
+		for (i = 0; i < 256; i++) shim_gpio_drive(btn_gpio_num, !gpio_get_value(btn_gpio_num));
+		shim_read(f, ev, sizeof(ev));
+	});
+	BENCH("read_single", 1000000, {
+		shim_gpio_drive(btn_gpio_num, !gpio_get_value(btn_gpio_num));
+		shim_read(f, ev, sizeof(ev[0]));
+	});
+
+	shim_close(f);
+	shim_module_exit();
+}
+
+HARNESS_MAIN("gpio_interrupt", tests, benches)
@@ -0,0 +1,68 @@
+/*
+	GPIO_LED template harness: blinking timer
+*/
+
+#include "harness.h"
+#include "../templates/module_gpio_led/gpio_led.c"
+
+static int toggles;
+static int last_level;
+
+static void count_toggles(void *arg)
+{
+	int level = gpio_get_value(led_gpio_num);
+
+	if (level != last_level) { toggles++; last_level = level; }
+	shim_at(shim_now() + NSEC_PER_MSEC, count_toggles, NULL);
+}
+
+
+static void tests(void)
+{
+	char buf[8];
+
+	CHECK_EQ(shim_module_init(), 0);
+	shim_at(shim_now(), count_toggles, NULL);
+
+	// default 250ms: 4 toggles per second
+	shim_run(NSEC_PER_SEC + NSEC_PER_MSEC);
+	CHECK_EQ(toggles, 4);
+
+	CHECK_EQ(harness_cat("/dev/gled", buf, sizeof(buf)), MSG_SIZE);
+	CHECK(strcmp(buf, "250") == 0);
+
+	// 100ms: 10 toggles per second
+	CHECK_EQ(harness_echo("/dev/gled", "100"), 3);
+	shim_run(50 * NSEC_PER_MSEC);
+	toggles = 0;
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(toggles, 10);
+
+	CHECK_EQ(harness_echo("/dev/gled", "123456"), -EINVAL);
+
+	// 0 switches the led off and stops the timer
+	CHECK_EQ(harness_echo("/dev/gled", "0"), 1);
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(gpio_get_value(led_gpio_num), 0);
+	CHECK(!timer_pending(&my_timer));
+
+	shim_module_exit();
+}
+
+static void benches(void)
+{
+	struct file *f;
+	char buf[8];
+
+	shim_module_init();
+	f = shim_open("/dev/gled", O_RDWR);
+
+	BENCH("write_interval", 1000000, { f->f_pos = 0; shim_write(f, "250", 3); });
+	BENCH("read_interval", 1000000, { f->f_pos = 0; shim_read(f, buf, sizeof(buf)); });
+	BENCH("timer_toggle", 1000000, { toggle_led(0); });
+
+	shim_close(f);
+	shim_module_exit();
+}
+
+HARNESS_MAIN("gpio_led", tests, benches)
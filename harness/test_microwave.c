@@ -0,0 +1,184 @@
+/*
+	MICROWAVE harness: halogen lights through write() and through the control page
+*/
+
+#include "harness.h"
+#include "../drivers/microwave/microwave.c"
+
+static int lights(void)
+{
+	return gpio_get_value(hal1_gpio) | gpio_get_value(hal2_gpio) << 1 | gpio_get_value(hal3_gpio) << 2;
+}
+
+
+static void test_write(void)
+{
+	char buf[8];
+
+	CHECK_EQ(lights(), 0);
+	CHECK_EQ(harness_echo("/dev/microwave", "2"), 1);
+	CHECK_EQ(lights(), 0x3);
+	CHECK_EQ(harness_cat("/dev/microwave", buf, sizeof(buf)), MSG_SIZE);
+	CHECK(strcmp(buf, "2\n") == 0);
+
+	CHECK_EQ(harness_echo("/dev/microwave", "3"), 1);
+	CHECK_EQ(lights(), 0x7);
+	CHECK_EQ(harness_echo("/dev/microwave", "1"), 1);
+	CHECK_EQ(lights(), 0x1);
+
+	// anything else turns everything off
+	CHECK_EQ(harness_echo("/dev/microwave", "7"), -EINVAL);
+	CHECK_EQ(lights(), 0);
+	CHECK_EQ(harness_echo("/dev/microwave", "12"), -EINVAL);
+	CHECK_EQ(harness_echo("/dev/microwave", "0"), 1);
+	CHECK_EQ(lights(), 0);
+
+	// the in-kernel interface takes any mask
+	CHECK_EQ(microwave_set_lamps(0x5), 0);
+	CHECK_EQ(lights(), 0x5);
+	CHECK_EQ(microwave_set_lamps(0x8), -EINVAL);
+	CHECK_EQ(lights(), 0x5);
+	CHECK_EQ(microwave_set_lamps(0), 0);
+}
+
+static void test_partial_read(void)
+{
+	struct file *f;
+	char a[4] = { 0 }, b[4] = { 0 };
+
+	harness_echo("/dev/microwave", "3");
+	f = shim_open("/dev/microwave", O_RDONLY);
+	CHECK_EQ(shim_read(f, a, 1), 1);
+	CHECK_EQ(shim_read(f, b, 2), 2);
+	CHECK_EQ(a[0], '3');
+	CHECK_EQ(b[0], '\n');
+	shim_close(f);
+	harness_echo("/dev/microwave", "0");
+}
+
+static void test_control_page(void)
+{
+	struct file *f = shim_open("/dev/microwave", O_RDWR);
+	struct epro_ctrl_page *page;
+
+	page = shim_mmap(f, PAGE_SIZE, 0);
+	CHECK(page != NULL);
+	if (page == NULL) { shim_close(f); return; }
+
+	// any combination of lamps, not only the first N
+	page->cmd_seq++;
+	page->lamp_mask = 0x5;
+	page->cmd_seq++;
+	shim_run(2 * EPRO_CTRL_POLL * NSEC_PER_MSEC);
+	CHECK_EQ(lights(), 0x5);
+	CHECK_EQ(page->lamp_state, 0x5);
+	CHECK_EQ(page->cmd_applied, page->cmd_seq);
+	CHECK_EQ(hal_status, 2);
+
+	// doorbell
+	page->cmd_seq++;
+	page->lamp_mask = 0x2;
+	page->cmd_seq++;
+	CHECK_EQ(shim_ioctl(f, EPRO_IOC_DOORBELL, 0), 0);
+	CHECK_EQ(lights(), 0x2);
+
+	// write() still works and shows up in the status
+	harness_echo("/dev/microwave", "3");
+	shim_run(2 * EPRO_CTRL_POLL * NSEC_PER_MSEC);
+	CHECK_EQ(page->lamp_state, 0x7);
+
+	shim_munmap(page);
+	shim_run(NSEC_PER_SEC);
+	CHECK(!timer_pending(&ctrl_timer));
+	shim_close(f);
+}
+
+static void test_sysfs(void)
+{
+	long writes = harness_attr("microwave", "writes"), rejected = harness_attr("microwave", "rejected");
+	char buf[PAGE_SIZE];
+	unsigned long a0, b0, c0, a, b, c;
+
+	shim_attr_show("microwave", "lamp_on_ms", buf);
+	CHECK_EQ(sscanf(buf, "%lu %lu %lu", &a0, &b0, &c0), 3);
+
+	// two lamps for a second, then the third one alone for half a second, still on
+	CHECK_EQ(harness_echo("/dev/microwave", "2"), 1);
+	shim_run(NSEC_PER_SEC);
+	CHECK_EQ(microwave_set_lamps(0x4), 0);
+	shim_run(NSEC_PER_SEC / 2);
+	shim_attr_show("microwave", "lamp_on_ms", buf);
+	sscanf(buf, "%lu %lu %lu", &a, &b, &c);
+	CHECK_EQ(a - a0, 1000);
+	CHECK_EQ(b - b0, 1000);
+	CHECK_EQ(c - c0, 500);
+
+	// and off
+	CHECK_EQ(harness_echo("/dev/microwave", "9"), -EINVAL);
+	shim_run(NSEC_PER_SEC);
+	shim_attr_show("microwave", "lamp_on_ms", buf);
+	sscanf(buf, "%lu %lu %lu", &a, &b, &c);
+	CHECK_EQ(c - c0, 500);
+
+	CHECK_EQ(harness_attr("microwave", "writes") - writes, 2);
+	CHECK_EQ(harness_attr("microwave", "rejected") - rejected, 1);
+	CHECK_EQ(shim_attr_store("microwave", "writes", "0"), -EACCES);
+}
+
+// a lamp gpio already taken: insmod fails and leaves nothing behind, so the next one works
+static void test_insmod(void)
+{
+	CHECK_EQ(gpio_request(hal3_gpio, "busy"), 0);
+	CHECK_EQ(shim_module_init(), -EINVAL);
+	CHECK(shim_open("/dev/microwave", O_RDWR) == NULL);
+	CHECK(harness_attr("microwave", "writes") < 0);
+	gpio_free(hal3_gpio);
+
+	CHECK_EQ(shim_module_init(), 0);
+	CHECK_EQ(harness_echo("/dev/microwave", "3"), 1);
+	CHECK_EQ(lights(), 0x7);
+	shim_module_exit();
+}
+
+static void tests(void)
+{
+	CHECK_EQ(shim_module_init(), 0);
+
+	test_write();
+	test_partial_read();
+	test_control_page();
+	test_sysfs();
+
+	shim_module_exit();
+	CHECK_EQ(lights(), 0);
+
+	test_insmod();
+}
+
+static void benches(void)
+{
+	struct file *f;
+	struct epro_ctrl_page *page;
+	char buf[8];
+	int i = 0;
+
+	shim_module_init();
+	f = shim_open("/dev/microwave", O_RDWR);
+
+	BENCH("write_lamps", 1000000, { f->f_pos = 0; shim_write(f, (i++ & 1) ? "3" : "0", 1); });
+	BENCH("read_lamps", 1000000, { f->f_pos = 0; shim_read(f, buf, sizeof(buf)); });
+	BENCH("echo_open_write_close", 1000000, { harness_echo("/dev/microwave", (i++ & 1) ? "2" : "1"); });
+
+	page = shim_mmap(f, PAGE_SIZE, 0);
+	BENCH("page_command_doorbell", 1000000, {
+		page->cmd_seq++; page->lamp_mask = (i++ & 1) ? 0x7 : 0x0; page->cmd_seq++;
+		shim_ioctl(f, EPRO_IOC_DOORBELL, 0);
+	});
+	BENCH("page_poll_idle", 1000000, { ctrl_check(0); });
+	shim_munmap(page);
+
+	shim_close(f);
+	shim_module_exit();
+}
+
+HARNESS_MAIN("microwave", tests, benches)
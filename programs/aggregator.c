@@ -0,0 +1,433 @@
+/*
+ *	AGGREGATOR
+ *
+ *	Edge of a site: the sensors and monitors of a floor talk to the aggregator with the
+ *	controller protocol, see controller.c, and the aggregator talks to the controller, or to
+ *	a router, over one persistent connection. The controller sees one client per floor
+ *	instead of one per sensor.
+ *
+ *	TEMP and HB are answered here. Every zone keeps the newest reading of each of its sensors,
+ *	fresh for [deadline] milliseconds past the last reading or heartbeat like the controller
+ *	does, and every [flush] milliseconds the zones whose readings moved more than [deadband]
+ *	degrees since their last batch go upstream in one BATCH each, all their fresh readings
+ *	in it. A zone with nothing new is sent again every [deadline]/2 so that its sensors stay
+ *	fresh on the controller, a sensor that goes silent here drops out of the batches and goes
+ *	stale there.
+ *
+ *	The reply to a BATCH is the LOG line of the zone: it is cached, and LOG is answered from
+ *	the cache for [cache] milliseconds, else forwarded and cached again. SET, SCHED and LOAD
+ *	are forwarded and clear the cache of their zone, the other commands are forwarded as is
+ *	but SUB and HIST, which take the controller itself. The aggregator also takes:
+ *	  EDGE;<anything>[;<zone>]			"<readings>;<batches>;<forwarded>;<log hits>;<log misses>"
+ *
+ *	A router answers one request per connection: through one, every request opens its own.
+ *
+ *	  ./bin/controller -z 8 5001 &
+ *	  ./bin/aggregator -z 8 6000 127.0.0.1:5001 &
+ *	  ./bin/sensor 127.0.0.1 6000 3 1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define MAX_ZONES	64	// as the controller
+#define MAX_SENSORS	8	// per zone, as the controller
+#define REPLY		255	// every reply of the controller is a whole buffer of this size
+
+typedef struct
+{
+	float value;		// newest reading
+	float sent;		// in the last batch
+	int64_t expires;	// [milliseconds, monotonic] staleness deadline, 0 = never read
+	int heartbeat;		// [milliseconds] announced by HB
+} edge_sensor_t;
+
+typedef struct
+{
+	edge_sensor_t sensors[MAX_SENSORS];
+	int moved;		// a reading moved more than [deadband] since the last batch
+	int64_t flushed;	// [milliseconds, monotonic] last batch
+	char log[REPLY];	// the LOG line the controller last returned
+	int64_t logged;		// [milliseconds, monotonic] when, 0 = not cached
+	unsigned long readings, batches, forwarded, hits, misses;
+} edge_zone_t;
+
+edge_zone_t zone[MAX_ZONES];
+
+int   zones = 1;		// zones of the site, the controller needs at least as many
+int   deadline = 5000;		// [milliseconds] a silent sensor is stale after this
+float deadband = 0.1;		// [degrees] smaller moves wait for the next refresh
+int   flush = 250;		// [milliseconds] batch period
+int   cache = 1000;		// [milliseconds] a LOG line is answered here for this long
+
+struct sockaddr_in controller;
+int upstream = -1;		// the persistent connection, -1 = not connected
+
+pthread_mutex_t mutex_zones    = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_upstream = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_t flusher;
+
+typedef struct
+{
+	int sock;
+	struct sockaddr address;
+	int addr_len;
+} connection_t;
+
+void * requestHandler(void * ptr);
+void * flushLoop(void * ptr);
+int  zone_batch(int z, char * msg, int size, int64_t now);
+int  upstream_request(const char * msg, char * reply);
+int64_t now_ms(void);
+
+
+
+int main(int argc, char ** argv)
+{
+	int port, sock=-1, opt;
+	char host[48];
+	struct hostent * server;
+	struct sockaddr_in address;
+	connection_t * connection;
+	pthread_t thread;
+
+	// check for command line arguments
+	while ((opt = getopt(argc, argv, "z:d:b:f:c:")) != -1) {
+		switch (opt) {
+		case 'z': zones = atoi(optarg); break;
+		case 'd': deadline = atoi(optarg); break;
+		case 'b': deadband = atof(optarg); break;
+		case 'f': flush = atoi(optarg); break;
+		case 'c': cache = atoi(optarg); break;
+		default:  optind = argc + 1;
+		}
+	}
+	if (optind != argc - 2 || zones < 1 || zones > MAX_ZONES || deadline <= 0 || deadband < 0 || flush <= 0 || cache < 0) {
+		fprintf(stderr, "usage: %s [-z zones] [-d deadline_ms] [-b deadband] [-f flush_ms] [-c cache_ms] port host:port\n", argv[0]);
+		return -1;
+	}
+
+	// obtain port number
+	if (sscanf(argv[optind], "%d", &port) <= 0) {
+		fprintf(stderr, "%s: error: wrong parameter: port\n", argv[0]);
+		return -2;
+	}
+
+	// the controller, or the router of the cluster
+	if (sscanf(argv[optind + 1], "%47[^:]:%d", host, &opt) != 2 || (server = gethostbyname(host)) == NULL) {
+		fprintf(stderr, "%s: error: wrong controller: %s\n", argv[0], argv[optind + 1]);
+		return -2;
+	}
+	controller.sin_family = AF_INET;
+	memcpy(&controller.sin_addr.s_addr, server->h_addr, server->h_length);
+	controller.sin_port = htons(opt);
+
+	// create socket
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock <= 0) {
+		fprintf(stderr, "%s: error: cannot create socket\n", argv[0]);
+		return -3;
+	}
+
+	// bind socket to port
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *)&address, sizeof(struct sockaddr_in)) < 0) {
+		fprintf(stderr, "%s: error: cannot bind socket to port %d\n", argv[0], port);
+		return -4;
+	}
+
+	// listen on port
+	if (listen(sock, 128) < 0) {
+		fprintf(stderr, "%s: error: cannot listen on port\n", argv[0]);
+		return -5;
+	}
+	printf("\nAGGREGATOR is ready and listening on port %i, %d zones for %s ..\n\n", port, zones, argv[optind + 1]);
+
+	// batches go upstream from now on
+	pthread_create(&flusher,NULL,flushLoop,NULL);
+
+
+	while (1)
+	{
+		// accept incoming connections
+		connection = (connection_t *)malloc(sizeof(connection_t));
+		connection->addr_len = sizeof(connection->address);
+		connection->sock = accept(sock, &connection->address, (socklen_t*)&connection->addr_len);
+		if (connection->sock <= 0) {
+			free(connection);
+		}
+		else {
+			// start a new thread but do not wait for it
+			pthread_create(&thread, 0, requestHandler, (void *)connection);
+			pthread_detach(thread);
+		}
+	}
+
+	return 0;
+}
+
+
+
+
+
+/*
+ *	Receive a message: readings and LOG are answered here, the rest is forwarded upstream
+ */
+void * requestHandler(void * ptr)
+{
+	char buffer[255], parsed[255], reply[REPLY], * field[5], * cmd, * val, * arg1, * arg2;
+	edge_zone_t * zn;
+	edge_sensor_t * s;
+	int len, n, z, cached;
+	long id, l;
+	float value;
+	int64_t now;
+	connection_t * conn;
+	if (!ptr) pthread_exit(0);
+	conn = (connection_t *)ptr;
+
+	// read the meassage
+	len = read(conn->sock,buffer,254);
+	if (len > 0) {
+		buffer[len] = 0;
+		buffer[strcspn(buffer, "\r\n")] = 0;
+
+		// parse the command, a copy stays whole for the controller
+		memcpy(parsed, buffer, len + 1);
+		n = proto_split(parsed, ';', field, 5);
+		cmd  = field[0];
+		val  = n > 1 ? field[1] : "";
+		arg1 = n > 2 ? field[2] : "0";
+		arg2 = n > 3 ? field[3] : "0";
+		z = proto_long(strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "HB") == 0 ? arg2 : arg1, &l) ? l : -1;
+		if (!proto_long(arg1, &id)) id = -1;
+
+		memset(reply, 0, sizeof(reply));
+		now = now_ms();
+
+		if (z < 0 || z >= zones) {
+			sprintf(reply,"cannot compute, unknown zone!");
+		}
+
+		else if ((strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "HB") == 0) && (id < 0 || id >= MAX_SENSORS)) {
+			sprintf(reply,"cannot compute, unknown sensor!");
+		}
+
+		else if (strcmp(cmd, "TEMP") == 0) {
+
+			// KEEP THE NEWEST READING, THE NEXT BATCH TAKES IT
+			if (!proto_float(val, &value)) sprintf(reply,"cannot compute, not a temperature!");
+			else {
+				pthread_mutex_lock(&mutex_zones);
+				zn = &zone[z];
+				s = &zn->sensors[id];
+				if (s->expires <= now || fabsf(value - s->sent) > deadband) zn->moved = 1;
+				s->value = value;
+				if (s->expires < now + deadline + s->heartbeat) s->expires = now + deadline + s->heartbeat;
+				zn->readings++;
+				pthread_mutex_unlock(&mutex_zones);
+				sprintf(reply,"Temperature value received!");
+			}
+		}
+
+		else if (strcmp(cmd, "HB") == 0) {
+
+			// THE READING HOLDS UNTIL [deadline] PAST THE NEXT HEARTBEAT
+			if (!(proto_long(val, &l) && l >= 0 && l <= 86400)) sprintf(reply,"cannot compute, not a heartbeat!");
+			else {
+				pthread_mutex_lock(&mutex_zones);
+				s = &zone[z].sensors[id];
+				if (s->expires <= now) sprintf(reply,"cannot compute, no fresh reading!");
+				else {
+					s->heartbeat = l * 1000;
+					s->expires = now + deadline + s->heartbeat;
+					sprintf(reply,"Heartbeat received!");
+				}
+				pthread_mutex_unlock(&mutex_zones);
+			}
+		}
+
+		else if (strcmp(cmd, "LOG") == 0) {
+
+			// THE LAST LOG LINE OF THE ZONE, UNLESS IT IS TOO OLD
+			pthread_mutex_lock(&mutex_zones);
+			zn = &zone[z];
+			cached = zn->logged > 0 && now - zn->logged < cache;
+			if (cached) { memcpy(reply, zn->log, sizeof(reply)); zn->hits++; }
+			else zn->misses++;
+			pthread_mutex_unlock(&mutex_zones);
+
+			if (!cached) {
+				if (upstream_request(buffer, reply) < 0) sprintf(reply,"cannot compute, controller unavailable!");
+				else if (strncmp(reply, "cannot compute", 14) != 0) {
+					pthread_mutex_lock(&mutex_zones);
+					memcpy(zone[z].log, reply, sizeof(reply));
+					zone[z].logged = now;
+					pthread_mutex_unlock(&mutex_zones);
+				}
+			}
+		}
+
+		else if (strcmp(cmd, "EDGE") == 0) {
+
+			// WHAT THE AGGREGATOR SAVED THE CONTROLLER
+			pthread_mutex_lock(&mutex_zones);
+			zn = &zone[z];
+			sprintf(reply,"%lu;%lu;%lu;%lu;%lu", zn->readings, zn->batches, zn->forwarded, zn->hits, zn->misses);
+			pthread_mutex_unlock(&mutex_zones);
+		}
+
+		else if (strcmp(cmd, "SUB") == 0 || strcmp(cmd, "HIST") == 0) {
+			sprintf(reply,"cannot compute, ask the controller!");
+		}
+
+		else {
+
+			// FORWARD, A NEW SETPOINT CLEARS THE CACHE
+			if (upstream_request(buffer, reply) < 0) sprintf(reply,"cannot compute, controller unavailable!");
+			if (strcmp(cmd, "SET") == 0 || strcmp(cmd, "SCHED") == 0 || strcmp(cmd, "LOAD") == 0) {
+				pthread_mutex_lock(&mutex_zones);
+				zone[z].logged = 0;
+				pthread_mutex_unlock(&mutex_zones);
+			}
+		}
+
+		// send back a response
+		write(conn->sock,reply,sizeof(reply));
+	}
+
+	// close socket and clean up
+	close(conn->sock);
+	free(conn);
+	pthread_exit(0);
+}
+
+
+
+/*
+ *	Every [flush] milliseconds, a BATCH of every zone that moved or needs a refresh
+ */
+void * flushLoop(void * ptr)
+{
+	char msg[255], reply[REPLY];
+	int64_t now;
+	int z, n;
+
+	(void)ptr;
+
+	while (1) {
+		usleep(flush * 1000);
+		now = now_ms();
+
+		for (z = 0; z < zones; z++) {
+			if (!zone_batch(z, msg, sizeof(msg), now)) continue;
+			n = upstream_request(msg, reply);
+
+			pthread_mutex_lock(&mutex_zones);
+			if (n < 0) zone[z].moved = 1;	// again next time
+			else if (strncmp(reply, "cannot compute", 14) != 0) {
+				memcpy(zone[z].log, reply, sizeof(reply));
+				zone[z].logged = now;
+			}
+			pthread_mutex_unlock(&mutex_zones);
+		}
+	}
+}
+
+// the BATCH of zone [z] in [msg] if it is due, 0 when it is not
+int zone_batch(int z, char * msg, int size, int64_t now)
+{
+	edge_zone_t * zn = &zone[z];
+	edge_sensor_t * s;
+	int i, n = 0, len;
+
+	pthread_mutex_lock(&mutex_zones);
+	if (!zn->moved && now - zn->flushed < deadline / 2) {
+		pthread_mutex_unlock(&mutex_zones);
+		return 0;
+	}
+
+	len = snprintf(msg, size, "BATCH;");
+	for (i = 0; i < MAX_SENSORS; i++) {
+		s = &zn->sensors[i];
+		if (s->expires <= now) continue;
+		len += snprintf(msg + len, size - len, "%s%d:%.2f", n ? "," : "", i, s->value);
+		s->sent = s->value;
+		n++;
+	}
+	snprintf(msg + len, size - len, ";%d", z);
+
+	zn->moved = 0;
+	zn->flushed = now;
+	if (n > 0) { zn->batches++; zn->forwarded += n; }
+	pthread_mutex_unlock(&mutex_zones);
+	return n > 0;
+}
+
+
+
+/*
+ *	UPSTREAM
+ */
+
+// one request over the persistent connection, -1 when the controller does not answer in time
+int upstream_request(const char * msg, char * reply)
+{
+	struct timeval timeout = { 0, 500000 };
+	int tries, len, n;
+
+	pthread_mutex_lock(&mutex_upstream);
+	for (tries = 0; tries < 2; tries++) {
+		if (upstream < 0) {
+			// the controller keeps it open once it has seen a BATCH on it
+			upstream = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (upstream < 0) break;
+			setsockopt(upstream, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(upstream, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			if (connect(upstream, (struct sockaddr *)&controller, sizeof(controller)) < 0) {
+				close(upstream);
+				upstream = -1;
+				break;
+			}
+		}
+
+		len = 0;
+		if (send(upstream, msg, strlen(msg), MSG_NOSIGNAL) == (int)strlen(msg)) {
+			while (len < REPLY && (n = recv(upstream, reply + len, REPLY - len, 0)) > 0) len += n;
+		}
+		if (len == REPLY) {
+			pthread_mutex_unlock(&mutex_upstream);
+			return 0;
+		}
+
+		// hung up, as the controller does before the first BATCH and a router after every
+		// reply, or too slow: once more on a new one
+		close(upstream);
+		upstream = -1;
+	}
+	pthread_mutex_unlock(&mutex_upstream);
+	return -1;
+}
+
+int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,173 @@
+/*
+ *	BENCH
+ *
+ *	Microbenchmarks of the controller, built from its own source with main() renamed, one
+ *	CSV line each: program,benchmark,iterations,ns_per_op. The same binary for the host and
+ *	the board (make bench), so the two columns of numbers can be tracked side by side.
+ *	- parse_* / format_*: the request codec as requestHandler() and zone_request() use it
+ *	- request_*: a whole request, socket included, without the network
+ *	- control: one evaluation of the control law of a zone, control_box of the box, which
+ *	  also drives the actuators
+ *	- window_*: WIN over a day of samples, one zone with the SIMD and the scalar kernels,
+ *	  then all MAX_ZONES zones
+ *	- history_*: a day of compressed history, its sealing a block at a time, the decoding
+ *	  of the last HIST_SIZE records and of a range of ten minutes in its middle
+ *	- actuator_*: the write paths of the actuators, on a file standing for the control page
+ *	  of the drivers (the doorbell ioctl fails there, at the cost of the syscall) and on
+ *	  /dev/null standing for their device files
+ */
+
+#define _GNU_SOURCE
+
+#include "../harness/check.h"
+
+#define main controller_main
+#include "controller.c"
+#undef main
+
+
+// one request through requestHandler(), the owner and requestDone()
+static void request(const char * msg)
+{
+	static char reply[256];
+	connection_t * conn = pool_get();
+	int sv[2], w;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	conn->sock = sv[0];
+	if (write(sv[1], msg, strlen(msg)) < 0) return;
+	w = requestHandler(conn);
+	if (w >= 0) {
+		zone_request(conn);
+		requestDone(conn);
+	}
+	if (read(sv[1], reply, sizeof(reply)) < 0) { }
+	close(sv[1]);
+}
+
+// a page of a regular file in place of the one of a driver
+static struct epro_ctrl_page * fake_page(int * fd)
+{
+	char path[] = "/tmp/epro_benchXXXXXX";
+	void * page;
+
+	*fd = mkstemp(path);
+	if (*fd < 0) return NULL;
+	unlink(path);
+	if (ftruncate(*fd, sysconf(_SC_PAGESIZE)) < 0) return NULL;
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	return page == MAP_FAILED ? NULL : (struct epro_ctrl_page *)page;
+}
+
+int main(void)
+{
+	char buf[255], *field[5];
+	proto_out_t out;
+	zone_view_t view;
+	float f;
+	long l;
+	win_stats_t stats;
+	telemetry_t t;
+	static telemetry_t recs[HIST_SIZE];
+	unsigned k = 0;
+	int z, i;
+
+	harness_name = "controller";
+	zones = 2;
+	workers = 1;
+	for (z = 0; z < zones; z++) {
+		zone_init(&zone[z]);
+		hist_init(&history[z]);
+		worker[0].own[worker[0].nown++] = z;
+	}
+	pool_init();
+	zone[1].target = 22;
+	zone_reading(&zone[1], 0, 21);
+
+	printf("program,benchmark,iterations,ns_per_op\n");
+
+	// the codec
+	BENCH("parse_temp", 1000000, {
+		strcpy(buf, "TEMP;21.5;3;1");
+		proto_split(buf, ';', field, 5);
+		proto_long(field[3], &l);
+		proto_long(field[2], &l);
+		proto_float(field[1], &f);
+	});
+	BENCH("parse_set", 1000000, {
+		strcpy(buf, "SET;22.5;1");
+		proto_split(buf, ';', field, 5);
+		proto_long(field[2], &l);
+		proto_float(field[1], &f);
+	});
+	BENCH("format_log", 1000000, {
+		zone_snapshot(&zone[1], &view);
+		proto_begin(&out, buf, sizeof(buf));
+		proto_float_out(&out, view.target, 1);	proto_char(&out, ';');
+		proto_float_out(&out, view.current, 1);	proto_char(&out, ';');
+		proto_long_out(&out, view.lamps);	proto_char(&out, ';');
+		proto_long_out(&out, view.fan);		proto_char(&out, ';');
+		proto_long_out(&out, view.fresh);
+	});
+	BENCH("log_cached", 1000000, { log_reply(1); });
+	BENCH("format_set", 1000000, {
+		proto_begin(&out, buf, sizeof(buf));
+		proto_str(&out, "Temperature is set! I have to INCREASE the box temp of ");
+		proto_float_out(&out, 1.5f, 1);
+		proto_str(&out, " degrees");
+	});
+	BENCH("request_temp", 100000, { request("TEMP;21.3;0;1"); });
+	BENCH("request_log", 100000, { request("LOG;1;1"); });
+
+	// the control law, over temperatures that take all its branches
+	BENCH("control", 1000000, {
+		zone[1].current = 16 + (k++ % 16) * 0.5f;
+		zone[1].fresh = 1;
+		zone_control(&zone[1], 1000000 + k);
+	});
+
+	// windows over a full day of every zone
+	for (z = 0; z < MAX_ZONES; z++) {
+		win_init(&windows[z]);
+		for (i = 0; i < WIN_MINUTES * 60; i++) win_sample(&windows[z], 20 + (i % 600) / 100.0f, 22, 1);
+	}
+	BENCH("window_5min", 1000000, { win_query(&windows[1], 300, &stats); });
+	BENCH("window_24h", 100000, { win_query(&windows[1], 86400, &stats); });
+	BENCH("window_24h_scalar", 100000, { win_reduce(&windows[1], 86400, 0, &stats); });
+	BENCH("window_24h_all", 10000, { for (z = 0; z < MAX_ZONES; z++) win_query(&windows[z], 86400, &stats); });
+
+	// a day of history drifting a tenth every 20 seconds
+	memset(&t, 0, sizeof(t));
+	t.target = 220;
+	t.fresh = 3;
+	BENCH("history_add", 86400, {
+		t.time++;
+		t.current = 210 + (t.time / 20) % 20;
+		t.lamps = t.current < 220;
+		hist_add(&history[1], &t);
+	});
+	BENCH("history_last", 1000, { hist_last(&history[1], HIST_SIZE, recs); });
+	BENCH("history_range", 10000, { hist_range(&history[1], 43200, 43799, recs, HIST_SIZE); });
+
+	// the actuators, through their control pages then through their device files
+	fan_page = fake_page(&fan_fd);
+	lamp_page = fake_page(&lamp_fd);
+	if (fan_page != NULL && lamp_page != NULL) {
+		BENCH("actuator_page_steady", 1000000, { set_fan_speed(40); });
+		BENCH("actuator_page_change", 100000, { set_fan_speed(k++ & 1 ? 30 : 40); });
+		BENCH("control_box", 100000, {
+			zone[0].target = 22;
+			zone[0].current = 16 + (k++ % 16) * 0.5f;
+			zone[0].fresh = 1;
+			zone_control(&zone[0], 1000000 + k);
+		});
+	}
+	fan_page = lamp_page = NULL;
+	fan_dev = lamp_dev = "/dev/null";
+	BENCH("actuator_file", 100000, { set_fan_speed(k++ & 1 ? 30 : 40); });
+	BENCH("control_box_file", 100000, {
+		zone[0].current = 16 + (k++ % 16) * 0.5f;
+		zone_control(&zone[0], 1000000 + k);
+	});
+	return 0;
+}
@@ -1,7 +1,93 @@
 /*
  *	CONTROLLER
+ *
+ *	Protocol, one command per connection, fields separated by ';':
+ *	  SET;<temperature>[;<zone>]			target temperature of a zone
+ *	  TEMP;<temperature>[;<sensor>[;<zone>]]		reading of one of the sensors of a zone
+ *	  HB;<heartbeat s>[;<sensor>[;<zone>]]		the reading of the sensor is unchanged, see sensor.c
+ *	  BATCH;<sensor>:<temperature>,...[;<zone>]	readings of up to MAX_SENSORS sensors, the LOG line of
+ *							the zone back, see aggregator.c
+ *	  LOG;<anything>[;<zone>]			"<target>;<current>;<lamps>;<fan>;<fresh sensors>"
+ *	  DUMP;<anything>[;<zone>]			"<target>/<sensor>:<value>:<ttl ms>,..." fresh sensors only
+ *	  DUMP;sched[;<zone>]				"S/<hh:mm>=<temperature>,..." the schedule
+ *	  DUMP;model[;<zone>]				"M/<observations>:<theta>x3:<covariance>x6" the model
+ *	  LOAD;<dump>[;<zone>]				replace that part of the state of a zone with a DUMP reply
+ *	  SCHED;<hh:mm>=<temperature>,...[;<zone>]	daily setpoint schedule, empty to clear it
+ *	  MODEL;<anything>[;<zone>]			"<heat>;<cool>;<drift>;<observations>" [degrees/minute]
+ *	  SUB;<anything>[;<zone>|*]			telemetry of the zone, or of all, every second until hang up
+ *	  HIST;<records>[;<zone>]			telemetry of the last seconds of the zone, oldest first
+ *	  HIST;<from>-<to>[;<zone>]			telemetry of the zone from <from> to <to> seconds ago
+ *	  WIN;<seconds>[;<zone>]			"<samples>;<min>;<max>;<mean>;<stddev>;<seconds above
+ *							target>" of the zone over the last seconds, up to a day
+ *	  STATS;<anything>[;<zone>]			"<periods>;<misses>;<max latency us>;<histogram>;
+ *							<refused>;<shed>;<conflated>;<expired>" of the control
+ *							period and the queue of the worker that owns the zone
+ *	zone and sensor default to 0, zone 0 is the box with the actuators.
+ *	DUMP and LOAD move zones between the controllers of a cluster, see router.c, a part at a
+ *	time: a whole zone does not fit in one reply.
+ *	A connection that sent a BATCH stays open for more requests, one at a time, until the
+ *	client hangs up: an aggregator feeds a whole site of sensors through it.
+ *
+ *	Sensor fusion: every zone fuses up to MAX_SENSORS sensors into its current temperature,
+ *	the median of the fresh readings, then the mean of the readings within [outlier] degrees
+ *	of it. A sensor that is silent for [deadline] milliseconds is stale and drops out, a
+ *	per-zone timerfd fires at the earliest deadline. A zone without fresh sensors goes to
+ *	the safe actuator state until a reading arrives. Sensors that only report changes send
+ *	HB every <heartbeat> seconds instead: it keeps their last reading fresh, and their
+ *	readings stay fresh for [deadline] past the next heartbeat.
+ *
+ *	Threads: the network thread accepts and parses the requests with epoll, every zone is
+ *	owned by one worker thread pinned to a core (zone z by worker z % workers) and only that
+ *	worker touches it. SET and TEMP travel to the owner over a single-producer/single-consumer
+ *	ring and come back answered over another one, LOG is answered by the network thread from
+ *	the copy of the zone the owner publishes under a seqlock. No lock is taken on the way.
+ *	The copy carries a version that only moves when the zone does: LOG replies are rendered
+ *	once per version and zone, every poll in between is one write() of the cached bytes.
+ *	The connections come from a preallocated pool, requests are parsed in place and replies
+ *	formatted by hand (protocol.h): no heap allocation either, see harness/test_controller.c.
+ *
+ *	Overload: a connection that finds the pool empty is refused with a busy reply at once,
+ *	a request that finds the queue of its owner full is shed the same way. SET, SCHED and
+ *	LOAD may use the whole queue, the other requests leave the last RING_RESERVE slots to
+ *	them. The owner takes its queue in batches: SET, SCHED and LOAD first, then the rest but
+ *	the ones queued for more than [queue_ms], which get a busy reply too, then only the
+ *	newest TEMP of every sensor, the older ones are conflated. STATS counts all of them.
+ *
+ *	Control period: every worker runs the control law of its zones on the absolute deadlines
+ *	of a timerfd, one second apart whatever the loop takes. It records how late it wakes up,
+ *	in a histogram of LATENCY_BUCKETS powers of 2 microseconds (bucket 0 below 1, bucket i
+ *	from 2^(i-1)), and the deadline misses: periods skipped or overrun. With -r the memory is
+ *	locked and the workers run SCHED_FIFO at that priority, above the network thread, and
+ *	the actuator mutex inherits priorities.
+ *
+ *	Schedules: every zone learns how fast its lamps heat and its fan cools (model.h) from
+ *	what it observes every MODEL_WINDOW seconds. A scheduled setpoint is applied as late as
+ *	the model allows to reach it on time at full power, then the control law takes over.
+ *
+ *	State file (-p): every zone is copied to a small mmap'd file once a control period, and
+ *	at once when SET, SCHED or LOAD change what it has to do: setpoint, schedule, model,
+ *	fresh readings and actuators. A restart picks them up in a
+ *	few milliseconds, the readings still fresh for what is left of their deadline, the box
+ *	back at its previous actuator state. The self-test of the actuators only runs at a cold
+ *	start, and not even then with -f. The pages survive a crash of the controller, the
+ *	kernel writes them back to the disk by itself.
+ *
+ *	Shared memory: sensors and monitors on the same board skip the sockets (shm.h). The owner
+ *	of a zone drains the rings of readings of its sensors whenever it wakes up, at least
+ *	once a control period, zone_publish() copies the zones there for the monitors.
+ *
+ *	Telemetry: SUB and HIST replies are binary, the records of telemetry.h. Every second the
+ *	network thread samples all the zones, encodes what changed once and sends the same bytes
+ *	to every subscriber, a new one first gets a keyframe of what the others last got. A
+ *	subscriber that cannot take a whole second of records is dropped. About a day of samples
+ *	of every zone is kept for HIST, compressed (history.h), a HIST reply is HIST_SIZE of
+ *	them at most. It goes out HIST_CHUNK records at a time, the next ones are decoded when
+ *	the socket takes more. The same samples feed the sliding windows of WIN (window.h), any window
+ *	of any zone is a few microseconds of SIMD away.
  */
 
+#define _GNU_SOURCE	// accept4, pthread_setaffinity_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,49 +99,306 @@
 #include <time.h>
 #include <pthread.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "../drivers/epro_ctrl.h"
+#include "spsc.h"
+#include "protocol.h"
+#include "model.h"
+#include "telemetry.h"
+#include "history.h"
+#include "window.h"
+#include "shm.h"
 
 #define lamp_step	3	// degrees interval to fire each lamp 
 #define fan_step	0.5	// degrees interval to increase the fan speed of [fan_increment]
 #define fan_increment	10
 
-float current_temperature=0, target_temperature=0;
-int   lamps=0, fan=0;
+#define MAX_ZONES	64
+#define MAX_SENSORS	8	// per zone, fusion is O(MAX_SENSORS^2) = O(1) per reading
+#define MAX_WORKERS	64
+#define RING_SIZE	1024	// requests in flight per worker, power of 2
+#define RING_RESERVE	128	// of them for SET, SCHED and LOAD only
+#define BACKLOG		128	// connections waiting for accept()
+#define POOL_SIZE	4096	// connections open at once
+#define MAX_SCHEDULE	16	// setpoints per zone and day
+#define MODEL_WINDOW	10	// [seconds] one model observation
+#define MAX_LEAD	21600	// [seconds] a preheat never starts earlier than this
+#define HIST_SIZE	3600	// records of a HIST reply at most
+#define HIST_CHUNK	120	// records of a HIST reply decoded and sent at once
+#define PERIOD_NS	1000000000LL	// control period
+#define LATENCY_BUCKETS	20
+#define STATE_MAGIC	0x45505354	// "EPST"
+
+// fusion settings, see the options in main()
+int   zones = 1;		// zones in use
+int   deadline = 5000;		// [milliseconds] a silent sensor is stale after this
+float outlier = 3.0;		// [degrees] readings farther than this from the median are ignored
+int   safe_lamps = 0, safe_fan = 50;	// actuator state of a zone without fresh sensors
+int   workers = 0;		// worker threads, 0 = one per core but the network one
+int   rt_priority = 0;		// SCHED_FIFO priority of the workers, 0 = not real time
+int   fast_start = 0;		// no self-test of the actuators
+int   queue_ms = 250;		// [milliseconds] requests queued longer are turned away, but SET, SCHED and LOAD
+
+typedef struct
+{
+	float value;		// last reading
+	int64_t expires;	// [nanoseconds, monotonic] staleness deadline
+	int fresh;		// a reading arrived within the deadline
+	int outlier;		// left out of the last fusion
+	int heartbeat;		// [milliseconds] announced by HB, 0 = reports every reading
+} sensor_t;
+
+// what a LOG reply shows of a zone
+typedef struct
+{
+	float target, current;
+	int   lamps, fan, fresh;
+	unsigned int version;	// moves whenever the rest does
+} zone_view_t;
+
+typedef struct
+{
+	int tod;		// [seconds] time of day
+	float target;
+} setpoint_t;
+
+// owned by one worker, nobody else reads or writes it but through [view]
+typedef struct
+{
+	float target, current;	// current is the fused temperature
+	int   lamps, fan;	// outputs of the control law
+	int   fresh;		// fresh sensors, 0 = safe state
+	sensor_t sensors[MAX_SENSORS];
+	struct connection * newest[MAX_SENSORS];	// TEMP of each sensor to apply in the batch of the owner
+	int timer;		// timerfd, armed at the earliest staleness deadline
+	unsigned long readings, outliers, heartbeats;
+	int owner;		// worker
+	seqlock_t seq;		// the owner publishes [view] under it
+	zone_view_t view;
+
+	// learned model: an observation every MODEL_WINDOW seconds with fresh sensors
+	model_t model;
+	float win_start;	// temperature at the start of the window
+	int   win_secs;		// -1: the window starts at the next control period
+	int   win_lamps, win_fan;
+
+	// schedule, sorted by time of day
+	setpoint_t sched[MAX_SCHEDULE];
+	int nsched;
+	int next;		// next setpoint to apply
+	time_t next_at;		// its time
+	int boost;		// preheating at full power: 1 heating, -1 cooling
+} zone_t;
+
+zone_t zone[MAX_ZONES];
+
+// what the state file keeps of a zone, written by its owner
+typedef struct
+{
+	unsigned int seq;	// odd while the owner writes it, a crash in between leaves it odd
+	int64_t saved;		// [milliseconds, wall clock]
+	float target, current;
+	int   lamps, fan;
+	int   ttl[MAX_SENSORS];	// [milliseconds] left to the fresh readings, 0 = stale
+	float value[MAX_SENSORS];
+	setpoint_t sched[MAX_SCHEDULE];
+	int   nsched;
+	model_t model;
+} zone_saved_t;
+
+typedef struct
+{
+	unsigned int magic, size;	// another size is another layout: cold start
+	int zones;
+	zone_saved_t zone[MAX_ZONES];
+} saved_t;
+
+saved_t * saved = NULL;		// the state file, NULL without -p
+
+int   lamps=0, fan=0;	// actuators of the box (zone 0)
 FILE* file;
 
-pthread_t ctrl;
-pthread_mutex_t mutex_temperature = PTHREAD_MUTEX_INITIALIZER;
+// actuator control pages, NULL when the driver cannot be mapped (then we write the device files)
+const char *fan_dev = "/dev/eprofan", *lamp_dev = "/dev/microwave";
+struct epro_ctrl_page *fan_page = NULL, *lamp_page = NULL;
+int fan_fd = -1, lamp_fd = -1;
+
+// in-kernel thermostat (drivers/thermostat), when loaded we only relay to it
+int thermo_fd = -1;
+
+// shared memory with the local sensors and monitors, NULL when not available
+shm_region_t * shm = NULL;
+unsigned int shm_head[SHM_RINGS];	// of the rings, by the owner of the zone of the ring
+
 pthread_mutex_t mutex_actuators   = PTHREAD_MUTEX_INITIALIZER;
 
+enum { CMD_SET, CMD_TEMP, CMD_DUMP, CMD_LOAD, CMD_SCHED, CMD_MODEL, CMD_STATS, CMD_SUB, CMD_HB, CMD_BATCH, CMD_HIST };
 
-typedef struct
+// one connection, one request: the network thread hands the whole of it to the owner of the zone
+typedef struct connection
 {
 	int sock;
 	struct sockaddr address;
 	int addr_len;
+	int cmd, zone, sensor;
+	int keep;		// sent a BATCH: not closed after the reply
+	float value;
+	int64_t queued;		// [nanoseconds, monotonic] handed to the owner
+	char * val;		// into buffer: relayed to the in-kernel thermostat or loaded
+	char buffer[255];	// the request, parsed in place
+	char reply[255];
+	struct connection * next;	// free list, subscribers
+
+	// a HIST reply on its way, network thread only
+	long long hist_next;	// serial of the next record
+	long long hist_to;	// [seconds] of the last one, 0 = any
+	int hist_left, hist_sent;	// records
+	telemetry_t hist_prev;	// the last one out, the next delta applies to it
+	int out_off, out_len;	// [bytes] in reply of the record cut short by a full socket
 } connection_t;
 
-void * requestHandler(void * ptr);
-void * controller(void * ptr);
+// all the connections, taken and given back by the network thread only
+connection_t pool[POOL_SIZE];
+connection_t * pool_free = NULL;
+
+// telemetry, network thread only
+connection_t * subscribers = NULL;
+telemetry_t tele_last[MAX_ZONES];	// the last sample the subscribers got
+long tele_ticks = 0;
+hist_t history[MAX_ZONES];
+window_t windows[MAX_ZONES];
+
+// LOG replies as sent, rendered again only when the version of their zone moves; network thread only
+typedef struct
+{
+	unsigned int version;
+	int len;			// 0 = not rendered yet
+	unsigned long renders;
+	char reply[sizeof(((connection_t *)0)->reply)];
+} log_cache_t;
+
+log_cache_t log_cache[MAX_ZONES];
+
+typedef struct
+{
+	int id, cpu;
+	pthread_t thread;
+	int wake;		// eventfd, rung by the network thread after pushing requests
+	spsc_t requests;	// network thread -> worker
+	spsc_t replies;		// worker -> network thread
+	int pending;		// requests in flight, network thread only
+	int nown, own[MAX_ZONES];
+
+	// control period, see STATS
+	int64_t next;		// [nanoseconds, monotonic] deadline of the next one
+	unsigned long periods, misses;
+	long max_latency;	// [microseconds]
+	unsigned long latency[LATENCY_BUCKETS];
+
+	// overload, see STATS
+	unsigned long shed;		// turned away with the queue full, by the network thread
+	unsigned long conflated, expired;
+} worker_t;
+
+worker_t worker[MAX_WORKERS];
+int net_wake;			// eventfd, rung by the workers after pushing replies
+unsigned long refused = 0;	// connections turned away with the pool empty, by the network thread
+
+void network(int sock);
+void pool_init(void);
+connection_t * pool_get(void);
+void pool_put(connection_t * conn);
+void reply_text(connection_t * conn, const char * text);
+int  requestHandler(connection_t * conn);
+void requestDone(connection_t * conn);
+void requestSend(connection_t * conn, const char * reply);
+const char * log_reply(int z);
+int  log_line(const zone_view_t * v, char * buf, int size);
+void telemetry_tick(time_t now);
+void tele_sample(int z, time_t now, telemetry_t * t);
+int  tele_send(connection_t * conn, const unsigned char * buf, int len);
+void subscribe(connection_t * conn);
+void unsubscribe(connection_t * conn);
+int  history_reply(connection_t * conn, long records, long long from, long long to);
+int  history_send(connection_t * conn);
+void * workerLoop(void * ptr);
+void worker_period(worker_t * w, uint64_t count, int64_t now);
+int  worker_batch(worker_t * w, int64_t now);
+int  urgent(int cmd);
+void shm_drain(worker_t * w, int period);
+int64_t now_ns(void);
+void self_test(void);
+void zone_control(zone_t * zn, time_t now);
+void zone_learn(zone_t * zn);
+int  zone_lead(zone_t * zn, float target);
+time_t sched_next(zone_t * zn, time_t after, int * next);
+void zone_schedule(zone_t * zn, time_t now);
+int  zone_sched_set(zone_t * zn, char * list, time_t now);
+void zone_request(connection_t * conn);
+void zone_init(zone_t * z);
+void zone_reading(zone_t * z, int id, float value);
+void zone_temp(zone_t * zn, int sensor, float value);
+int  zone_heartbeat(zone_t * z, int id, int heartbeat);
+void zone_expire(zone_t * z);
+void zone_publish(zone_t * z);
+void zone_snapshot(zone_t * z, zone_view_t * v);
+void zone_dump(zone_t * z, const char * part, char * buf, int size);
+saved_t * state_open(const char * path, int * warm);
+void zone_save(zone_t * z);
+int  zone_restore(zone_t * z, zone_saved_t * s);
+int  zone_load(zone_t * z, char * state);
+int  model_load(model_t * m, char * state);
 void set_fan_speed(int val);
 void set_lamps(int val);
+struct epro_ctrl_page * map_actuator(const char * dev, int * fd);
+void thermo_relay(const char * key, const char * val);
 
 
 
 int main(int argc, char ** argv)
 {
-	int port, sock=-1;
+	int port, sock=-1, opt, z, w, cpus, warm = 0, restored = 0, resume = 0;
+	const char * state_path = NULL;
 	struct sockaddr_in address;
-	connection_t * connection;
-	pthread_t thread;
+	pthread_mutexattr_t pi;
+	pthread_attr_t attr;
 
 	// check for command line arguments 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s port\n", argv[0]);
+	while ((opt = getopt(argc, argv, "z:d:o:s:w:r:p:fq:")) != -1) {
+		switch (opt) {
+		case 'q': queue_ms = atoi(optarg); break;
+		case 'z': zones = atoi(optarg); break;
+		case 'p': state_path = optarg; break;
+		case 'f': fast_start = 1; break;
+		case 'r': rt_priority = atoi(optarg); break;
+		case 'w': workers = atoi(optarg); break;
+		case 'd': deadline = atoi(optarg); break;
+		case 'o': outlier = atof(optarg); break;
+		case 's': if (sscanf(optarg, "%d,%d", &safe_lamps, &safe_fan) == 2) break;
+			/* fall through */
+		default:  optind = argc + 1;
+		}
+	}
+	if (optind != argc - 1 || zones < 1 || zones > MAX_ZONES || deadline <= 0 || outlier <= 0 || queue_ms <= 0 || workers < 0 || workers > MAX_WORKERS ||
+	    rt_priority < 0 || rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+		fprintf(stderr, "usage: %s [-z zones] [-d deadline_ms] [-o outlier_degrees] [-s safe_lamps,safe_fan] [-w workers] [-r rt_priority] [-p state_file] [-f] [-q queue_ms] port\n", argv[0]);
 		return -1;
 	}
 
 	// obtain port number 
-	if (sscanf(argv[1], "%d", &port) <= 0) { 
+	if (sscanf(argv[optind], "%d", &port) <= 0) { 
 		fprintf(stderr, "%s: error: wrong parameter: port\n", argv[0]);
 		return -2;
 	}
@@ -77,33 +420,221 @@ int main(int argc, char ** argv)
 	}
 
 	// listen on port
-	if (listen(sock, 5) < 0) {
+	if (listen(sock, BACKLOG) < 0) {
 		fprintf(stderr, "%s: error: cannot listen on port\n", argv[0]);
 		return -5;
 	}
 	printf("\nCONTROLLER is ready and listening on port %i ..\n\n",port);
 
-		
-	// create the controller thread
-	pthread_create(&ctrl,NULL,controller,NULL);
+	// one worker per core, the network thread keeps the first one
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+	if (workers == 0) workers = cpus > 1 ? cpus - 1 : 1;
+	if (workers > zones) workers = zones;
+
+	// zones and their staleness deadlines, dealt round robin to the workers
+	for (z = 0; z < zones; z++) {
+		zone_init(&zone[z]);
+		win_init(&windows[z]);
+		hist_init(&history[z]);
+		zone[z].owner = z % workers;
+		worker[z % workers].own[worker[z % workers].nown++] = z;
+	}
+
+	// where the last run left off
+	if (state_path != NULL) {
+		saved = state_open(state_path, &warm);
+		if (saved == NULL) perror(state_path);
+		for (z = 0; saved != NULL && warm && z < zones && z < saved->zones; z++) {
+			if (zone_restore(&zone[z], &saved->zone[z]) < 0) continue;
+			restored++;
+			// the actuators were tested by the run that saved them
+			if (z == 0) resume = fast_start = 1;
+		}
+		if (saved != NULL) saved->zones = zones;
+		printf("State file %s: %d zones restored\n", state_path, restored);
+	}
+
+	// the local sensors and monitors
+	shm = shm_create(port, zones);
+	if (shm != NULL) printf("Local sensors and monitors: shared memory /epro-%d\n", port);
+	else perror("shared memory");
+	for (z = 0; z < zones; z++) zone_publish(&zone[z]);
+
+	// the in-kernel thermostat runs the control law of zone 0 by itself
+	thermo_fd = open("/dev/eprothermo", O_RDWR);
+	if (thermo_fd >= 0) {
+		printf("In-kernel thermostat found: relaying SET, TEMP and LOG to /dev/eprothermo\n");
+		thermo_relay(NULL, NULL);
+		zone_publish(&zone[0]);
+	}
+	else {
+		// map the actuator control pages
+		fan_page  = map_actuator(fan_dev, &fan_fd);
+		lamp_page = map_actuator(lamp_dev, &lamp_fd);
+
+		// back where we were, the next period goes on from there
+		if (resume) {
+			set_fan_speed(zone[0].fan);
+			set_lamps(zone[0].lamps);
+		}
+	}
+
+	// real time: no page faults from now on, small stacks since they are locked too
+	pthread_attr_init(&attr);
+	if (rt_priority > 0) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) perror("mlockall");
+		pthread_attr_setstacksize(&attr, 256 * 1024);
+	}
+
+	// a worker holding the actuators runs at the priority of the one waiting for them
+	pthread_mutexattr_init(&pi);
+	pthread_mutexattr_setprotocol(&pi, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&mutex_actuators, &pi);
+
+	// create the worker threads
+	pool_init();
+	net_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	for (w = 0; w < workers; w++) {
+		worker[w].id = w;
+		worker[w].cpu = (w + 1) % cpus;
+		worker[w].wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker[w].wake < 0 || spsc_init(&worker[w].requests, RING_SIZE) < 0 || spsc_init(&worker[w].replies, RING_SIZE) < 0) {
+			fprintf(stderr, "%s: error: cannot create worker %d\n", argv[0], w);
+			return -6;
+		}
+		pthread_create(&worker[w].thread, &attr, workerLoop, &worker[w]);
+	}
+	printf("%d zones on %d workers\n", zones, workers);
 	
+	network(sock);
+	return 0;
+}
+
+
+
+/*
+ *	Accept the connections and read the requests, hand SET and TEMP to the owner of the
+ *	zone and write back the replies it returns
+ */
+void network(int sock)
+{
+	struct epoll_event ev, events[64];
+	struct itimerspec second = { { 1, 0 }, { 1, 0 } };
+	connection_t * conn, busy;
+	char ring[MAX_WORKERS];
+	uint64_t count;
+	int epfd, n, i, w, tick, len, busy_len;
+
+	reply_text(&busy, "cannot compute, busy!");
+	busy_len = strlen(busy.reply) + 1;	// the message and its NUL, not the rest of the buffer
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	tick = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	timerfd_settime(tick, 0, &second, NULL);
+
+	// data.ptr: NULL for the listening socket, &net_wake for the replies, &tick for the
+	// telemetry, else the connection
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+	ev.data.ptr = &net_wake;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, net_wake, &ev);
+	ev.data.ptr = &tick;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tick, &ev);
 
 	while (1)
 	{
-		// accept incoming connections
-		connection = (connection_t *)malloc(sizeof(connection_t));
-		connection->sock = accept(sock, &connection->address, (socklen_t*)&connection->addr_len);
-		if (connection->sock <= 0) {
-			free(connection);
+		n = epoll_wait(epfd, events, 64, -1);
+		memset(ring, 0, workers);
+
+		for (i = 0; i < n; i++) {
+
+			if (events[i].data.ptr == NULL) {
+				// accept incoming connections
+				while (1) {
+					conn = pool_get();
+					if (conn == NULL) {
+						// all the connections in use: turn it away
+						conn = &busy;
+						conn->sock = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+						if (conn->sock < 0) break;
+						__atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+						write(conn->sock,conn->reply,busy_len);
+						close(conn->sock);
+						continue;
+					}
+					conn->addr_len = sizeof(conn->address);
+					conn->sock = accept4(sock, &conn->address, (socklen_t*)&conn->addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+					if (conn->sock < 0) { pool_put(conn); break; }
+					ev.data.ptr = conn;
+					epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sock, &ev);
+				}
+			}
+
+			else if (events[i].data.ptr == &net_wake) {
+				// answered requests
+				if (read(net_wake, &count, sizeof(count)) < 0) { }
+				for (w = 0; w < workers; w++) {
+					while ((conn = (connection_t *)spsc_pop(&worker[w].replies)) != NULL) {
+						worker[w].pending--;
+						requestDone(conn);
+						if (conn->keep) {
+							// back to us, for its next request
+							ev.data.ptr = conn;
+							epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sock, &ev);
+						}
+					}
+				}
+			}
+
+			else if (events[i].data.ptr == &tick) {
+				if (read(tick, &count, sizeof(count)) < 0) { }
+				telemetry_tick(time(NULL));
+			}
+
+			else if (((connection_t *)events[i].data.ptr)->cmd == CMD_SUB) {
+				// a subscriber has nothing to say, but that it hangs up
+				conn = (connection_t *)events[i].data.ptr;
+				len = read(conn->sock, conn->buffer, sizeof(conn->buffer));
+				if (len == 0 || (len < 0 && errno != EAGAIN)) unsubscribe(conn);
+			}
+
+			else if (((connection_t *)events[i].data.ptr)->cmd == CMD_HIST) {
+				// the socket takes the next records of a HIST reply
+				conn = (connection_t *)events[i].data.ptr;
+				if (!history_send(conn)) {
+					close(conn->sock);
+					pool_put(conn);
+				}
+			}
+
+			else {
+				conn = (connection_t *)events[i].data.ptr;
+				w = requestHandler(conn);
+				if (w == -2) {
+					// the rest of a HIST reply when the socket takes it
+					ev.events = EPOLLOUT;
+					ev.data.ptr = conn;
+					epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev);
+					ev.events = EPOLLIN;
+				}
+				else if (w >= 0) {
+					// from now on the connection belongs to the worker until it comes back
+					epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+					spsc_push(&worker[w].requests, conn);
+					worker[w].pending++;
+					ring[w] = 1;
+				}
+			}
 		}
-		else {
-			// start a new thread but do not wait for it 
-			pthread_create(&thread, 0, requestHandler, (void *)connection);
-			pthread_detach(thread);
+
+		// one wake up per worker and batch
+		for (w = 0; w < workers; w++) {
+			if (ring[w]) eventfd_write(worker[w].wake, 1);
 		}
 	}
-
-	return 0;
 }
 
 
@@ -111,85 +642,690 @@ int main(int argc, char ** argv)
 
 
 /*
- *	Receive and parse a message and execute the requested action
+ *	Receive and parse a message: LOG, SUB, HIST and errors are answered here, the others go
+ *	to the worker that owns the zone. Returns that worker, -1 when the connection is done
+ *	with or stays here as a subscriber, -2 when the socket did not take all of a HIST reply.
  */
-void * requestHandler(void * ptr)
+int requestHandler(connection_t * conn)
 {
-	char buffer[255], reply[255], cmd[10], val[10];
-	int len;
-	connection_t * conn;
-	if (!ptr) pthread_exit(0); 
-	conn = (connection_t *)ptr;
+	char * field[5], * range[2], * cmd, * arg1, * arg2;
+	int len, n, z, w, all;
+	long id, l, from;
+	win_stats_t stats;
+	proto_out_t out;
 
 	// read the meassage
-	len = read(conn->sock,buffer,255);
+	len = read(conn->sock,conn->buffer,sizeof(conn->buffer)-1);
+	if (len < 0 && errno == EAGAIN) return -1;
 	if (len > 0) {
-		buffer[len] = 0;
-		// printf("Received: %s\n",buffer);
+		conn->buffer[len] = 0;
+		// printf("Received: %s\n",conn->buffer);
 		
-		// parse the command
-		char *token, *string, *tofree;
-		string = strdup(buffer); tofree = string;
-		token = strsep(&string, ";"); sprintf(cmd,"%s", token);
-		token = strsep(&string, ";"); sprintf(val,"%s", token);
-		free(tofree);
+		// parse the command, in place
+		n = proto_split(conn->buffer, ';', field, 5);
+		cmd  = field[0];
+		conn->val = n > 1 ? field[1] : conn->buffer + len;
+		arg1 = n > 2 ? field[2] : "0";
+		arg2 = n > 3 ? field[3] : "0";
+
+		// the zone is the last argument: SET;val;zone, TEMP;val;sensor;zone, LOG;x;zone
+		z = proto_long(strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "HB") == 0 ? arg2 : arg1, &l) ? l : -1;
+		if (!proto_long(arg1, &id)) id = -1;
 
+		conn->zone = z;
+		conn->sensor = id;
+		all = strcmp(cmd, "SUB") == 0 && arg1[0] == '*';
 
 		// execute an action
-		sprintf(reply,"cannot compute, unknown command!");
+		reply_text(conn, "cannot compute, unknown command!");
 
-		if (strcmp(cmd, "SET") == 0) {
-		
-			// SET TARGET TEMPERATURE
-			pthread_mutex_lock(&mutex_temperature);				
-			target_temperature=atof(val);
-			float diff=target_temperature-current_temperature;
-			pthread_mutex_unlock(&mutex_temperature);
-			if (diff>0) sprintf(reply,"Temperature is set! I have to INCREASE the box temp of %.1f degrees",diff);
-			else sprintf(reply,"Temperature is set! I have to DECREASE the box temp of %.1f degrees",diff*-1);
+		if (!all && (z < 0 || z >= zones)) {
+			reply_text(conn, "cannot compute, unknown zone!");
+		}
+
+		else if ((strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "HB") == 0) && (id < 0 || id >= MAX_SENSORS)) {
+			reply_text(conn, "cannot compute, unknown sensor!");
 		}
 
-		if (strcmp(cmd, "TEMP") == 0) {
+		else if ((strcmp(cmd, "SET") == 0 || strcmp(cmd, "TEMP") == 0) && !proto_float(conn->val, &conn->value)) {
+			reply_text(conn, "cannot compute, not a temperature!");
+		}
+
+		else if (strcmp(cmd, "HB") == 0 && !(proto_long(conn->val, &l) && l >= 0 && l <= 86400)) {
+			reply_text(conn, "cannot compute, not a heartbeat!");
+		}
+
+		else if (strcmp(cmd, "SET") == 0 || strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "DUMP") == 0 || strcmp(cmd, "LOAD") == 0 ||
+			 strcmp(cmd, "SCHED") == 0 || strcmp(cmd, "MODEL") == 0 || strcmp(cmd, "STATS") == 0 || strcmp(cmd, "HB") == 0 ||
+			 strcmp(cmd, "BATCH") == 0) {
 		
-			// UPDATE CURRENT TEMPERATURE
-			pthread_mutex_lock(&mutex_temperature);	
-			current_temperature=atof(val);
-			pthread_mutex_unlock(&mutex_temperature);	
-			sprintf(reply,"Temperature value received!");
+			// the owner answers, unless it is too far behind
+			conn->cmd = strcmp(cmd, "SET") == 0 ? CMD_SET : strcmp(cmd, "TEMP") == 0 ? CMD_TEMP :
+				    strcmp(cmd, "DUMP") == 0 ? CMD_DUMP : strcmp(cmd, "LOAD") == 0 ? CMD_LOAD :
+				    strcmp(cmd, "SCHED") == 0 ? CMD_SCHED : strcmp(cmd, "MODEL") == 0 ? CMD_MODEL :
+				    strcmp(cmd, "STATS") == 0 ? CMD_STATS : strcmp(cmd, "HB") == 0 ? CMD_HB : CMD_BATCH;
+			if (conn->cmd == CMD_HB) conn->value = strtol(conn->val, NULL, 10);
+			if (conn->cmd == CMD_BATCH) conn->keep = 1;
+			w = zone[z].owner;
+			if (worker[w].pending < (urgent(conn->cmd) ? RING_SIZE : RING_SIZE - RING_RESERVE)) {
+				conn->queued = now_ns();
+				return w;
+			}
+			__atomic_fetch_add(&worker[w].shed, 1, __ATOMIC_RELAXED);
+			reply_text(conn, "cannot compute, busy!");
 		}
 
-		if (strcmp(cmd, "LOG") == 0) {
+		else if (strcmp(cmd, "LOG") == 0) {
 		
-			// GENERATE A LOG LINE
-			pthread_mutex_lock(&mutex_temperature);
-			pthread_mutex_lock(&mutex_actuators);	
-			sprintf(reply,"%.1f;%.1f;%d;%d",target_temperature,current_temperature,lamps,fan);
-			pthread_mutex_unlock(&mutex_actuators);
-			pthread_mutex_unlock(&mutex_temperature);
+			// THE LOG LINE OF THE LAST VERSION OF THE ZONE, AS IS
+			requestSend(conn, log_reply(z));
+			return -1;
+		}
+
+		else if (strcmp(cmd, "SUB") == 0) {
+			if (all) conn->zone = -1;
+			subscribe(conn);
+			return -1;
+		}
+
+		else if (strcmp(cmd, "HIST") == 0) {
+			if (proto_long(conn->val, &l) && l >= 0) return history_reply(conn, l, 0, 0);
+			if (proto_split(conn->val, '-', range, 2) == 2 && proto_long(range[0], &from) && proto_long(range[1], &l) && from >= l && l >= 0) {
+				return history_reply(conn, HIST_SIZE, time(NULL) - from, time(NULL) - l);
+			}
+			reply_text(conn, "cannot compute, not a number of records!");
+		}
+
+		else if (strcmp(cmd, "WIN") == 0) {
+
+			// STATISTICS OF THE LAST SECONDS OF THE ZONE
+			if (!(proto_long(conn->val, &l) && l > 0 && l <= WIN_MINUTES * 60)) reply_text(conn, "cannot compute, not a window!");
+			else if (!win_query(&windows[z], l, &stats)) reply_text(conn, "cannot compute, no samples!");
+			else {
+				proto_begin(&out, conn->reply, sizeof(conn->reply));
+				proto_long_out(&out, stats.samples);		proto_char(&out, ';');
+				proto_float_out(&out, stats.min, 1);		proto_char(&out, ';');
+				proto_float_out(&out, stats.max, 1);		proto_char(&out, ';');
+				proto_float_out(&out, stats.mean, 2);		proto_char(&out, ';');
+				proto_float_out(&out, stats.stddev, 2);		proto_char(&out, ';');
+				proto_long_out(&out, stats.above);
+			}
 		}
 		
-		// send back a response
-		write(conn->sock,reply,sizeof(reply));
+		requestDone(conn);
+		return -1;
 	}
 
-	// close socket and clean up 
+	// closed or broken
+	close(conn->sock);
+	pool_put(conn);
+	return -1;
+}
+
+/*
+ *	Send back the response, close socket and clean up
+ */
+void requestDone(connection_t * conn)
+{
+	requestSend(conn, conn->reply);
+}
+
+// [reply] is a whole reply buffer, sent as is with one write
+void requestSend(connection_t * conn, const char * reply)
+{
+	write(conn->sock,reply,sizeof(conn->reply));
+	if (conn->keep) return;
 	close(conn->sock);
-	free(conn);
-	pthread_exit(0);
+	pool_put(conn);
 }
 
+// "<target>;<current>;<lamps>;<fan>;<fresh sensors>" of zone [z], from the cache unless the
+// zone changed since; network thread only
+const char * log_reply(int z)
+{
+	log_cache_t * c = &log_cache[z];
+	zone_view_t view;
 
+	// an older version while the owner publishes a new one is fine, it was current a moment ago
+	if (c->len > 0 && __atomic_load_n(&zone[z].view.version, __ATOMIC_ACQUIRE) == c->version) return c->reply;
+
+	zone_snapshot(&zone[z], &view);
+	memset(c->reply, 0, sizeof(c->reply));
+	c->len = log_line(&view, c->reply, sizeof(c->reply));
+	c->version = view.version;
+	c->renders++;
+	return c->reply;
+}
+
+// the LOG line of [v] in [buf], its length
+int log_line(const zone_view_t * v, char * buf, int size)
+{
+	proto_out_t out;
+
+	proto_begin(&out, buf, size);
+	proto_float_out(&out, v->target, 1);	proto_char(&out, ';');
+	proto_float_out(&out, v->current, 1);	proto_char(&out, ';');
+	proto_long_out(&out, v->lamps);		proto_char(&out, ';');
+	proto_long_out(&out, v->fan);		proto_char(&out, ';');
+	proto_long_out(&out, v->fresh);
+	return out.len;
+}
+
+void reply_text(connection_t * conn, const char * text)
+{
+	proto_out_t out;
+
+	proto_begin(&out, conn->reply, sizeof(conn->reply));
+	proto_str(&out, text);
+}
 
 
 
 /*
- *	Adjust fan speed and lamps to match the target desired temperature
+ *	CONNECTION POOL: a free list, the network thread is the only one to use it
  */
-void * controller(void * ptr)
+
+void pool_init(void)
 {
-	int n;
+	int i;
+
+	for (i = POOL_SIZE - 1; i >= 0; i--) pool_put(&pool[i]);
+}
+
+connection_t * pool_get(void)
+{
+	connection_t * conn = pool_free;
+
+	if (conn != NULL) {
+		pool_free = conn->next;
+		conn->cmd = -1;
+		conn->keep = 0;
+	}
+	return conn;
+}
+
+void pool_put(connection_t * conn)
+{
+	conn->next = pool_free;
+	pool_free = conn;
+}
+
+
+
+/*
+ *	TELEMETRY: the network thread samples every zone once a second, encodes the changes
+ *	once for all the subscribers and keeps the samples for HIST
+ */
+
+void telemetry_tick(time_t now)
+{
+	static unsigned char buf[MAX_ZONES * TELE_MAX];
+	static int seg[MAX_ZONES + 1];	// the records of zone z are buf[seg[z]] to buf[seg[z + 1]]
+	connection_t * conn, * next;
+	telemetry_t cur;
+	int z, len = 0, key = (tele_ticks % TELE_KEYFRAME == 0);
+
+	for (z = 0; z < zones; z++) {
+		tele_sample(z, now, &cur);
+		seg[z] = len;
+		len += tele_encode(buf + len, z, key ? NULL : &tele_last[z], &cur);
+		tele_last[z] = cur;
+		hist_add(&history[z], &cur);
+		win_sample(&windows[z], cur.current / 10.0f, cur.target / 10.0f, cur.fresh > 0);
+	}
+	seg[zones] = len;
+	tele_ticks++;
+
+	for (conn = subscribers; conn != NULL; conn = next) {
+		next = conn->next;
+		z = conn->zone;
+		if (!(z < 0 ? tele_send(conn, buf, len) : tele_send(conn, buf + seg[z], seg[z + 1] - seg[z]))) unsubscribe(conn);
+	}
+}
+
+void tele_sample(int z, time_t now, telemetry_t * t)
+{
+	zone_view_t view;
+
+	zone_snapshot(&zone[z], &view);
+	t->time    = now;
+	t->target  = lroundf(view.target * 10);
+	t->current = lroundf(view.current * 10);
+	t->lamps   = view.lamps;
+	t->fan     = view.fan;
+	t->fresh   = view.fresh;
+}
+
+// 0 when the records did not all fit in the socket: the stream would be broken from there on
+int tele_send(connection_t * conn, const unsigned char * buf, int len)
+{
+	return len == 0 || send(conn->sock, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) == len;
+}
+
+void subscribe(connection_t * conn)
+{
+	static unsigned char buf[MAX_ZONES * TELE_MAX];
+	int z, len = 0;
+
+	conn->cmd = CMD_SUB;
+	conn->next = subscribers;
+	subscribers = conn;
+
+	// keyframes of the last samples, the next deltas apply to them
+	for (z = 0; tele_ticks > 0 && z < zones; z++) {
+		if (conn->zone < 0 || conn->zone == z) len += tele_encode(buf + len, z, NULL, &tele_last[z]);
+	}
+	if (!tele_send(conn, buf, len)) unsubscribe(conn);
+}
+
+void unsubscribe(connection_t * conn)
+{
+	connection_t ** link;
+
+	for (link = &subscribers; *link != NULL; link = &(*link)->next) {
+		if (*link == conn) { *link = conn->next; break; }
+	}
+	close(conn->sock);
+	pool_put(conn);
+}
+
+// the last [records], or those from [from] to [to] when [to] is not 0: as much as the socket
+// takes now, -2 when the rest has to wait for it, else -1 and the connection is done with
+int history_reply(connection_t * conn, long records, long long from, long long to)
+{
+	hist_t * h = &history[conn->zone];
+
+	conn->cmd = CMD_HIST;
+	conn->hist_left = records < HIST_SIZE ? records : HIST_SIZE;
+	if (conn->hist_left > h->records) conn->hist_left = h->records;
+	conn->hist_next = to ? hist_seek(h, from) : h->serial - conn->hist_left;
+	conn->hist_to = to;
+	conn->hist_sent = 0;
+	conn->out_len = 0;
+	if (history_send(conn)) return -2;
+	close(conn->sock);
+	pool_put(conn);
+	return -1;
+}
+
+// the next records of a HIST reply, HIST_CHUNK at a time until the socket is full; 0 when
+// they are all out or the client is gone
+int history_send(connection_t * conn)
+{
+	static unsigned char buf[HIST_CHUNK * TELE_MAX];
+	static telemetry_t recs[HIST_CHUNK];
+	static int end[HIST_CHUNK];
+	int i, n, want, len, sent;
+
+	// the rest of the record cut short
+	if (conn->out_len > 0) {
+		sent = send(conn->sock, conn->reply + conn->out_off, conn->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) return errno == EAGAIN;
+		conn->out_off += sent;
+		conn->out_len -= sent;
+		if (conn->out_len > 0) return 1;
+	}
+
+	while (conn->hist_left > 0) {
+		want = conn->hist_left < HIST_CHUNK ? conn->hist_left : HIST_CHUNK;
+		n = hist_next(&history[conn->zone], &conn->hist_next, recs, want);
+		for (i = 0; i < n && (conn->hist_to == 0 || recs[i].time <= conn->hist_to); i++) { }
+		if (i < n || n < want) conn->hist_left = n = i;		// past [to], or no more records
+		if (n == 0) break;
+
+		for (i = 0, len = 0; i < n; i++) {
+			len += tele_encode(buf + len, conn->zone, (conn->hist_sent + i) % TELE_KEYFRAME ?
+				(i > 0 ? &recs[i - 1] : &conn->hist_prev) : NULL, &recs[i]);
+			end[i] = len;
+		}
+		sent = send(conn->sock, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno != EAGAIN) return 0;
+
+		// the records out, a part of one waits in reply
+		for (i = 0; i < n && end[i] <= sent; i++) { }
+		if (i < n && sent > (i > 0 ? end[i - 1] : 0)) {
+			conn->out_off = 0;
+			conn->out_len = end[i] - sent;
+			memcpy(conn->reply, buf + sent, conn->out_len);
+			i++;
+		}
+		if (i > 0) conn->hist_prev = recs[i - 1];
+		conn->hist_next += i;
+		conn->hist_sent += i;
+		conn->hist_left -= i;
+		if (i < n || conn->out_len > 0) return 1;
+	}
+	return 0;
+}
+
+
+
+
+
+/*
+ *	Worker: owns its zones, answers their requests, runs their control law every second
+ *	and drops their stale sensors
+ */
+void * workerLoop(void * ptr)
+{
+	worker_t * w = (worker_t *)ptr;
+	struct pollfd pfd[MAX_ZONES + 2];
+	struct itimerspec its;
+	struct sched_param param;
+	cpu_set_t cpus;
+	uint64_t count;
+	int i;
+
+	// stay on our core, the zones stay in its cache
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		fprintf(stderr, "Worker %d: cannot pin to cpu %d\n", w->id, w->cpu);
+	}
+	param.sched_priority = rt_priority;
+	if (rt_priority > 0 && pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+		fprintf(stderr, "Worker %d: cannot run SCHED_FIFO at priority %d\n", w->id, rt_priority);
+	}
+
+	// the owner of the box checks the actuators first, requests queue up meanwhile
+	if (zone[0].owner == w->id && thermo_fd < 0 && !fast_start) self_test();
+
+	pfd[0].fd = w->wake;
+	// absolute deadlines: the periods do not drift with what we do in between
+	pfd[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	w->next = now_ns() + PERIOD_NS;
+	its.it_value.tv_sec = w->next / 1000000000LL;
+	its.it_value.tv_nsec = w->next % 1000000000LL;
+	its.it_interval.tv_sec = PERIOD_NS / 1000000000LL;
+	its.it_interval.tv_nsec = PERIOD_NS % 1000000000LL;
+	timerfd_settime(pfd[1].fd, TFD_TIMER_ABSTIME, &its, NULL);
+	for (i = 0; i < w->nown; i++) pfd[i + 2].fd = zone[w->own[i]].timer;
+	for (i = 0; i < w->nown + 2; i++) pfd[i].events = POLLIN;
+
+	while (1) {
+		if (poll(pfd, w->nown + 2, -1) < 0) continue;
+
+		// requests, whether or not we were rung: one wake up may cover several batches
+		if (pfd[0].revents & POLLIN) { if (read(w->wake, &count, sizeof(count)) < 0) { } }
+		if (worker_batch(w, now_ns()) > 0) eventfd_write(net_wake, 1);
+
+		// readings of the local sensors
+		if (shm != NULL) shm_drain(w, pfd[1].revents & POLLIN);
+
+		// staleness deadlines
+		for (i = 0; i < w->nown; i++) {
+			if (!(pfd[i + 2].revents & POLLIN)) continue;
+			if (read(pfd[i + 2].fd, &count, sizeof(count)) < 0) continue;
+			zone_expire(&zone[w->own[i]]);
+			zone_publish(&zone[w->own[i]]);
+		}
+
+		// control period
+		if (pfd[1].revents & POLLIN) {
+			if (read(pfd[1].fd, &count, sizeof(count)) < 0) continue;
+			worker_period(w, count, now_ns());
+			for (i = 0; i < w->nown; i++) {
+				zone_control(&zone[w->own[i]], time(NULL));
+				if (saved != NULL) zone_save(&zone[w->own[i]]);
+			}
+			if (now_ns() > w->next) w->misses++;
+		}
+	}
+}
+
+// SET, SCHED and LOAD change what a zone has to do: never expired, and room is kept for them
+int urgent(int cmd)
+{
+	return cmd == CMD_SET || cmd == CMD_SCHED || cmd == CMD_LOAD;
+}
+
+// answer the requests queued for our zones, the number answered
+int worker_batch(worker_t * w, int64_t now)
+{
+	connection_t * batch[RING_SIZE], * conn;
+	zone_t * zn;
+	int n = 0, i;
+
+	while (n < RING_SIZE && (conn = (connection_t *)spsc_pop(&w->requests)) != NULL) batch[n++] = conn;
+
+	// SET, SCHED and LOAD first
+	for (i = 0; i < n; i++) {
+		if (urgent(batch[i]->cmd)) zone_request(batch[i]);
+	}
+
+	// then the rest, unless it waited too long; the readings wait for the last pass
+	for (i = 0; i < n; i++) {
+		conn = batch[i];
+		if (urgent(conn->cmd)) continue;
+		if (now - conn->queued > (int64_t)queue_ms * 1000000LL) {
+			reply_text(conn, "cannot compute, busy!");
+			conn->cmd = -1;
+			w->expired++;
+		}
+		else if (conn->cmd == CMD_TEMP) zone[conn->zone].newest[conn->sensor] = conn;
+		else zone_request(conn);
+	}
+
+	// last value wins: the newest reading of every sensor
+	for (i = 0; i < n; i++) {
+		conn = batch[i];
+		if (conn->cmd != CMD_TEMP) continue;
+		zn = &zone[conn->zone];
+		if (zn->newest[conn->sensor] == conn) {
+			zone_request(conn);
+			zn->newest[conn->sensor] = NULL;
+		}
+		else {
+			reply_text(conn, "Temperature value received, but a newer one replaced it!");
+			w->conflated++;
+		}
+	}
+
+	for (i = 0; i < n; i++) spsc_push(&w->replies, batch[i]);
+	return n;
+}
+
+// readings of the sensors of our zones, free the rings they left once a [period]; every
+// field of the region is read once and checked, any client can write it
+void shm_drain(worker_t * w, int period)
+{
+	shm_reading_t reading;
+	shm_ring_t * q;
+	zone_t * zn;
+	int r, z, n, pid;
+
+	for (r = 0; r < SHM_RINGS; r++) {
+		q = &shm->ring[r];
+		if (!__atomic_load_n(&q->active, __ATOMIC_ACQUIRE)) continue;
+		z = __atomic_load_n(&q->zone, __ATOMIC_RELAXED);
+		if (z < 0 || z >= zones || zone[z].owner != w->id) continue;
+
+		zn = &zone[z];
+		for (n = 0; shm_recv(q, &shm_head[r], &reading); n++) {
+			if (reading.sensor >= 0 && reading.sensor < MAX_SENSORS) zone_temp(zn, reading.sensor, reading.value);
+		}
+		if (n > 0) zone_publish(zn);
+
+		// the sensor is gone and we have all it sent: the next one may take the ring
+		pid = __atomic_load_n(&q->pid, __ATOMIC_ACQUIRE);
+		if (period && (pid == -1 || shm_dead(pid))) {
+			__atomic_store_n(&q->active, 0, __ATOMIC_RELEASE);
+			__atomic_compare_exchange_n(&q->pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// [count] periods expired, the last one [now] - its deadline ago
+void worker_period(worker_t * w, uint64_t count, int64_t now)
+{
+	long late = (now - w->next - (int64_t)(count - 1) * PERIOD_NS) / 1000;
+	long us = late;
+	int b = 0;
+
+	while (us > 0 && b < LATENCY_BUCKETS - 1) { us >>= 1; b++; }
+	w->latency[b]++;
+	if (late > w->max_latency) w->max_latency = late;
+	w->periods += count;
+	w->misses += count - 1;
+	w->next += (int64_t)count * PERIOD_NS;
+}
+
+/*
+ *	Execute a request on a zone we own
+ */
+void zone_request(connection_t * conn)
+{
+	char fused[16];
+	zone_t * zn = &zone[conn->zone];
 	float diff;
-	
+	proto_out_t out;
+
+	if (conn->cmd == CMD_SET) {
+
+		// SET TARGET TEMPERATURE
+		if (thermo_fd >= 0 && conn->zone == 0) thermo_relay("setpoint", conn->val);
+		zn->target=conn->value;
+		zn->boost=0;
+		diff=zn->target-zn->current;
+		proto_begin(&out, conn->reply, sizeof(conn->reply));
+		if (diff>0) proto_str(&out, "Temperature is set! I have to INCREASE the box temp of ");
+		else proto_str(&out, "Temperature is set! I have to DECREASE the box temp of ");
+		proto_float_out(&out, diff>0 ? diff : diff*-1, 1);
+		proto_str(&out, " degrees");
+	}
+
+	else if (conn->cmd == CMD_SCHED) {
+
+		// DAILY SETPOINTS
+		if (zone_sched_set(zn, conn->val, time(NULL)) < 0) {
+			reply_text(conn, "cannot compute, bad schedule!");
+			return;
+		}
+		proto_begin(&out, conn->reply, sizeof(conn->reply));
+		proto_str(&out, "Schedule is set! ");
+		proto_long_out(&out, zn->nsched);
+		proto_str(&out, " setpoints a day");
+		if (thermo_fd >= 0 && conn->zone == 0 && zn->nsched > 0) {
+			snprintf(fused, sizeof(fused), "%.3f", zn->target);
+			thermo_relay("setpoint", fused);
+		}
+	}
+
+	else if (conn->cmd == CMD_MODEL) {
+
+		// WHAT THE ZONE LEARNED, PER MINUTE
+		proto_begin(&out, conn->reply, sizeof(conn->reply));
+		proto_float_out(&out, zn->model.theta[0] * 60, 3);	proto_char(&out, ';');
+		proto_float_out(&out, zn->model.theta[1] * 60, 3);	proto_char(&out, ';');
+		proto_float_out(&out, zn->model.theta[2] * 60, 3);	proto_char(&out, ';');
+		proto_long_out(&out, zn->model.samples);
+		return;
+	}
+
+	else if (conn->cmd == CMD_STATS) {
+
+		// HOW LATE THE CONTROL PERIODS OF THIS WORKER RUN
+		worker_t * w = &worker[zn->owner];
+		int i;
+
+		proto_begin(&out, conn->reply, sizeof(conn->reply));
+		proto_long_out(&out, w->periods);	proto_char(&out, ';');
+		proto_long_out(&out, w->misses);	proto_char(&out, ';');
+		proto_long_out(&out, w->max_latency);
+		for (i = 0; i < LATENCY_BUCKETS; i++) {
+			proto_char(&out, i ? ',' : ';');
+			proto_long_out(&out, w->latency[i]);
+		}
+
+		// AND HOW MUCH OF ITS QUEUE IT COULD NOT TAKE
+		proto_char(&out, ';');	proto_long_out(&out, __atomic_load_n(&refused, __ATOMIC_RELAXED));
+		proto_char(&out, ';');	proto_long_out(&out, __atomic_load_n(&w->shed, __ATOMIC_RELAXED));
+		proto_char(&out, ';');	proto_long_out(&out, w->conflated);
+		proto_char(&out, ';');	proto_long_out(&out, w->expired);
+		return;
+	}
+
+	else if (conn->cmd == CMD_DUMP) {
+
+		// SERIALIZE THE ZONE
+		zone_dump(zn, conn->val, conn->reply, sizeof(conn->reply));
+		return;
+	}
+
+	else if (conn->cmd == CMD_LOAD) {
+
+		// TAKE OVER A ZONE
+		if (zone_load(zn, conn->val) < 0) {
+			reply_text(conn, "cannot compute, bad zone state!");
+			return;
+		}
+		reply_text(conn, "Zone state loaded!");
+		if (thermo_fd >= 0 && conn->zone == 0) {
+			snprintf(fused, sizeof(fused), "%.3f", zn->target);
+			thermo_relay("setpoint", fused);
+			snprintf(fused, sizeof(fused), "%.3f", zn->current);
+			if (zn->fresh > 0) thermo_relay("temp", fused);
+		}
+	}
+
+	else if (conn->cmd == CMD_BATCH) {
+
+		// READINGS OF SEVERAL SENSORS, ALL OR NONE
+		char * entry[MAX_SENSORS], * colon;
+		int sensor[MAX_SENSORS], i, n;
+		float value[MAX_SENSORS];
+		long id;
+
+		n = proto_split(conn->val, ',', entry, MAX_SENSORS);
+		for (i = 0; i < n; i++) {
+			if ((colon = strchr(entry[i], ':')) == NULL) break;
+			*colon = 0;
+			if (!proto_long(entry[i], &id) || id < 0 || id >= MAX_SENSORS || !proto_float(colon + 1, &value[i])) break;
+			sensor[i] = id;
+		}
+		if (i < n) {
+			reply_text(conn, "cannot compute, bad batch!");
+			return;
+		}
+		for (i = 0; i < n; i++) zone_temp(zn, sensor[i], value[i]);
+
+		// THE ZONE AS LOG SHOWS IT, FOR THE AGGREGATOR TO ANSWER LOG WITH
+		zone_publish(zn);
+		log_line(&zn->view, conn->reply, sizeof(conn->reply));
+		return;
+	}
+
+	else if (conn->cmd == CMD_HB) {
+
+		// THE SENSOR IS ALIVE, ITS READING UNCHANGED
+		if (zone_heartbeat(zn, conn->sensor, conn->value * 1000) < 0) {
+			reply_text(conn, "cannot compute, no fresh reading!");
+			return;
+		}
+		reply_text(conn, "Heartbeat received!");
+	}
+
+	else {
+
+		// UPDATE ONE SENSOR, FUSE THE ZONE
+		zone_temp(zn, conn->sensor, conn->value);
+		if (zn->sensors[conn->sensor].outlier) reply_text(conn, "Temperature value received, but it is an outlier!");
+		else reply_text(conn, "Temperature value received!");
+	}
+
+	zone_publish(zn);
+	if (saved != NULL && urgent(conn->cmd)) zone_save(zn);
+}
+
+
+
+/*
+ *	Turn on and off the lamps, ramp the fan up and down
+ */
+void self_test(void)
+{
+	int n;
+
 	// turn on and off the lamps
 	set_lamps(0); sleep(1);
 	set_lamps(1); sleep(1);
@@ -203,53 +1339,608 @@ void * controller(void * ptr)
 	// ramp down the fan to 25
 	for (n=0; n<3; n++) { set_fan_speed(fan-20); }
 	set_fan_speed(25);
+}
+
+/*
+ *	Adjust fan speed and lamps to match the target desired temperature
+ */
+void zone_control(zone_t * zn, time_t now)
+{
+	char val[16];
+	float target = zn->target;
+	int n;
+	float diff;
+	
+	// learn from the last period, then the setpoints that are due
+	zone_learn(zn);
+	zone_schedule(zn, now);
+	
+	// zone 0 belongs to the in-kernel thermostat, when there is one: just refresh our copy
+	if (zn == &zone[0] && thermo_fd >= 0) {
+		if (zn->target != target) {
+			snprintf(val, sizeof(val), "%.3f", zn->target);
+			thermo_relay("setpoint", val);
+		}
+		thermo_relay(NULL, NULL);
+		zone_publish(zn);
+		return;
+	}
 
+	// preheating (or precooling) at full power until the setpoint
+	if (zn->boost > 0 && (zn->fresh == 0 || zn->current >= zn->target)) zn->boost = 0;
+	if (zn->boost < 0 && (zn->fresh == 0 || zn->current <= zn->target)) zn->boost = 0;
 
-	while(1){
+	// no fresh sensor: we do not know the temperature, stay safe
+	if (zn->fresh == 0) {
+		zn->lamps = safe_lamps;
+		zn->fan = safe_fan;
+	}
+
+	// delta temperature
+	diff=zn->target-zn->current;
 		
-		// delta temperature
-		pthread_mutex_lock(&mutex_temperature);	
-		diff=target_temperature-current_temperature;
-		pthread_mutex_unlock(&mutex_temperature);
+	if (zn->boost > 0) {
+		zn->lamps = 3;
+		zn->fan = 25;
+	}
+	else if (zn->boost < 0) {
+		zn->lamps = 0;
+		zn->fan = 100;
+	}
+
+	// we need to RAISE the temperature
+	else if(zn->fresh > 0 && diff>0) {
+		// slow down the fan
+		zn->fan = 25;
+
+		// turn on the lamps in a number proportional to the difference of temperature
+		n = floor(diff/lamp_step)+1;
+		if (n > 3) n = 3;
+		zn->lamps = n;
+	}
+
+	// we need to LOWER the temperature
+	else if(zn->fresh > 0 && diff<0) {
+		// turn off the lamps
+		zn->lamps = 0;
+
+		// speed up the fan to a number proportional to the difference of temperature
+		n = -(floor(diff/fan_step)+1)*fan_increment;
+		if (n > 100) { n = 100; }
+		if (n < 25)  { n = 25;  }
+		zn->fan = n;
+	}
 		
+	// zone 0 is the box with the actuators
+	if (zn == &zone[0]) {
+		set_fan_speed(zn->fan);
+		set_lamps(zn->lamps);
+	}	
+	zone_publish(zn);
+}
+
+
+
+/*
+ *	SENSOR FUSION
+ */
+
+int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void zone_init(zone_t * z)
+{
+	memset(z, 0, sizeof(*z));
+	z->lamps = safe_lamps;
+	z->fan = safe_fan;
+	z->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (z->timer < 0) perror("timerfd_create");
+	model_init(&z->model);
+	z->win_secs = -1;
+	zone_publish(z);
+}
+
+// the owner only
+void zone_publish(zone_t * z)
+{
+	shm_zone_t * v;
+
+	// a new version only when something shows
+	if (z->view.target != z->target || z->view.current != z->current || z->view.lamps != z->lamps ||
+	    z->view.fan != z->fan || z->view.fresh != z->fresh) {
+		seqlock_write_begin(&z->seq);
+		z->view.target  = z->target;
+		z->view.current = z->current;
+		z->view.lamps   = z->lamps;
+		z->view.fan     = z->fan;
+		z->view.fresh   = z->fresh;
+		__atomic_store_n(&z->view.version, z->view.version + 1, __ATOMIC_RELAXED);
+		seqlock_write_end(&z->seq);
+	}
+
+	if (shm == NULL) return;
+	v = &shm->zone[z - zone];
+	seqlock_write_begin(&v->seq);
+	v->target  = z->target;
+	v->current = z->current;
+	v->lamps   = z->lamps;
+	v->fan     = z->fan;
+	v->fresh   = z->fresh;
+	seqlock_write_end(&v->seq);
+}
+
+// any thread
+void zone_snapshot(zone_t * z, zone_view_t * v)
+{
+	unsigned int seq;
+
+	do {
+		seq = seqlock_read_begin(&z->seq);
+		*v = z->view;
+	} while (seqlock_read_retry(&z->seq, seq));
+}
+
+// median of the fresh readings, then the mean of the ones close to it; owner only
+void zone_fuse(zone_t * z)
+{
+	float v[MAX_SENSORS], median, sum = 0, x;
+	int i, j, n = 0, used = 0;
+
+	// insertion sort of at most MAX_SENSORS values
+	for (i = 0; i < MAX_SENSORS; i++) {
+		if (!z->sensors[i].fresh) continue;
+		x = z->sensors[i].value;
+		for (j = n; j > 0 && v[j-1] > x; j--) v[j] = v[j-1];
+		v[j] = x;
+		n++;
+	}
+
+	z->fresh = n;
+	if (n == 0) return;
+	median = (n & 1) ? v[n/2] : (v[n/2-1] + v[n/2]) / 2;
+
+	for (i = 0; i < MAX_SENSORS; i++) {
+		if (!z->sensors[i].fresh) continue;
+		z->sensors[i].outlier = fabsf(z->sensors[i].value - median) > outlier;
+		if (!z->sensors[i].outlier) { sum += z->sensors[i].value; used++; }
+	}
+
+	// with two sensors that disagree there is no majority, trust the median
+	z->current = used ? sum / used : median;
+}
+
+// arm the zone timer at the earliest deadline of its fresh sensors; owner only
+void zone_arm(zone_t * z)
+{
+	struct itimerspec its;
+	int64_t next = 0;
+	int i;
+
+	for (i = 0; i < MAX_SENSORS; i++) {
+		if (z->sensors[i].fresh && (next == 0 || z->sensors[i].expires < next)) next = z->sensors[i].expires;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = next / 1000000000LL;
+	its.it_value.tv_nsec = next % 1000000000LL;
+	timerfd_settime(z->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// a reading from TEMP or from the shared memory, relayed to the in-kernel thermostat; owner only
+void zone_temp(zone_t * zn, int sensor, float value)
+{
+	char fused[16];
+
+	zone_reading(zn, sensor, value);
+	if (thermo_fd >= 0 && zn == &zone[0]) {
+		snprintf(fused, sizeof(fused), "%.3f", zn->current);
+		thermo_relay("temp", fused);
+	}
+}
+
+// a new reading; owner only
+void zone_reading(zone_t * z, int id, float value)
+{
+	sensor_t * s = &z->sensors[id];
+	int was_fresh = s->fresh;
+
+	int64_t expires = now_ns() + (int64_t)(deadline + s->heartbeat) * 1000000LL;
+
+	s->value = value;
+	if (!was_fresh || expires > s->expires) s->expires = expires;	// not before a heartbeat announced it
+	s->fresh = 1;
+	z->readings++;
+
+	zone_fuse(z);
+	if (s->outlier) z->outliers++;
+
+	// deadlines only move later, so a running timer is never late: at worst it fires
+	// early and zone_expire() re-arms it. Only the first fresh sensor needs to arm it.
+	if (!was_fresh && z->fresh == 1) zone_arm(z);
+}
 
-		// we need to RAISE the temperature
-		if(diff>0) {
-			// slow down the fan
-			set_fan_speed(25);
+// a HB: the last reading still holds, fresh until [deadline] past the next heartbeat;
+// -1 when there is none to hold, the sensor has to send it again; owner only
+int zone_heartbeat(zone_t * z, int id, int heartbeat)
+{
+	sensor_t * s = &z->sensors[id];
+
+	if (!s->fresh) return -1;
+	s->heartbeat = heartbeat;
+	s->expires = now_ns() + (int64_t)(deadline + heartbeat) * 1000000LL;
+	z->heartbeats++;
+	return 0;
+}
+
+// drop the sensors past their deadline; owner only
+void zone_expire(zone_t * z)
+{
+	int64_t now = now_ns();
+	int i, before = z->fresh;
+
+	for (i = 0; i < MAX_SENSORS; i++) {
+		if (z->sensors[i].fresh && z->sensors[i].expires <= now) z->sensors[i].fresh = 0;
+	}
+	zone_fuse(z);
+	zone_arm(z);
 
-			// turn on the lamps in a number proportional to the difference of temperature
-			n = floor(diff/lamp_step)+1;
-			if (n > 3) n = 3;
-			set_lamps(n);
+	if (before > 0 && z->fresh == 0) {
+		printf("Zone %ld: all sensors stale, safe state: lamps %d, fan %d\n", (long)(z - zone), safe_lamps, safe_fan);
+	}
+}
+
+// "<target>/<sensor>:<value>:<ttl ms>,...", or the schedule or the model as [part] says,
+// what a LOAD takes back; owner only
+void zone_dump(zone_t * z, const char * part, char * buf, int size)
+{
+	int64_t now = now_ns();
+	proto_out_t out;
+	int i;
+
+	proto_begin(&out, buf, size);
+
+	// THE SCHEDULE
+	if (strncmp(part, "sched", 5) == 0) {
+		proto_str(&out, "S/");
+		for (i = 0; i < z->nsched; i++) {
+			proto_long_out(&out, z->sched[i].tod / 3600);		proto_char(&out, ':');
+			proto_long_out(&out, z->sched[i].tod / 60 % 60);	proto_char(&out, '=');
+			proto_float_out(&out, z->sched[i].target, 2);		proto_char(&out, ',');
 		}
+		return;
+	}
 
+	// THE MODEL, THE COVARIANCE IS SYMMETRIC
+	if (strncmp(part, "model", 5) == 0) {
+		snprintf(buf, size, "M/%ld:%.8g:%.8g:%.8g:%.8g:%.8g:%.8g:%.8g:%.8g:%.8g", z->model.samples,
+			z->model.theta[0], z->model.theta[1], z->model.theta[2],
+			z->model.P[0][0], z->model.P[0][1], z->model.P[0][2], z->model.P[1][1], z->model.P[1][2], z->model.P[2][2]);
+		return;
+	}
 
-		// we need to LOWER the temperature
-		if(diff<0) {
-			// turn off the lamps
-			set_lamps(0);
+	proto_float_out(&out, z->target, 3);
+	proto_char(&out, '/');
+	for (i = 0; i < MAX_SENSORS; i++) {
+		if (!z->sensors[i].fresh) continue;
+		proto_long_out(&out, i);				proto_char(&out, ':');
+		proto_float_out(&out, z->sensors[i].value, 3);		proto_char(&out, ':');
+		proto_long_out(&out, (z->sensors[i].expires - now) / 1000000LL);	proto_char(&out, ',');
+	}
+}
+
+// the model of a DUMP reply, after its "M/"; -1 if it does not parse
+int model_load(model_t * m, char * state)
+{
+	static const int at[6][2] = { {0,0}, {0,1}, {0,2}, {1,1}, {1,2}, {2,2} };
+	char * field[10], * end;
+	double v[9];
+	model_t x;
+	long samples;
+	int i;
+
+	if (proto_split(state, ':', field, 10) != 10 || !proto_long(field[0], &samples) || samples < 0) return -1;
+	for (i = 0; i < 9; i++) {
+		v[i] = strtod(field[i + 1], &end);
+		if (end == field[i + 1] || (*end != 0 && *end != '\n') || !isfinite(v[i])) return -1;
+	}
+	x.samples = samples;
+	for (i = 0; i < 3; i++) x.theta[i] = v[i];
+	for (i = 0; i < 6; i++) x.P[at[i][0]][at[i][1]] = x.P[at[i][1]][at[i][0]] = v[3 + i];
+	*m = x;
+	return 0;
+}
 
-			// speed up the fan to a number proportional to the difference of temperature
-			n = -(floor(diff/fan_step)+1)*fan_increment;
-			if (n > 100) { n = 100; }
-			if (n < 25)  { n = 25;  }
-			set_fan_speed(n);
+// replace target and sensors, the schedule or the model with a DUMP reply, in place; -1 if
+// it does not parse; owner only
+int zone_load(zone_t * z, char * state)
+{
+	sensor_t sensors[MAX_SENSORS];
+	char * part[2], * item[MAX_SENSORS + 1], * field[3];
+	int64_t now = now_ns();
+	long id, ttl;
+	float target, value;
+	int i, n;
+
+	if (proto_split(state, '/', part, 2) != 2) return -1;
+
+	// the schedule: the target stays, a SET survives until the next setpoint
+	if (strcmp(part[0], "S") == 0) {
+		target = z->target;
+		if (zone_sched_set(z, part[1], time(NULL)) < 0) return -1;
+		z->target = target;
+		return 0;
+	}
+	if (strcmp(part[0], "M") == 0) return model_load(&z->model, part[1]);
+
+	if (!proto_float(part[0], &target)) return -1;
+	memset(sensors, 0, sizeof(sensors));
+
+	n = part[1][0] ? proto_split(part[1], ',', item, MAX_SENSORS + 1) : 0;
+	for (i = 0; i < n; i++) {
+		if (item[i][0] == 0 || item[i][0] == '\n') continue;	// after the last ','
+		if (proto_split(item[i], ':', field, 3) != 3) return -1;
+		if (!proto_long(field[0], &id) || !proto_float(field[1], &value) || !proto_long(field[2], &ttl)) return -1;
+		if (id < 0 || id >= MAX_SENSORS) return -1;
+		sensors[id].value = value;
+		sensors[id].expires = now + (int64_t)(ttl > 0 ? ttl : 0) * 1000000LL;
+		sensors[id].fresh = ttl > 0;
+	}
+
+	z->target = target;
+	for (i = 0; i < MAX_SENSORS; i++) z->sensors[i] = sensors[i];
+	zone_fuse(z);
+	zone_arm(z);
+	return 0;
+}
+
+
+
+/*
+ *	STATE FILE
+ */
+
+saved_t * state_open(const char * path, int * warm)
+{
+	struct stat st;
+	saved_t * s;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return NULL;
+	*warm = fstat(fd, &st) == 0 && st.st_size == sizeof(saved_t);
+	if (ftruncate(fd, sizeof(saved_t)) < 0) { close(fd); return NULL; }
+	s = (saved_t *)mmap(NULL, sizeof(saved_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) return NULL;
+
+	if (!*warm || s->magic != STATE_MAGIC || s->size != sizeof(saved_t)) {
+		memset(s, 0, sizeof(saved_t));
+		s->magic = STATE_MAGIC;
+		s->size = sizeof(saved_t);
+		*warm = 0;
+	}
+	return s;
+}
+
+int64_t wall_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// owner only, every control period and after SET, SCHED and LOAD
+void zone_save(zone_t * z)
+{
+	zone_saved_t * s = &saved->zone[z - zone];
+	int64_t now = now_ns();
+	int i;
+
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+	s->saved   = wall_ms();
+	s->target  = z->target;
+	s->current = z->current;
+	s->lamps   = z->lamps;
+	s->fan     = z->fan;
+	for (i = 0; i < MAX_SENSORS; i++) {
+		s->ttl[i] = z->sensors[i].fresh ? (z->sensors[i].expires - now) / 1000000LL : 0;
+		s->value[i] = z->sensors[i].value;
+	}
+	memcpy(s->sched, z->sched, sizeof(s->sched));
+	s->nsched = z->nsched;
+	s->model  = z->model;
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+// before the workers start; -1 when the entry was being written at a crash
+int zone_restore(zone_t * z, zone_saved_t * s)
+{
+	int64_t now = now_ns(), age = wall_ms() - s->saved;
+	int i;
+
+	if ((s->seq & 1) || s->seq == 0 || s->nsched < 0 || s->nsched > MAX_SCHEDULE) return -1;
+
+	z->target  = s->target;
+	z->current = s->current;
+	z->lamps   = s->lamps;
+	z->fan     = s->fan;
+	for (i = 0; i < MAX_SENSORS; i++) {
+		z->sensors[i].value = s->value[i];
+		z->sensors[i].fresh = s->ttl[i] > age && age >= 0;
+		z->sensors[i].expires = now + (int64_t)(s->ttl[i] - age) * 1000000LL;
+	}
+	zone_fuse(z);
+	zone_arm(z);
+
+	// the target stays, a SET survives until the next setpoint
+	memcpy(z->sched, s->sched, sizeof(z->sched));
+	z->nsched = s->nsched;
+	if (z->nsched > 0) z->next_at = sched_next(z, time(NULL), &z->next);
+	z->model = s->model;
+	return 0;
+}
+
+
+
+/*
+ *	SCHEDULES
+ */
+
+// one observation every MODEL_WINDOW seconds: mean actuators and temperature rate over it
+void zone_learn(zone_t * zn)
+{
+	if (zn->fresh == 0) { zn->win_secs = -1; return; }
+
+	if (zn->win_secs >= 0) {
+		// the actuators held during the period that just ended
+		zn->win_lamps += zn->lamps;
+		zn->win_fan += zn->fan;
+		if (++zn->win_secs < MODEL_WINDOW) return;
+		model_update(&zn->model, (double)zn->win_lamps / zn->win_secs, zn->win_fan / 100.0 / zn->win_secs,
+			(zn->current - zn->win_start) / zn->win_secs);
+	}
+	zn->win_start = zn->current;
+	zn->win_secs = zn->win_lamps = zn->win_fan = 0;
+}
+
+// [seconds] at full power to go from the current temperature to [target], 0 if unknown
+int zone_lead(zone_t * zn, float target)
+{
+	double diff = target - zn->current, rate, lead;
+
+	if (!model_ready(&zn->model) || zn->fresh == 0 || fabs(diff) < fan_step) return 0;
+
+	// full power as the control law knows it: 3 lamps and slow fan, or fan only
+	rate = diff > 0 ? model_rate(&zn->model, 3, 0.25) : model_rate(&zn->model, 0, 1.0);
+	if (rate * diff <= 0) return 0;
+
+	// 10% and one observation of margin
+	lead = diff / rate * 1.1 + MODEL_WINDOW;
+	return lead > MAX_LEAD ? MAX_LEAD : (int)lead;
+}
+
+// next time of day of the schedule strictly after [after], its index in [next]
+time_t sched_next(zone_t * zn, time_t after, int * next)
+{
+	struct tm tm;
+	time_t midnight, t, best = 0;
+	int i, day;
+
+	localtime_r(&after, &tm);
+	midnight = after - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+	for (day = 0; day < 2 && best == 0; day++) {
+		for (i = 0; i < zn->nsched; i++) {
+			t = midnight + day * 86400 + zn->sched[i].tod;
+			if (t > after && (best == 0 || t < best)) { best = t; *next = i; }
 		}
+	}
+	return best;
+}
 
+// apply the setpoints that are due, early by the time the model needs to reach them
+void zone_schedule(zone_t * zn, time_t now)
+{
+	struct tm tm;
+	int n, lead;
 
-		sleep(1);
-	}	
+	for (n = 0; n < zn->nsched; n++) {
+		lead = zone_lead(zn, zn->sched[zn->next].target);
+		if (now + lead < zn->next_at) return;
+
+		zn->target = zn->sched[zn->next].target;
+		zn->boost = lead == 0 ? 0 : zn->target > zn->current ? 1 : -1;
+		if (zn->boost) {
+			localtime_r(&zn->next_at, &tm);
+			printf("Zone %ld: %s to %.1f, %d s ahead of %02d:%02d\n", (long)(zn - zone),
+				zn->boost > 0 ? "preheating" : "precooling", zn->target, (int)(zn->next_at - now), tm.tm_hour, tm.tm_min);
+		}
+		zn->next_at = sched_next(zn, zn->next_at, &zn->next);
+	}
+}
+
+// "hh:mm=temperature,...", parsed in place; the setpoint in effect now applies at once
+int zone_sched_set(zone_t * zn, char * list, time_t now)
+{
+	setpoint_t sched[MAX_SCHEDULE], x;
+	char * item[MAX_SCHEDULE + 1], * field[2], * hm[2];
+	long h, m;
+	int i, j, n, count = 0;
+
+	n = (list[0] && list[0] != '\n') ? proto_split(list, ',', item, MAX_SCHEDULE + 1) : 0;
+	for (i = 0; i < n; i++) {
+		if (item[i][0] == 0 || item[i][0] == '\n') continue;	// after the last ','
+		if (count == MAX_SCHEDULE) return -1;
+		if (proto_split(item[i], '=', field, 2) != 2 || proto_split(field[0], ':', hm, 2) != 2) return -1;
+		if (!proto_long(hm[0], &h) || !proto_long(hm[1], &m) || h < 0 || h > 23 || m < 0 || m > 59) return -1;
+		if (!proto_float(field[1], &x.target)) return -1;
+		x.tod = h * 3600 + m * 60;
+
+		// insertion sort by time of day
+		for (j = count; j > 0 && sched[j-1].tod > x.tod; j--) sched[j] = sched[j-1];
+		sched[j] = x;
+		count++;
+	}
+
+	for (i = 0; i < count; i++) zn->sched[i] = sched[i];
+	zn->nsched = count;
+	zn->boost = 0;
+	if (count == 0) return 0;
+
+	// in effect now: the one before the next, sorted by time of day
+	zn->next_at = sched_next(zn, now, &zn->next);
+	zn->target = zn->sched[(zn->next + count - 1) % count].target;
+	return 0;
 }
 
 
 
+/*
+ *	Map the control page of an actuator driver, see ../drivers/epro_ctrl.h
+ */
+struct epro_ctrl_page * map_actuator(const char * dev, int * fd)
+{
+	void * page;
+
+	*fd = open(dev, O_RDWR);
+	if (*fd < 0) return NULL;
+
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (page == MAP_FAILED) {
+		close(*fd); *fd = -1;
+		return NULL;
+	}
+	printf("Actuator %s: control page mapped\n", dev);
+	return (struct epro_ctrl_page *)page;
+}
+
+/*
+ *	Update the command half of a control page: odd sequence while writing, even when done.
+ *	Steady values cost nothing, changes ring the doorbell so the driver applies them at once.
+ */
+#define ctrl_command(page, fd, field, val) do {		\
+	if ((page)->field != (__u32)(val)) {			\
+		(page)->cmd_seq++; __sync_synchronize();	\
+		(page)->field = (val);				\
+		__sync_synchronize(); (page)->cmd_seq++;	\
+		ioctl((fd), EPRO_IOC_DOORBELL);			\
+	}							\
+} while (0)
+
 void set_fan_speed(int val) {
 
 	pthread_mutex_lock(&mutex_actuators);
 	fan=val;
-	file = fopen("/dev/eprofan", "w");
-	if (file != NULL) { fprintf(file, "%d", fan); fclose(file);}
+	if (fan_page != NULL) {
+		ctrl_command(fan_page, fan_fd, fan_percentage, fan);
+	}
+	else {
+		file = fopen(fan_dev, "w");
+		if (file != NULL) { fprintf(file, "%d", fan); fclose(file);}
+	}
 	pthread_mutex_unlock(&mutex_actuators);
 }
 
@@ -257,11 +1948,40 @@ void set_lamps(int val) {
 
 	pthread_mutex_lock(&mutex_actuators);
 	lamps=val;
-	file = fopen("/dev/microwave", "w");
-	if (file != NULL) { fprintf(file, "%d", lamps); fclose(file);}
+	if (lamp_page != NULL) {
+		// the first [lamps] halogens
+		ctrl_command(lamp_page, lamp_fd, lamp_mask, (1 << lamps) - 1);
+	}
+	else {
+		file = fopen(lamp_dev, "w");
+		if (file != NULL) { fprintf(file, "%d", lamps); fclose(file);}
+	}
 	pthread_mutex_unlock(&mutex_actuators);
 }
 
 
 
+/*
+ *	Relay a setting to the in-kernel thermostat and refresh our copy of its actuators,
+ *	the first line of /dev/eprothermo has the same format as our LOG reply. Target and
+ *	temperature stay ours: the module prints them with one decimal only
+ */
+void thermo_relay(const char * key, const char * val) {
 
+	char buf[256];
+	int len;
+
+	pthread_mutex_lock(&mutex_actuators);
+	if (key != NULL) {
+		len = snprintf(buf, sizeof(buf), "%s=%s", key, val);
+		if (write(thermo_fd, buf, len) < 0) perror("/dev/eprothermo");
+	}
+	len = pread(thermo_fd, buf, sizeof(buf) - 1, 0);
+	if (len > 0) {
+		buf[len] = 0;
+		sscanf(buf, "%*f;%*f;%d;%d", &lamps, &fan);
+		zone[0].lamps = lamps;
+		zone[0].fan = fan;
+	}
+	pthread_mutex_unlock(&mutex_actuators);
+}
@@ -0,0 +1,352 @@
+/*
+ *	HISTORY
+ *
+ *	Compressed history of a zone, the telemetry_t records of telemetry.h one a second. The
+ *	records gather as they are in an open block of HIST_BLOCK, which is then sealed, bit
+ *	packed, into two sections:
+ *
+ *		runs	the runs of equal (target, lamps, fan, fresh): the length of the run and
+ *			every value as the difference from the previous run, a few runs an hour
+ *		records	every record: its time as a delta of delta (Gorilla), a bit for "one
+ *			second after the previous one", and the current temperature in tenths as
+ *			the difference from the previous record, a bit when it did not move
+ *
+ *	Numbers are written with one code: '0' for 0, else '10', '110', '1110' or '1111' and the
+ *	zig-zag of the number in 2, 6, 12 or 64 bits. A steady zone costs about 3 bits a second
+ *	instead of the 32 bytes of a record. The sealed blocks of a zone share HIST_ARENA bytes,
+ *	a day of a typical zone, the oldest ones make room for the new ones; their headers
+ *	stay in an index, in time order.
+ *
+ *	Decoding streams a record at a time (hist_dec_t). hist_last() and hist_range() only
+ *	decode the blocks whose headers overlap what they are asked for. A block is
+ *	self-contained: it may as well be written to a file with its header. Every record has a
+ *	serial number, its rank since hist_init(): hist_seek() and hist_next() walk the history
+ *	a few records at a time, from where they left off.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string.h>
+
+#include "telemetry.h"
+
+#define HIST_BLOCK	120		// records per block
+#define HIST_BLOCKS	1024		// blocks per zone at most
+#define HIST_ARENA	(48 * 1024)	// [bytes] of sealed blocks per zone
+#define HIST_BLOCK_MAX	(HIST_BLOCK * 60)	// [bytes] of a block at worst: 5 + 2 numbers of 68 bits a record
+
+typedef struct
+{
+	long long first, last;	// [seconds] times of its first and last records
+	int off, len;		// [bytes] in the arena
+	int count;		// records
+	int runs;		// [bits] of the runs, the records follow
+} hist_block_t;
+
+typedef struct
+{
+	hist_block_t block[HIST_BLOCKS];	// ring, the oldest at [head]
+	int head, blocks;
+	int end;			// [bytes] where the next block goes in the arena
+	long records, bytes;		// all of them, open ones included; arena in use
+	long long serial;		// of the next record
+	telemetry_t open[HIST_BLOCK];	// not sealed yet
+	int nopen;
+	unsigned char arena[HIST_ARENA];
+} hist_t;
+
+// a bit stream, most significant bit first
+typedef struct
+{
+	unsigned char * p;
+	long bits;
+} hist_bits_t;
+
+typedef struct
+{
+	hist_bits_t runs, recs;
+	int left, run;		// records left in the block, in the run
+	int started;		// the first record is out
+	long long delta;	// [seconds] between the last two records
+	telemetry_t cur;
+} hist_dec_t;
+
+
+/*
+ *	BITS
+ */
+static inline void hist_put_bits(hist_bits_t * b, unsigned long long v, int n)
+{
+	while (n-- > 0) {
+		if ((v >> n) & 1) b->p[b->bits >> 3] |= 0x80 >> (b->bits & 7);
+		b->bits++;
+	}
+}
+
+static inline unsigned long long hist_get_bits(hist_bits_t * b, int n)
+{
+	unsigned long long v = 0;
+
+	while (n-- > 0) {
+		v = (v << 1) | ((b->p[b->bits >> 3] >> (7 - (b->bits & 7))) & 1);
+		b->bits++;
+	}
+	return v;
+}
+
+static inline void hist_put_num(hist_bits_t * b, long long v)
+{
+	static const int width[] = { 2, 6, 12, 64 };
+	unsigned long long z = ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+	int c;
+
+	if (z == 0) { hist_put_bits(b, 0, 1); return; }
+	for (c = 0; c < 3 && z >> width[c]; c++) { }
+	hist_put_bits(b, c < 3 ? (2ULL << (c + 1)) - 2 : 15, c < 3 ? c + 2 : 4);	// c + 1 ones, then a zero but for the last
+	hist_put_bits(b, z, width[c]);
+}
+
+static inline long long hist_get_num(hist_bits_t * b)
+{
+	static const int width[] = { 2, 6, 12, 64 };
+	unsigned long long z;
+	int c = 0;
+
+	if (!hist_get_bits(b, 1)) return 0;
+	while (c < 3 && hist_get_bits(b, 1)) c++;
+	z = hist_get_bits(b, width[c]);
+	return (long long)(z >> 1) ^ -(long long)(z & 1);
+}
+
+
+/*
+ *	ENCODER
+ */
+static inline void hist_init(hist_t * h)
+{
+	h->head = h->blocks = h->end = h->nopen = 0;
+	h->records = h->bytes = 0;
+	h->serial = 0;
+}
+
+// the oldest block
+static inline void hist_drop(hist_t * h)
+{
+	h->records -= h->block[h->head].count;
+	h->bytes -= h->block[h->head].len;
+	h->head = (h->head + 1) % HIST_BLOCKS;
+	h->blocks--;
+}
+
+// the open block into the arena, the oldest blocks in its way are dropped
+static inline void hist_seal(hist_t * h)
+{
+	unsigned char buf[HIST_BLOCK_MAX];
+	hist_bits_t b = { buf, 0 };
+	const telemetry_t * r = h->open, * prev;
+	telemetry_t none;
+	hist_block_t * blk;
+	long long delta = 1;
+	int i, start, off, len;
+
+	if (h->nopen == 0) return;
+	memset(buf, 0, sizeof(buf));
+
+	// the runs
+	memset(&none, 0, sizeof(none));
+	prev = &none;
+	for (start = 0, i = 1; i <= h->nopen; i++) {
+		if (i < h->nopen && r[i].target == r[start].target && r[i].lamps == r[start].lamps &&
+		    r[i].fan == r[start].fan && r[i].fresh == r[start].fresh) continue;
+		hist_put_num(&b, i - start - 1);
+		hist_put_num(&b, r[start].target - prev->target);
+		hist_put_num(&b, r[start].lamps - prev->lamps);
+		hist_put_num(&b, r[start].fan - prev->fan);
+		hist_put_num(&b, r[start].fresh - prev->fresh);
+		prev = &r[start];
+		start = i;
+	}
+	start = b.bits;
+
+	// the records, the time of the first one is in the header
+	hist_put_num(&b, r[0].current);
+	for (i = 1; i < h->nopen; i++) {
+		hist_put_num(&b, (r[i].time - r[i-1].time) - delta);
+		delta = r[i].time - r[i-1].time;
+		hist_put_num(&b, r[i].current - r[i-1].current);
+	}
+	len = (b.bits + 7) / 8;
+
+	// after the last block, else back at the start of the arena: the blocks past the last
+	// one are the oldest, they go first
+	off = h->end;
+	if (off + len > HIST_ARENA) {
+		while (h->blocks > 0 && h->block[h->head].off >= h->end) hist_drop(h);
+		off = 0;
+	}
+	while (h->blocks > 0) {
+		blk = &h->block[h->head];
+		if (h->blocks < HIST_BLOCKS && (blk->off >= off + len || blk->off + blk->len <= off)) break;
+		hist_drop(h);
+	}
+
+	memcpy(h->arena + off, buf, len);
+	blk = &h->block[(h->head + h->blocks) % HIST_BLOCKS];
+	blk->first = r[0].time;
+	blk->last = r[h->nopen - 1].time;
+	blk->off = off;
+	blk->len = len;
+	blk->count = h->nopen;
+	blk->runs = start;
+	h->blocks++;
+	h->bytes += len;
+	h->end = off + len;
+	h->nopen = 0;
+}
+
+static inline void hist_add(hist_t * h, const telemetry_t * t)
+{
+	h->open[h->nopen++] = *t;
+	h->records++;
+	h->serial++;
+	if (h->nopen == HIST_BLOCK) hist_seal(h);
+}
+
+
+/*
+ *	DECODER
+ */
+static inline void hist_dec_init(hist_dec_t * d, const hist_t * h, const hist_block_t * blk)
+{
+	d->runs.p = d->recs.p = (unsigned char *)h->arena + blk->off;
+	d->runs.bits = 0;
+	d->recs.bits = blk->runs;
+	d->left = blk->count;
+	d->run = 0;
+	d->started = 0;
+	d->delta = 1;
+	memset(&d->cur, 0, sizeof(d->cur));
+	d->cur.time = blk->first;
+}
+
+// the next record of the block, 0 when there is none
+static inline int hist_dec_next(hist_dec_t * d, telemetry_t * t)
+{
+	if (d->left == 0) return 0;
+	if (d->run == 0) {
+		d->run = hist_get_num(&d->runs) + 1;
+		d->cur.target += hist_get_num(&d->runs);
+		d->cur.lamps  += hist_get_num(&d->runs);
+		d->cur.fan    += hist_get_num(&d->runs);
+		d->cur.fresh  += hist_get_num(&d->runs);
+	}
+	if (!d->started) d->started = 1;
+	else {
+		d->delta += hist_get_num(&d->recs);
+		d->cur.time += d->delta;
+	}
+	d->cur.current += hist_get_num(&d->recs);
+	d->run--;
+	d->left--;
+	*t = d->cur;
+	return 1;
+}
+
+// the last [n] records at most in [out], oldest first; their number
+static inline int hist_last(const hist_t * h, int n, telemetry_t * out)
+{
+	hist_dec_t d;
+	telemetry_t t;
+	int k, i, skip, total = h->nopen, m = 0;
+
+	// back from the newest block until there are enough
+	for (k = h->blocks; k > 0 && total < n; k--) total += h->block[(h->head + k - 1) % HIST_BLOCKS].count;
+	skip = total > n ? total - n : 0;
+
+	for (i = k; i < h->blocks; i++) {
+		hist_dec_init(&d, h, &h->block[(h->head + i) % HIST_BLOCKS]);
+		while (hist_dec_next(&d, &t)) {
+			if (skip > 0) skip--;
+			else out[m++] = t;
+		}
+	}
+	for (i = 0; i < h->nopen; i++) {
+		if (skip > 0) skip--;
+		else out[m++] = h->open[i];
+	}
+	return m;
+}
+
+// the records from [from] to [to] seconds in [out], [max] at most, oldest first; their number
+static inline int hist_range(const hist_t * h, long long from, long long to, telemetry_t * out, int max)
+{
+	const hist_block_t * blk;
+	hist_dec_t d;
+	telemetry_t t;
+	int i, m = 0;
+
+	for (i = 0; i < h->blocks && m < max; i++) {
+		blk = &h->block[(h->head + i) % HIST_BLOCKS];
+		if (blk->last < from || blk->first > to) continue;
+		hist_dec_init(&d, h, blk);
+		while (m < max && hist_dec_next(&d, &t)) {
+			if (t.time >= from && t.time <= to) out[m++] = t;
+		}
+	}
+	for (i = 0; i < h->nopen && m < max; i++) {
+		if (h->open[i].time >= from && h->open[i].time <= to) out[m++] = h->open[i];
+	}
+	return m;
+}
+
+// the serial of the first record at [from] seconds or later, of the next record when there is none
+static inline long long hist_seek(const hist_t * h, long long from)
+{
+	const hist_block_t * blk;
+	hist_dec_t d;
+	telemetry_t t;
+	long long s = h->serial - h->records;
+	int i;
+
+	for (i = 0; i < h->blocks; i++) {
+		blk = &h->block[(h->head + i) % HIST_BLOCKS];
+		if (blk->last < from) { s += blk->count; continue; }
+		hist_dec_init(&d, h, blk);
+		while (hist_dec_next(&d, &t)) {
+			if (t.time >= from) return s;
+			s++;
+		}
+	}
+	for (i = 0; i < h->nopen; i++, s++) {
+		if (h->open[i].time >= from) return s;
+	}
+	return s;
+}
+
+// the records from serial [*serial] on in [out], [max] at most, oldest first; their number.
+// [*serial] moves up to the oldest record there is when the ones it was at are gone.
+static inline int hist_next(const hist_t * h, long long * serial, telemetry_t * out, int max)
+{
+	const hist_block_t * blk;
+	hist_dec_t d;
+	telemetry_t t;
+	long long s = h->serial - h->records;
+	int i, m = 0;
+
+	if (*serial < s) *serial = s;
+	for (i = 0; i < h->blocks && m < max; i++) {
+		blk = &h->block[(h->head + i) % HIST_BLOCKS];
+		if (s + blk->count <= *serial) { s += blk->count; continue; }
+		hist_dec_init(&d, h, blk);
+		while (m < max && hist_dec_next(&d, &t)) {
+			if (s++ >= *serial) out[m++] = t;
+		}
+	}
+	for (i = 0; i < h->nopen && m < max; i++, s++) {
+		if (s >= *serial) out[m++] = h->open[i];
+	}
+	return m;
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ *	MODEL
+ *
+ *	Thermal model of a zone, fitted online by recursive least squares:
+ *
+ *		dT/dt = heat * lamps + cool * fan + drift		[degrees per second]
+ *
+ *	with fan the duty cycle 0..1. heat should come out positive and cool negative, drift
+ *	sums up whatever the box does by itself. Old observations fade with the forgetting
+ *	factor, so the model follows a box that changes (door open, lamp gone).
+ */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#define MODEL_FORGET	0.995	// forgetting factor, about 200 observations of memory
+#define MODEL_READY	6	// observations before the model is trusted
+
+typedef struct
+{
+	double theta[3];	// heat, cool, drift
+	double P[3][3];		// covariance
+	long samples;
+} model_t;
+
+static inline void model_init(model_t * m)
+{
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		m->theta[i] = 0;
+		for (j = 0; j < 3; j++) m->P[i][j] = (i == j) ? 1000.0 : 0.0;
+	}
+	m->samples = 0;
+}
+
+// predicted [degrees per second] with [lamps] on and the fan at [fan] (0..1)
+static inline double model_rate(const model_t * m, double lamps, double fan)
+{
+	return m->theta[0] * lamps + m->theta[1] * fan + m->theta[2];
+}
+
+// one observation: the mean actuators over an interval and the temperature rate over it
+static inline void model_update(model_t * m, double lamps, double fan, double rate)
+{
+	double x[3] = { lamps, fan, 1.0 }, Px[3], K[3], denom = MODEL_FORGET, err;
+	int i, j;
+
+	for (i = 0; i < 3; i++) Px[i] = m->P[i][0] * x[0] + m->P[i][1] * x[1] + m->P[i][2] * x[2];
+	for (i = 0; i < 3; i++) denom += x[i] * Px[i];
+	for (i = 0; i < 3; i++) K[i] = Px[i] / denom;
+
+	err = rate - model_rate(m, lamps, fan);
+	for (i = 0; i < 3; i++) m->theta[i] += K[i] * err;
+
+	// P = (P - K x'P) / forget, P stays symmetric so x'P = Px'. Forgetting only while P is
+	// small: what the data does not excite (a fan that never moves) would grow without end.
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) m->P[i][j] -= K[i] * Px[j];
+	}
+	if (m->P[0][0] + m->P[1][1] + m->P[2][2] < 1000.0) {
+		for (i = 0; i < 3; i++) {
+			for (j = 0; j < 3; j++) m->P[i][j] /= MODEL_FORGET;
+		}
+	}
+	m->samples++;
+}
+
+static inline int model_ready(const model_t * m)
+{
+	return m->samples >= MODEL_READY;
+}
+
+#endif
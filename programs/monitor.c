@@ -1,7 +1,14 @@
 /*
  *	MONITOR
  *
- *	Ask the controller for the status of all the variables and display them
+ *	Ask the controller for the status of all the variables and display them, or with -s
+ *	subscribe to its telemetry (telemetry.h) and display what it sends every second. A
+ *	controller on this board is read straight from its shared memory (shm.h).
+ *
+ *	With -f, a fleet of controllers "ip:port[/zone]": every second all of them are asked at
+ *	once over non-blocking sockets, each one gets [timeout] milliseconds to connect and
+ *	answer, then a table of the replies is shown (-c: CSV lines). A controller that is
+ *	down or slow costs the others nothing, the refresh does not depend on the fleet size.
  */
 
 #include <stdio.h>
@@ -11,9 +18,44 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "telemetry.h"
+#include "shm.h"
+
+#define MAX_ZONES	64
+#define MAX_ENDPOINTS	1000	// below the limit of open files
+
+// one controller of the fleet and its last reply
+typedef struct
+{
+	char name[64];
+	struct sockaddr_in addr;
+	int zone;
+	int sock, state;
+	char reply[256];
+	int len;
+	long long took;		// [milliseconds]
+	char status[32];
+	float target, current;
+	int lamps, fan, fresh;
+} endpoint_t;
+
+enum { E_CONNECT, E_REPLY, E_DONE };
+
+endpoint_t endpoint[MAX_ENDPOINTS];
 
 float t=0;
 void  read_temperature();
+void  stream(int sockfd);
+int   fleet(int argc, char *argv[]);
+void  fleet_query(endpoint_t *e, int n, int timeout);
+void  fleet_done(endpoint_t *e, const char *status, long long took);
+void  fleet_show(endpoint_t *e, int n, int csv, long long took);
+long long now_ms(void);
 
 
 int main(int argc, char *argv[])
@@ -22,14 +64,31 @@ int main(int argc, char *argv[])
 	struct sockaddr_in serv_addr;
 	char msg[512], buf[512];
 	float target_t, current_t;
-	int   lamps, fan;
+	int   lamps, fan, fresh, subscribe = 0, zone;
+	shm_region_t *shm;
+	shm_zone_t view;
 
-	if(argc != 3) {
-		printf("\n Usage: %s <server ip> <server port>\n",argv[0]);
+	if (argc > 1 && strcmp(argv[1], "-f") == 0) return fleet(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) { subscribe = 1; argc--; argv++; }
+	if(argc < 3 || argc > 4) {
+		printf("\n Usage: %s [-s] <server ip> <server port> [zone|*]\n",argv[0]);
+		printf("        %s -f [-c] [-t timeout_ms] <server ip>:<server port>[/zone] ...\n",argv[0]);
 		return 1;
 	}
 
 
+	// a controller on this board: read its zones from the shared memory while it lives
+	zone = argc > 3 ? atoi(argv[3]) : 0;
+	if (!subscribe && (shm = shm_attach(argv[1], atoi(argv[2]))) != NULL && zone >= 0 && zone < shm->zones) {
+		printf("\n Controller is local: reading the shared memory\n");
+		while (!shm_dead(shm->pid)) {
+			shm_read_zone(shm, zone, &view);
+			printf("   shared memory: TARGET_TEMP:[%.1f], CURRENT_TEMP:[%.1f], LAMPS_ON[%d], FAN[%d%%], SENSORS[%d]\n",view.target,view.current,view.lamps,view.fan,view.fresh);
+			sleep(1);
+		}
+		shm_detach(shm);
+	}
+
 	// Message sending loop
 	while(1)
 	{
@@ -56,7 +115,7 @@ int main(int argc, char *argv[])
 
 		// create log request
 		printf("\n > Asking the controller for data..\n");
-		sprintf(msg,"LOG;1");
+		sprintf(msg,"%s;1;%s", subscribe ? "SUB" : "LOG", argc > 3 ? argv[3] : "0");
 
 		// Send value to controller
 		if( send(sockfd , msg , strlen(msg) , 0) < 0) {
@@ -64,11 +123,14 @@ int main(int argc, char *argv[])
 		    return 1;
 		}
 
+		// until the controller goes away
+		if (subscribe) { stream(sockfd); close(sockfd); sleep(5); continue; }
+
 		// parse response
 		n = read(sockfd,buf,512);
 		if (n < 0) { perror("ERROR reading response"); exit(1); }
-		sscanf(buf,"%f;%f;%d;%d",&target_t,&current_t,&lamps,&fan);
-		printf("   server reply: TARGET_TEMP:[%.1f], CURRENT_TEMP:[%.1f], LAMPS_ON[%d], FAN[%d%%]\n",target_t,current_t,lamps,fan);
+		sscanf(buf,"%f;%f;%d;%d;%d",&target_t,&current_t,&lamps,&fan,&fresh);
+		printf("   server reply: TARGET_TEMP:[%.1f], CURRENT_TEMP:[%.1f], LAMPS_ON[%d], FAN[%d%%], SENSORS[%d]\n",target_t,current_t,lamps,fan,fresh);
 
 		// close
 		close(sockfd);
@@ -80,5 +142,207 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
+/*
+ *	Decode the telemetry records as they arrive, a record may be split between two reads
+ */
+void stream(int sockfd)
+{
+	static tele_state_t state[MAX_ZONES];
+	unsigned char buf[4096];
+	telemetry_t * r;
+	int len = 0, n, used, zone;
+
+	memset(state, 0, sizeof(state));
+	while ((n = read(sockfd, buf + len, sizeof(buf) - len)) > 0) {
+		len += n;
+		for (used = 0; (n = tele_decode(buf + used, len - used, state, MAX_ZONES, &zone)) > 0; used += n) {
+			if (zone < 0) continue;
+			r = &state[zone].last;
+			printf("   zone %d at %lld: TARGET_TEMP:[%.1f], CURRENT_TEMP:[%.1f], LAMPS_ON[%d], FAN[%d%%], SENSORS[%d]\n",
+				zone, r->time, r->target / 10.0, r->current / 10.0, r->lamps, r->fan, r->fresh);
+		}
+		if (n < 0) { printf("\n Error : not a telemetry stream \n"); return; }
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+}
 
 	
+
+
+
+/*
+ *	FLEET
+ */
+int fleet(int argc, char *argv[])
+{
+	int n = 0, csv = 0, timeout = 500, opt, port;
+	char ip[16];
+	long long start, took;
+	endpoint_t *e;
+
+	while ((opt = getopt(argc, argv, "ct:")) != -1) {
+		switch (opt) {
+		case 'c': csv = 1; break;
+		case 't': timeout = atoi(optarg); break;
+		default:  return 1;
+		}
+	}
+	if (optind >= argc || argc - optind > MAX_ENDPOINTS || timeout <= 0 || timeout >= 1000) {
+		printf("\n Usage: monitor -f [-c] [-t timeout_ms (< 1000)] <server ip>:<server port>[/zone] ...\n");
+		return 1;
+	}
+
+	for (; optind < argc; optind++, n++) {
+		e = &endpoint[n];
+		e->zone = 0;
+		if (sscanf(argv[optind], "%15[^:]:%d/%d", ip, &port, &e->zone) < 2) {
+			printf("\n Error : %s is not <ip>:<port>[/zone]\n", argv[optind]);
+			return 1;
+		}
+		memset(&e->addr, 0, sizeof(e->addr));
+		e->addr.sin_family = AF_INET;
+		e->addr.sin_port = htons(port);
+		if (inet_pton(AF_INET, ip, &e->addr.sin_addr) <= 0) {
+			printf("\n inet_pton error occured for %s\n", ip);
+			return 1;
+		}
+		snprintf(e->name, sizeof(e->name), "%s:%d/%d", ip, port, e->zone);
+	}
+
+	if (csv) printf("time,endpoint,zone,target,current,lamps,fan,sensors,status,ms\n");
+	while (1) {
+		start = now_ms();
+		fleet_query(endpoint, n, timeout);
+		took = now_ms() - start;
+		fleet_show(endpoint, n, csv, took);
+
+		// the next round a second after this one started
+		if (took < 1000) usleep((1000 - took) * 1000);
+	}
+	return 0;
+}
+
+/*
+ *	Ask all the endpoints at once, wait for the replies until the timeout
+ */
+void fleet_query(endpoint_t *e, int n, int timeout)
+{
+	static struct pollfd fds[MAX_ENDPOINTS];
+	static int of[MAX_ENDPOINTS];
+	long long now, start, deadline;
+	char msg[32];
+	int i, k, r, err;
+	socklen_t len;
+
+	now = start = now_ms();
+	deadline = start + timeout;
+	for (i = 0; i < n; i++) {
+		e[i].state = E_CONNECT;
+		e[i].len = 0;
+		e[i].sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (e[i].sock < 0) { fleet_done(&e[i], "no socket", 0); continue; }
+		fcntl(e[i].sock, F_SETFL, fcntl(e[i].sock, F_GETFL) | O_NONBLOCK);
+		if (connect(e[i].sock, (struct sockaddr *)&e[i].addr, sizeof(e[i].addr)) < 0 && errno != EINPROGRESS) {
+			fleet_done(&e[i], "down", now - start);
+		}
+	}
+
+	while ((now = now_ms()) < deadline) {
+		// what every endpoint waits for
+		for (k = 0, i = 0; i < n; i++) {
+			if (e[i].state == E_DONE) continue;
+			fds[k].fd = e[i].sock;
+			fds[k].events = e[i].state == E_CONNECT ? POLLOUT : POLLIN;
+			of[k++] = i;
+		}
+		if (k == 0) break;
+		if (poll(fds, k, deadline - now) <= 0) continue;
+
+		now = now_ms();
+		for (r = 0; r < k; r++) {
+			if (fds[r].revents == 0) continue;
+			i = of[r];
+			if (e[i].state == E_CONNECT) {
+				// connected, or not
+				len = sizeof(err);
+				if (getsockopt(e[i].sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) { fleet_done(&e[i], "down", now - start); continue; }
+				snprintf(msg, sizeof(msg), "LOG;1;%d", e[i].zone);
+				if (send(e[i].sock, msg, strlen(msg), MSG_NOSIGNAL) < 0) { fleet_done(&e[i], "down", now - start); continue; }
+				e[i].state = E_REPLY;
+			}
+			else {
+				// the reply ends when the controller closes
+				err = read(e[i].sock, e[i].reply + e[i].len, sizeof(e[i].reply) - 1 - e[i].len);
+				if (err > 0) e[i].len += err;
+				if (err == 0 || e[i].len == sizeof(e[i].reply) - 1) fleet_done(&e[i], NULL, now - start);
+				else if (err < 0 && errno != EAGAIN) fleet_done(&e[i], "broken", now - start);
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (e[i].state != E_DONE) fleet_done(&e[i], "timeout", now - start);
+	}
+}
+
+// close the endpoint, parse its reply when [status] is NULL
+void fleet_done(endpoint_t *e, const char *status, long long took)
+{
+	if (e->sock >= 0) close(e->sock);
+	e->sock = -1;
+	e->state = E_DONE;
+	e->took = took;
+
+	if (status == NULL) {
+		e->reply[e->len] = 0;
+		if (strncmp(e->reply, "cannot compute, ", 16) == 0) status = e->reply + 16;
+		else if (sscanf(e->reply, "%f;%f;%d;%d;%d", &e->target, &e->current, &e->lamps, &e->fan, &e->fresh) == 5) status = "ok";
+		else status = "bad reply";
+	}
+	snprintf(e->status, sizeof(e->status), "%s", status);
+}
+
+void fleet_show(endpoint_t *e, int n, int csv, long long took)
+{
+	int i, ok = 0, safe = 0, live = 0;
+	float sum = 0;
+	time_t now = time(NULL);
+
+	if (!csv) {
+		printf("\n%-28s %7s %8s %6s %4s %8s %5s  %s\n", "CONTROLLER", "TARGET", "CURRENT", "LAMPS", "FAN", "SENSORS", "MS", "STATUS");
+	}
+	for (i = 0; i < n; i++, e++) {
+		if (csv) {
+			if (strcmp(e->status, "ok") == 0) {
+				printf("%ld,%s,%d,%.1f,%.1f,%d,%d,%d,ok,%lld\n", (long)now, e->name, e->zone, e->target, e->current, e->lamps, e->fan, e->fresh, e->took);
+			}
+			else printf("%ld,%s,%d,,,,,,%s,%lld\n", (long)now, e->name, e->zone, e->status, e->took);
+		}
+		else if (strcmp(e->status, "ok") == 0) {
+			printf("%-28s %7.1f %8.1f %6d %3d%% %8d %5lld  ok\n", e->name, e->target, e->current, e->lamps, e->fan, e->fresh, e->took);
+		}
+		else printf("%-28s %7s %8s %6s %4s %8s %5lld  %s\n", e->name, "-", "-", "-", "-", "-", e->took, e->status);
+
+		if (strcmp(e->status, "ok") == 0) {
+			ok++;
+			if (e->fresh == 0) safe++;
+			else { sum += e->current; live++; }
+		}
+	}
+	if (!csv) {
+		printf("%d of %d answering in %lld ms", ok, n, took);
+		if (live > 0) printf(", mean temperature %.1f", sum / live);
+		if (safe > 0) printf(", %d in the safe state", safe);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
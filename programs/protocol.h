@@ -0,0 +1,129 @@
+/*
+ *	PROTOCOL
+ *
+ *	Parsing and formatting of the ';' separated messages without copies or allocations:
+ *	- proto_split() cuts a received buffer in place, the fields point into it
+ *	- proto_float() / proto_long() read "[-]digits[.digits]", and only that
+ *	- proto_out_t appends strings and numbers to a fixed buffer, always NUL terminated,
+ *	  silently truncated at its end
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// split [buf] in place at [sep], at most [max] fields, the last one keeps the rest; their number
+static inline int proto_split(char * buf, char sep, char ** field, int max)
+{
+	int n = 0;
+
+	field[n++] = buf;
+	for (; *buf && n < max; buf++) {
+		if (*buf == sep) { *buf = 0; field[n++] = buf + 1; }
+	}
+	return n;
+}
+
+// 1 if [s] is a whole decimal number
+static inline int proto_long(const char * s, long * v)
+{
+	long x = 0;
+	int neg = (*s == '-'), digits = 0;
+
+	if (neg || *s == '+') s++;
+	if (*s < '0' || *s > '9') return 0;
+	while (*s >= '0' && *s <= '9') {
+		if (++digits > 9) return 0;
+		x = x * 10 + (*s++ - '0');
+	}
+	if (*s != 0 && *s != '\n' && *s != '\r') return 0;
+	*v = neg ? -x : x;
+	return 1;
+}
+
+static inline int proto_float(const char * s, float * v)
+{
+	long long x = 0;
+	long scale = 1;
+	int neg = (*s == '-'), digits = 0;
+
+	if (neg || *s == '+') s++;
+	while (*s >= '0' && *s <= '9') {
+		if (++digits > 9) return 0;
+		x = x * 10 + (*s++ - '0');
+	}
+	if (*s == '.') {
+		// beyond 6 decimals a float has nothing left to keep
+		for (s++; *s >= '0' && *s <= '9'; s++, digits++) {
+			if (scale < 1000000) { x = x * 10 + (*s - '0'); scale *= 10; }
+		}
+	}
+	if (digits == 0 || (*s != 0 && *s != '\n' && *s != '\r')) return 0;
+	*v = (float)((neg ? -x : x) / (double)scale);
+	return 1;
+}
+
+
+/*
+ *	FORMATTER
+ */
+typedef struct
+{
+	char * buf;
+	int len, size;
+} proto_out_t;
+
+static inline void proto_begin(proto_out_t * o, char * buf, int size)
+{
+	o->buf = buf;
+	o->size = size;
+	o->len = 0;
+	buf[0] = 0;
+}
+
+static inline void proto_str(proto_out_t * o, const char * s)
+{
+	while (*s && o->len < o->size - 1) o->buf[o->len++] = *s++;
+	o->buf[o->len] = 0;
+}
+
+static inline void proto_char(proto_out_t * o, char c)
+{
+	if (o->len < o->size - 1) o->buf[o->len++] = c;
+	o->buf[o->len] = 0;
+}
+
+static inline void proto_llong_out(proto_out_t * o, long long v)
+{
+	char digits[24];
+	unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+	int n = 0;
+
+	do { digits[n++] = '0' + u % 10; u /= 10; } while (u);
+	if (v < 0) proto_char(o, '-');
+	while (n) proto_char(o, digits[--n]);
+}
+
+static inline void proto_long_out(proto_out_t * o, long v)
+{
+	proto_llong_out(o, v);
+}
+
+// like "%.<decimals>f", rounded half away from zero; in a double and a long long even where a
+// long is 32 bits, beyond it (and NaN) the largest one it holds
+static inline void proto_float_out(proto_out_t * o, float v, int decimals)
+{
+	static const long long pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+	long long scale = pow10[decimals], x;
+	int neg = v < 0;
+	double d;
+
+	d = (neg ? -(double)v : v) * scale + 0.5;
+	x = d < 9.2e18 ? (long long)d : 9200000000000000000LL;
+	if (neg && x != 0) proto_char(o, '-');
+	proto_llong_out(o, x / scale);
+	if (decimals == 0) return;
+	proto_char(o, '.');
+	for (x %= scale, scale /= 10; scale; scale /= 10) proto_char(o, '0' + (x / scale) % 10);
+}
+
+#endif
@@ -0,0 +1,435 @@
+/*
+ *	ROUTER
+ *
+ *	Front end of a cluster of controllers: every zone lives on one controller, its owner,
+ *	and is mirrored on a second one, its standby. Clients talk to the router with the
+ *	controller protocol, see controller.c, and the router forwards each request to the
+ *	owner of the zone; SET, TEMP, HB, BATCH and SCHED are then forwarded to the standby too,
+ *	which keeps a warm copy of the zone.
+ *
+ *	Placement is rendezvous hashing: the owner of a zone is the live node with the highest
+ *	hash(node, zone), the standby the second highest. A node that joins or leaves only moves
+ *	the zones it wins or loses; their state, schedule and model are handed off with DUMP
+ *	from the old owner (the standby when the owner is dead) and LOAD into the new owner and
+ *	standby.
+ *
+ *	The router forwards one request and its one reply at a time: a connection that sent a
+ *	BATCH stays open for more, as on a controller, but SUB and HIST, whose binary replies
+ *	go on past the first read, are turned away; subscribe to the controllers themselves.
+ *
+ *	Nodes come and go by themselves: one that does not answer the health check is dead
+ *	until it answers again. The router also takes:
+ *	  JOIN;<host>:<port>				add a controller to the cluster
+ *	  LEAVE;<host>:<port>				hand off its zones and drop it
+ *
+ *	All on one host:
+ *	  ./bin/controller -z 8 5001 & ./bin/controller -z 8 5002 & ./bin/controller -z 8 5003 &
+ *	  ./bin/router -z 8 5000 127.0.0.1:5001 127.0.0.1:5002 127.0.0.1:5003
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#define MAX_NODES	16
+#define MAX_ZONES	64
+
+typedef struct
+{
+	char name[64];			// host:port
+	struct sockaddr_in address;
+	unsigned int hash;
+	int alive;			// answered the last health check
+	int left;			// removed with LEAVE
+} node_t;
+
+node_t node[MAX_NODES];
+int    nodes = 0;
+
+int zones = 1;				// zones of the cluster, all the controllers need at least as many
+int check = 1000;			// [milliseconds] health check period
+
+// placement of every zone, -1 = nowhere; read by the request handlers, written by rebalance()
+int owner[MAX_ZONES], standby[MAX_ZONES];
+pthread_rwlock_t lock_placement = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t  mutex_nodes    = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t  mutex_rebalance = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_t health;
+
+typedef struct
+{
+	int sock;
+	struct sockaddr address;
+	int addr_len;
+} connection_t;
+
+void * requestHandler(void * ptr);
+void * healthCheck(void * ptr);
+int  node_add(const char * name);
+int  node_find(const char * name);
+int  node_request(int n, const char * msg, char * reply, int size);
+void rebalance(void);
+
+
+
+int main(int argc, char ** argv)
+{
+	int port, sock=-1, opt, z, i;
+	struct sockaddr_in address;
+	connection_t * connection;
+	pthread_t thread;
+
+	// check for command line arguments
+	while ((opt = getopt(argc, argv, "z:c:")) != -1) {
+		switch (opt) {
+		case 'z': zones = atoi(optarg); break;
+		case 'c': check = atoi(optarg); break;
+		default:  optind = argc + 1;
+		}
+	}
+	if (optind >= argc || zones < 1 || zones > MAX_ZONES || check <= 0) {
+		fprintf(stderr, "usage: %s [-z zones] [-c check_ms] port [host:port ...]\n", argv[0]);
+		return -1;
+	}
+
+	// obtain port number
+	if (sscanf(argv[optind], "%d", &port) <= 0) {
+		fprintf(stderr, "%s: error: wrong parameter: port\n", argv[0]);
+		return -2;
+	}
+
+	// the controllers
+	for (i = optind + 1; i < argc; i++) {
+		if (node_add(argv[i]) < 0) {
+			fprintf(stderr, "%s: error: wrong node: %s\n", argv[0], argv[i]);
+			return -2;
+		}
+	}
+	for (z = 0; z < MAX_ZONES; z++) owner[z] = standby[z] = -1;
+
+	// create socket
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock <= 0) {
+		fprintf(stderr, "%s: error: cannot create socket\n", argv[0]);
+		return -3;
+	}
+
+	// bind socket to port
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *)&address, sizeof(struct sockaddr_in)) < 0) {
+		fprintf(stderr, "%s: error: cannot bind socket to port %d\n", argv[0], port);
+		return -4;
+	}
+
+	// listen on port
+	if (listen(sock, 5) < 0) {
+		fprintf(stderr, "%s: error: cannot listen on port\n", argv[0]);
+		return -5;
+	}
+	printf("\nROUTER is ready and listening on port %i, %d zones on %d nodes ..\n\n", port, zones, nodes);
+
+	// first placement, then keep it up to date
+	pthread_create(&health,NULL,healthCheck,NULL);
+
+
+	while (1)
+	{
+		// accept incoming connections
+		connection = (connection_t *)malloc(sizeof(connection_t));
+		connection->addr_len = sizeof(connection->address);
+		connection->sock = accept(sock, &connection->address, (socklen_t*)&connection->addr_len);
+		if (connection->sock <= 0) {
+			free(connection);
+		}
+		else {
+			// start a new thread but do not wait for it
+			pthread_create(&thread, 0, requestHandler, (void *)connection);
+			pthread_detach(thread);
+		}
+	}
+
+	return 0;
+}
+
+
+
+
+
+/*
+ *	Receive a message, forward it to the owner of its zone and its reply back
+ */
+void * requestHandler(void * ptr)
+{
+	char buffer[255], reply[255], cmd[10], arg1[10], arg2[10];
+	int len, z, n, s, keep = 0;
+	connection_t * conn;
+	if (!ptr) pthread_exit(0);
+	conn = (connection_t *)ptr;
+
+	// read the meassage, the next ones too after a BATCH
+	while ((len = read(conn->sock,buffer,254)) > 0) {
+		buffer[len] = 0;
+		buffer[strcspn(buffer, "\r\n")] = 0;
+
+		// parse the command, only as far as the zone
+		char *token, *string, *tofree;
+		string = strdup(buffer); tofree = string;
+		token = strsep(&string, ";"); snprintf(cmd,sizeof(cmd),"%s", token);
+		strsep(&string, ";");
+		token = strsep(&string, ";"); snprintf(arg1,sizeof(arg1),"%s", token ? token : "0");
+		token = strsep(&string, ";"); snprintf(arg2,sizeof(arg2),"%s", token ? token : "0");
+		free(tofree);
+		z = atoi(strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "HB") == 0 ? arg2 : arg1);
+
+		memset(reply, 0, sizeof(reply));
+
+		if (strcmp(cmd, "JOIN") == 0) {
+
+			// ADD A NODE
+			n = node_add(buffer + 5);
+			if (n < 0) sprintf(reply,"cannot compute, wrong node!");
+			else sprintf(reply,"Node %d joined!", n);
+			rebalance();
+		}
+
+		else if (strcmp(cmd, "LEAVE") == 0) {
+
+			// DROP A NODE, ITS ZONES GO FIRST
+			n = node_find(buffer + 6);
+			if (n < 0) sprintf(reply,"cannot compute, unknown node!");
+			else {
+				pthread_mutex_lock(&mutex_nodes);
+				node[n].left = 1;
+				pthread_mutex_unlock(&mutex_nodes);
+				rebalance();
+				sprintf(reply,"Node %d left!", n);
+			}
+		}
+
+		else if (strcmp(cmd, "SUB") == 0 || strcmp(cmd, "HIST") == 0) {
+			sprintf(reply,"cannot compute, not through the router!");
+		}
+
+		else if (z < 0 || z >= zones) {
+			sprintf(reply,"cannot compute, unknown zone!");
+		}
+
+		else {
+
+			// FORWARD TO THE OWNER, SET, TEMP, HB, BATCH AND SCHED TO THE STANDBY TOO
+			pthread_rwlock_rdlock(&lock_placement);
+			n = owner[z];
+			s = standby[z];
+			if (n < 0 || node_request(n, buffer, reply, sizeof(reply)) < 0) {
+				sprintf(reply,"cannot compute, zone unavailable!");
+				s = -1;
+			}
+			write(conn->sock,reply,sizeof(reply));
+			if (s >= 0 && (strcmp(cmd, "SET") == 0 || strcmp(cmd, "TEMP") == 0 || strcmp(cmd, "HB") == 0 ||
+					strcmp(cmd, "BATCH") == 0 || strcmp(cmd, "SCHED") == 0)) {
+				node_request(s, buffer, reply, sizeof(reply));
+			}
+			pthread_rwlock_unlock(&lock_placement);
+			len = 0;
+		}
+
+		// send back a response
+		if (len > 0) write(conn->sock,reply,sizeof(reply));
+		if (strcmp(cmd, "BATCH") == 0) keep = 1;
+		if (!keep) break;
+	}
+
+	// close socket and clean up
+	close(conn->sock);
+	free(conn);
+	pthread_exit(0);
+}
+
+
+
+/*
+ *	NODES
+ */
+
+// FNV-1a
+unsigned int hash_string(const char * s)
+{
+	unsigned int h = 2166136261u;
+	while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+	return h;
+}
+
+// rendezvous weight of a zone on a node, a good mix so that zones spread evenly
+unsigned int weight(int n, int z)
+{
+	unsigned int h = node[n].hash ^ ((unsigned int)z * 0x9e3779b9u);
+	h ^= h >> 16; h *= 0x85ebca6bu;
+	h ^= h >> 13; h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// "host:port", the node index; an existing node is just back in
+int node_add(const char * name)
+{
+	char host[48];
+	struct hostent * server;
+	int port, n;
+
+	if (sscanf(name, "%47[^:]:%d", host, &port) != 2) return -1;
+	server = gethostbyname(host);
+	if (server == NULL) return -1;
+
+	pthread_mutex_lock(&mutex_nodes);
+	for (n = 0; n < nodes; n++) {
+		if (strcmp(node[n].name, name) == 0) break;
+	}
+	if (n == MAX_NODES) { pthread_mutex_unlock(&mutex_nodes); return -1; }
+	if (n == nodes) {
+		memset(&node[n], 0, sizeof(node[n]));
+		snprintf(node[n].name, sizeof(node[n].name), "%s:%d", host, port);
+		node[n].address.sin_family = AF_INET;
+		memcpy(&node[n].address.sin_addr.s_addr, server->h_addr, server->h_length);
+		node[n].address.sin_port = htons(port);
+		node[n].hash = hash_string(node[n].name);
+		nodes++;
+	}
+	node[n].left = 0;
+	node[n].alive = node_request(n, "LOG;0;0", host, sizeof(host)) >= 0;
+	pthread_mutex_unlock(&mutex_nodes);
+	return n;
+}
+
+int node_find(const char * name)
+{
+	int n;
+
+	for (n = 0; n < nodes; n++) {
+		if (strcmp(node[n].name, name) == 0) return n;
+	}
+	return -1;
+}
+
+// one request to a controller, the length of its reply or -1 if it did not answer in time
+int node_request(int n, const char * msg, char * reply, int size)
+{
+	struct timeval timeout = { 0, 500000 };
+	int sock, len;
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) return -1;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	len = -1;
+	if (connect(sock, (struct sockaddr *)&node[n].address, sizeof(node[n].address)) == 0 &&
+	    write(sock, msg, strlen(msg)) > 0) {
+		len = read(sock, reply, size - 1);
+		if (len > 0) reply[len] = 0;
+		else len = -1;
+	}
+	close(sock);
+	return len;
+}
+
+
+
+/*
+ *	Place every zone on the two live nodes that weigh the most for it, move the state
+ *	of the zones that changed place. The requests go on meanwhile: the placement is only
+ *	locked to publish the new one, once the zones are where it says.
+ */
+void rebalance(void)
+{
+	static const char * part[3] = { "0", "sched", "model" };
+	int first[MAX_ZONES], second[MAX_ZONES], from[MAX_ZONES], moved[MAX_ZONES];
+	char state[255], msg[300];
+	int z, n, p;
+
+	// one at a time: owner[] and standby[] only change here
+	pthread_mutex_lock(&mutex_rebalance);
+
+	pthread_mutex_lock(&mutex_nodes);
+	for (z = 0; z < zones; z++) {
+
+		// rendezvous: the two highest weights among the live nodes
+		first[z] = second[z] = -1;
+		for (n = 0; n < nodes; n++) {
+			if (!node[n].alive || node[n].left) continue;
+			if (first[z] < 0 || weight(n, z) > weight(first[z], z)) { second[z] = first[z]; first[z] = n; }
+			else if (second[z] < 0 || weight(n, z) > weight(second[z], z)) second[z] = n;
+		}
+
+		// the freshest copy: the old owner, else the old standby
+		moved[z] = owner[z] >= 0 || standby[z] >= 0;
+		from[z] = -1;
+		if (owner[z] >= 0 && node[owner[z]].alive) from[z] = owner[z];
+		else if (standby[z] >= 0 && node[standby[z]].alive) from[z] = standby[z];
+	}
+	pthread_mutex_unlock(&mutex_nodes);
+
+	// a part at a time, the target and sensors first: without them the zone is lost
+	for (z = 0; z < zones; z++) {
+		if (first[z] == owner[z] && second[z] == standby[z]) continue;
+		for (p = 0; from[z] >= 0 && p < 3; p++) {
+			snprintf(msg, sizeof(msg), "DUMP;%s;%d", part[p], z);
+			if (node_request(from[z], msg, state, sizeof(state)) > 0 && strchr(state, '/') != NULL) {
+				snprintf(msg, sizeof(msg), "LOAD;%s;%d", state, z);
+				if (first[z] >= 0 && first[z] != from[z]) node_request(first[z], msg, state, sizeof(state));
+				if (second[z] >= 0 && second[z] != from[z]) node_request(second[z], msg, state, sizeof(state));
+			}
+			else if (p == 0) from[z] = -1;
+		}
+	}
+
+	pthread_rwlock_wrlock(&lock_placement);
+	for (z = 0; z < zones; z++) {
+		if (first[z] == owner[z] && second[z] == standby[z]) continue;
+		printf("Zone %d: owner %s, standby %s%s\n", z,
+			first[z] >= 0 ? node[first[z]].name : "none", second[z] >= 0 ? node[second[z]].name : "none",
+			moved[z] && from[z] < 0 ? ", state lost" : "");
+		owner[z] = first[z];
+		standby[z] = second[z];
+	}
+	pthread_rwlock_unlock(&lock_placement);
+
+	pthread_mutex_unlock(&mutex_rebalance);
+}
+
+/*
+ *	Check that the nodes answer, rebalance when one dies or comes back
+ */
+void * healthCheck(void * ptr)
+{
+	char reply[255];
+	int n, alive, changed = 1;
+
+	(void)ptr;
+
+	while (1) {
+		if (changed) rebalance();
+		usleep(check * 1000);
+
+		changed = 0;
+		pthread_mutex_lock(&mutex_nodes);
+		for (n = 0; n < nodes; n++) {
+			if (node[n].left) continue;
+			alive = node_request(n, "LOG;0;0", reply, sizeof(reply)) >= 0;
+			if (alive != node[n].alive) {
+				printf("Node %s is %s\n", node[n].name, alive ? "back" : "dead");
+				node[n].alive = alive;
+				changed = 1;
+			}
+		}
+		pthread_mutex_unlock(&mutex_nodes);
+	}
+}
@@ -1,7 +1,14 @@
 /*
  *	SENSOR
  *
- *	Read the temperature value from the I2C sensor and send it to the controller
+ *	Read the temperature value from the I2C sensor and send it to the controller, through
+ *	shared memory (shm.h) when the controller runs on this board
+ *
+ *	Send on delta: over the network a reading is smoothed and only sent when it moved more
+ *	than [deadband] degrees since the last one sent, or more than [rate] degrees in a second.
+ *	In between, an HB every [heartbeat] seconds tells the controller the sensor is alive and
+ *	its reading unchanged: on a steady box, one connection every [heartbeat] seconds instead
+ *	of every second. -h 0 sends every reading, as do controllers that do not know HB.
  */
 
 #include <stdio.h>
@@ -11,38 +18,133 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#include "../drivers/tmp102/eprotemp.h"
+#include "shm.h"
+
+#define FILTER	0.5	// weight of a new reading in the smoothed value
 
 float t=0;
+float deadband = 0.2;	// [degrees]
+float rate = 0.1;	// [degrees/second]
+int   heartbeat = 30;	// [seconds], 0 = send every reading
 FILE* file;
 int temperature;
+int temp_fd = -1;	// TMP102 driver, -1 when not loaded
 
 void read_temperature() {
 
+		struct eprotemp_sample s[64];
+		long sum = 0;
+		int i, n;
+
+		// the driver samples by itself: average whatever it collected since last time
+		if (temp_fd >= 0) {
+			n = read(temp_fd, s, sizeof(s));
+			if (n >= (int)sizeof(s[0])) {
+				n /= sizeof(s[0]);
+				for (i = 0; i < n; i++) sum += s[i].temp;
+				t = sum / n / 1000.0;
+				return;
+			}
+			perror("/dev/eprotemp");
+		}
+
 		system("i2cget -f -y 1 0x48 0x00 > temperature");
 		file = fopen("/home/root/temperature", "r");
         	if (file != NULL) {
 			fscanf(file, "%x", &temperature);
 			fclose(file);
+			t = (signed char)temperature;	// msb only: whole degrees
 		}
 		else
 			printf("ERROR reading temperature file");
 }
 
+long now_s() {
+
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec;
+}
+
 int main(int argc, char *argv[])
 {
-	int sockfd,n;
+	int sockfd,n,sent=0,opt;
 	struct sockaddr_in serv_addr;
 	char msg[512], buf[512]; 
-
-	if(argc != 3) {
-		printf("\n Usage: %s <server ip> <server port>\n",argv[0]);
+	shm_region_t *shm = NULL;
+	shm_ring_t *ring = NULL;
+	float filtered = 0, previous = 0, reported = 0;
+	int smoothed = 0, known = 0, announced = 0;	// the controller has [reported], and our heartbeat
+	long last = 0;					// [seconds] of the last message
+
+	while ((opt = getopt(argc, argv, "b:r:h:")) != -1) {
+		switch (opt) {
+		case 'b': deadband = atof(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'h': heartbeat = atoi(optarg); break;
+		default: argc = 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if(argc < 3 || argc > 5 || deadband < 0 || rate < 0 || heartbeat < 0) {
+		printf("\n Usage: %s [-b deadband] [-r rate] [-h heartbeat_s] <server ip> <server port> [sensor id] [zone]\n",argv[0]);
 		return 1;
 	}
 
+	// blocking reads, they return at least one sample
+	temp_fd = open("/dev/eprotemp", O_RDONLY);
+	if (temp_fd >= 0) printf("\n Reading the TMP102 through /dev/eprotemp\n");
 
 	// Message sending loop
 	while(1)
 	{
+		// a controller on this board: shared memory, no connection
+		if (ring == NULL && (shm = shm_attach(argv[1], atoi(argv[2]))) != NULL) {
+			ring = shm_claim(shm, argc > 4 ? atoi(argv[4]) : 0);
+			if (ring != NULL) printf("\n Controller is local: sending through shared memory\n");
+			else { shm_detach(shm); shm = NULL; }
+		}
+		if (ring != NULL) {
+			read_temperature();
+			printf("\n > I2C temperature sensor value [C]: %.1f \n",t);
+			if (!shm_send(ring, argc > 3 ? atoi(argv[3]) : 0, t)) printf("   controller busy: value dropped\n");
+
+			// now and then: has the controller gone away?
+			if (++sent % 10 == 0 && shm_dead(shm->pid)) {
+				printf("   controller gone, back to the network\n");
+				shm_release(ring);
+				shm_detach(shm);
+				ring = NULL;
+				shm = NULL;
+			}
+			sleep(1);
+			continue;
+		}
+
+		// read temperature value from sensor, smooth it
+		read_temperature();
+		printf("\n > I2C temperature sensor value [C]: %.1f \n",t);
+		previous = filtered;
+		filtered = smoothed ? filtered + (t - filtered) * FILTER : t;
+		smoothed = 1;
+
+		// create command: a reading that moved, else a heartbeat when due, else nothing
+		if (heartbeat == 0 || !known || fabsf(filtered - reported) > deadband || fabsf(filtered - previous) > rate)
+			sprintf(msg,"TEMP;%.1f;%s;%s",filtered, argc > 3 ? argv[3] : "0", argc > 4 ? argv[4] : "0");
+		else if (!announced || now_s() - last >= heartbeat)
+			sprintf(msg,"HB;%d;%s;%s",heartbeat, argc > 3 ? argv[3] : "0", argc > 4 ? argv[4] : "0");
+		else {
+			sleep(1);
+			continue;
+		}
+
 		// Open connection with server
 		if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 			printf("\n Error : Could not create socket \n");
@@ -64,22 +166,28 @@ int main(int argc, char *argv[])
 		} 
 	
 	
-		// read temperature value from sensor
-		read_temperature();
-		printf("\n > I2C temperature sensor value [C]: %.1f \n",t);
-
-		// create command
-		sprintf(msg,"TEMP;%.1f",t);
-
 		// Send value to controller
 		if( send(sockfd , msg , strlen(msg) , 0) < 0) {
 		    puts("Send failed");
 		    return 1;
 		}
 
-		n = read(sockfd,buf,512);
+		memset(buf, 0, sizeof(buf));
+		n = read(sockfd,buf,511);
 		if (n < 0) { perror("ERROR reading response"); exit(1); }
 		printf("   server reply: %s\n",buf);
+		last = now_s();
+
+		// what the controller now holds
+		if (msg[0] == 'T') {
+			known = strncmp(buf, "Temperature value received", 26) == 0;
+			reported = filtered;
+		}
+		else if (strstr(buf, "unknown command") != NULL) heartbeat = 0;	// an older controller
+		else {
+			announced = strcmp(buf, "Heartbeat received!") == 0;
+			known = announced;	// a stale reading is sent again
+		}
 
 
 		// close
@@ -0,0 +1,216 @@
+/*
+ *	SHM
+ *
+ *	Transport between the controller and the sensors and monitors running on the same
+ *	board: a POSIX shared memory object "/epro-<port>" the controller creates at start.
+ *	- every sensor process claims one of SHM_RINGS single-producer/single-consumer rings of
+ *	  readings for its zone, the worker owning the zone drains it
+ *	- the controller publishes every zone as LOG shows it under a seqlock, monitors copy it
+ *	A reading costs a few memory writes instead of a connection. There are no replies: a
+ *	reading that finds its ring full is dropped, as a lost packet would be.
+ *
+ *	shm_attach() is for the clients: it returns the region when [ip] is an address of this
+ *	machine and a live controller listens on [port], else NULL and they go over TCP.
+ *
+ *	The region is 0660: the sensors and monitors run in the group of the controller. Any of
+ *	them can still write all of it, so the controller takes nothing from it on trust: the
+ *	ring size is SHM_SLOTS, not a field, it keeps the head of every ring to itself and a
+ *	tail more than SHM_SLOTS ahead of it drops what the ring holds (shm_recv()).
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "spsc.h"
+
+#define SHM_MAGIC	0x4550524f	// "EPRO"
+#define SHM_ZONES	64
+#define SHM_RINGS	16	// sensor processes at once
+#define SHM_SLOTS	64	// readings per ring, power of 2
+
+typedef struct
+{
+	int sensor;
+	float value;
+} shm_reading_t;
+
+typedef struct
+{
+	int pid;		// producer, 0 = free
+	int zone;
+	int active;		// zone is set, the consumer may drain it
+	unsigned int head __attribute__((aligned(SPSC_CACHELINE)));	// next slot to read, a copy of the controller's
+	unsigned int tail __attribute__((aligned(SPSC_CACHELINE)));	// next slot to write
+	shm_reading_t slot[SHM_SLOTS];
+} shm_ring_t;
+
+typedef struct
+{
+	seqlock_t seq;
+	float target, current;
+	int   lamps, fan, fresh;
+} shm_zone_t;
+
+typedef struct
+{
+	unsigned int magic;
+	int pid;		// controller
+	int zones;
+	shm_ring_t ring[SHM_RINGS];
+	shm_zone_t zone[SHM_ZONES];
+} shm_region_t;
+
+
+static inline void shm_name(char * buf, int size, int port)
+{
+	snprintf(buf, size, "/epro-%d", port);
+}
+
+// [pid] is gone
+static inline int shm_dead(int pid)
+{
+	return pid <= 0 || (kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+/*
+ *	Controller side: a fresh region, NULL when the system has no shared memory
+ */
+static inline shm_region_t * shm_create(int port, int zones)
+{
+	shm_region_t * r;
+	char name[32];
+	int fd, i;
+
+	shm_name(name, sizeof(name), port);
+	shm_unlink(name);	// clients of a previous controller keep their own copy
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0) return NULL;
+	fchmod(fd, 0660);	// whatever the umask, sensors may run as other users of the group
+	if (ftruncate(fd, sizeof(shm_region_t)) < 0) { close(fd); shm_unlink(name); return NULL; }
+	r = (shm_region_t *)mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) { shm_unlink(name); return NULL; }
+
+	for (i = 0; i < SHM_RINGS; i++) r->ring[i].head = r->ring[i].tail = 0;
+	r->pid = getpid();
+	r->zones = zones;
+	__atomic_store_n(&r->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return r;
+}
+
+/*
+ *	Client side
+ */
+static inline shm_region_t * shm_attach(const char * ip, int port)
+{
+	struct sockaddr_in addr;
+	shm_region_t * r;
+	char name[32];
+	int fd, local;
+
+	// an address of this machine is one we can bind to
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) return NULL;
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return NULL;
+	local = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	close(fd);
+	if (!local) return NULL;
+
+	shm_name(name, sizeof(name), port);
+	if ((fd = shm_open(name, O_RDWR, 0)) < 0) return NULL;
+	r = (shm_region_t *)mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) return NULL;
+	if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || shm_dead(r->pid)) {
+		munmap(r, sizeof(shm_region_t));
+		return NULL;
+	}
+	return r;
+}
+
+static inline void shm_detach(shm_region_t * r)
+{
+	munmap(r, sizeof(shm_region_t));
+}
+
+// a ring of readings for [zone], NULL when all are taken
+static inline shm_ring_t * shm_claim(shm_region_t * r, int zone)
+{
+	shm_ring_t * q;
+	int i, pid;
+
+	for (i = 0; i < SHM_RINGS; i++) {
+		q = &r->ring[i];
+		pid = __atomic_load_n(&q->pid, __ATOMIC_ACQUIRE);
+		if (pid != 0 && (__atomic_load_n(&q->active, __ATOMIC_ACQUIRE) || !shm_dead(pid))) continue;
+		// free, or claimed by a process that died before using it
+		if (!__atomic_compare_exchange_n(&q->pid, &pid, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+		q->zone = zone;
+		__atomic_store_n(&q->active, 1, __ATOMIC_RELEASE);
+		return q;
+	}
+	return NULL;
+}
+
+// 0 when the ring is full
+static inline int shm_send(shm_ring_t * q, int sensor, float value)
+{
+	unsigned int tail = q->tail;
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= SHM_SLOTS) return 0;
+	q->slot[tail & (SHM_SLOTS - 1)].sensor = sensor;
+	q->slot[tail & (SHM_SLOTS - 1)].value = value;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ *	Controller side: the next reading of [q] in [out] from [*head], the controller's own
+ *	head of the ring; 0 when there is none. A tail that does not fit is a forged one: the
+ *	readings are dropped, the ring starts over from there.
+ */
+static inline int shm_recv(shm_ring_t * q, unsigned int * head, shm_reading_t * out)
+{
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (tail == *head) return 0;
+	if (tail - *head > SHM_SLOTS) {
+		*head = tail;
+		__atomic_store_n(&q->head, *head, __ATOMIC_RELEASE);
+		return 0;
+	}
+	*out = q->slot[*head & (SHM_SLOTS - 1)];
+	(*head)++;
+	__atomic_store_n(&q->head, *head, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// the ring goes back to the controller, which frees it once drained
+static inline void shm_release(shm_ring_t * q)
+{
+	__atomic_store_n(&q->pid, -1, __ATOMIC_RELEASE);
+}
+
+static inline void shm_read_zone(shm_region_t * r, int zone, shm_zone_t * v)
+{
+	unsigned int seq;
+
+	do {
+		seq = seqlock_read_begin(&r->zone[zone].seq);
+		*v = r->zone[zone];
+	} while (seqlock_read_retry(&r->zone[zone].seq, seq));
+}
+
+#endif
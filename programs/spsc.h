@@ -0,0 +1,139 @@
+/*
+ *	SPSC
+ *
+ *	Lock-free building blocks shared by the programs:
+ *	- spsc_t: bounded ring of pointers with exactly one producer and one consumer thread,
+ *	  or of indexes into storage of its own, e.g. in shared memory between two processes
+ *	- seqlock_t: one writer publishes a small struct, any number of readers copy it and
+ *	  retry if the writer was busy meanwhile
+ *
+ *	Only the gcc __atomic builtins are used, so it also builds with the older arm
+ *	cross compilers that have no <stdatomic.h>.
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SPSC_CACHELINE	64
+
+
+/*
+ *	SPSC RING: head is written by the consumer only, tail by the producer only, each on
+ *	its own cache line so the two threads do not bounce it
+ */
+typedef struct
+{
+	unsigned int head __attribute__((aligned(SPSC_CACHELINE)));	// next slot to pop
+	unsigned int tail_cache;					// consumer copy of tail
+	unsigned int tail __attribute__((aligned(SPSC_CACHELINE)));	// next slot to push
+	unsigned int head_cache;					// producer copy of head
+	unsigned int mask __attribute__((aligned(SPSC_CACHELINE)));
+	void ** slot;
+} spsc_t;
+
+// size must be a power of 2, no slots: the caller keeps the items and uses the indexes
+static inline void spsc_init_indexes(spsc_t * q, unsigned int size)
+{
+	memset(q, 0, sizeof(*q));
+	q->mask = size - 1;
+}
+
+static inline int spsc_init(spsc_t * q, unsigned int size)
+{
+	spsc_init_indexes(q, size);
+	q->slot = (void **)calloc(size, sizeof(void *));
+	return q->slot ? 0 : -1;
+}
+
+// producer side: the index to fill, -1 when the ring is full; spsc_put_end() publishes it
+static inline int spsc_put_begin(spsc_t * q)
+{
+	unsigned int tail = q->tail;
+
+	if (tail - q->head_cache > q->mask) {
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail - q->head_cache > q->mask) return -1;
+	}
+	return tail & q->mask;
+}
+
+static inline void spsc_put_end(spsc_t * q)
+{
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+// consumer side: the index to read, -1 when the ring is empty; spsc_get_end() frees it
+static inline int spsc_get_begin(spsc_t * q)
+{
+	unsigned int head = q->head;
+
+	if (head == q->tail_cache) {
+		q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head == q->tail_cache) return -1;
+	}
+	return head & q->mask;
+}
+
+static inline void spsc_get_end(spsc_t * q)
+{
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+// producer side, 0 when the ring is full
+static inline int spsc_push(spsc_t * q, void * item)
+{
+	int i = spsc_put_begin(q);
+
+	if (i < 0) return 0;
+	q->slot[i] = item;
+	spsc_put_end(q);
+	return 1;
+}
+
+// consumer side, NULL when the ring is empty
+static inline void * spsc_pop(spsc_t * q)
+{
+	int i = spsc_get_begin(q);
+	void * item;
+
+	if (i < 0) return NULL;
+	item = q->slot[i];
+	spsc_get_end(q);
+	return item;
+}
+
+
+/*
+ *	SEQLOCK: odd while the writer is inside
+ */
+typedef struct { unsigned int seq; } seqlock_t;
+
+static inline void seqlock_write_begin(seqlock_t * l)
+{
+	__atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(seqlock_t * l)
+{
+	__atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int seqlock_read_begin(const seqlock_t * l)
+{
+	unsigned int seq;
+	while ((seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE)) & 1) { }
+	return seq;
+}
+
+// non zero when the copy taken since seqlock_read_begin() may be torn
+static inline int seqlock_read_retry(const seqlock_t * l, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif
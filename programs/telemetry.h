@@ -0,0 +1,160 @@
+/*
+ *	TELEMETRY
+ *
+ *	Compact encoding of the zone state for streams (SUB) and history (HIST), shared by the
+ *	controller and its clients. A record is
+ *
+ *		<zone varint> <mask byte> <fields>
+ *
+ *	the mask tells which fields follow, in this order, each a zig-zag varint:
+ *
+ *		TELE_TIME	[seconds]	TELE_LAMPS
+ *		TELE_TARGET	[tenths]	TELE_FAN	[percent]
+ *		TELE_CURRENT	[tenths]	TELE_FRESH	[sensors]
+ *
+ *	A keyframe (TELE_KEY) carries all the fields as they are, any other record only the
+ *	fields that changed, as the difference from the previous record of the same zone; the
+ *	time is left out when it is one second after the previous one. A steady zone costs
+ *	2 bytes a second instead of a 255 bytes LOG reply. Records are self-delimiting, so a
+ *	reader that joins in the middle skips the zones it has no keyframe for yet.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#define TELE_TIME	0x01
+#define TELE_TARGET	0x02
+#define TELE_CURRENT	0x04
+#define TELE_LAMPS	0x08
+#define TELE_FAN	0x10
+#define TELE_FRESH	0x20
+#define TELE_KEY	0x80
+#define TELE_FIELDS	6
+
+#define TELE_KEYFRAME	30	// records between keyframes
+#define TELE_MAX	(1 + 5 + 1 + 10 + 5 * 5)	// longest record [bytes]
+
+typedef struct
+{
+	long long time;
+	int target, current;	// [tenths of degree]
+	int lamps, fan, fresh;
+} telemetry_t;
+
+// one zone as a reader sees it
+typedef struct
+{
+	telemetry_t last;
+	int known;		// a keyframe arrived
+} tele_state_t;
+
+
+static inline int tele_put(unsigned char * p, unsigned long long v)
+{
+	int n = 0;
+
+	while (v >= 0x80) { p[n++] = (unsigned char)(v | 0x80); v >>= 7; }
+	p[n++] = (unsigned char)v;
+	return n;
+}
+
+static inline int tele_put_signed(unsigned char * p, long long v)
+{
+	return tele_put(p, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+// bytes used, 0 when [len] ends in the middle of it
+static inline int tele_get(const unsigned char * p, int len, unsigned long long * v)
+{
+	int n = 0, shift = 0;
+
+	*v = 0;
+	while (n < len && n < 10) {
+		*v |= (unsigned long long)(p[n] & 0x7f) << shift;
+		if (!(p[n++] & 0x80)) return n;
+		shift += 7;
+	}
+	return 0;
+}
+
+static inline int tele_get_signed(const unsigned char * p, int len, long long * v)
+{
+	unsigned long long u;
+	int n = tele_get(p, len, &u);
+
+	*v = (long long)(u >> 1) ^ -(long long)(u & 1);
+	return n;
+}
+
+/*
+ *	One record of [zone] into [p], at most TELE_MAX bytes: a keyframe when [prev] is NULL,
+ *	else the changes from it. Returns its length.
+ */
+static inline int tele_encode(unsigned char * p, int zone, const telemetry_t * prev, const telemetry_t * cur)
+{
+	long long field[TELE_FIELDS], base[TELE_FIELDS] = { 0 };
+	int i, n, mask = 0;
+
+	field[0] = cur->time;  field[1] = cur->target; field[2] = cur->current;
+	field[3] = cur->lamps; field[4] = cur->fan;    field[5] = cur->fresh;
+	if (prev == NULL) mask = TELE_KEY | ((1 << TELE_FIELDS) - 1);
+	else {
+		base[0] = prev->time + 1; base[1] = prev->target; base[2] = prev->current;
+		base[3] = prev->lamps;    base[4] = prev->fan;    base[5] = prev->fresh;
+		for (i = 0; i < TELE_FIELDS; i++) if (field[i] != base[i]) mask |= 1 << i;
+	}
+
+	n = tele_put(p, zone);
+	p[n++] = mask;
+	for (i = 0; i < TELE_FIELDS; i++) {
+		if (mask & (1 << i)) n += tele_put_signed(p + n, field[i] - base[i]);
+	}
+	return n;
+}
+
+/*
+ *	Read one record from [p] into [state][zone], for zones below [zones]. Returns its
+ *	length, 0 when [len] ends in the middle of it, -1 when the data is not telemetry.
+ *	[zone] is -1 for a record that could not be applied: no keyframe yet, or out of range.
+ */
+static inline int tele_decode(const unsigned char * p, int len, tele_state_t * state, int zones, int * zone)
+{
+	unsigned long long z;
+	long long v, field[TELE_FIELDS];
+	telemetry_t * last;
+	int i, n, k, mask;
+
+	if ((n = tele_get(p, len, &z)) == 0) return 0;
+	if (n >= len) return 0;
+	mask = p[n++];
+	if (mask & 0x40) return -1;
+
+	for (i = 0; i < TELE_FIELDS; i++) {
+		field[i] = 0;
+		if (!(mask & (1 << i))) continue;
+		if ((k = tele_get_signed(p + n, len - n, &v)) == 0) return 0;
+		field[i] = v;
+		n += k;
+	}
+
+	*zone = -1;
+	if (z >= (unsigned long long)zones) return n;
+	last = &state[z].last;
+	if (mask & TELE_KEY) {
+		state[z].known = 1;
+		memset(last, 0, sizeof(*last));
+		last->time = -1;	// + 1 below
+	}
+	else if (!state[z].known) return n;
+
+	last->time    += field[0] + 1;
+	last->target  += field[1];
+	last->current += field[2];
+	last->lamps   += field[3];
+	last->fan     += field[4];
+	last->fresh   += field[5];
+	*zone = (int)z;
+	return n;
+}
+
+#endif
@@ -17,8 +17,8 @@ int main(int argc, char *argv[])
 	struct sockaddr_in serv_addr;
 	char msg[512], buf[512]; 
 
-	if(argc != 3) {
-		printf("\n Usage: %s <server ip> <server port>\n",argv[0]);
+	if(argc < 3 || argc > 4) {
+		printf("\n Usage: %s <server ip> <server port> [zone]\n",argv[0]);
 		return 1;
 	}
 
@@ -48,11 +48,12 @@ int main(int argc, char *argv[])
 	
 	
 		// read value from user
-		printf("\n > Enter a new target temperature [C]: ");
-        	scanf("%s" , buf);
+		printf("\n > Enter a new target temperature [C], or a daily schedule hh:mm=C,hh:mm=C,..: ");
+        	scanf("%400s" , buf);
 
 		// create command
-		sprintf(msg,"SET;%s",buf);
+		if (strchr(buf, '=') != NULL) sprintf(msg,"SCHED;%.400s;%.16s",buf, argc > 3 ? argv[3] : "0");
+		else sprintf(msg,"SET;%.400s;%.16s",buf, argc > 3 ? argv[3] : "0");
 
 		// Send value
 		if( send(sockfd , msg , strlen(msg) , 0) < 0) {
@@ -0,0 +1,316 @@
+/*
+ *	WINDOW
+ *
+ *	Statistics of a zone over a sliding window of the last seconds: min, max, mean and
+ *	standard deviation of its temperature, and the seconds it spent above its target.
+ *
+ *	Every second win_sample() adds one sample, in O(1): a bucket of one second, and into the
+ *	bucket of the current minute, folded in as it goes (Welford). Two rings of buckets are
+ *	kept, WIN_SECONDS of one second and WIN_MINUTES of one minute, each as a structure of
+ *	arrays: one array per field, so that win_query() reduces any window with SIMD kernels,
+ *	AVX or SSE on x86, NEON on the board (-mfpu=neon), 1, 4 or 8 buckets per instruction.
+ *	Windows up to WIN_SECONDS are exact, longer ones are rounded up to whole minutes.
+ *
+ *	A bucket keeps its samples n, min, max, mean, the sum of the squared deviations from
+ *	its mean m2, and above. Buckets combine in two passes, the mean first, then
+ *
+ *		M2 = sum(m2) + sum(n * (mean - M)^2)
+ *
+ *	so floats are enough: nothing large is subtracted from anything large. A bucket without
+ *	samples (no fresh sensor) has n = 0, min = +inf and max = -inf, and counts for nothing.
+ *	win_reduce() without [simd] is the same reduction a bucket at a time, for the tests.
+ */
+
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <math.h>
+
+#define WIN_SECONDS	300	// 5 minutes of one second buckets
+#define WIN_MINUTES	1440	// 24 hours of one minute buckets
+#define WIN_FIELDS	6
+
+enum { WIN_N, WIN_MIN, WIN_MAX, WIN_MEAN, WIN_M2, WIN_ABOVE };
+
+// a ring of buckets, field k of bucket i at f[k * size + i]
+typedef struct
+{
+	float * f;
+	int size, next, count;	// buckets, the next one to write, the ones written
+} win_ring_t;
+
+typedef struct
+{
+	float n, min, max, mean, m2, above;
+} win_bucket_t;
+
+typedef struct
+{
+	win_ring_t sec, min;
+	win_bucket_t minute;	// being filled
+	int seconds;		// in it
+	float sec_f[WIN_FIELDS * WIN_SECONDS];
+	float min_f[WIN_FIELDS * WIN_MINUTES];
+} window_t;
+
+typedef struct
+{
+	long samples;
+	float min, max, mean, stddev;
+	long above;		// [seconds]
+} win_stats_t;
+
+
+/*
+ *	VECTORS: WIN_LANES floats, unaligned loads, the windows start anywhere in the rings
+ */
+#if defined(__AVX__)
+#include <immintrin.h>
+#define WIN_LANES	8
+typedef __m256 win_v;
+#define wv_load(p)	_mm256_loadu_ps(p)
+#define wv_store(p, a)	_mm256_storeu_ps(p, a)
+#define wv_set(x)	_mm256_set1_ps(x)
+#define wv_add(a, b)	_mm256_add_ps(a, b)
+#define wv_sub(a, b)	_mm256_sub_ps(a, b)
+#define wv_mul(a, b)	_mm256_mul_ps(a, b)
+#define wv_min(a, b)	_mm256_min_ps(a, b)
+#define wv_max(a, b)	_mm256_max_ps(a, b)
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define WIN_LANES	4
+typedef __m128 win_v;
+#define wv_load(p)	_mm_loadu_ps(p)
+#define wv_store(p, a)	_mm_storeu_ps(p, a)
+#define wv_set(x)	_mm_set1_ps(x)
+#define wv_add(a, b)	_mm_add_ps(a, b)
+#define wv_sub(a, b)	_mm_sub_ps(a, b)
+#define wv_mul(a, b)	_mm_mul_ps(a, b)
+#define wv_min(a, b)	_mm_min_ps(a, b)
+#define wv_max(a, b)	_mm_max_ps(a, b)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WIN_LANES	4
+typedef float32x4_t win_v;
+#define wv_load(p)	vld1q_f32(p)
+#define wv_store(p, a)	vst1q_f32(p, a)
+#define wv_set(x)	vdupq_n_f32(x)
+#define wv_add(a, b)	vaddq_f32(a, b)
+#define wv_sub(a, b)	vsubq_f32(a, b)
+#define wv_mul(a, b)	vmulq_f32(a, b)
+#define wv_min(a, b)	vminq_f32(a, b)
+#define wv_max(a, b)	vmaxq_f32(a, b)
+#else
+#define WIN_LANES	1
+typedef float win_v;
+#define wv_load(p)	(*(p))
+#define wv_store(p, a)	(*(p) = (a))
+#define wv_set(x)	(x)
+#define wv_add(a, b)	((a) + (b))
+#define wv_sub(a, b)	((a) - (b))
+#define wv_mul(a, b)	((a) * (b))
+#define wv_min(a, b)	((a) < (b) ? (a) : (b))
+#define wv_max(a, b)	((a) > (b) ? (a) : (b))
+#endif
+
+
+static inline void win_ring_init(win_ring_t * r, float * f, int size)
+{
+	r->f = f;
+	r->size = size;
+	r->next = r->count = 0;
+}
+
+static inline void win_empty(win_bucket_t * b)
+{
+	b->n = b->mean = b->m2 = b->above = 0;
+	b->min = INFINITY;
+	b->max = -INFINITY;
+}
+
+static inline void win_init(window_t * w)
+{
+	win_ring_init(&w->sec, w->sec_f, WIN_SECONDS);
+	win_ring_init(&w->min, w->min_f, WIN_MINUTES);
+	win_empty(&w->minute);
+	w->seconds = 0;
+}
+
+static inline void win_put(win_ring_t * r, const win_bucket_t * b)
+{
+	float * f = r->f + r->next;
+
+	f[WIN_N * r->size]     = b->n;
+	f[WIN_MIN * r->size]   = b->min;
+	f[WIN_MAX * r->size]   = b->max;
+	f[WIN_MEAN * r->size]  = b->mean;
+	f[WIN_M2 * r->size]    = b->m2;
+	f[WIN_ABOVE * r->size] = b->above;
+	r->next = (r->next + 1) % r->size;
+	if (r->count < r->size) r->count++;
+}
+
+// one second of a zone: its temperature when [valid], and its target
+static inline void win_sample(window_t * w, float value, float target, int valid)
+{
+	win_bucket_t s, * m = &w->minute;
+	float delta;
+
+	win_empty(&s);
+	if (valid) {
+		s.n = 1;
+		s.min = s.max = s.mean = value;
+		s.above = value > target;
+
+		m->n++;
+		delta = value - m->mean;
+		m->mean += delta / m->n;
+		m->m2 += delta * (value - m->mean);
+		if (value < m->min) m->min = value;
+		if (value > m->max) m->max = value;
+		m->above += s.above;
+	}
+	win_put(&w->sec, &s);
+
+	if (++w->seconds == 60) {
+		win_put(&w->min, m);
+		win_empty(m);
+		w->seconds = 0;
+	}
+}
+
+
+/*
+ *	REDUCTION of [len] consecutive buckets from [first], which do not wrap: pass 1 adds
+ *	into [acc] n, n * mean (in mean), min, max and above; pass 2 adds into acc->m2 the
+ *	spread around the mean [mean] of the whole window
+ */
+static inline void win_pass1_scalar(const win_ring_t * r, int first, int len, win_bucket_t * acc)
+{
+	const float * f = r->f + first;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		acc->n += f[WIN_N * r->size + i];
+		acc->mean += f[WIN_N * r->size + i] * f[WIN_MEAN * r->size + i];
+		if (f[WIN_MIN * r->size + i] < acc->min) acc->min = f[WIN_MIN * r->size + i];
+		if (f[WIN_MAX * r->size + i] > acc->max) acc->max = f[WIN_MAX * r->size + i];
+		acc->above += f[WIN_ABOVE * r->size + i];
+	}
+}
+
+static inline void win_pass2_scalar(const win_ring_t * r, int first, int len, float mean, win_bucket_t * acc)
+{
+	const float * f = r->f + first;
+	float d;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		d = f[WIN_MEAN * r->size + i] - mean;
+		acc->m2 += f[WIN_M2 * r->size + i] + f[WIN_N * r->size + i] * d * d;
+	}
+}
+
+static inline void win_pass1(const win_ring_t * r, int first, int len, win_bucket_t * acc)
+{
+	const float * n = r->f + WIN_N * r->size + first, * mean = r->f + WIN_MEAN * r->size + first;
+	const float * mn = r->f + WIN_MIN * r->size + first, * mx = r->f + WIN_MAX * r->size + first;
+	const float * above = r->f + WIN_ABOVE * r->size + first;
+	float ln[WIN_LANES], lsum[WIN_LANES], lmin[WIN_LANES], lmax[WIN_LANES], labove[WIN_LANES];
+	win_v vn = wv_set(0), vsum = wv_set(0), vmin = wv_set(INFINITY), vmax = wv_set(-INFINITY), vabove = wv_set(0), x;
+	int i, k;
+
+	for (i = 0; i + WIN_LANES <= len; i += WIN_LANES) {
+		x = wv_load(n + i);
+		vn = wv_add(vn, x);
+		vsum = wv_add(vsum, wv_mul(x, wv_load(mean + i)));
+		vmin = wv_min(vmin, wv_load(mn + i));
+		vmax = wv_max(vmax, wv_load(mx + i));
+		vabove = wv_add(vabove, wv_load(above + i));
+	}
+	wv_store(ln, vn);	wv_store(lsum, vsum);
+	wv_store(lmin, vmin);	wv_store(lmax, vmax);
+	wv_store(labove, vabove);
+	for (k = 0; k < WIN_LANES; k++) {
+		acc->n += ln[k];
+		acc->mean += lsum[k];
+		if (lmin[k] < acc->min) acc->min = lmin[k];
+		if (lmax[k] > acc->max) acc->max = lmax[k];
+		acc->above += labove[k];
+	}
+	win_pass1_scalar(r, first + i, len - i, acc);
+}
+
+static inline void win_pass2(const win_ring_t * r, int first, int len, float mean, win_bucket_t * acc)
+{
+	const float * n = r->f + WIN_N * r->size + first, * mn = r->f + WIN_MEAN * r->size + first;
+	const float * m2 = r->f + WIN_M2 * r->size + first;
+	float lm2[WIN_LANES];
+	win_v vm2 = wv_set(0), vmean = wv_set(mean), d;
+	int i, k;
+
+	for (i = 0; i + WIN_LANES <= len; i += WIN_LANES) {
+		d = wv_sub(wv_load(mn + i), vmean);
+		vm2 = wv_add(vm2, wv_add(wv_load(m2 + i), wv_mul(wv_load(n + i), wv_mul(d, d))));
+	}
+	wv_store(lm2, vm2);
+	for (k = 0; k < WIN_LANES; k++) acc->m2 += lm2[k];
+	win_pass2_scalar(r, first + i, len - i, mean, acc);
+}
+
+// the last [len] buckets of [r] and [extra], in [s]; [simd] 0 for the scalar kernels
+static inline void win_reduce_ring(const win_ring_t * r, int len, const win_bucket_t * extra, int simd, win_stats_t * s)
+{
+	win_bucket_t acc;
+	int first = (r->next - len + r->size) % r->size;
+	int head = first + len > r->size ? r->size - first : len;	// up to the end of the ring, then from its start
+	float mean, d;
+
+	win_empty(&acc);
+	acc.n = extra->n;
+	acc.mean = extra->n * extra->mean;
+	acc.min = extra->min;
+	acc.max = extra->max;
+	acc.above = extra->above;
+	if (simd) { win_pass1(r, first, head, &acc); win_pass1(r, 0, len - head, &acc); }
+	else { win_pass1_scalar(r, first, head, &acc); win_pass1_scalar(r, 0, len - head, &acc); }
+
+	s->samples = lroundf(acc.n);
+	s->above = lroundf(acc.above);
+	s->min = acc.min;
+	s->max = acc.max;
+	s->mean = mean = acc.n > 0 ? acc.mean / acc.n : 0;
+
+	d = extra->mean - mean;
+	acc.m2 = extra->m2 + extra->n * d * d;
+	if (simd) { win_pass2(r, first, head, mean, &acc); win_pass2(r, 0, len - head, mean, &acc); }
+	else { win_pass2_scalar(r, first, head, mean, &acc); win_pass2_scalar(r, 0, len - head, mean, &acc); }
+	s->stddev = acc.n > 0 ? sqrtf(acc.m2 / acc.n) : 0;
+}
+
+// the last [seconds] of [w] in [s]: 0 when it has no samples
+static inline int win_reduce(const window_t * w, int seconds, int simd, win_stats_t * s)
+{
+	win_bucket_t none;
+	int len;
+
+	if (seconds <= WIN_SECONDS) {
+		win_empty(&none);
+		len = seconds < w->sec.count ? seconds : w->sec.count;
+		win_reduce_ring(&w->sec, len, &none, simd, s);
+	}
+	else {
+		// the minute being filled, then as many whole ones as it takes
+		len = (seconds - w->seconds + 59) / 60;
+		if (len > w->min.count) len = w->min.count;
+		win_reduce_ring(&w->min, len, &w->minute, simd, s);
+	}
+	return s->samples > 0;
+}
+
+static inline int win_query(const window_t * w, int seconds, win_stats_t * s)
+{
+	return win_reduce(w, seconds, 1, s);
+}
+
+#endif
@@ -1,7 +1,36 @@
 /*
-	Echobox, a Simple Linux Character Device Driver
+	Echobox, a Simple Linux Character Device Driver grown into a pipe
 	
-	Echobox device can store a string in an internal buffer and then print it back.
+	In this episode:
+	- A ring buffer of a configurable size, free-running head and tail counters
+	- Blocking and non-blocking reads and writes, sleeping on wait queues
+	- poll()/select() support
+	- mmap() of the ring for zero-copy consumers
+
+	Usage:
+	- insmod echobox.ko ring_size=<bytes>, rounded up to a power of 2 pages (default 4096)
+	- What is written to /dev/echobox is read back from it, in order, by anybody: a local
+	  message channel between processes on the board
+	- A read returns what is in the ring, up to the length asked, blocking while it is empty;
+	  a write stores what fits, blocking while it is full. With O_NONBLOCK both return
+	  -EAGAIN instead of sleeping. There is no end of file, a reader waits for the next writer
+	- poll()/select() report the device readable while the ring is not empty, writable while
+	  it is not full
+	- A consumer can skip the copy of read(): it maps the head page and the ring read-only,
+	  takes the bytes from tail to head straight from the ring, then hands them back with
+	  ECHOBOX_IOC_CONSUME. It still sleeps in poll() for more
+
+	Mapping layout, at mmap() offsets in pages (see echobox.h):
+
+		ECHOBOX_PAGE_HEAD	struct echobox_head, one page
+		ECHOBOX_PAGE_RING	the ring, ring_size bytes: byte n of the stream is at n & (size - 1)
+
+	The counters only grow and wrap at 2^32, head - tail is the number of bytes in the ring.
+	The driver keeps its own copy of them and only mirrors it into the mapped page, which
+	can never be made writable: nothing a process does to its mapping reaches the ring state.
+	The bytes are in the ring before head moves over them (smp_wmb), readers and writers are
+	serialized by a mutex and never sleep holding it.
+
 	The device Major number is assigned dynamically via alloc_chrdev_region().
 	Devices files are automatically created by udev deamon, no need to issue mknod commands.
 */
@@ -15,13 +44,44 @@
 #include <linux/device.h>	// udev support: class_create() and device_create()
 #include <linux/cdev.h>		// VFS registration: cdev_init() and cdev_add()
 #include <linux/uaccess.h>	// copy_to_user() and read_from_user()
+#include <linux/wait.h>		// wait queues for blocking readers and writers
+#include <linux/poll.h>		// poll() and select() support
+#include <linux/mutex.h>	// serialize readers and writers
+#include <linux/mm.h>		// the ring pages and their mapping
+#include <linux/ioctl.h>	// consume ioctl
+
+#include "echobox.h"
+
+#define RING_MAX_ORDER	10	// the ring is 4MB at most
+
 
-#define MSG_SIZE 5		// my buffer size
- 
 static dev_t devnum; 		// my dynamically allocated device number <Major,Minor>
 static struct cdev mydev;	// character device structure
 static struct class *cl;	// device class
-static char msg[MSG_SIZE];	// my buffer to store a string
+
+static int ring_size = 4096;	// [bytes] asked for at insmod
+module_param(ring_size, int, 0444);
+MODULE_PARM_DESC(ring_size, "ring size in bytes, rounded up to a power of 2 pages (default 4096)");
+
+static struct echobox_head state;	// the counters, the driver only trusts these
+static struct echobox_head *rb;		// their mirror, in a page of their own for mmap()
+static char *ring;		// the bytes, PAGE_SIZE << ring_order
+static unsigned int ring_order;
+
+static DECLARE_WAIT_QUEUE_HEAD(readers);	// readers sleeping on an empty ring
+static DECLARE_WAIT_QUEUE_HEAD(writers);	// writers sleeping on a full ring
+static DEFINE_MUTEX(ring_lock);
+
+static inline u32 ring_used(void) { return state.head - state.tail; }
+
+// the counters out to the consumers of the mapping, after the bytes they cover
+static inline void ring_publish(void)
+{
+	smp_wmb();
+	rb->head = state.head;
+	rb->tail = state.tail;
+	rb->size = state.size;
+}
 
 
 /*
@@ -29,7 +89,7 @@ static char msg[MSG_SIZE];	// my buffer to store a string
  */
 static int echobox_open(struct inode *i, struct file *f)
 {
-	printk(KERN_INFO "Echobox: open()\n");
+	pr_debug("Echobox: open()\n");
 	return 0;
 }
 
@@ -38,90 +98,223 @@ static int echobox_open(struct inode *i, struct file *f)
  */
 static int echobox_close(struct inode *i, struct file *f)
 {
-	printk(KERN_INFO "Echobox: close()\n");
+	pr_debug("Echobox: close()\n");
 	return 0;
 }
 
 /*
- *	READ
+ *	READ:
+ *	As much as there is in the ring, up to LEN bytes, sleeping while it is empty
  */
 static ssize_t echobox_read(struct file *f, char __user *buf, size_t len, loff_t *off)
 {
-	// no more (or nothing) to read in my buffer
-	if (*off >= MSG_SIZE) {	return 0; }
+	u32 pos, chunk;
+
+	if (len == 0) { return 0; }
+	if (mutex_lock_interruptible(&ring_lock)) { return -ERESTARTSYS; }
 
-	// prevent overflow reading my buffer
-	if (*off + len > MSG_SIZE) { len = MSG_SIZE - *off; }
+	// sleep until a writer puts something in
+	while (ring_used() == 0) {
+		mutex_unlock(&ring_lock);
+		if (f->f_flags & O_NONBLOCK) { return -EAGAIN; }
+		if (wait_event_interruptible(readers, ring_used() != 0)) { return -ERESTARTSYS; }
+		if (mutex_lock_interruptible(&ring_lock)) { return -ERESTARTSYS; }
+	}
 
-	// read LEN bytes from my buffer
-	if (copy_to_user(buf, &msg + *off, len) != 0) { return -EFAULT; }
+	// in two chunks when the bytes wrap around the end of the ring
+	len = min_t(size_t, len, min_t(u32, ring_used(), state.size));
+	pos = state.tail & (state.size - 1);
+	chunk = min_t(size_t, len, state.size - pos);
+	if (copy_to_user(buf, ring + pos, chunk) != 0 || copy_to_user(buf + chunk, ring, len - chunk) != 0) {
+		mutex_unlock(&ring_lock);
+		return -EFAULT;
+	}
 
-	//increment offset
-	*off += len;
+	// the bytes are out before the writers get their room back
+	smp_mb();
+	state.tail += len;
+	ring_publish();
+	mutex_unlock(&ring_lock);
 
+	wake_up_interruptible(&writers);
 	return len;
 }
 
 /*
- *	WRITE
+ *	WRITE:
+ *	As much as fits in the ring, up to LEN bytes, sleeping while it is full
  */
 static ssize_t echobox_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
 {
-	// no more space left to write in my buffer (returns: "No space left on device" error)
-	// this check is meaningful only starting from the second iteration of the write function
-	if (*off >= MSG_SIZE) return -ENOSPC;
-	
-	// prevent overflow when writing in my buffer:
-	// if the lenght of the message the user wants to write in my driver exceeds my buffer lenght
-	// then I decrease the lenght of the message (LEN) to be stored in my buffer
-	// * at the first iteration, the message length is pushed down to the size of my buffer (offest=0)
-	// * for all the other iterations, when we are running out of space the lenght of the data chunk the user 
-	//   wants to write in the driver is downsized to the free space left [buffer_size - buffer_used(offset)]
-	if (*off + len > MSG_SIZE) { len = MSG_SIZE - *off; }
-	
-	// extract a chunk of data (of LEN bytes) from the user buffer and store it in my buffer at position OFFSET
-	if ( copy_from_user(&msg + *off, buf, len) != 0 ) { return -EFAULT; }
+	u32 pos, chunk;
+
+	if (len == 0) { return 0; }
+	if (mutex_lock_interruptible(&ring_lock)) { return -ERESTARTSYS; }
+
+	// sleep until a reader makes room
+	while (ring_used() >= state.size) {
+		mutex_unlock(&ring_lock);
+		if (f->f_flags & O_NONBLOCK) { return -EAGAIN; }
+		if (wait_event_interruptible(writers, ring_used() < state.size)) { return -ERESTARTSYS; }
+		if (mutex_lock_interruptible(&ring_lock)) { return -ERESTARTSYS; }
+	}
+
+	len = min_t(size_t, len, state.size - ring_used());
+	pos = state.head & (state.size - 1);
+	chunk = min_t(size_t, len, state.size - pos);
+	if (copy_from_user(ring + pos, buf, chunk) != 0 || copy_from_user(ring, buf + chunk, len - chunk) != 0) {
+		mutex_unlock(&ring_lock);
+		return -EFAULT;
+	}
 
-	// increment offset, the placeholder inside my buffer
-	*off += len;
+	// the bytes are in before a consumer of the mapping sees them
+	state.head += len;
+	ring_publish();
+	mutex_unlock(&ring_lock);
 
-	// return the number of bytes I was able to write in my driver buffer
-	// a new iteration of this function is expected if there is still user data pending to be store in the driver
+	wake_up_interruptible(&readers);
 	return len;
 }
 
+/*
+ *	POLL:
+ *	Readable while the ring is not empty, writable while it is not full
+ */
+static unsigned int echobox_poll(struct file *f, poll_table *wait)
+{
+	unsigned int mask = 0;
+
+	poll_wait(f, &readers, wait);
+	poll_wait(f, &writers, wait);
+	if (ring_used() != 0) { mask |= POLLIN | POLLRDNORM; }
+	if (ring_used() < state.size) { mask |= POLLOUT | POLLWRNORM; }
+	return mask;
+}
+
+/*
+ *	IOCTL:
+ *	A consumer of the mapping hands back the bytes it took from the ring
+ */
+static long echobox_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	if (cmd != ECHOBOX_IOC_CONSUME) { return -ENOTTY; }
+
+	if (mutex_lock_interruptible(&ring_lock)) { return -ERESTARTSYS; }
+	if (arg > ring_used()) {
+		mutex_unlock(&ring_lock);
+		return -EINVAL;
+	}
+	smp_mb();
+	state.tail += arg;
+	ring_publish();
+	mutex_unlock(&ring_lock);
+
+	wake_up_interruptible(&writers);
+	return 0;
+}
+
+/*
+ *	MMAP:
+ *	The head page, then the ring, read-only: the counters are
+ *	the state of the ring itself
+ */
+static int echobox_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+	void *from;
+
+	// and it stays so: no mprotect(PROT_WRITE) later, no mremap() past the ring
+	if (vma->vm_flags & VM_WRITE) { return -EPERM; }
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	if (vma->vm_pgoff == ECHOBOX_PAGE_HEAD && len <= PAGE_SIZE) { from = rb; }
+	else if (vma->vm_pgoff == ECHOBOX_PAGE_RING && len <= state.size) { from = ring; }
+	else { return -EINVAL; }
+
+	if (remap_pfn_range(vma, vma->vm_start, virt_to_phys(from) >> PAGE_SHIFT, len, vma->vm_page_prot)) {
+		return -EAGAIN;
+	}
+	return 0;
+}
+
 /*
  *	File operations and function callbacks
  */
 static struct file_operations echobox_fops =
 {
-	.owner   = THIS_MODULE,
-	.open    = echobox_open,
-	.release = echobox_close,
-	.read    = echobox_read,
-	.write   = echobox_write
+	.owner   	= THIS_MODULE,
+	.open    	= echobox_open,
+	.release 	= echobox_close,
+	.read    	= echobox_read,
+	.write   	= echobox_write,
+	.poll    	= echobox_poll,
+	.unlocked_ioctl	= echobox_ioctl,
+	.mmap    	= echobox_mmap
 };
 
 
 
+/*
+ *	RING: pages reserved, so that remap_pfn_range() can hand them to userspace
+ */
+static int ring_alloc(void)
+{
+	int i;
+
+	if (ring_size <= 0 || (ring_order = get_order(ring_size)) > RING_MAX_ORDER) { return -EINVAL; }
+
+	if ((rb = (struct echobox_head *)get_zeroed_page(GFP_KERNEL)) == NULL) { return -ENOMEM; }
+	if ((ring = (char *)__get_free_pages(GFP_KERNEL, ring_order)) == NULL) {
+		free_page((unsigned long)rb);
+		return -ENOMEM;
+	}
+	memset(&state, 0, sizeof(state));
+	state.size = PAGE_SIZE << ring_order;
+	ring_publish();
+
+	SetPageReserved(virt_to_page(rb));
+	for (i = 0; i < (1 << ring_order); i++) { SetPageReserved(virt_to_page(ring + i * PAGE_SIZE)); }
+	return 0;
+}
+
+static void ring_free(void)
+{
+	int i;
+
+	for (i = 0; i < (1 << ring_order); i++) { ClearPageReserved(virt_to_page(ring + i * PAGE_SIZE)); }
+	ClearPageReserved(virt_to_page(rb));
+	free_pages((unsigned long)ring, ring_order);
+	free_page((unsigned long)rb);
+}
+
 /*
  *	CONSTRUCTOR
  */
 static int __init echobox_init(void)
 {
+	int rc;
+
+	if ((rc = ring_alloc()) != 0)
+	{
+		return rc;
+	}
 	if (alloc_chrdev_region(&devnum, 0, 1, "echobox") < 0)
 	{
+		ring_free();
 		return -1;
 	}
 	if ((cl = class_create(THIS_MODULE, "chardrv")) == NULL)
 	{
 		unregister_chrdev_region(devnum, 1);
+		ring_free();
 		return -1;
 	}
 	if (device_create(cl, NULL, devnum, NULL, "echobox") == NULL)
 	{
 		class_destroy(cl);
 		unregister_chrdev_region(devnum, 1);
+		ring_free();
 		return -1;
 	}
 
@@ -131,10 +324,11 @@ static int __init echobox_init(void)
 		device_destroy(cl, devnum);
 		class_destroy(cl);
 		unregister_chrdev_region(devnum, 1);
+		ring_free();
 		return -1;
 	}
 
-	printk(KERN_INFO "Echobox registered, <Major, Minor>: <%d, %d>\n", MAJOR(devnum), MINOR(devnum));
+	printk(KERN_INFO "Echobox registered, <Major, Minor>: <%d, %d>, ring of %u bytes\n", MAJOR(devnum), MINOR(devnum), state.size);
 	return 0;
 }
 
@@ -147,7 +341,8 @@ static void __exit echobox_exit(void)
 	device_destroy(cl, devnum);
 	class_destroy(cl);
 	unregister_chrdev_region(devnum, 1);
-	printk(KERN_INFO "Echobox unregistered");
+	printk(KERN_INFO "Echobox unregistered: %u bytes through the ring\n", state.head);
+	ring_free();
 }
 
 module_init(echobox_init);
@@ -0,0 +1,36 @@
+/*
+	ECHOBOX, ring-buffer pipe interface
+
+	The head page and the ring as a zero-copy consumer maps them, and the ioctl that hands
+	the bytes back. This header is included both by the driver and by the userspace programs.
+
+	Usage from userspace:
+		long page = sysconf(_SC_PAGESIZE);
+		fd   = open("/dev/echobox", O_RDONLY);
+		head = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, ECHOBOX_PAGE_HEAD * page);
+		ring = mmap(NULL, head->size, PROT_READ, MAP_SHARED, fd, ECHOBOX_PAGE_RING * page);
+		poll() for POLLIN, then the bytes from head->tail to head->head are at
+		ring[n & (head->size - 1)]; ioctl(fd, ECHOBOX_IOC_CONSUME, bytes) once done with them
+*/
+
+#ifndef ECHOBOX_H
+#define ECHOBOX_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// the counters, a copy of those of the driver: read head before the bytes it covers
+struct echobox_head {
+	__u32 head;			// bytes written since insmod
+	__u32 tail;			// bytes read (or consumed) since insmod
+	__u32 size;			// of the ring, a power of 2
+};
+
+// mmap() offsets, in pages
+#define ECHOBOX_PAGE_HEAD	0	// struct echobox_head, one page
+#define ECHOBOX_PAGE_RING	1	// the ring, size bytes
+
+#define ECHOBOX_IOC_MAGIC	'e'
+#define ECHOBOX_IOC_CONSUME	_IO(ECHOBOX_IOC_MAGIC, 1)	// arg: bytes taken from the mapped ring
+
+#endif
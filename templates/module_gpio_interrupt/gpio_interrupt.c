@@ -4,6 +4,8 @@
 	In this episode:
 	- Setup of GPIO pins (as input and output)
 	- Registering and Handling Interrupts
+	- Capturing timestamped edge events in a lock-free kfifo
+	- Blocking, batched reads and poll()/select() support
 
 	Configuration:
 	- We have a led connected to pin 10 of header P8 (gpio2[4])
@@ -11,12 +13,19 @@
 
 	Usage:
 	- When inserted, the driver configures the GPIOs and claims an interrupt line for the button pin
-	- When the button is pressed (on rising edge) a callback function is executed to toggle the led
+	- On every edge (rising and falling) the interrupt handler toggles the led and pushes a
+	  (timestamp, gpio, level) record in a fifo
+	- Reading /dev/gint returns as many whole records as fit in the user buffer (at least one),
+	  blocking until an edge arrives unless the file was opened with O_NONBLOCK
+	- poll()/select() report the device as readable while the fifo is not empty
+	- GINT_IOC_STATS returns the captured/dropped/read counters, a full fifo drops the newest edges
 	- When removed, the driver turns off the led, frees the interrupt line and releases the gpios.
 
+	Record layout and ioctl are in gpio_interrupt.h. The edge of a record is the level of the
+	pin when the handler ran, a bounce faster than the interrupt latency repeats a level.
 
-	Note: file operations OPEN, CLOSE, READ and WRITE are reported only for convinience in expanding
-	the driver functionality
+	The interrupt handler is the only producer and reads are serialized by a mutex, so the
+	fifo is used without any spinlock (kfifo is lock-free with one reader and one writer).
 */
 
 
@@ -34,16 +43,34 @@
 #include <linux/gpio.h>		// gpio kernel library
 #include <linux/interrupt.h>	// interrupt functions
 
+#include <linux/kfifo.h>	// lock-free fifo between the irq handler and read()
+#include <linux/wait.h>		// wait queues for blocking readers
+#include <linux/poll.h>		// poll() and select() support
+#include <linux/mutex.h>	// serialize concurrent readers
+#include <linux/ktime.h>	// event timestamps
+#include <linux/ioctl.h>	// statistics ioctl
+
+#include "gpio_interrupt.h"
+
+#define GINT_FIFO_SIZE	1024	// [records] must be a power of 2, 16kB of events
+
 static dev_t devnum; 		// my dynamically allocated device number <Major,Minor>
 static struct cdev mydev;	// character device structure
 static struct class *cl;	// device class
 
 static int led_gpio_num = 68;	// LED gpio number (P8_10 -> gpio2[4])
 static int btn_gpio_num = 60;	// BUTTON gpio number (P9_12 -> gpio1[28])
+module_param(btn_gpio_num, int, 0444);
+MODULE_PARM_DESC(btn_gpio_num, "gpio to capture edges from (default 60, P9_12)");
 
 static int led_status = 0;	// led status memory: 0=OFF, 1=ON
 static int my_irq;		// IRQ identifier
 
+static DECLARE_KFIFO(events, struct gint_event, GINT_FIFO_SIZE);
+static DECLARE_WAIT_QUEUE_HEAD(readers);	// readers sleeping on an empty fifo
+static DEFINE_MUTEX(read_lock);			// kfifo allows only one reader at a time
+static struct gint_stats stats;
+
 
 
 /*
@@ -66,11 +93,33 @@ static int my_close(struct inode *i, struct file *f)
 
 /*
  *	READ:
+ *	Drain whole records from the fifo, as many as fit in the user buffer
  */
 static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off)
 {
-	// do nothing
-	return 0;
+	unsigned int copied;
+	int rc;
+
+	// we deliver only whole records
+	if (len < sizeof(struct gint_event)) { return -EINVAL; }
+	len -= len % sizeof(struct gint_event);
+
+	if (mutex_lock_interruptible(&read_lock)) { return -ERESTARTSYS; }
+
+	// sleep until the interrupt handler pushes something
+	while (kfifo_is_empty(&events)) {
+		mutex_unlock(&read_lock);
+		if (f->f_flags & O_NONBLOCK) { return -EAGAIN; }
+		if (wait_event_interruptible(readers, !kfifo_is_empty(&events))) { return -ERESTARTSYS; }
+		if (mutex_lock_interruptible(&read_lock)) { return -ERESTARTSYS; }
+	}
+
+	// one copy for the whole batch
+	rc = kfifo_to_user(&events, buf, len, &copied);
+	if (rc == 0) { stats.read += copied / sizeof(struct gint_event); }
+	mutex_unlock(&read_lock);
+
+	return rc ? rc : copied;
 }
 
 
@@ -84,11 +133,55 @@ static ssize_t my_write(struct file *f, const char __user *buf, size_t len, loff
 }
 
 
+/*
+ *	POLL:
+ *	Readable while there are records in the fifo
+ */
+static unsigned int my_poll(struct file *f, poll_table *wait)
+{
+	poll_wait(f, &readers, wait);
+	if (!kfifo_is_empty(&events)) { return POLLIN | POLLRDNORM; }
+	return 0;
+}
+
+
+/*
+ *	IOCTL:
+ *	Report the event counters
+ */
+static long my_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct gint_stats snapshot;
+
+	if (cmd != GINT_IOC_STATS) { return -ENOTTY; }
+
+	// the counters are written in irq context
+	disable_irq(my_irq);
+	snapshot = stats;
+	enable_irq(my_irq);
+
+	if (copy_to_user((void __user *)arg, &snapshot, sizeof(snapshot)) != 0) { return -EFAULT; }
+	return 0;
+}
+
+
 /*
  *	CALLBACK FUNCTION to handle interrupts
  */
 static irqreturn_t irqhandler(int irq, void* dev_id)
 {
+	struct gint_event ev;
+
+	// timestamp first, everything else is jitter
+	ev.timestamp = ktime_to_ns(ktime_get());
+	ev.gpio = btn_gpio_num;
+	ev.edge = gpio_get_value(btn_gpio_num) ? 1 : 0;	// the level now, not the edge that fired
+
+	// push the event, never wait: a full fifo drops the newest edge
+	if (kfifo_put(&events, &ev)) { stats.captured++; }
+	else { stats.dropped++; }
+	wake_up_interruptible(&readers);
+
 	// toggle led
 	if(led_status==0) led_status=1; else led_status=0;
 	gpio_set_value(led_gpio_num, led_status);
@@ -102,11 +195,13 @@ static irqreturn_t irqhandler(int irq, void* dev_id)
  */
 static struct file_operations fops =
 {
-	.owner   = THIS_MODULE,
-	.open    = my_open,
-	.release = my_close,
-	.read    = my_read,
-	.write   = my_write
+	.owner   	= THIS_MODULE,
+	.open    	= my_open,
+	.release 	= my_close,
+	.read    	= my_read,
+	.write   	= my_write,
+	.poll    	= my_poll,
+	.unlocked_ioctl	= my_ioctl
 };
 
 
@@ -118,6 +213,8 @@ static int __init my_init(void)
 {
 	int rc;
 
+	INIT_KFIFO(events);
+
 	// register character device as usual
 	if (alloc_chrdev_region(&devnum, 0, 1, "gint") < 0) {
 		return -1;
@@ -181,11 +278,14 @@ static int __init my_init(void)
 	 * 	IRQF_TRIGGER_FALLING   	: triggered on falling edge
 	 * 	IRQF_TRIGGER_HIGH 	: triggered when high
 	 * 	IRQF_TRIGGER_LOW	: triggered when low
+	 *
+	 *	We capture both edges, the handler tells them apart by reading the pin: that is the
+	 *	level when it runs, which a bounce may already have changed again
 	 */
 	rc = request_irq(
 			my_irq,			// interrupt line number requested
 			irqhandler,		// my callback function to handle the interrupts
-			IRQF_TRIGGER_RISING,	// bitmask, interrupt flags 
+			IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,	// bitmask, interrupt flags
 			"GINT",			// name of the device claiming the irq
 			NULL			// struct passed to the handler function
 		);
@@ -222,7 +322,7 @@ static void __exit my_exit(void)
 	device_destroy(cl, devnum);
 	class_destroy(cl);
 	unregister_chrdev_region(devnum, 1);
-	printk(KERN_INFO "GPIO_INTERRUPT module unregistered \n");
+	printk(KERN_INFO "GPIO_INTERRUPT module unregistered: %llu edges captured, %llu dropped\n", stats.captured, stats.dropped);
 }
 
 module_init(my_init);
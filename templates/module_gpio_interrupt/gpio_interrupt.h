@@ -0,0 +1,42 @@
+/*
+	GPIO_INTERRUPT, "gint" edge capture interface
+
+	Records read from /dev/gint and the statistics ioctl. This header is included both by
+	the driver and by the userspace programs.
+
+	Usage from userspace:
+		struct gint_event ev[64];
+		fd = open("/dev/gint", O_RDONLY);
+		n  = read(fd, ev, sizeof(ev)) / sizeof(ev[0]);
+*/
+
+#ifndef GPIO_INTERRUPT_H
+#define GPIO_INTERRUPT_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// one edge, 16 bytes, native endianness
+struct gint_event {
+	__s64 timestamp;		// [nanoseconds] monotonic clock, when the interrupt was taken
+	__u32 gpio;			// gpio number that fired
+	__u32 edge;			// level at service time: 1=high, 0=low, see below
+};
+
+/*
+ *	The line triggers on both edges and the hardware does not say which one fired, so
+ *	edge is the pin read back by the handler: after a rising edge it is 1, after a falling
+ *	one 0, unless the pin bounced again before the handler ran. Then two records in a row
+ *	carry the same level, the timestamps are still those of the interrupts.
+ */
+
+struct gint_stats {
+	__u64 captured;			// edges pushed in the fifo
+	__u64 dropped;			// edges lost because the fifo was full
+	__u64 read;			// records delivered to userspace
+};
+
+#define GINT_IOC_MAGIC	'g'
+#define GINT_IOC_STATS	_IOR(GINT_IOC_MAGIC, 1, struct gint_stats)
+
+#endif
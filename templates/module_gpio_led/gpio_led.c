@@ -77,7 +77,7 @@ static ssize_t my_read(struct file *f, char __user *buf, size_t len, loff_t *off
 	// prevent overflow reading my buffer
 	if (*off + len > MSG_SIZE) { len = MSG_SIZE - *off; }
 	// read LEN bytes from my buffer
-	if (copy_to_user(buf, &msg + *off, len) != 0) { return -EFAULT; }
+	if (copy_to_user(buf, msg + *off, len) != 0) { return -EFAULT; }
 
 	*off += len;
 	return len;
@@ -92,7 +92,7 @@ static ssize_t my_write(struct file *f, const char __user *buf, size_t len, loff
 {
 	// get msec from user, return an error for numbers bigger than 4 digits (+'/0')
 	if (*off + len > MSG_SIZE) { return -EINVAL; }
-	if ( copy_from_user(&msg + *off, buf, len) != 0 ) { return -EFAULT; }
+	if ( copy_from_user(msg + *off, buf, len) != 0 ) { return -EFAULT; }
 	*off += len;
 
 	// homemade string to integer conversion